@@ -8,6 +8,13 @@
     #include "GSPar_OpenCL.hpp"
     using namespace GSPar::Driver::OpenCL;
 
+#elif defined(GSPARDRIVER_HOST)
+
+    const char* nameOfGSParDriver = "Host";
+
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
+
 #else
 
     const char* nameOfGSParDriver = "CUDA";
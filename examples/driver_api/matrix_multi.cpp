@@ -6,6 +6,11 @@
     #include "GSPar_CUDA.hpp"
     using namespace GSPar::Driver::CUDA;
 
+#elif defined(GSPARDRIVER_HOST)
+
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
+
 // #elif GSPARDRIVER_OPENCL
 #else // This way my IDE doesn't complain
 
@@ -4,6 +4,9 @@
 #ifdef GSPARDRIVER_OPENCL
     #include "GSPar_OpenCL.hpp"
     using namespace GSPar::Driver::OpenCL;
+#elif defined(GSPARDRIVER_HOST)
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
 #else
     #include "GSPar_CUDA.hpp"
     using namespace GSPar::Driver::CUDA;
@@ -28,7 +31,7 @@ int main(int argc, const char * argv[]) {
     "GSPAR_DEVICE_KERNEL void sharedmem_kernel(const int max, \n"
     "    GSPAR_DEVICE_GLOBAL_MEMORY const unsigned int *vector, \n"
     "    GSPAR_DEVICE_GLOBAL_MEMORY unsigned int *result";
-    #ifdef GSPARDRIVER_OPENCL // OpenCL requires declaring shared memory after all the parameters
+    #if defined(GSPARDRIVER_OPENCL) || defined(GSPARDRIVER_HOST) // OpenCL and Host require declaring shared memory after all the parameters
         kernelSource += ", GSPAR_DEVICE_SHARED_MEMORY unsigned int* sharedMem) { \n";
     #else // CUDA requires declaring shared memory inside kernel's body
         kernelSource += ") { \n GSPAR_DEVICE_SHARED_MEMORY unsigned int sharedMem[];\n";
@@ -6,6 +6,11 @@
     #include "GSPar_OpenCL.hpp"
     using namespace GSPar::Driver::OpenCL;
 
+#elif defined(GSPARDRIVER_HOST)
+
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
+
 #else
 
     #include "GSPar_CUDA.hpp"
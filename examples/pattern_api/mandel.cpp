@@ -14,6 +14,11 @@ std::chrono::steady_clock::time_point tEnd;
     #include "GSPar_CUDA.hpp"
     using namespace GSPar::Driver::CUDA;
 
+#elif defined(GSPARDRIVER_HOST)
+
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
+
 // #elif GSPARDRIVER_OPENCL
 #else // This way my IDE doesn't complain
 
@@ -49,8 +54,8 @@ void mandelbrot(const double init_a, const double init_b, const double range, co
         pattern->setParameter("init_a", init_a)
             .setParameter("init_b", init_b)
             .setParameter("step", step)
-            .setParameter("dim", dim)
-            .setParameter("niter", niter)
+            .setConstantParameter("dim", dim) // Known at compile time, so the compiler can fold them
+            .setConstantParameter("niter", niter)
             .setParameter("M", dim*dim, M, GSPAR_PARAM_OUT);
 
         pattern->setStdVarNames({"i", "j", ""});
@@ -61,6 +61,11 @@ Modified by:
     #include "GSPar_CUDA.hpp"
     using namespace GSPar::Driver::CUDA;
 
+#elif defined(GSPARDRIVER_HOST)
+
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
+
 // #elif GSPARDRIVER_OPENCL
 #else // This way my IDE doesn't complain
 
@@ -70,6 +75,7 @@ Modified by:
 #endif
 
 #include "GSPar_PatternMap.hpp"
+#include "GSPar_PatternStreamExecutor.hpp"
 using namespace GSPar::Pattern;
 
 #define DIM 800
@@ -109,9 +115,16 @@ int main(int argc, char **argv) {
     }
 
     double * runs = new double[retries];
-    unsigned char **Ms = new unsigned char*[batch_size];
-    for (int b = 0; b < batch_size; b++) {
-        Ms[b] = new unsigned char[dim];
+    // Each execution flow of the executor has its own batch of lines
+    const unsigned int flows = GSPAR_STREAM_EXECUTOR_FLOWS;
+    unsigned char ***Ms = new unsigned char**[flows];
+    int **Is = new int*[flows];
+    for (unsigned int f = 0; f < flows; f++) {
+        Ms[f] = new unsigned char*[batch_size];
+        for (int b = 0; b < batch_size; b++) {
+            Ms[f][b] = new unsigned char[dim];
+        }
+        Is[f] = new int[batch_size];
     }
 
     unsigned int batches = ceil((double)dim/batch_size);
@@ -166,33 +179,45 @@ int main(int argc, char **argv) {
         // Start time
         gettimeofday(&t1,NULL);
 
-        int* Is = new int[batch_size];
+        // The batches are copied to the GPU, computed and copied back concurrently, in the flows of the executor
+        StreamExecutor<Instance> executor(*pattern, flows);
 
         for(unsigned int b=0; b<batches; b++) {
-            // std::cout << "Processing batch " << b << ", lines ";
-            for (int i = 0; i < batch_size; i++) {
-                Is[i] = b*batch_size + i;
-                // std::cout << Is[i] << " ";
-            }
-            // std::cout << std::endl;
+            int* batchIs = Is[b % flows];
+            unsigned char** batchMs = Ms[b % flows];
 
             try {
 
-                pattern->setBatchedParameter("i", Is)
-                    .setBatchedParameter("M", dim, Ms, GSPAR_PARAM_INOUT);
+                auto handle = executor.run(dimensions, [&](Map& flowPattern) {
+                    // std::cout << "Processing batch " << b << ", lines ";
+                    // The previous batch of the flow already completed, so its memory can be reused
+                    for (int i = 0; i < batch_size; i++) {
+                        batchIs[i] = b*batch_size + i;
+                        // std::cout << batchIs[i] << " ";
+                    }
+                    // std::cout << std::endl;
+                    flowPattern.setBatchedParameter("i", batchIs)
+                        .setBatchedParameter("M", dim, batchMs, GSPAR_PARAM_INOUT);
+                });
 
-                pattern->run<Instance>(dimensions);
+#ifdef DEBUG
+                handle.then([=]() {
+                    for (int i = 0; i < batch_size; i++) {
+                        ShowLine(batchMs[i],dim,batchIs[i]);
+                    }
+                });
+#endif
 
             } catch (GSPar::GSParException &ex) {
                 std::cerr << "Exception: " << ex.what() << " - " << ex.getDetails() << std::endl;
                 exit(-1);
             }
-            
-#ifdef DEBUG
-            for (int i = 0; i < batch_size; i++) {
-                ShowLine(Ms[i],dim,Is[i]);
-            }
-#endif
+        }
+        try {
+            executor.synchronize();
+        } catch (GSPar::GSParException &ex) {
+            std::cerr << "Exception: " << ex.what() << " - " << ex.getDetails() << std::endl;
+            exit(-1);
         }
         // Stop time
         gettimeofday(&t2,NULL);
@@ -214,9 +239,14 @@ int main(int argc, char **argv) {
 #endif
 
     delete[] runs;
-    for (int b = 0; b < batch_size; b++) {
-        delete[] Ms[b];
+    for (unsigned int f = 0; f < flows; f++) {
+        for (int b = 0; b < batch_size; b++) {
+            delete[] Ms[f][b];
+        }
+        delete[] Ms[f];
+        delete[] Is[f];
     }
     delete[] Ms;
+    delete[] Is;
     return 0;
 }
@@ -12,6 +12,11 @@ std::chrono::steady_clock::time_point tEnd;
     #include "GSPar_CUDA.hpp"
     namespace Driver = GSPar::Driver::CUDA;
 
+#elif defined(GSPARDRIVER_HOST)
+
+    #include "GSPar_Host.hpp"
+    namespace Driver = GSPar::Driver::Host;
+
 // #elif GSPARDRIVER_OPENCL
 #else // This way my IDE doesn't complain
 
@@ -0,0 +1,94 @@
+#include <iostream>
+#include <chrono>
+
+#ifdef GSPARDRIVER_OPENCL
+    #include "GSPar_OpenCL.hpp"
+    using namespace GSPar::Driver::OpenCL;
+#elif defined(GSPARDRIVER_HOST)
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
+#else
+    #include "GSPar_CUDA.hpp"
+    using namespace GSPar::Driver::CUDA;
+#endif
+
+#include "GSPar_PatternMap.hpp"
+using namespace GSPar::Pattern;
+
+void matrix_scale(const unsigned long width, const unsigned long height, const unsigned long tile_rows,
+        const float* matrix, const float* weights, float* result) {
+    try {
+
+        // The kernel indexes the whole matrix, each tile only gets the rows it uses
+        auto pattern = new Map(GSPAR_STRINGIZE_SOURCE(
+            result[y * width + x] = matrix[y * width + x] * weights[x];
+        ));
+
+        pattern->setParameter("width", width)
+            .setParameter("matrix", sizeof(float) * width * height, matrix)
+            .setParameter("weights", sizeof(float) * width, weights)
+            .setParameter("result", sizeof(float) * width * height, result, GSPAR_PARAM_OUT);
+
+        // The rows of matrix and result are split in tiles, while the weights are copied once
+        pattern->setOutOfCore(true, tile_rows)
+            .setTiledParameter("matrix", sizeof(float) * width)
+            .setTiledParameter("result", sizeof(float) * width);
+
+        pattern->run<Instance>({width, height});
+
+        delete pattern;
+
+    } catch (GSPar::GSParException &ex) {
+        std::cerr << "Exception: " << ex.what() << " - " << ex.getDetails() << std::endl;
+        exit(-1);
+    }
+}
+
+int main(int argc, const char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "Use: " << argv[0] << " <width> <height> [tile_rows]" << std::endl;
+        std::cerr << "With no tile_rows, the tiles use GSPAR_OUT_OF_CORE_DEVICE_MEMORY_PERCENT of the GPU memory" << std::endl;
+        exit(-1);
+    }
+
+    const unsigned long WIDTH = std::stoul(argv[1]);
+    const unsigned long HEIGHT = std::stoul(argv[2]);
+    const unsigned long TILE_ROWS = argc > 3 ? std::stoul(argv[3]) : 0;
+
+    // Create memory objects
+    float* matrix = new float[WIDTH * HEIGHT];
+    float* weights = new float[WIDTH];
+    float* result = new float[WIDTH * HEIGHT];
+    for (unsigned long x = 0; x < WIDTH; x++) {
+        weights[x] = x % 4;
+    }
+    for (unsigned long i = 0; i < WIDTH * HEIGHT; i++) {
+        matrix[i] = i % 1000;
+        result[i] = 0;
+    }
+
+    auto t_start = std::chrono::steady_clock::now();
+
+    matrix_scale(WIDTH, HEIGHT, TILE_ROWS, matrix, weights, result);
+
+    auto t_end = std::chrono::steady_clock::now();
+
+    unsigned long errors = 0;
+    for (unsigned long i = 0; i < WIDTH * HEIGHT; i++) {
+        if (result[i] != matrix[i] * weights[i % WIDTH]) {
+            errors++;
+        }
+    }
+
+    delete[] result;
+    delete[] matrix;
+    delete[] weights;
+
+    if (errors) {
+        std::cerr << "Found " << errors << " wrong elements" << std::endl;
+        exit(-1);
+    }
+    std::cout << "Test finished succesfully in " << std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count() << " ms " << std::endl;
+
+    return 0;
+}
@@ -34,10 +34,15 @@
 #include <iostream>
 #include "rapidxml-1.13/rapidxml.hpp"
 
-#ifdef GSPARDRIVER_CUDA
+#if defined(GSPARDRIVER_CUDA) || defined(GSPARDRIVER_HOST) // Both compile C++ kernels
 
-    #include "GSPar_CUDA.hpp"
-    using namespace GSPar::Driver::CUDA;
+    #ifdef GSPARDRIVER_HOST
+        #include "GSPar_Host.hpp"
+        using namespace GSPar::Driver::Host;
+    #else
+        #include "GSPar_CUDA.hpp"
+        using namespace GSPar::Driver::CUDA;
+    #endif
 
     const char* extraKernelCode = GSPAR_STRINGIZE_SOURCE(
         template<typename T>
@@ -548,6 +553,10 @@ void raytrace(std::string output_folder, int total_frames, unsigned int width, u
         // Extra kernel code
         pattern->addExtraKernelCode(extraKernelCode);
 
+        // Relaxed floating-point math, the image is only a visual result
+        pattern->addCompilerOption(GSPar::Driver::GSPAR_COMPILER_FAST_MATH)
+            .addCompilerOption(GSPar::Driver::GSPAR_COMPILER_MAD_ENABLE);
+
         unsigned long dimensions[3] = {width, height, 0};
         pattern->compile<Instance>(dimensions);
 
@@ -1,6 +1,9 @@
 #ifdef GSPARDRIVER_CUDA
     #include "GSPar_CUDA.hpp"
     using namespace GSPar::Driver::CUDA;
+#elif defined(GSPARDRIVER_HOST)
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
 #else
     #include "GSPar_OpenCL.hpp"
     using namespace GSPar::Driver::OpenCL;
@@ -0,0 +1,85 @@
+#include <iostream>
+#include <chrono>
+#include <vector>
+
+#ifdef GSPARDRIVER_OPENCL
+    #include "GSPar_OpenCL.hpp"
+    using namespace GSPar::Driver::OpenCL;
+#elif defined(GSPARDRIVER_HOST)
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
+#else
+    #include "GSPar_CUDA.hpp"
+    using namespace GSPar::Driver::CUDA;
+#endif
+
+#include "GSPar_PatternMap.hpp"
+using namespace GSPar::Pattern;
+
+/**
+ * Scales the vector in place, so the kernel reads the values it writes (INOUT)
+ */
+void vector_scale(std::vector<unsigned int>& vector, const unsigned int runs, bool autotuning) {
+    try {
+
+        auto pattern = new Map(GSPAR_STRINGIZE_SOURCE(
+            vector[x] = vector[x] * 2 + 1;
+        ));
+
+        pattern->setParameter("vector", sizeof(unsigned int) * vector.size(), vector.data(), GSPAR_PARAM_INOUT);
+
+        // Running the kernel once per block shape would apply it several times, so an INOUT Map is not autotuned
+        pattern->setAutotuning(autotuning);
+
+        for (unsigned int r = 0; r < runs; r++) {
+            pattern->run<Instance>({vector.size(), 0, 0});
+        }
+
+        delete pattern;
+
+    } catch (GSPar::GSParException &ex) {
+        std::cerr << "Exception: " << ex.what() << " - " << ex.getDetails() << std::endl;
+        exit(-1);
+    }
+}
+
+int main(int argc, const char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "Use: " << argv[0] << " <vector_size> <runs>" << std::endl;
+        exit(-1);
+    }
+
+    const unsigned long VECTOR_SIZE = std::stoul(argv[1]);
+    const unsigned int RUNS = std::stoi(argv[2]);
+
+    std::vector<unsigned int> tuned(VECTOR_SIZE), untuned(VECTOR_SIZE);
+    for (unsigned long i = 0; i < VECTOR_SIZE; i++) {
+        tuned[i] = untuned[i] = i;
+    }
+
+    auto t_start = std::chrono::steady_clock::now();
+
+    vector_scale(untuned, RUNS, false);
+    vector_scale(tuned, RUNS, true);
+
+    auto t_end = std::chrono::steady_clock::now();
+
+    unsigned long errors = 0;
+    for (unsigned long i = 0; i < VECTOR_SIZE; i++) {
+        unsigned int expected = i;
+        for (unsigned int r = 0; r < RUNS; r++) {
+            expected = expected * 2 + 1;
+        }
+        if (untuned[i] != expected || tuned[i] != untuned[i]) {
+            errors++;
+        }
+    }
+
+    if (errors) {
+        std::cerr << "Found " << errors << " elements that differ with autotuning" << std::endl;
+        exit(-1);
+    }
+    std::cout << "Test finished succesfully in " << std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count() << " ms " << std::endl;
+
+    return 0;
+}
@@ -4,6 +4,9 @@
 #ifdef GSPARDRIVER_OPENCL
     #include "GSPar_OpenCL.hpp"
     using namespace GSPar::Driver::OpenCL;
+#elif defined(GSPARDRIVER_HOST)
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
 #else
     #include "GSPar_CUDA.hpp"
     using namespace GSPar::Driver::CUDA;
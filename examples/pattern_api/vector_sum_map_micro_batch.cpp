@@ -0,0 +1,117 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <future>
+
+#ifdef GSPARDRIVER_OPENCL
+    #include "GSPar_OpenCL.hpp"
+    using namespace GSPar::Driver::OpenCL;
+#elif defined(GSPARDRIVER_HOST)
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
+#else
+    #include "GSPar_CUDA.hpp"
+    using namespace GSPar::Driver::CUDA;
+#endif
+
+#include "GSPar_PatternMap.hpp"
+#include "GSPar_PatternMicroBatcher.hpp"
+using namespace GSPar::Pattern;
+
+struct VectorSum {
+    std::vector<unsigned int> a, b, result;
+};
+
+int main(int argc, const char * argv[]) {
+    if (argc < 5) {
+        std::cerr << "Use: " << argv[0] << " <vector_size> <vectors_per_thread> <threads> <batch_size>" << std::endl;
+        exit(-1);
+    }
+
+    const unsigned int VECTOR_SIZE = std::stoi(argv[1]);
+    const unsigned int VECTORS_PER_THREAD = std::stoi(argv[2]);
+    const unsigned int THREADS = std::stoi(argv[3]);
+    const unsigned int BATCH_SIZE = std::stoi(argv[4]);
+
+    auto t_start = std::chrono::steady_clock::now();
+
+    unsigned long errors = 0;
+    try {
+
+        auto pattern = new Map(GSPAR_STRINGIZE_SOURCE(
+            result[x] = a[x] + b[x];
+        ));
+
+        pattern->setParameter("size", VECTOR_SIZE)
+            .setParameterPlaceholder<unsigned int *>("a", GSPAR_PARAM_POINTER, GSPAR_PARAM_IN, true)
+            .setParameterPlaceholder<unsigned int *>("b", GSPAR_PARAM_POINTER, GSPAR_PARAM_IN, true)
+            .setParameterPlaceholder<unsigned int *>("result", GSPAR_PARAM_POINTER, GSPAR_PARAM_OUT, true);
+
+        // Partial batches run with a smaller batch size, without recompiling the kernel
+        pattern->setBatchSize(BATCH_SIZE)
+            .setDimensionAgnostic(true);
+
+        // Only the batcher thread sets the batches, so the arrays of pointers are reused
+        std::vector<unsigned int*> as, bs, results;
+        MicroBatcher<Instance, VectorSum> batcher(*pattern, {VECTOR_SIZE, 0, 0}, [&](Map& batchPattern, std::vector<VectorSum*>& vectors) {
+            as.clear();
+            bs.clear();
+            results.clear();
+            for (auto vector : vectors) {
+                as.push_back(vector->a.data());
+                bs.push_back(vector->b.data());
+                results.push_back(vector->result.data());
+            }
+            batchPattern.setBatchedParameter("a", sizeof(unsigned int) * VECTOR_SIZE, as.data())
+                .setBatchedParameter("b", sizeof(unsigned int) * VECTOR_SIZE, bs.data())
+                .setBatchedParameter("result", sizeof(unsigned int) * VECTOR_SIZE, results.data(), GSPAR_PARAM_OUT);
+        });
+
+        // Each thread submits its vectors one at a time, as requests of a server would arrive
+        std::vector<std::thread> threads;
+        std::vector<unsigned long> threadErrors(THREADS, 0);
+        for (unsigned int t = 0; t < THREADS; t++) {
+            threads.emplace_back([&, t]() {
+                std::vector<std::future<VectorSum>> sums;
+                for (unsigned int v = 0; v < VECTORS_PER_THREAD; v++) {
+                    VectorSum sum;
+                    for (unsigned int i = 0; i < VECTOR_SIZE; i++) {
+                        sum.a.push_back(i + v);
+                        sum.b.push_back(i + t + 1);
+                    }
+                    sum.result.resize(VECTOR_SIZE);
+                    sums.push_back(batcher.submit(sum));
+                }
+                for (unsigned int v = 0; v < VECTORS_PER_THREAD; v++) {
+                    VectorSum sum = sums[v].get();
+                    for (unsigned int i = 0; i < VECTOR_SIZE; i++) {
+                        if (sum.result[i] != 2 * i + v + t + 1) {
+                            threadErrors[t]++;
+                        }
+                    }
+                }
+            });
+        }
+        for (unsigned int t = 0; t < THREADS; t++) {
+            threads[t].join();
+            errors += threadErrors[t];
+        }
+
+        delete pattern;
+
+    } catch (GSPar::GSParException &ex) {
+        std::cerr << "Exception: " << ex.what() << " - " << ex.getDetails() << std::endl;
+        exit(-1);
+    }
+
+    auto t_end = std::chrono::steady_clock::now();
+
+    if (errors) {
+        std::cerr << "Found " << errors << " wrong sums" << std::endl;
+        exit(-1);
+    }
+    std::cout << "Test finished succesfully in " << std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count() << " ms " << std::endl;
+
+    return 0;
+}
@@ -10,6 +10,9 @@ std::chrono::steady_clock::time_point tEnd;
 #ifdef GSPARDRIVER_OPENCL
     #include "GSPar_OpenCL.hpp"
     using namespace GSPar::Driver::OpenCL;
+#elif defined(GSPARDRIVER_HOST)
+    #include "GSPar_Host.hpp"
+    using namespace GSPar::Driver::Host;
 #else
     #include "GSPar_CUDA.hpp"
     using namespace GSPar::Driver::CUDA;
@@ -49,6 +52,8 @@ unsigned long vector_sum(const unsigned long max, const unsigned long *a, const
         // PatternComposition mapReduce {map, reduce};
         // Using variadic templates constructor
         auto mapReduce = new PatternComposition(map, reduce);
+        // The Map runs inside the Reduce kernel, so "result" is never written nor copied back to the host
+        mapReduce->setMapFusion(true);
 
         mapReduce->compilePatterns<Instance>({max, 0});
 
@@ -5,6 +5,7 @@
 // Include Drivers
 #include "GSPar_CUDA.hpp"
 #include "GSPar_OpenCL.hpp"
+#include "GSPar_Host.hpp"
 
 // Include Patterns
 #include "GSPar_PatternMap.hpp"
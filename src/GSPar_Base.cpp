@@ -3,7 +3,69 @@
 #include <string>
 #include <algorithm> //std::generate_n
 
+#include "GSPar_Base.hpp"
+
 namespace GSPar {
+
+    ///// CompilationThreadPool /////
+
+    CompilationThreadPool::CompilationThreadPool(unsigned int threadCount) {
+        if (!threadCount) {
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned int i = 0; i < threadCount; i++) {
+            this->workers.emplace_back(&CompilationThreadPool::workerLoop, this);
+        }
+    }
+
+    CompilationThreadPool::~CompilationThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(this->tasksMutex); // Auto-unlock, RAII
+            this->stopping = true;
+            // Auto-unlock of tasksMutex, RAII
+        }
+        this->tasksCondition.notify_all();
+        for (auto& worker : this->workers) {
+            worker.join();
+        }
+    }
+
+    CompilationThreadPool* CompilationThreadPool::getInstance() {
+        static CompilationThreadPool instance(GSPAR_COMPILATION_THREADS); // Thread-safe initialization since C++11
+        return &instance;
+    }
+
+    void CompilationThreadPool::workerLoop() {
+        while (true) {
+            std::packaged_task<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(this->tasksMutex); // Auto-unlock, RAII
+                this->tasksCondition.wait(lock, [this] { return this->stopping || !this->tasks.empty(); });
+                if (this->tasks.empty()) { // Only happens when stopping
+                    return;
+                }
+                task = std::move(this->tasks.front());
+                this->tasks.pop();
+                // Auto-unlock of tasksMutex, RAII
+            }
+            task(); // Exceptions are stored in the task's future
+        }
+    }
+
+    std::shared_future<void> CompilationThreadPool::submit(std::function<void()> task) {
+        std::packaged_task<void()> packagedTask(task);
+        std::shared_future<void> future = packagedTask.get_future().share();
+        {
+            std::lock_guard<std::mutex> lock(this->tasksMutex); // Auto-unlock, RAII
+            this->tasks.push(std::move(packagedTask));
+            // Auto-unlock of tasksMutex, RAII
+        }
+        this->tasksCondition.notify_one();
+        return future;
+    }
+
+    ///// Auxiliary functions /////
+
     static bool srandInitiated = false;
 
     std::string getRandomString(short length) {
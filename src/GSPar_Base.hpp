@@ -5,9 +5,23 @@
 #include <chrono>
 #include <string>
 #include <algorithm> //std::generate_n
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
 
 #define GSPAR_STRINGIZE_SOURCE(...) #__VA_ARGS__
 
+/**
+ * Number of threads that compile kernels in background (0 means one per hardware thread)
+ */
+#ifndef GSPAR_COMPILATION_THREADS
+#define GSPAR_COMPILATION_THREADS 0
+#endif
+
 namespace GSPar {
 
     class GSParException : public std::exception {
@@ -25,6 +39,31 @@ namespace GSPar {
         virtual std::string getDetails() { return this->details; }
     };
 
+    /**
+     * Thread pool that runs kernel compilations in background
+     */
+    class CompilationThreadPool {
+    private:
+        std::vector<std::thread> workers;
+        std::queue<std::packaged_task<void()>> tasks;
+        std::mutex tasksMutex;
+        std::condition_variable tasksCondition;
+        bool stopping = false;
+
+        void workerLoop();
+
+    public:
+        explicit CompilationThreadPool(unsigned int threadCount);
+        virtual ~CompilationThreadPool();
+
+        static CompilationThreadPool* getInstance();
+        /**
+         * Runs a task in background
+         * @return A future that is ready when the task finishes. It rethrows the exceptions thrown by the task.
+         */
+        std::shared_future<void> submit(std::function<void()> task);
+    };
+
     // Auxiliary functions
     std::string getRandomString(short length);
 
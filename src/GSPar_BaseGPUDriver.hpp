@@ -4,6 +4,42 @@
 
 #define SUPPORTED_DIMS 3
 
+// The GSPar device runtime (gspar_get_global_id and friends) is built once per device and linked into every kernel.
+// Set to 0 to prepend the runtime source to each kernel instead, like older versions did
+#ifndef GSPAR_LINK_DEVICE_RUNTIME
+#define GSPAR_LINK_DEVICE_RUNTIME 1
+#endif
+// Free device memory each DeviceMemoryPool keeps for reuse (high-water mark), in bytes
+#ifndef GSPAR_DEVICE_MEMORY_POOL_MAX_BYTES
+#define GSPAR_DEVICE_MEMORY_POOL_MAX_BYTES (256UL * 1024 * 1024)
+#endif
+// Asynchronous copies of unpinned host memory go through pinned staging buffers of the device, so the DMA runs while the host continues.
+// Set to 0 to copy from and to the host memory directly
+#ifndef GSPAR_HOST_STAGING_BUFFERS
+#define GSPAR_HOST_STAGING_BUFFERS 1
+#endif
+// Free pinned staging buffers each device keeps for reuse (high-water mark), in bytes
+#ifndef GSPAR_HOST_STAGING_POOL_MAX_BYTES
+#define GSPAR_HOST_STAGING_POOL_MAX_BYTES (64UL * 1024 * 1024)
+#endif
+// Staging buffers of 2 MB or more are backed by huge pages when set to 1, falling back to regular pages if there are none available
+#ifndef GSPAR_HOST_STAGING_HUGE_PAGES
+#define GSPAR_HOST_STAGING_HUGE_PAGES 0
+#endif
+// Devices that share the host memory (CPUs and integrated GPUs) use suitably aligned host memory directly instead of copying it.
+// Set to 0 to always copy it to device memory
+#ifndef GSPAR_ZERO_COPY
+#define GSPAR_ZERO_COPY 1
+#endif
+// Alignment, in bytes, of the host memory that OpenCL devices use without copies. allocHostMemory always aligns to it
+#ifndef GSPAR_HOST_MEMORY_ALIGNMENT
+#define GSPAR_HOST_MEMORY_ALIGNMENT 4096
+#endif
+// Compiled programs each device keeps in memory, the least recently used are released beyond it. 0 keeps every program
+#ifndef GSPAR_PROGRAM_CACHE_MAX_PROGRAMS
+#define GSPAR_PROGRAM_CACHE_MAX_PROGRAMS 128
+#endif
+
 #include <string>
 #include <iosfwd>
 #include <ostream>
@@ -11,10 +47,24 @@
 #include <math.h>
 #include <vector>
 #include <array>
+#include <map>
+#include <set>
+#include <algorithm> //std::find
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <cstdlib>
+#include <cstdint>
+#include <new> //std::bad_alloc
 #ifdef GSPAR_DEBUG
 #include <iostream> //std::cout and std::cerr
 #endif
 
+#include "GSPar_KernelCache.hpp"
+#include "GSPar_KernelTuning.hpp"
+
 ///// Forward declarations /////
 
 namespace GSPar {
@@ -23,7 +73,8 @@ namespace GSPar {
         enum Runtime {
             GSPAR_RT_NONE,
             GSPAR_RT_CUDA,
-            GSPAR_RT_OPENCL
+            GSPAR_RT_OPENCL,
+            GSPAR_RT_HOST
         };
 
         struct SingleDimension {
@@ -158,6 +209,61 @@ namespace GSPar {
             explicit operator bool() const { return this->getCount() > 0 && (bool)this->x; }
         };
 
+        /**
+         * Compiler options supported by every runtime. Each driver maps them to its own compiler flags.
+         */
+        enum CompilerOption {
+            GSPAR_COMPILER_FAST_MATH, // Relaxed floating-point math (OpenCL -cl-fast-relaxed-math, CUDA --use_fast_math)
+            GSPAR_COMPILER_MAD_ENABLE, // Fused multiply-add with reduced accuracy (OpenCL -cl-mad-enable, CUDA --fmad=true)
+            GSPAR_COMPILER_DISABLE_OPTIMIZATIONS // Eases kernel debugging (OpenCL -cl-opt-disable, CUDA --device-debug)
+        };
+
+        struct CompilerOptions {
+            std::set<CompilerOption> options;
+            // Macro definitions, as NAME or NAME=VALUE
+            std::vector<std::string> definitions;
+            // Options passed unchanged to the runtime compiler
+            std::vector<std::string> nativeOptions;
+
+            CompilerOptions& add(CompilerOption option) {
+                this->options.insert(option);
+                return *this;
+            }
+            /**
+             * Adds a -DNAME[=VALUE] macro definition, which is mapped to the syntax of each runtime compiler.
+             * Any other option is passed unchanged to the runtime compiler.
+             */
+            CompilerOptions& add(std::string option) {
+                if (option.compare(0, 2, "-D") == 0) {
+                    size_t nameStart = option.find_first_not_of(' ', 2); // Accepts both -DNAME and -D NAME
+                    std::string definition = nameStart == std::string::npos ? "" : option.substr(nameStart);
+                    if (!definition.empty() && std::find(this->definitions.begin(), this->definitions.end(), definition) == this->definitions.end()) {
+                        this->definitions.push_back(definition);
+                    }
+                } else if (!option.empty() && std::find(this->nativeOptions.begin(), this->nativeOptions.end(), option) == this->nativeOptions.end()) {
+                    this->nativeOptions.push_back(option);
+                }
+                return *this;
+            }
+            CompilerOptions& add(const CompilerOptions& other) {
+                this->options.insert(other.options.begin(), other.options.end());
+                for (auto& definition : other.definitions) {
+                    this->add("-D" + definition);
+                }
+                for (auto& nativeOption : other.nativeOptions) {
+                    this->add(nativeOption);
+                }
+                return *this;
+            }
+            bool empty() const {
+                return this->options.empty() && this->definitions.empty() && this->nativeOptions.empty();
+            }
+            bool operator==(const CompilerOptions& other) const {
+                return this->options == other.options && this->definitions == other.definitions && this->nativeOptions == other.nativeOptions;
+            }
+            bool operator!=(const CompilerOptions& other) const { return !(*this == other); }
+        };
+
         template <class TLibCode>
         class BaseException;
 
@@ -184,6 +290,35 @@ namespace GSPar {
         template <class TExecutionFlow, class TDevice, class TMemoryObject, class TChunkedMemoryObject, class TLibAsyncObj>
         class BaseKernel;
 
+        ///// Host memory /////
+
+        /**
+         * Allocates host memory that every device can use without copies (see GSPAR_ZERO_COPY).
+         * The size is rounded up to a multiple of 64 bytes, as OpenCL runtimes require for zero-copy buffers.
+         * Throws std::bad_alloc if there is no memory available.
+         */
+        inline void* allocHostMemory(size_t size) {
+            void* memory = nullptr;
+            if (posix_memalign(&memory, GSPAR_HOST_MEMORY_ALIGNMENT, ((size + 63) / 64) * 64) != 0) {
+                throw std::bad_alloc();
+            }
+            return memory;
+        }
+
+        /**
+         * Frees memory allocated with allocHostMemory
+         */
+        inline void freeHostMemory(void* memory) {
+            free(memory);
+        }
+
+        /**
+         * Checks whether the host memory is aligned to the given number of bytes
+         */
+        inline bool isHostMemoryAligned(const void* hostPtr, size_t alignment = GSPAR_HOST_MEMORY_ALIGNMENT) {
+            return reinterpret_cast<uintptr_t>(hostPtr) % alignment == 0;
+        }
+
         /**
          * Class to allow storing pointers to BaseMemoryObject without templates.
          */
@@ -191,12 +326,27 @@ namespace GSPar {
         protected:
             size_t size;
             void* hostPtr = NULL;
+            size_t allocatedSize = 0; // Bytes of device memory taken from the device's pool, which do not change with bindTo
+            bool zeroCopy = false; // The device uses the host memory the object was created with as its memory
         public:
             BaseMemoryObjectBase() {}
             virtual ~BaseMemoryObjectBase() {}
 
             size_t getSize() { return this->size; }
             void* getHostPointer() { return this->hostPtr; }
+            size_t getAllocatedSize() { return this->allocatedSize; }
+            /**
+             * Checks whether the device uses the host memory directly. Binding to another host memory stops it.
+             */
+            bool isZeroCopy() { return this->zeroCopy; }
+            virtual void bindTo(void* hostPtr) { this->hostPtr = hostPtr; }
+            /**
+             * Binds to another host memory of the given size, which must fit in the allocated device memory
+             */
+            void bindTo(void* hostPtr, size_t size) {
+                this->bindTo(hostPtr);
+                this->size = size;
+            }
         };
 
         template <class TException, class TExecutionFlow, class TDevice, class TLibMemoryObject, class TLibAsyncObj>
@@ -208,7 +358,7 @@ namespace GSPar {
         template <class TExecutionFlow, class TDevice, class TLibAsyncObj, class TLibFlowObject>
         class BaseStreamElement;
 
-        class BaseKernelGeneration;
+        class BaseKernelGenerator;
 
     }
 }
@@ -306,6 +456,10 @@ namespace GSPar {
              * Wait for the operations in this execution flow to complete.
              */
             virtual void synchronize() = 0;
+            /**
+             * Check, without blocking, whether the operations in this execution flow completed.
+             */
+            virtual bool isFinished() = 0;
 
             /**
              * Check if the execution flow was provided and get the device's default execution flow otherwise.
@@ -431,6 +585,320 @@ namespace GSPar {
             static TChunkedMemoryObject getChunkedMemoryObjectType() { return TChunkedMemoryObject(); }
         };
 
+        /**
+         * In-process cache of compiled programs of a device.
+         * Identical kernel sources (e.g., the same pattern instantiated by many workers) share a single program,
+         * and concurrent requests for the same source wait for a single compilation.
+         * Beyond maxPrograms, the least recently used programs are dropped from the cache, so TLibProgram must own the program
+         * (e.g., a shared_ptr), which is released by its last user.
+         *
+         * @param <TLibProgram> Type of the (lib-specific) compiled program handle
+         */
+        template <class TLibProgram>
+        class ProgramCache {
+        private:
+            struct CachedProgram {
+                std::shared_future<TLibProgram> program;
+                typename std::list<const std::string*>::iterator recentUse;
+            };
+            std::mutex programsMutex;
+            std::map<std::string, CachedProgram> programs;
+            // Keys of the programs, from the most to the least recently used
+            std::list<const std::string*> recentUses;
+            size_t maxPrograms;
+            std::atomic<unsigned long> hits;
+            std::atomic<unsigned long> misses;
+            std::atomic<unsigned long> evictions;
+
+            /**
+             * Drops the least recently used programs beyond maxPrograms. programsMutex must be locked
+             */
+            void evictLocked() {
+                auto recentUse = this->recentUses.end();
+                while (this->maxPrograms && this->programs.size() > this->maxPrograms && recentUse != this->recentUses.begin()) {
+                    --recentUse;
+                    auto program = this->programs.find(**recentUse);
+                    if (program->second.program.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                        continue; // Still compiling, some thread is waiting for it
+                    }
+                    recentUse = this->recentUses.erase(recentUse);
+                    this->programs.erase(program);
+                    this->evictions++;
+                }
+            }
+
+        public:
+            /**
+             * @param maxPrograms Programs kept in the cache, 0 for no limit
+             */
+            explicit ProgramCache(size_t maxPrograms = GSPAR_PROGRAM_CACHE_MAX_PROGRAMS) : maxPrograms(maxPrograms), hits(0), misses(0), evictions(0) { }
+
+            /**
+             * Normalizes the formatting of a kernel source, so insignificant whitespace does not change its key
+             */
+            static std::string normalizeSource(const std::string& source) {
+                std::string normalized;
+                normalized.reserve(source.size());
+                size_t lineStart = 0;
+                while (lineStart < source.size()) {
+                    size_t lineEnd = source.find('\n', lineStart);
+                    if (lineEnd == std::string::npos) {
+                        lineEnd = source.size();
+                    }
+                    size_t contentEnd = source.find_last_not_of(" \t\r", lineEnd - 1);
+                    if (contentEnd != std::string::npos && contentEnd >= lineStart && contentEnd < lineEnd) {
+                        normalized.append(source, lineStart, contentEnd - lineStart + 1);
+                        normalized += '\n';
+                    }
+                    lineStart = lineEnd + 1;
+                }
+                return normalized;
+            }
+
+            /**
+             * Gets the program compiled from a source, compiling it only if it is not cached yet
+             * @param key Key of the program, usually the normalized source
+             * @param compile Function that compiles the program. Failed compilations are not cached.
+             */
+            TLibProgram getOrCompile(const std::string& key, std::function<TLibProgram()> compile) {
+                std::shared_future<TLibProgram> cached;
+                std::promise<TLibProgram> compilation;
+                {
+                    std::lock_guard<std::mutex> lock(this->programsMutex); // Auto-unlock, RAII
+                    auto it = this->programs.find(key);
+                    if (it != this->programs.end()) {
+                        this->hits++;
+                        cached = it->second.program;
+                        this->recentUses.splice(this->recentUses.begin(), this->recentUses, it->second.recentUse);
+                    } else {
+                        this->misses++;
+                        it = this->programs.insert(std::make_pair(key, CachedProgram())).first;
+                        it->second.program = compilation.get_future().share();
+                        it->second.recentUse = this->recentUses.insert(this->recentUses.begin(), &it->first);
+                        this->evictLocked();
+                    }
+                    // Auto-unlock of programsMutex, RAII
+                }
+                if (cached.valid()) {
+                    return cached.get(); // Waits if another thread is still compiling it
+                }
+                try {
+                    TLibProgram program = compile();
+                    compilation.set_value(program);
+                    return program;
+                } catch (...) {
+                    compilation.set_exception(std::current_exception());
+                    std::lock_guard<std::mutex> lock(this->programsMutex); // Auto-unlock, RAII
+                    auto it = this->programs.find(key);
+                    if (it != this->programs.end()) {
+                        this->recentUses.erase(it->second.recentUse);
+                        this->programs.erase(it);
+                    }
+                    throw;
+                    // Auto-unlock of programsMutex, RAII
+                }
+            }
+
+            /**
+             * Gets every program successfully compiled, so they can be released
+             */
+            std::vector<TLibProgram> getPrograms() {
+                std::vector<TLibProgram> compiled;
+                std::lock_guard<std::mutex> lock(this->programsMutex); // Auto-unlock, RAII
+                for (auto& program : this->programs) {
+                    if (program.second.program.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                        try {
+                            compiled.push_back(program.second.program.get());
+                        } catch (...) { } // Failed compilations have nothing to release
+                    }
+                }
+                return compiled;
+                // Auto-unlock of programsMutex, RAII
+            }
+
+            /**
+             * Drops every compiled program, releasing the ones that no kernel uses anymore
+             */
+            void clear() {
+                std::lock_guard<std::mutex> lock(this->programsMutex); // Auto-unlock, RAII
+                for (auto program = this->programs.begin(); program != this->programs.end(); ) {
+                    if (program->second.program.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                        ++program; // Still compiling, some thread is waiting for it
+                        continue;
+                    }
+                    this->recentUses.erase(program->second.recentUse);
+                    program = this->programs.erase(program);
+                }
+                // Auto-unlock of programsMutex, RAII
+            }
+
+            size_t getMaxPrograms() { return this->maxPrograms; }
+            unsigned long getHits() { return this->hits; }
+            unsigned long getMisses() { return this->misses; }
+            unsigned long getEvictions() { return this->evictions; }
+        };
+
+        /**
+         * Caching allocator of the memory of a device.
+         * Released blocks are kept by size class and reused by later allocations of the same class, so memory objects
+         * created for each run (e.g., for each stream item) do not allocate and free device memory every time.
+         * Free blocks are released, from the least recently used, when they exceed the high-water mark or an allocation fails.
+         *
+         * @param <TLibMemory> Type of the (lib-specific) device memory handle
+         */
+        template <class TLibMemory>
+        class DeviceMemoryPool {
+        private:
+            struct FreeBlock {
+                size_t sizeClass;
+                unsigned long flags;
+                TLibMemory memory;
+            };
+            std::mutex blocksMutex;
+            // From the least to the most recently released
+            std::list<FreeBlock> freeBlocks;
+            std::multimap<std::pair<size_t, unsigned long>, typename std::list<FreeBlock>::iterator> freeBlocksIndex;
+            std::function<void(TLibMemory)> releaseMemory;
+            size_t maxHeldBytes;
+            size_t heldBytes = 0; // Guarded by blocksMutex
+            std::atomic<size_t> inUseBytes;
+            std::atomic<unsigned long> hits;
+            std::atomic<unsigned long> misses;
+
+            /**
+             * Releases the least recently used free blocks until at most maxBytes are held. blocksMutex must be locked.
+             */
+            void trimLocked(size_t maxBytes) {
+                while (this->heldBytes > maxBytes && !this->freeBlocks.empty()) {
+                    auto block = this->freeBlocks.begin();
+                    auto range = this->freeBlocksIndex.equal_range(std::make_pair(block->sizeClass, block->flags));
+                    for (auto it = range.first; it != range.second; it++) {
+                        if (it->second == block) {
+                            this->freeBlocksIndex.erase(it);
+                            break;
+                        }
+                    }
+                    this->heldBytes -= block->sizeClass;
+                    this->releaseMemory(block->memory);
+                    this->freeBlocks.erase(block);
+                }
+            }
+
+        public:
+            /**
+             * @param releaseMemory Function that actually frees a block of device memory
+             * @param maxHeldBytes High-water mark of free bytes kept for reuse
+             */
+            explicit DeviceMemoryPool(std::function<void(TLibMemory)> releaseMemory, size_t maxHeldBytes = GSPAR_DEVICE_MEMORY_POOL_MAX_BYTES) :
+                releaseMemory(releaseMemory), maxHeldBytes(maxHeldBytes), inUseBytes(0), hits(0), misses(0) { }
+            virtual ~DeviceMemoryPool() {
+                this->trim();
+            }
+
+            /**
+             * Gets the size actually allocated for a block of the given size.
+             * Each power of two is split in 4 classes, so a block wastes at most 25% of its size.
+             */
+            static size_t getSizeClass(size_t size) {
+                const size_t minSizeClass = 512;
+                if (size <= minSizeClass) {
+                    return minSizeClass;
+                }
+                size_t powerOfTwo = minSizeClass;
+                while (powerOfTwo < size) {
+                    powerOfTwo <<= 1;
+                }
+                size_t step = powerOfTwo / 8;
+                return ((size + step - 1) / step) * step;
+            }
+
+            /**
+             * Gets a block of at least size bytes, reusing a free block of the same size class and flags if there is one
+             * @param flags Lib-specific flags the block was allocated with (e.g., read-only)
+             * @param allocateMemory Function that actually allocates a block of the given size
+             */
+            TLibMemory allocate(size_t size, unsigned long flags, std::function<TLibMemory(size_t)> allocateMemory) {
+                size_t sizeClass = getSizeClass(size);
+                {
+                    std::lock_guard<std::mutex> lock(this->blocksMutex); // Auto-unlock, RAII
+                    auto it = this->freeBlocksIndex.find(std::make_pair(sizeClass, flags));
+                    if (it != this->freeBlocksIndex.end()) {
+                        TLibMemory memory = it->second->memory;
+                        this->freeBlocks.erase(it->second);
+                        this->freeBlocksIndex.erase(it);
+                        this->heldBytes -= sizeClass;
+                        this->inUseBytes += sizeClass;
+                        this->hits++;
+                        return memory;
+                    }
+                    // Auto-unlock of blocksMutex, RAII
+                }
+                this->misses++;
+                TLibMemory memory;
+                try {
+                    memory = allocateMemory(sizeClass);
+                } catch (...) {
+                    // The device may be out of memory because of the blocks we are holding, so we release them and try again
+                    this->trim();
+                    memory = allocateMemory(sizeClass);
+                }
+                this->inUseBytes += sizeClass;
+                return memory;
+            }
+
+            /**
+             * Gives a block back to the pool. The device must not be using it anymore.
+             */
+            void release(TLibMemory memory, size_t size, unsigned long flags) {
+                size_t sizeClass = getSizeClass(size);
+                this->inUseBytes -= sizeClass;
+                std::lock_guard<std::mutex> lock(this->blocksMutex); // Auto-unlock, RAII
+                if (sizeClass > this->maxHeldBytes) {
+                    this->releaseMemory(memory);
+                    return;
+                }
+                auto block = this->freeBlocks.insert(this->freeBlocks.end(), FreeBlock{sizeClass, flags, memory});
+                this->freeBlocksIndex.insert(std::make_pair(std::make_pair(sizeClass, flags), block));
+                this->heldBytes += sizeClass;
+                this->trimLocked(this->maxHeldBytes);
+                // Auto-unlock of blocksMutex, RAII
+            }
+
+            /**
+             * Releases the free blocks until at most maxBytes are held (all of them by default)
+             */
+            void trim(size_t maxBytes = 0) {
+                std::lock_guard<std::mutex> lock(this->blocksMutex); // Auto-unlock, RAII
+                this->trimLocked(maxBytes);
+                // Auto-unlock of blocksMutex, RAII
+            }
+
+            /**
+             * Sets the high-water mark of free bytes kept for reuse. 0 releases every block as soon as it is freed.
+             */
+            void setMaxHeldBytes(size_t maxHeldBytes) {
+                std::lock_guard<std::mutex> lock(this->blocksMutex); // Auto-unlock, RAII
+                this->maxHeldBytes = maxHeldBytes;
+                this->trimLocked(maxHeldBytes);
+                // Auto-unlock of blocksMutex, RAII
+            }
+            size_t getMaxHeldBytes() { return this->maxHeldBytes; }
+
+            unsigned long getHits() { return this->hits; }
+            unsigned long getMisses() { return this->misses; }
+            /**
+             * Bytes of the free blocks kept for reuse
+             */
+            size_t getHeldBytes() {
+                std::lock_guard<std::mutex> lock(this->blocksMutex); // Auto-unlock, RAII
+                return this->heldBytes;
+            }
+            /**
+             * Bytes of the blocks allocated from the pool and not released yet
+             */
+            size_t getInUseBytes() { return this->inUseBytes; }
+        };
+
         /**
          * Class to allow references to BaseDevice without templates.
          */
@@ -517,8 +985,12 @@ namespace GSPar {
             // virtual TMemoryObject* malloc(long size, void* hostPtr = NULL) {
             //     return new TMemoryObject(this, size, hostPtr, false, false);
             // }
-            virtual TKernel* prepareKernel(const std::string kernelSource, const std::string kernelName) = 0;
-            virtual std::vector<TKernel*> prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames) = 0;
+            /**
+             * Maps the runtime-independent compiler options to the flags of this runtime compiler
+             */
+            virtual std::vector<std::string> getCompilerFlags(const CompilerOptions& compilerOptions) = 0;
+            virtual TKernel* prepareKernel(const std::string kernelSource, const std::string kernelName, const CompilerOptions& compilerOptions = CompilerOptions()) = 0;
+            virtual std::vector<TKernel*> prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames, const CompilerOptions& compilerOptions = CompilerOptions()) = 0;
         };
 
         /**
@@ -701,17 +1173,22 @@ namespace GSPar {
                 // const pointer must be read-only
                 BaseMemoryObject(device, size, const_cast<void*>(hostPtr), true, false) { }
 
+            /**
+             * Throws if the range is not inside the first limit bytes
+             */
+            void checkRange(size_t offset, size_t length, size_t limit) {
+                if (offset > limit || length > limit - offset) {
+                    throw TException("Range of " + std::to_string(length) + " bytes from offset " + std::to_string(offset)
+                        + " exceeds the " + std::to_string(limit) + " bytes of the memory object");
+                }
+            }
+
         public:
             BaseMemoryObject() {}
             virtual ~BaseMemoryObject() {}
             TLibMemoryObject getBaseMemoryObject() { return this->devicePtr; }
             bool isReadOnly() { return !(this->flags & CAN_WRITE_FLAG); }
             bool isWriteOnly() { return !(this->flags & CAN_READ_FLAG); }
-            void bindTo(void* hostPtr) { this->hostPtr = hostPtr; }
-            void bindTo(void* hostPtr, size_t size) {
-                this->bindTo(hostPtr);
-                this->size = size;
-            }
             virtual void pinHostMemory() { this->setPinnedHostMemory(true); }
             virtual void setPinnedHostMemory(bool pinned) { this->_isPinnedHostMemory = pinned; }
             virtual bool isPinnedHostMemory() { return this->_isPinnedHostMemory; }
@@ -719,6 +1196,14 @@ namespace GSPar {
             virtual void copyOut() = 0;
             virtual void copyInAsync(TExecutionFlow* executionFlow = NULL) = 0;
             virtual void copyOutAsync(TExecutionFlow* executionFlow = NULL) = 0;
+            /**
+             * Copy only length bytes from offset, which is the same in the host and in the device memory.
+             * In chunked memory objects, the offset is counted as if the chunks were contiguous.
+             */
+            virtual void copyIn(size_t offset, size_t length) = 0;
+            virtual void copyOut(size_t offset, size_t length) = 0;
+            virtual void copyInAsync(size_t offset, size_t length, TExecutionFlow* executionFlow = NULL) = 0;
+            virtual void copyOutAsync(size_t offset, size_t length, TExecutionFlow* executionFlow = NULL) = 0;
         };
 
         /**
@@ -757,6 +1242,21 @@ namespace GSPar {
             virtual ~BaseChunkedMemoryObject() { }
             size_t getChunkSize() { return this->size; }
             unsigned int getChunkCount() { return this->chunks; }
+
+            /**
+             * Calls copyPart(chunk, offset in the chunk, length) for the part of the range in each chunk, in order
+             */
+            void forEachChunkInRange(size_t offset, size_t length, std::function<void(unsigned int, size_t, size_t)> copyPart) {
+                this->checkRange(offset, length, this->chunks * this->getChunkSize());
+                size_t end = offset + length;
+                while (offset < end) {
+                    unsigned int chunk = offset / this->getChunkSize();
+                    size_t chunkOffset = offset - chunk * this->getChunkSize();
+                    size_t partLength = std::min(end - offset, this->getChunkSize() - chunkOffset);
+                    copyPart(chunk, chunkOffset, partLength);
+                    offset += partLength;
+                }
+            }
         };
 
         /**
@@ -790,7 +1290,31 @@ namespace GSPar {
         public:
             virtual const std::string getKernelPrefix() = 0;
             virtual std::string generateStdFunctions() = 0;
-            virtual std::string replaceMacroKeywords(std::string kernelSource) = 0;
+            /**
+             * Replaces GSPAR_DEVICE_MACRO_BEGIN with #define and GSPAR_DEVICE_MACRO_END with a line break, in a single pass over the source
+             */
+            virtual std::string replaceMacroKeywords(std::string kernelSource) {
+                static const std::string keyword = "GSPAR_DEVICE_MACRO_";
+                std::string replaced;
+                replaced.reserve(kernelSource.size());
+                size_t copied = 0;
+                for (size_t pos = kernelSource.find(keyword); pos != std::string::npos; pos = kernelSource.find(keyword, copied)) {
+                    replaced.append(kernelSource, copied, pos - copied);
+                    size_t suffix = pos + keyword.size();
+                    if (kernelSource.compare(suffix, 5, "BEGIN") == 0) {
+                        replaced += "#define";
+                        copied = suffix + 5;
+                    } else if (kernelSource.compare(suffix, 3, "END") == 0) {
+                        replaced += "\n";
+                        copied = suffix + 3;
+                    } else { // Not a keyword, only starts like one
+                        replaced += keyword;
+                        copied = suffix;
+                    }
+                }
+                replaced.append(kernelSource, copied, std::string::npos);
+                return replaced;
+            }
             virtual std::string generateInitKernel(Pattern::BaseParallelPattern* pattern, Dimensions dims) = 0;
             virtual std::string generateParams(Pattern::BaseParallelPattern* pattern, Dimensions dims) = 0;
             virtual std::string generateStdVariables(Pattern::BaseParallelPattern* pattern, Dimensions dims) = 0;
@@ -808,6 +1332,13 @@ namespace GSPar {
                     this->getStdVarNameForDimension(patternNames, 2)
                 };
             }
+            /**
+             * Whether the threads of a block run one after the other, in the order of their IDs, such as in the host driver.
+             * Patterns may then generate kernels that don't synchronize the threads of a block.
+             */
+            virtual bool isBlockRunSequentially() {
+                return false;
+            }
         };
 
     }
@@ -10,8 +10,12 @@
 #include <iostream> //std::cout and std::cerr
 #include <chrono>
 #include <algorithm> //std::generate_n
-#ifdef GSPAR_DEBUG
+#include <iterator> //std::prev
 #include <sstream>
+#include <iomanip> //std::setprecision
+#include <limits>
+#include <cmath> //std::isfinite
+#ifdef GSPAR_DEBUG
 #include <thread>
 #endif
 
@@ -23,6 +27,35 @@
 #endif
 #include <memory>
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <list>
+#include <set>
+#include <future>
+#include <functional>
+#include <exception>
+
+/**
+ * Maximum number of compiled kernel variants (for different dimensions and batch configurations) kept by each pattern
+ */
+#ifndef GSPAR_PATTERN_MAX_COMPILED_KERNELS
+#define GSPAR_PATTERN_MAX_COMPILED_KERNELS 4
+#endif
+
+/**
+ * Number of timed runs of each block shape when autotuning a kernel
+ */
+#ifndef GSPAR_AUTOTUNING_RUNS
+#define GSPAR_AUTOTUNING_RUNS 3
+#endif
+
+/**
+ * Percentage of the GPU memory used by an out-of-core pattern when its tile size is not set
+ */
+#ifndef GSPAR_OUT_OF_CORE_DEVICE_MEMORY_PERCENT
+#define GSPAR_OUT_OF_CORE_DEVICE_MEMORY_PERCENT 50
+#endif
 
 ///// Forward declarations /////
 
@@ -42,6 +75,15 @@ namespace GSPar {
             GSPAR_PARAM_PRESENT // It avoids memory transfers when using a MemoryObject from user
         };
 
+        /**
+         * When an IN pointer parameter is copied to the GPU again in the following runs of a pattern
+         */
+        enum ParameterUpdateMode {
+            GSPAR_UPDATE_ALWAYS, // In every run
+            GSPAR_UPDATE_ON_DIRTY, // Only after being marked as dirty (see markDirty)
+            GSPAR_UPDATE_ON_CHANGE // Only when the hash of the host memory changed
+        };
+
         struct VarType {
             std::string name;
             bool isPointer; //std::is_pointer
@@ -191,6 +233,15 @@ namespace GSPar {
             virtual void setUserMemoryObject(Driver::BaseMemoryObjectBase* memoryObjectFromUser) {
                 this->userMemoryObject = memoryObjectFromUser;
             }
+            virtual Driver::BaseMemoryObjectBase* getUserMemoryObject() {
+                return this->userMemoryObject;
+            }
+            /**
+             * Takes the GPU memory allocated for another parameter, which is left without it
+             */
+            virtual void takeMemoryObject(TypedParameter<T>& other) {
+                this->memoryObject = std::move(other.memoryObject);
+            }
 
             // virtual T getValue() { return this->value; }
         };
@@ -229,6 +280,24 @@ namespace GSPar {
          */
         class PointerParameter
             : public TypedParameter<void*> {
+        protected:
+            unsigned long version = 1; // Incremented by markDirty
+            /**
+             * The host memory the GPU memory holds, since the last copy to the GPU
+             */
+            struct GpuCopy {
+                const Driver::BaseMemoryObjectBase* memoryObject;
+                const void* pointer;
+                size_t size;
+                unsigned long version;
+                uint64_t hash;
+            } gpuCopy = { nullptr, nullptr, 0, 0, 0 };
+            uint64_t hostHash = 0; // Hash computed by isGpuCopyCurrent, reused by setGpuCopyCurrent
+            bool isHostHashCurrent = false;
+            // Byte ranges [begin, end) changed since the last copy to the GPU, sorted and disjoint
+            std::vector<std::pair<size_t, size_t>> dirtyRanges;
+            bool wholeDirty = false; // Marked dirty without a range since the last copy to the GPU
+
         public:
             PointerParameter() : TypedParameter() { }
             // Constructor with no MemoryObject from user
@@ -248,8 +317,131 @@ namespace GSPar {
             virtual bool isValueTyped() override { return false; }
             virtual void* getPointer() { return this->value; }
 
+            /**
+             * Tells that the host memory changed, so it is copied to the GPU in the next run (see GSPAR_UPDATE_ON_DIRTY)
+             */
+            virtual void markDirty() {
+                this->version++;
+                this->wholeDirty = true;
+                this->dirtyRanges.clear();
+            }
+            /**
+             * Tells that only length bytes from offset changed, so only them are copied to the GPU in the next run
+             */
+            virtual void markDirty(size_t offset, size_t length) {
+                if (offset > this->size || length > this->size - offset) {
+                    throw GSParException("Dirty range of " + std::to_string(length) + " bytes from offset " + std::to_string(offset)
+                        + " exceeds the " + std::to_string(this->size) + " bytes of parameter " + this->name);
+                }
+                this->version++;
+                if (this->wholeDirty || !length) {
+                    return;
+                }
+                // Keeps the ranges sorted, merging the ones that overlap or touch
+                size_t begin = offset, end = offset + length;
+                auto range = std::lower_bound(this->dirtyRanges.begin(), this->dirtyRanges.end(), std::make_pair(begin, begin));
+                if (range != this->dirtyRanges.begin() && std::prev(range)->second >= begin) {
+                    range--;
+                }
+                auto last = range;
+                while (last != this->dirtyRanges.end() && last->first <= end) {
+                    begin = std::min(begin, last->first);
+                    end = std::max(end, last->second);
+                    last++;
+                }
+                range = this->dirtyRanges.erase(range, last);
+                this->dirtyRanges.insert(range, std::make_pair(begin, end));
+            }
+            const std::vector<std::pair<size_t, size_t>>& getDirtyRanges() { return this->dirtyRanges; }
+            /**
+             * Same as markDirty
+             */
+            virtual void touch() { this->markDirty(); }
+            virtual unsigned long getVersion() { return this->version; }
+            virtual void setUserMemoryObject(Driver::BaseMemoryObjectBase* memoryObjectFromUser) override {
+                TypedParameter::setUserMemoryObject(memoryObjectFromUser);
+                this->gpuCopy = { nullptr, nullptr, 0, 0, 0 };
+            }
+            /**
+             * Takes the GPU memory of another parameter, with what it holds.
+             * Setting the same host memory again doesn't make it dirty, a different one is always copied.
+             */
+            virtual void takeMemoryObject(TypedParameter<void*>& other) override {
+                TypedParameter::takeMemoryObject(other);
+                auto otherPointer = dynamic_cast<PointerParameter*>(&other);
+                if (otherPointer) {
+                    this->gpuCopy = otherPointer->gpuCopy;
+                    this->version = otherPointer->version;
+                    this->dirtyRanges = otherPointer->dirtyRanges;
+                    this->wholeDirty = otherPointer->wholeDirty;
+                }
+            }
+
+            /**
+             * Gets a hash of the host memory, fast enough to be computed on every run.
+             * It is not cryptographic: it only detects changes to the data.
+             */
+            static uint64_t hashHostMemory(const void* memory, size_t size) {
+                const unsigned char* bytes = static_cast<const unsigned char*>(memory);
+                const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+                // Independent lanes keep several multiplications in flight
+                uint64_t lanes[4] = { size, prime, ~size, ~prime };
+                size_t i = 0;
+                for (; i + sizeof(lanes) <= size; i += sizeof(lanes)) {
+                    for (int lane = 0; lane < 4; lane++) {
+                        uint64_t word;
+                        std::memcpy(&word, bytes + i + lane * sizeof(uint64_t), sizeof(uint64_t));
+                        lanes[lane] = (lanes[lane] ^ word) * prime;
+                        lanes[lane] ^= lanes[lane] >> 31;
+                    }
+                }
+                uint64_t hash = lanes[0] ^ (lanes[1] << 17 | lanes[1] >> 47) ^ (lanes[2] << 31 | lanes[2] >> 33) ^ (lanes[3] << 47 | lanes[3] >> 17);
+                for (; i < size; i++) {
+                    hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+                }
+                return hash ^ (hash >> 32);
+            }
+
+            /**
+             * Checks whether the GPU memory already holds the current host memory, according to the update mode
+             */
+            virtual bool isGpuCopyCurrent(ParameterUpdateMode updateMode) {
+                this->isHostHashCurrent = false;
+                if (updateMode == GSPAR_UPDATE_ALWAYS || this->gpuCopy.memoryObject != this->getMemoryObject()
+                        || this->gpuCopy.pointer != this->value || this->gpuCopy.size != this->size) {
+                    return false;
+                }
+                if (updateMode == GSPAR_UPDATE_ON_DIRTY) {
+                    return this->gpuCopy.version == this->version;
+                }
+                this->hostHash = hashHostMemory(this->value, this->size);
+                this->isHostHashCurrent = true;
+                return this->gpuCopy.hash == this->hostHash;
+            }
+            /**
+             * Checks whether only the dirty ranges must be copied to bring the GPU memory up to date
+             */
+            virtual bool isGpuCopyDirtyOnlyInRanges(ParameterUpdateMode updateMode) {
+                return updateMode == GSPAR_UPDATE_ON_DIRTY && !this->wholeDirty && !this->dirtyRanges.empty()
+                    && this->gpuCopy.memoryObject == this->getMemoryObject() && this->gpuCopy.pointer == this->value && this->gpuCopy.size == this->size;
+            }
+            /**
+             * Records that the host memory was just copied to the GPU
+             */
+            virtual void setGpuCopyCurrent(ParameterUpdateMode updateMode) {
+                uint64_t hash = 0;
+                if (updateMode == GSPAR_UPDATE_ON_CHANGE) {
+                    hash = this->isHostHashCurrent ? this->hostHash : hashHostMemory(this->value, this->size);
+                }
+                this->gpuCopy = { this->getMemoryObject(), this->value, this->size, this->version, hash };
+                this->isHostHashCurrent = false;
+                this->dirtyRanges.clear();
+                this->wholeDirty = false;
+            }
+
             template <class TDevice>
             Driver::BaseMemoryObjectBase *malloc(TDevice gpu, unsigned int batchSize) {
+                this->gpuCopy = { nullptr, nullptr, 0, 0, 0 }; // The new GPU memory holds nothing yet
                 // If it is only IN, the kernel won't write, if is OUT, the kernel won't read
                 bool readOnly = (this->direction == Pattern::ParameterDirection::GSPAR_PARAM_IN);
                 bool writeOnly = (this->direction == Pattern::ParameterDirection::GSPAR_PARAM_OUT);
@@ -263,6 +455,166 @@ namespace GSPar {
             }
         };
 
+        /**
+         * Completion of a pattern run started with runAsync.
+         * The copies to the GPU and the kernel are already enqueued in the execution flow of the pattern,
+         * and the run is completed (the results copied back to the host and the callbacks called) by the first wait or successful test.
+         * Copies of a handle share the same run.
+         */
+        class RunHandle {
+        private:
+            struct State {
+                std::mutex mutex;
+                bool completed = false;
+                std::function<bool()> isFinished; // Whether the work in the GPU finished, without blocking
+                std::function<void()> complete; // Waits for the work in the GPU and finishes the run
+                std::exception_ptr failure;
+                std::atomic<bool> reported{false}; // Whether the failure was already rethrown by wait
+                std::vector<std::function<void()>> continuations;
+            };
+            std::shared_ptr<State> state;
+
+            /**
+             * Completes the run and gets the continuations to call. The mutex of the state must be locked
+             */
+            std::vector<std::function<void()>> completeLocked() {
+                try {
+                    this->state->complete();
+                } catch (...) {
+                    this->state->failure = std::current_exception();
+                }
+                this->state->completed = true;
+                // Releases the kernel and anything else held by the run
+                this->state->isFinished = nullptr;
+                this->state->complete = nullptr;
+                std::vector<std::function<void()>> continuations;
+                if (!this->state->failure) {
+                    continuations.swap(this->state->continuations);
+                }
+                this->state->continuations.clear();
+                return continuations;
+            }
+
+            /**
+             * Completes the run, if it didn't complete yet, and calls its continuations
+             */
+            void finish() {
+                std::vector<std::function<void()>> continuations;
+                {
+                    std::lock_guard<std::mutex> lock(this->state->mutex); // Auto-unlock, RAII
+                    if (!this->state->completed) {
+                        continuations = this->completeLocked();
+                    }
+                    // Auto-unlock of mutex, RAII
+                }
+                // Continuations may use the handle
+                for (auto& continuation : continuations) {
+                    continuation();
+                }
+            }
+
+        public:
+            /**
+             * A handle of no run, which is already completed
+             */
+            RunHandle() { }
+            RunHandle(std::function<bool()> isFinished, std::function<void()> complete) : state(std::make_shared<State>()) {
+                this->state->isFinished = isFinished;
+                this->state->complete = complete;
+            }
+
+            /**
+             * Waits for the run to complete.
+             * Rethrows the exception thrown while completing it.
+             */
+            void wait() {
+                if (!this->state) {
+                    return;
+                }
+                this->finish();
+                if (this->state->failure) {
+                    this->state->reported = true;
+                    std::rethrow_exception(this->state->failure);
+                }
+            }
+
+            /**
+             * Waits for the run to complete, as wait does, but rethrows its failure only if no wait rethrew it yet.
+             * Thus, the failure of a run whose handle was dropped is still reported once.
+             */
+            void waitUnreported() {
+                if (!this->state) {
+                    return;
+                }
+                this->finish();
+                if (this->state->failure && !this->state->reported.exchange(true)) {
+                    std::rethrow_exception(this->state->failure);
+                }
+            }
+
+            /**
+             * Waits for the run to complete, as wait does, but leaves its failure to be rethrown by a later wait or waitUnreported
+             */
+            void waitDeferringFailure() {
+                if (!this->state) {
+                    return;
+                }
+                this->finish();
+            }
+
+            /**
+             * Checks whether the run completed, without blocking while the GPU is working.
+             * If the GPU finished, completes the run as wait does, but a failure is only rethrown by wait.
+             */
+            bool test() {
+                if (!this->state) {
+                    return true;
+                }
+                std::vector<std::function<void()>> continuations;
+                {
+                    std::lock_guard<std::mutex> lock(this->state->mutex); // Auto-unlock, RAII
+                    if (this->state->completed) {
+                        return true;
+                    }
+                    bool finished;
+                    try {
+                        finished = this->state->isFinished();
+                    } catch (...) {
+                        finished = true; // Completing the run gets the failure
+                    }
+                    if (!finished) {
+                        return false;
+                    }
+                    continuations = this->completeLocked();
+                    // Auto-unlock of mutex, RAII
+                }
+                for (auto& continuation : continuations) {
+                    continuation();
+                }
+                return true;
+            }
+
+            /**
+             * Calls the callback after the run completes, in the thread that completes it with wait or test,
+             * or right away if it already completed. It is not called if the run failed.
+             */
+            RunHandle& then(std::function<void()> callback) {
+                if (this->state) {
+                    std::lock_guard<std::mutex> lock(this->state->mutex); // Auto-unlock, RAII
+                    if (!this->state->completed) {
+                        this->state->continuations.push_back(callback);
+                        return *this;
+                    }
+                    if (this->state->failure) {
+                        return *this;
+                    }
+                    // Auto-unlock of mutex, RAII
+                }
+                callback();
+                return *this;
+            }
+        };
+
         /**
          * Base class for parallel patterns
          */
@@ -274,11 +626,49 @@ namespace GSPar {
         protected:
             std::unique_ptr<Driver::BaseExecutionFlowBase> executionFlow;
             bool batched = false;
+            bool dimensionAgnostic = false; // Are all sizes runtime parameters of the kernel?
+            bool autotuning = false; // Should we search the fastest number of threads per block?
+            bool autotuningSkipWarned = false; // The warning of a kernel that can't be autotuned is shown once
+            // Parameters kept in the GPU by a PatternComposition: already there before running or only needed there afterwards
+            std::set<std::string> residentInputs;
+            std::set<std::string> residentOutputs;
+            // When each IN pointer parameter is copied to the GPU again. The ones not in the map are copied in every run
+            std::map<std::string, ParameterUpdateMode> updateModes;
+            std::atomic<unsigned long> bytesCopiedToGpu{0};
+            std::atomic<unsigned long> bytesSkippedToGpu{0}; // Not copied because the GPU already had them
+            // Byte ranges (offset and length) of OUT pointer parameters that are copied back to the host. The others are copied whole
+            std::map<std::string, std::pair<size_t, size_t>> outputRanges;
+            // Out-of-core runs split the last dimension in tiles, and only the slices of the tiled parameters used by a tile are in the GPU
+            bool outOfCore = false;
+            unsigned long tileSize = 0; // Indexes of the last dimension in each tile, 0 to fit in GSPAR_OUT_OF_CORE_DEVICE_MEMORY_PERCENT
+            std::map<std::string, size_t> tiledParameters; // Name => bytes used by each index of the last dimension, 0 for size / extent
+            std::map<std::string, size_t> tileBytes; // Bytes per index of each tiled parameter in the compiled kernel
+            std::unique_ptr<Driver::BaseExecutionFlowBase> tileExecutionFlow; // Runs every other tile
+            RunHandle pendingRun; // The last run started, which uses the GPU memory of the parameters until it completes
             unsigned int batchSize = 1; //TODO what if Dimension max is not divisible by batchSize? It actually segfaults
             bool _isKernelCompiled = false;
             bool isKernelStale = false; // Do we need to recompile the kernel?
             mutable std::mutex compiledKernelMutex;
-            // Should we use a std::map to support multiple pre-compiled kernels?
+            /**
+             * A kernel compiled for a specific dimensions and batch configuration
+             */
+            struct CompiledKernelVariant {
+                Driver::Dimensions dims;
+                bool batched;
+                unsigned int batchSize;
+                /**
+                 * Ready as soon as the kernel finishes compiling, so other threads can wait for a compilation in progress
+                 */
+                std::shared_future<std::shared_ptr<Driver::BaseKernelBase>> kernel;
+                unsigned long compilationId;
+            };
+            /**
+             * Compiled kernels, ordered from the most to the least recently used (LRU)
+             */
+            std::list<CompiledKernelVariant> compiledKernels;
+            unsigned int maxCompiledKernels = GSPAR_PATTERN_MAX_COMPILED_KERNELS;
+            unsigned long lastCompilationId = 0;
+            // The most recently used variant
             Driver::Dimensions compiledKernelDimension;
             std::shared_ptr<Driver::BaseKernelBase> compiledKernel;
             std::string kernelName;
@@ -292,11 +682,188 @@ namespace GSPar {
              * And they'll be automatically released as soon as all clones are destroyed
              */
             std::map<std::string, std::shared_ptr<BaseParameter>> params;
+            /**
+             * Constant parameters are emitted as macros in the kernel source (name => literal),
+             * so the compiler can fold them. Their values are part of the kernel source and, thus, of its cache key.
+             */
+            std::map<std::string, std::string> constantParams;
+            Driver::CompilerOptions compilerOptions;
             std::array<std::string, 3> stdVarNames;
             bool useSharedMemory = false;
             mutable std::mutex sharedMemoryParameterMutex;
             PointerParameter* sharedMemoryParameter = nullptr;
 
+            /**
+             * Checks whether a compiled variant can run the dims Dimensions with the current batch configuration
+             */
+            virtual bool isCompiledKernelVariantFor(CompiledKernelVariant& variant, Driver::Dimensions dims) {
+                if (this->dimensionAgnostic) {
+                    // Extents, offsets and batch size are kernel parameters, only the used dimensions change the kernel code
+                    for (int d = 0; d < SUPPORTED_DIMS; d++) {
+                        if (variant.dims.is(d) != dims.is(d)) {
+                            return false;
+                        }
+                    }
+                    return variant.batched == this->batched;
+                }
+                // TODO #10 Do we really need the exact same dimension? The sizes are passed in parameters.
+                return variant.dims == dims && variant.batched == this->batched && variant.batchSize == this->batchSize;
+            }
+
+            /**
+             * Finds the compiled variant for the dims Dimensions. compiledKernelMutex must be locked.
+             */
+            std::list<CompiledKernelVariant>::iterator findCompiledKernelVariant(Driver::Dimensions dims) {
+                if (!this->_isKernelCompiled || this->isKernelStale) {
+                    return this->compiledKernels.end();
+                }
+                for (auto it = this->compiledKernels.begin(); it != this->compiledKernels.end(); ++it) {
+                    if (this->isCompiledKernelVariantFor(*it, dims)) {
+                        return it;
+                    }
+                }
+                return this->compiledKernels.end();
+            }
+
+            static bool isCompiledKernelReady(const std::shared_future<std::shared_ptr<Driver::BaseKernelBase>>& kernel) {
+                return kernel.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            }
+
+            static std::shared_future<std::shared_ptr<Driver::BaseKernelBase>> makeReadyCompiledKernel(std::shared_ptr<Driver::BaseKernelBase> kernel) {
+                std::promise<std::shared_ptr<Driver::BaseKernelBase>> compilation;
+                compilation.set_value(kernel);
+                return compilation.get_future().share();
+            }
+
+            /**
+             * Stores a new compiled (or being compiled) variant as the most recently used one. compiledKernelMutex must be locked.
+             * @return The id of the new variant
+             */
+            unsigned long addCompiledKernelVariant(std::shared_future<std::shared_ptr<Driver::BaseKernelBase>> kernel, Driver::Dimensions dims) {
+                if (this->isKernelStale) {
+                    this->compiledKernels.clear(); // Every variant was generated from an outdated kernel code
+                } else {
+                    auto replaced = this->findCompiledKernelVariant(dims);
+                    if (replaced != this->compiledKernels.end()) {
+                        this->compiledKernels.erase(replaced);
+                    }
+                }
+                unsigned long compilationId = ++this->lastCompilationId;
+                this->compiledKernels.push_front({ dims, this->batched, this->batchSize, kernel, compilationId });
+                while (this->compiledKernels.size() > this->maxCompiledKernels) {
+                    this->compiledKernels.pop_back();
+                }
+                if (isCompiledKernelReady(kernel)) {
+                    this->compiledKernel = kernel.get();
+                    this->compiledKernelDimension = dims;
+                }
+                this->_isKernelCompiled = true;
+                this->isKernelStale = false;
+                return compilationId;
+            }
+
+            /**
+             * Removes a variant whose compilation failed. compiledKernelMutex must be locked.
+             */
+            void removeCompiledKernelVariant(unsigned long compilationId) {
+                for (auto it = this->compiledKernels.begin(); it != this->compiledKernels.end(); ++it) {
+                    if (it->compilationId == compilationId) {
+                        this->compiledKernels.erase(it);
+                        break;
+                    }
+                }
+                if (this->compiledKernels.empty()) {
+                    this->_isKernelCompiled = false;
+                }
+            }
+
+            /**
+             * A variant registered by prepareCompilation, with everything its compilation needs, so it doesn't read the pattern
+             */
+            struct PreparedCompilation {
+                Driver::Dimensions dims;
+                std::shared_future<std::shared_ptr<Driver::BaseKernelBase>> kernel;
+                // Compiles the generated source in the device, or empty if the variant was already compiled (or being compiled)
+                std::function<Driver::BaseKernelBase*()> prepareKernel;
+                std::shared_ptr<std::promise<std::shared_ptr<Driver::BaseKernelBase>>> compilation;
+                unsigned long compilationId;
+            };
+
+            /**
+             * Finds the variant for the dims Dimensions or, if there is none, generates its kernel source and registers it,
+             * so concurrent callers wait for its compilation instead of compiling it again
+             */
+            template<class TDriverInstance>
+            PreparedCompilation prepareCompilation(Driver::Dimensions dims) {
+                std::lock_guard<std::mutex> lock(this->compiledKernelMutex); // Auto-unlock, RAII
+                // We only compile if the kernel wasn't compiled yet and the configuration didn't change
+                auto variant = this->findCompiledKernelVariant(dims);
+                if (variant != this->compiledKernels.end()) {
+                    this->compiledKernels.splice(this->compiledKernels.begin(), this->compiledKernels, variant); // Now it is the most recently used
+                    return { variant->dims, variant->kernel, nullptr, nullptr, 0 };
+                }
+                #ifdef GSPAR_DEBUG
+                    std::stringstream ss;
+                    ss << "[" << std::this_thread::get_id() << " GSPar "<<this<<"] Compiling Kernel for ParallelPattern with " << dims.toString() << std::endl;
+                    std::cout << ss.str();
+                    ss.str("");
+                #endif
+
+                auto gpu = this->getGpu<TDriverInstance>();
+                if (gpu == nullptr) {
+                    throw GSParException("No GPU found for Pattern compilation");
+                }
+
+                std::string kernelName = this->getKernelName();
+
+                this->callbackBeforeGeneratingKernelSource();
+
+                std::string kernelSource = this->generateKernelSource<TDriverInstance>(dims);
+
+                #ifdef GSPAR_DEBUG
+                    ss << "[" << std::this_thread::get_id() << " GSPar "<<this<<"] Compiling kernel source for " << kernelName << ":" << std::endl;
+                    ss << kernelSource << std::endl;
+                    std::cout << ss.str();
+                    ss.str("");
+                #endif
+                Driver::CompilerOptions compilerOptions = this->compilerOptions;
+                auto compilation = std::make_shared<std::promise<std::shared_ptr<Driver::BaseKernelBase>>>();
+                std::shared_future<std::shared_ptr<Driver::BaseKernelBase>> kernel = compilation->get_future().share();
+                unsigned long compilationId = this->addCompiledKernelVariant(kernel, dims);
+                return { dims, kernel, [gpu, kernelSource, kernelName, compilerOptions]() -> Driver::BaseKernelBase* {
+                    return gpu->prepareKernel(kernelSource.c_str(), kernelName.c_str(), compilerOptions);
+                }, compilation, compilationId };
+                // Auto-unlock of compiledKernelMutex, RAII
+            }
+
+            /**
+             * Compiles a variant registered by prepareCompilation (or waits for it, if it was already registered) and makes it the most recently used.
+             * Compiling can take long, so other variants may be used (or compiled) meanwhile.
+             */
+            std::shared_ptr<Driver::BaseKernelBase> compilePrepared(PreparedCompilation& prepared) {
+                std::shared_ptr<Driver::BaseKernelBase> kernel;
+                if (prepared.prepareKernel) {
+                    try {
+                        kernel = std::shared_ptr<Driver::BaseKernelBase>(prepared.prepareKernel());
+                    } catch (...) {
+                        prepared.compilation->set_exception(std::current_exception());
+                        std::lock_guard<std::mutex> lock(this->compiledKernelMutex); // Auto-unlock, RAII
+                        this->removeCompiledKernelVariant(prepared.compilationId);
+                        throw;
+                        // Auto-unlock of compiledKernelMutex, RAII
+                    }
+                    prepared.compilation->set_value(kernel);
+                } else {
+                    kernel = prepared.kernel.get(); // The variant may still be compiling in another thread
+                }
+
+                std::lock_guard<std::mutex> lock(this->compiledKernelMutex); // Auto-unlock, RAII
+                this->compiledKernel = kernel;
+                this->compiledKernelDimension = prepared.dims;
+                return kernel;
+                // Auto-unlock of compiledKernelMutex, RAII
+            }
+
             // Parameters
 
             /**
@@ -337,9 +904,38 @@ namespace GSPar {
                 if (direction == GSPAR_PARAM_PRESENT) {
                     throw GSParException("Pattern parameter \"" + name + "\": GSPAR_PARAM_PRESENT is only allowed when a MemoryObject is provided");
                 }
-                std::shared_ptr<BaseParameter> parameter(new PointerParameter(name, type, size, value, direction, batched));
+                std::shared_ptr<PointerParameter> parameter(new PointerParameter(name, type, size, value, direction, batched));
+                this->waitPendingRun(); // The run copies its results to the host pointer the memory object is bound to
+                this->rebindMemoryObject(parameter.get());
                 this->setParameter(parameter);
             }
+            /**
+             * Moves the GPU memory of the parameter being replaced to the new one, bound to the new host pointer.
+             * It happens when only the host pointer or a size that fits in the allocated memory changes (e.g., a new item of a stream),
+             * so the GPU memory is not allocated again.
+             */
+            virtual void rebindMemoryObject(PointerParameter* parameter) {
+                auto it = this->params.find(parameter->name);
+                // Cloned patterns (and fused ones) share the parameters, so another pattern may still be using its GPU memory
+                if (it == this->params.end() || it->second.use_count() > 1 || !parameter->isComplete() || parameter->isBatched()) {
+                    return;
+                }
+                BaseParameter* current = it->second.get();
+                if (current->paramValueType != GSPAR_PARAM_POINTER || current->isBatched() || current->direction != parameter->direction
+                        || current->type.getFullName() != parameter->type.getFullName()) {
+                    return;
+                }
+                auto currentPointer = static_cast<PointerParameter*>(current);
+                Driver::BaseMemoryObjectBase* memoryObject = currentPointer->getMemoryObject();
+                if (currentPointer->getUserMemoryObject() || !memoryObject || memoryObject->getAllocatedSize() < parameter->size) {
+                    return;
+                }
+                if (memoryObject->isZeroCopy()) {
+                    return; // A new memory object may use the new host memory directly, which costs less than copying it
+                }
+                memoryObject->bindTo(parameter->getPointer(), parameter->size);
+                parameter->takeMemoryObject(*currentPointer);
+            }
             // Using MemoryObject from user
             virtual void setPointerParameter(std::string name, VarType type, Driver::BaseMemoryObjectBase* userMemoryObject, ParameterDirection direction = GSPAR_PARAM_IN, bool batched = false) {
                 // new PointParameter with MemoryObject from user
@@ -357,6 +953,10 @@ namespace GSPar {
                     this->paramsOrder.push_back(paramName);
                     this->isKernelStale = true; // There is a new parameter, we need to recompile the kernel
                 }
+                if (this->constantParams.erase(paramName)) {
+                    this->isKernelStale = true; // It was a constant, now it is a kernel parameter
+                }
+                this->waitPendingRun(); // The GPU memory of the replaced parameter goes back to the device's pool
                 this->params[paramName] = parameter;
             }
 
@@ -365,13 +965,164 @@ namespace GSPar {
                 return dynamic_cast<decltype(TDriverInstance::getExecutionFlowType())*>(this->executionFlow.get());
             }
 
+            /**
+             * Checks whether running the kernel several times leaves its parameters as a single run would, so it can be autotuned.
+             * The trials copy the IN parameters again, but not the GPU memory the kernel reads after writing it
+             * (INOUT or PRESENT parameters, MemoryObjects from the user and data kept in the GPU by a PatternComposition),
+             * nor the outputs it accumulates into with atomics.
+             * @param reason Why the kernel can't be autotuned
+             */
+            virtual bool isAutotuningSafe(std::string& reason) {
+                for (auto& paramName : this->paramsOrder) {
+                    BaseParameter* param = this->getParameter(paramName);
+                    if (!param || param->paramValueType != GSPAR_PARAM_POINTER) {
+                        continue;
+                    }
+                    auto paramPointer = static_cast<PointerParameter*>(param);
+                    if (param->direction == GSPAR_PARAM_INOUT || param->direction == GSPAR_PARAM_PRESENT) {
+                        reason = "parameter \"" + paramName + "\" is read and written by the kernel";
+                        return false;
+                    }
+                    if (paramPointer->getUserMemoryObject() || this->residentInputs.count(paramName) || this->residentOutputs.count(paramName)) {
+                        reason = "parameter \"" + paramName + "\" is not copied from the host";
+                        return false;
+                    }
+                }
+                if (this->userKernel.find("atomic") != std::string::npos || this->extraKernelCode.find("atomic") != std::string::npos) {
+                    reason = "the kernel uses atomic operations";
+                    return false;
+                }
+                return true;
+            }
+
+            /**
+             * Sets the number of threads per block tuned for this kernel, device and dimensions.
+             * On the first use it runs the kernel with each candidate block shape and keeps the fastest one.
+             * The inputs are copied again before each run, so the parameters end up as they were before tuning.
+             * Kernels that can't run more than once (see isAutotuningSafe) keep the default block shape.
+             */
+            template<class TDriverInstance>
+            void tuneNumThreadsPerBlock(decltype(TDriverInstance::getKernelType())* kernel, Driver::Dimensions dimsToUse, Driver::Dimensions dimsToRun) {
+                auto gpu = this->getGpu<TDriverInstance>();
+                std::vector<std::string> keyParts = { typeid(TDriverInstance).name(), gpu->getName(), this->getKernelName(),
+                    std::to_string(this->batched) + " " + std::to_string(this->batchSize) + " " + std::to_string(this->dimensionAgnostic),
+                    dimsToRun.toString() };
+                for (auto& constant : this->constantParams) {
+                    keyParts.push_back(constant.first + "=" + constant.second);
+                }
+                for (auto& flag : gpu->getCompilerFlags(this->compilerOptions)) {
+                    keyParts.push_back(flag);
+                }
+                std::string key = Driver::KernelBinaryCache::computeKey(keyParts);
+
+                Driver::KernelTuningDatabase* database = Driver::KernelTuningDatabase::getInstance();
+                std::array<unsigned long, 3> best;
+                if (database->find(key, best)) {
+                    kernel->setNumThreadsPerBlock(best[0], best[1], best[2]);
+                    return;
+                }
+                std::string unsafeReason;
+                if (!this->isAutotuningSafe(unsafeReason)) {
+                    if (!this->autotuningSkipWarned) {
+                        this->autotuningSkipWarned = true;
+                        std::stringstream ss; // Using stringstream eases multi-threaded debugging
+                        ss << "[GSPar Pattern " << this << "] Not autotuning " << this->getKernelName() << ": " << unsafeReason << std::endl;
+                        std::cerr << ss.str();
+                    }
+                    return;
+                }
+
+                // Candidates are powers of two of 32 to 1024 threads. {0, 0, 0} is the default heuristic
+                std::vector<std::array<unsigned long, 3>> candidates = { {{0, 0, 0}} };
+                for (unsigned long threads = 32; threads <= 1024; threads *= 2) {
+                    if (dimsToRun.getCount() == 1) {
+                        candidates.push_back({{threads, 0, 0}});
+                    } else {
+                        for (unsigned long x = 4; x <= threads / 4; x *= 2) {
+                            candidates.push_back({{x, threads / x, 0}});
+                        }
+                    }
+                }
+
+                auto executionFlow = this->getExecutionFlow<TDriverInstance>();
+                std::set<std::string> testedShapes;
+                double bestTime = -1;
+                for (auto& candidate : candidates) {
+                    kernel->setNumThreadsPerBlock(candidate[0], candidate[1], candidate[2]);
+                    // Different candidates may be clamped to the same shape by the device limits
+                    if (!testedShapes.insert(kernel->getNumBlocksAndThreadsFor(dimsToRun).toString()).second) {
+                        continue;
+                    }
+                    double candidateTime = -1;
+                    for (int r = 0; r <= GSPAR_AUTOTUNING_RUNS; r++) { // The first run is a warm-up
+                        kernel->clearParameters();
+                        this->copyParametersFromHostToGpuAsync<TDriverInstance>();
+                        this->setParametersInKernel<TDriverInstance>(kernel, dimsToUse);
+                        executionFlow->synchronize();
+                        auto start = std::chrono::steady_clock::now();
+                        kernel->runAsync(dimsToRun, executionFlow);
+                        kernel->waitAsync();
+                        double runTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                        if (r && (candidateTime < 0 || runTime < candidateTime)) {
+                            candidateTime = runTime;
+                        }
+                    }
+                    #ifdef GSPAR_DEBUG
+                        std::stringstream ss;
+                        ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Autotuning " << this->getKernelName() << ": ";
+                        ss << candidate[0] << "x" << candidate[1] << "x" << candidate[2] << " took " << candidateTime << " s" << std::endl;
+                        std::cout << ss.str();
+                    #endif
+                    if (bestTime < 0 || candidateTime < bestTime) {
+                        bestTime = candidateTime;
+                        best = candidate;
+                    }
+                }
+                database->store(key, best);
+
+                // Restores the inputs and parameters for the actual run
+                kernel->setNumThreadsPerBlock(best[0], best[1], best[2]);
+                kernel->clearParameters();
+                this->copyParametersFromHostToGpuAsync<TDriverInstance>();
+                this->setParametersInKernel<TDriverInstance>(kernel, dimsToUse);
+            }
+
+            /**
+             * Waits for the last run to complete. Rethrows its failure, unless the handle of the run already did
+             */
+            void finishPendingRun() {
+                RunHandle pendingRun = this->pendingRun;
+                this->pendingRun = RunHandle(); // The failure is not rethrown again by the next run
+                pendingRun.waitUnreported();
+            }
+            /**
+             * Waits for the last run to complete before its parameters are replaced, so the device doesn't reuse their GPU memory
+             * while the run is using it. Its failure is still rethrown by the next run
+             */
+            void waitPendingRun() {
+                this->pendingRun.waitDeferringFailure();
+            }
+
             // Main run function for Parallel Pattern
             template<class TDriverInstance>
             void run(Driver::Dimensions pDims, bool useCompiledDim) {
+                this->startRun<TDriverInstance>(pDims, useCompiledDim).wait();
+            }
+
+            /**
+             * Enqueues the copies to the GPU and the kernel in the execution flow of the pattern.
+             * The returned handle copies the results back to the host when the kernel finishes.
+             */
+            template<class TDriverInstance>
+            RunHandle startRun(Driver::Dimensions pDims, bool useCompiledDim) {
                 Driver::Dimensions dimsToUse = useCompiledDim ? this->compiledKernelDimension : pDims;
                 if (!dimsToUse.getCount()) {
                     throw GSParException("No dimensions set to run the pattern");
                 }
+                this->finishPendingRun(); // Its results are still in the GPU memory of the parameters
+                if (this->outOfCore) {
+                    return this->runOutOfCore<TDriverInstance>(dimsToUse);
+                }
                 #ifdef GSPAR_DEBUG
                     std::stringstream ss;
                 #endif
@@ -389,7 +1140,8 @@ namespace GSPar {
                     #endif
                 }
 
-                this->compile<TDriverInstance>(dimsToUse);
+                // Holds the variant alive even if it gets evicted while running
+                std::shared_ptr<Driver::BaseKernelBase> compiledKernel = this->compileVariant<TDriverInstance>(dimsToUse);
 
                 // #ifdef GSPAR_DEBUG
                 //     auto gpu = this->getGpu<TDriverInstance>();
@@ -398,68 +1150,240 @@ namespace GSPar {
                 //     ss.str("");
                 // #endif
 
-                auto kernel = this->getCompiledKernel<TDriverInstance>();
+                auto kernel = static_cast<decltype(TDriverInstance::getKernelType())*>(compiledKernel.get());
                 kernel->clearParameters();
 
                 // Set the thread block size (it is an optional paramenter)
-                if (numThreadsPerBlock[0] != 0) {
-                    kernel->setNumThreadsPerBlockForX(numThreadsPerBlock[0]);
+                // Always set, so a shape tuned for other dims (or a previous configuration) is not kept
+                kernel->setNumThreadsPerBlock(numThreadsPerBlock[0], numThreadsPerBlock[1], numThreadsPerBlock[2]);
+
+                this->callbackBeforeAllocatingMemoryOnGpu(dimsToUse, kernel);
+
+                this->mallocParametersInGpu<TDriverInstance>();
+
+                this->copyParametersFromHostToGpuAsync<TDriverInstance>();
+
+                this->setSharedMemoryInKernel<TDriverInstance>(kernel, dimsToUse);
+
+                this->setParametersInKernel<TDriverInstance>(kernel, dimsToUse);
+
+                // A shape set by the user prevails. Kernels using shared memory size it with the block shape, so they are not tuned
+                if (this->autotuning && !numThreadsPerBlock[0] && !numThreadsPerBlock[1] && !numThreadsPerBlock[2] && !this->useSharedMemory) {
+                    this->tuneNumThreadsPerBlock<TDriverInstance>(kernel, dimsToUse, dimsToRun);
+                }
+
+                this->callbackAfterCopyDataFromHostToGpu();
+                this->callbackBeforeRunInGpu();
+
+                auto executionFlow = this->getExecutionFlow<TDriverInstance>();
+
+                #ifdef GSPAR_DEBUG
+                    ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Running kernel " << kernel << " for " << dimsToRun.toString() << " in flow " << executionFlow << std::endl;
+                    std::cout << ss.str();
+                    ss.str("");
+                #endif
+
+                kernel->runAsync(dimsToRun, executionFlow);
+
+                #ifdef GSPAR_DEBUG
+                    ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Started running kernel " << kernel << " in flow " << executionFlow << std::endl;
+                    std::cout << ss.str();
+                    ss.str("");
+                #endif
+
+                // Enqueued after the kernel, in the same flow
+                this->copyParametersFromGpuToHostAsync<TDriverInstance>();
+
+                // The handle holds the variant alive until the run completes
+                this->pendingRun = RunHandle([executionFlow]() {
+                    return executionFlow->isFinished();
+                }, [this, compiledKernel, kernel, dimsToUse, executionFlow]() {
+                    executionFlow->synchronize(); // The kernel and the copies to the host
+                    kernel->waitAsync();
+
+                    #ifdef GSPAR_DEBUG
+                        std::stringstream ss;
+                        ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Finished running kernel " << kernel << " in flow " << executionFlow << std::endl;
+                        std::cout << ss.str();
+                        ss.str("");
+                    #endif
+
+                    this->callbackAfterRunInGpu();
+
+                    this->callbackAfterCopyDataFromGpuToHost(dimsToUse, kernel);
+
+                    #ifdef GSPAR_DEBUG
+                        ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Finished running pattern" << std::endl;
+                        std::cout << ss.str();
+                        ss.str("");
+                    #endif
+                });
+                return this->pendingRun;
+            }
+
+            /**
+             * Runs the kernel in tiles of the last dimension, so the tiled parameters don't need to fit in the GPU memory.
+             * Consecutive tiles alternate between two execution flows with their own GPU memory,
+             * so the slices of a tile are copied while the previous tile runs.
+             */
+            template<class TDriverInstance>
+            RunHandle runOutOfCore(Driver::Dimensions dimsToUse) {
+                if (this->isBatched()) {
+                    throw GSParException("Batched patterns can't run out-of-core");
+                }
+                #ifdef GSPAR_DEBUG
+                    std::stringstream ss;
+                #endif
+                auto gpu = this->getGpu<TDriverInstance>();
+                int tileDimension = dimsToUse.getCount() - 1;
+                unsigned long extent = dimsToUse[tileDimension].max;
+
+                // The tiled parameters with the bytes of each index of the last dimension
+                std::vector<std::pair<PointerParameter*, size_t>> tiled;
+                size_t tiledBytesPerIndex = 0;
+                for (auto& tiledParameter : this->tiledParameters) {
+                    BaseParameter* param = this->getParameter(tiledParameter.first);
+                    if (!param || param->paramValueType != GSPAR_PARAM_POINTER || param->isBatched()
+                            || static_cast<PointerParameter*>(param)->getUserMemoryObject()) {
+                        throw GSParException("Tiled parameter \"" + tiledParameter.first + "\" must be a pointer parameter with host memory");
+                    }
+                    size_t bytesPerIndex = tiledParameter.second ? tiledParameter.second : param->size / extent;
+                    if (!bytesPerIndex || bytesPerIndex * extent > param->size) {
+                        throw GSParException("Tiled parameter \"" + tiledParameter.first + "\" has " + std::to_string(param->size) + " bytes, which are not enough for "
+                            + std::to_string(extent) + " indexes of " + std::to_string(bytesPerIndex) + " bytes");
+                    }
+                    if (this->tileBytes[tiledParameter.first] != bytesPerIndex) {
+                        this->tileBytes[tiledParameter.first] = bytesPerIndex;
+                        this->isKernelStale = true; // The bytes per index are written in the kernel source
+                    }
+                    tiled.push_back(std::make_pair(static_cast<PointerParameter*>(param), bytesPerIndex));
+                    tiledBytesPerIndex += bytesPerIndex;
                 }
-                if (numThreadsPerBlock[1] != 0) {
-                    kernel->setNumThreadsPerBlockForY(numThreadsPerBlock[1]);
+                if (tiled.empty()) {
+                    throw GSParException("Out-of-core patterns need at least one tiled parameter");
                 }
-                if (numThreadsPerBlock[2] != 0) {
-                    kernel->setNumThreadsPerBlockForZ(numThreadsPerBlock[2]);
+                for (auto compiled = this->tileBytes.begin(); compiled != this->tileBytes.end(); ) {
+                    if (!this->tiledParameters.count(compiled->first)) { // No longer tiled
+                        compiled = this->tileBytes.erase(compiled);
+                        this->isKernelStale = true;
+                    } else {
+                        compiled++;
+                    }
                 }
 
-                this->callbackBeforeAllocatingMemoryOnGpu(dimsToUse, kernel);
+                unsigned long tileSize = this->tileSize;
+                if (!tileSize) {
+                    // The parameters that are not tiled stay in the GPU, and two tiles are there at once
+                    size_t untiledBytes = 0;
+                    for (auto param : this->getParameterList()) {
+                        if (param->paramValueType == GSPAR_PARAM_POINTER && !this->isTiledParameter(param->name)) {
+                            untiledBytes += param->size;
+                        }
+                    }
+                    size_t availableBytes = gpu->getGlobalMemorySizeBytes() / 100 * GSPAR_OUT_OF_CORE_DEVICE_MEMORY_PERCENT;
+                    if (availableBytes <= untiledBytes || (availableBytes - untiledBytes) / 2 < tiledBytesPerIndex) {
+                        throw GSParException("The GPU memory is not enough for the parameters that are not tiled and two indexes of the tiled ones");
+                    }
+                    tileSize = (availableBytes - untiledBytes) / 2 / tiledBytesPerIndex;
+                }
+                tileSize = std::min(tileSize, dimsToUse[tileDimension].delta());
 
-                this->mallocParametersInGpu<TDriverInstance>();
+                std::shared_ptr<Driver::BaseKernelBase> compiledKernel = this->compileVariant<TDriverInstance>(dimsToUse);
+                auto kernel = static_cast<decltype(TDriverInstance::getKernelType())*>(compiledKernel.get());
+                kernel->setNumThreadsPerBlock(numThreadsPerBlock[0], numThreadsPerBlock[1], numThreadsPerBlock[2]);
 
+                this->callbackBeforeAllocatingMemoryOnGpu(dimsToUse, kernel);
+                this->mallocParametersInGpu<TDriverInstance>(); // Only the parameters that are not tiled
                 this->copyParametersFromHostToGpuAsync<TDriverInstance>();
 
-                this->setSharedMemoryInKernel<TDriverInstance>(kernel, dimsToUse);
-
-                this->setParametersInKernel<TDriverInstance>(kernel, dimsToUse);
+                auto executionFlow = this->getExecutionFlow<TDriverInstance>();
+                auto tileExecutionFlow = dynamic_cast<decltype(TDriverInstance::getExecutionFlowType())*>(this->tileExecutionFlow.get());
+                if (!tileExecutionFlow) {
+                    tileExecutionFlow = new decltype(TDriverInstance::getExecutionFlowType())(gpu);
+                    tileExecutionFlow->start();
+                    this->tileExecutionFlow = std::unique_ptr<decltype(TDriverInstance::getExecutionFlowType())>(tileExecutionFlow);
+                }
+                decltype(TDriverInstance::getExecutionFlowType())* flows[2] = { executionFlow, tileExecutionFlow };
+                executionFlow->synchronize(); // Tiles in the other flow also use the parameters that are not tiled
+
+                // GPU memory for the slices of each tiled parameter, in each flow. It is bound to the slices of each tile
+                // and kept by the handle until the run completes
+                auto buffers = std::make_shared<std::array<std::vector<std::unique_ptr<decltype(TDriverInstance::getMemoryObjectType())>>, 2>>();
+                for (int flow = 0; flow < 2; flow++) {
+                    for (auto& tiledParameter : tiled) {
+                        (*buffers)[flow].emplace_back(gpu->malloc(tileSize * tiledParameter.second, (void*)nullptr,
+                            tiledParameter.first->direction == GSPAR_PARAM_IN, tiledParameter.first->direction == GSPAR_PARAM_OUT));
+                    }
+                }
 
                 this->callbackAfterCopyDataFromHostToGpu();
                 this->callbackBeforeRunInGpu();
 
-                auto executionFlow = this->getExecutionFlow<TDriverInstance>();
-
-                #ifdef GSPAR_DEBUG
-                    ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Running kernel " << kernel << " for " << dimsToRun.toString() << " in flow " << executionFlow << std::endl;
-                    std::cout << ss.str();
-                    ss.str("");
-                #endif
-
-                kernel->runAsync(dimsToRun, executionFlow);
-
-                #ifdef GSPAR_DEBUG
-                    ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Started running kernel " << kernel << " in flow " << executionFlow << std::endl;
-                    std::cout << ss.str();
-                    ss.str("");
-                #endif
-
-                kernel->waitAsync();
+                unsigned long tile = 0;
+                for (unsigned long tileMin = dimsToUse[tileDimension].min; tileMin < extent; tileMin += tileSize, tile++) {
+                    unsigned long tileMax = std::min(extent, tileMin + tileSize);
+                    auto flow = flows[tile % 2];
+                    auto& tileBuffers = (*buffers)[tile % 2];
+                    for (size_t t = 0; t < tiled.size(); t++) {
+                        // The previous transfers of the buffer were enqueued with the host memory they were bound to
+                        tileBuffers[t]->bindTo(static_cast<unsigned char*>(tiled[t].first->getPointer()) + tileMin * tiled[t].second, (tileMax - tileMin) * tiled[t].second);
+                        if (tiled[t].first->isIn()) {
+                            tileBuffers[t]->copyInAsync(flow);
+                            this->bytesCopiedToGpu += tileBuffers[t]->getSize();
+                        }
+                    }
 
-                #ifdef GSPAR_DEBUG
-                    ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Finished running kernel " << kernel << " in flow " << executionFlow << std::endl;
-                    std::cout << ss.str();
-                    ss.str("");
-                #endif
+                    Driver::Dimensions tileDims = dimsToUse;
+                    tileDims[tileDimension] = Driver::SingleDimension(tileMax, tileMin);
+                    kernel->clearParameters();
+                    this->setSharedMemoryInKernel<TDriverInstance>(kernel, dimsToUse);
+                    this->setDimsParametersInKernel<TDriverInstance>(kernel, tileDims);
+                    for (auto& paramName : this->paramsOrder) {
+                        auto param = this->getParameter(paramName);
+                        if (!this->isTiledParameter(paramName)) {
+                            this->setParameterInKernel<TDriverInstance>(kernel, param);
+                        } else if (param->direction != GSPAR_PARAM_NONE) {
+                            size_t t = 0;
+                            while (tiled[t].first != param) {
+                                t++;
+                            }
+                            kernel->setParameter(tileBuffers[t].get());
+                        }
+                    }
+                    #ifdef GSPAR_DEBUG
+                        ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Running tile " << tileDims.toString() << " in flow " << flow << std::endl;
+                        std::cout << ss.str();
+                        ss.str("");
+                    #endif
+                    kernel->runAsync(tileDims, flow);
 
-                this->callbackAfterRunInGpu();
+                    for (size_t t = 0; t < tiled.size(); t++) {
+                        if (tiled[t].first->isOut()) {
+                            tileBuffers[t]->copyOutAsync(flow);
+                        }
+                    }
+                }
 
-                this->copyParametersFromGpuToHostAsync<TDriverInstance>();
+                this->pendingRun = RunHandle([executionFlow, tileExecutionFlow]() {
+                    return executionFlow->isFinished() && tileExecutionFlow->isFinished();
+                }, [this, compiledKernel, kernel, buffers, dimsToUse, executionFlow, tileExecutionFlow, tile, tileSize]() {
+                    executionFlow->synchronize();
+                    tileExecutionFlow->synchronize();
 
-                this->callbackAfterCopyDataFromGpuToHost(dimsToUse, kernel);
+                    this->callbackAfterRunInGpu();
+                    // Only the parameters that are not tiled, which the tiles of both flows may write
+                    this->copyParametersFromGpuToHostAsync<TDriverInstance>();
+                    executionFlow->synchronize();
+                    this->callbackAfterCopyDataFromGpuToHost(dimsToUse, kernel);
 
-                #ifdef GSPAR_DEBUG
-                    ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Finished running pattern" << std::endl;
-                    std::cout << ss.str();
-                    ss.str("");
-                #endif
+                    #ifdef GSPAR_DEBUG
+                        std::stringstream ss;
+                        ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Finished running " << tile << " tiles of " << tileSize << std::endl;
+                        std::cout << ss.str();
+                        ss.str("");
+                    #endif
+                });
+                return this->pendingRun;
             }
 
         public:
@@ -470,7 +1394,11 @@ namespace GSPar {
                 other.cloneIntoNonTemplated(this);
             };
             
-            virtual ~BaseParallelPattern() { }
+            virtual ~BaseParallelPattern() {
+                try {
+                    this->finishPendingRun(); // The run uses the execution flow and the parameters
+                } catch (...) { } // We don't throw exceptions on destructors
+            }
 
             virtual bool isBatched() {
                 return this->batched;
@@ -493,13 +1421,146 @@ namespace GSPar {
                 this->batchSize = batchSize;
                 return *this;
             }
+            virtual unsigned int getBatchSize() {
+                return this->batchSize;
+            }
+
+            /**
+             * In dimension-agnostic mode the generated kernel receives every extent, offset and batch size as a parameter,
+             * so a single compiled kernel runs any problem size with the same number of dimensions.
+             */
+            virtual BaseParallelPattern& setDimensionAgnostic(bool dimensionAgnostic) {
+                if (this->dimensionAgnostic != dimensionAgnostic) {
+                    this->isKernelStale = true; // The kernel parameters changed, we need to recompile the kernel
+                }
+                this->dimensionAgnostic = dimensionAgnostic;
+                return *this;
+            }
+            virtual bool isDimensionAgnostic() {
+                return this->dimensionAgnostic;
+            }
+            /**
+             * In autotuning mode, the first run for each dimensions benchmarks several numbers of threads per block and keeps the fastest.
+             * Results are persisted by KernelTuningDatabase and reused by later runs and processes.
+             * Shapes set with setNumThreadsPerBlock take precedence.
+             */
+            virtual BaseParallelPattern& setAutotuning(bool autotuning) {
+                this->autotuning = autotuning;
+                return *this;
+            }
+            virtual bool isAutotuning() {
+                return this->autotuning;
+            }
+            /**
+             * Sets when an IN pointer parameter is copied to the GPU again in the following runs.
+             * The mode is kept if the parameter is set again (e.g., for each stream item).
+             */
+            virtual BaseParallelPattern& setParameterUpdateMode(std::string name, ParameterUpdateMode updateMode) {
+                this->updateModes[name] = updateMode;
+                return *this;
+            }
+            virtual ParameterUpdateMode getParameterUpdateMode(std::string name) {
+                auto updateMode = this->updateModes.find(name);
+                return updateMode == this->updateModes.end() ? GSPAR_UPDATE_ALWAYS : updateMode->second;
+            }
+            const std::map<std::string, ParameterUpdateMode>& getParameterUpdateModes() {
+                return this->updateModes;
+            }
+            /**
+             * Tells that the host memory of a pointer parameter changed, so it is copied to the GPU in the next run
+             */
+            virtual BaseParallelPattern& markDirty(std::string name) {
+                BaseParameter* parameter = this->getParameter(name);
+                if (parameter && parameter->paramValueType == GSPAR_PARAM_POINTER) {
+                    static_cast<PointerParameter*>(parameter)->markDirty();
+                }
+                return *this;
+            }
+            /**
+             * Tells that only length bytes from offset of a pointer parameter changed.
+             * With GSPAR_UPDATE_ON_DIRTY, only the changed ranges are copied to the GPU in the next run.
+             */
+            virtual BaseParallelPattern& markDirty(std::string name, size_t offset, size_t length) {
+                BaseParameter* parameter = this->getParameter(name);
+                if (parameter && parameter->paramValueType == GSPAR_PARAM_POINTER) {
+                    static_cast<PointerParameter*>(parameter)->markDirty(offset, length);
+                }
+                return *this;
+            }
+            /**
+             * Same as markDirty
+             */
+            virtual BaseParallelPattern& touch(std::string name) {
+                return this->markDirty(name);
+            }
+            /**
+             * Copies only length bytes from offset of an OUT pointer parameter back to the host after running (e.g., the first N results).
+             * In batched parameters, the offset is counted across the items of the batch.
+             */
+            virtual BaseParallelPattern& setOutputRange(std::string name, size_t offset, size_t length) {
+                this->outputRanges[name] = std::make_pair(offset, length);
+                return *this;
+            }
+            /**
+             * Copies the whole parameter back to the host again
+             */
+            virtual BaseParallelPattern& clearOutputRange(std::string name) {
+                this->outputRanges.erase(name);
+                return *this;
+            }
+            const std::map<std::string, std::pair<size_t, size_t>>& getOutputRanges() {
+                return this->outputRanges;
+            }
+            bool isOutOfCore() {
+                return this->outOfCore;
+            }
+            unsigned long getTileSize() {
+                return this->tileSize;
+            }
+            /**
+             * Checks whether only the slices of a parameter used by each tile are copied to the GPU, in an out-of-core run
+             */
+            bool isTiledParameter(std::string name) {
+                return this->outOfCore && this->tiledParameters.count(name);
+            }
+            unsigned long getBytesCopiedToGpu() {
+                return this->bytesCopiedToGpu;
+            }
+            /**
+             * Gets the bytes of IN parameters not copied to the GPU because it already had them (see setParameterUpdateMode)
+             */
+            unsigned long getBytesSkippedToGpu() {
+                return this->bytesSkippedToGpu;
+            }
+            void resetTransferStats() {
+                this->bytesCopiedToGpu = 0;
+                this->bytesSkippedToGpu = 0;
+            }
+            /**
+             * Sets the parameters that are not copied to the GPU before running (inputs) or back to the host afterwards (outputs).
+             * PatternComposition uses it to keep the data shared between its patterns in the GPU.
+             */
+            virtual void setResidentParameters(std::set<std::string> inputs, std::set<std::string> outputs) {
+                this->residentInputs = inputs;
+                this->residentOutputs = outputs;
+            }
+            /**
+             * Checks whether the kernel receives the first index of dimension d as a parameter
+             */
+            virtual bool isUsingMinParameter(Driver::Dimensions dims, int d) {
+                // TODO Support min in batches
+                // Out-of-core runs use the same kernel for every tile of the last dimension
+                return !this->isBatched() && (dims[d].min || this->dimensionAgnostic || (this->outOfCore && d == dims.getCount() - 1));
+            }
 
             // TODO support using GPUs based on some scheduler (round-robin, etc)
             virtual void setGpuIndex(unsigned int index) {
                 if (this->gpuIndex != index) {
+                    this->finishPendingRun(); // It runs in the execution flow of the current GPU
                     this->isKernelStale = true; // If the GPU changed, we need to recompile the kernel
                     this->gpuDevice = nullptr;
                     this->executionFlow.reset();
+                    this->tileExecutionFlow.reset();
                     this->gpuIndex = index;
                 }
             }
@@ -523,11 +1584,26 @@ namespace GSPar {
                         Driver::Dimensions compiledKernelDimension = this->compiledKernelDimension;
                         other->compiledKernelDimension = compiledKernelDimension;
                     }
-                    if (this->compiledKernel.get()) {
-                        other->compiledKernel = std::shared_ptr<decltype(TDriverInstance::getKernelType())>(new decltype(TDriverInstance::getKernelType())());
-                        auto localKernel = this->getCompiledKernel<TDriverInstance>();
-                        localKernel->cloneInto(other->compiledKernel.get());
+                    std::lock_guard<std::mutex> localLock(this->compiledKernelMutex); // Auto-unlock, RAII
+                    other->compiledKernels.clear();
+                    for (auto& variant : this->compiledKernels) {
+                        if (!isCompiledKernelReady(variant.kernel)) {
+                            continue; // Variants still being compiled are not cloned, the clone compiles them on demand
+                        }
+                        CompiledKernelVariant otherVariant = variant;
+                        auto otherKernel = std::shared_ptr<decltype(TDriverInstance::getKernelType())>(new decltype(TDriverInstance::getKernelType())());
+                        static_cast<decltype(TDriverInstance::getKernelType())*>(variant.kernel.get().get())->cloneInto(otherKernel.get());
+                        otherVariant.kernel = makeReadyCompiledKernel(otherKernel);
+                        otherVariant.compilationId = ++other->lastCompilationId;
+                        other->compiledKernels.push_back(otherVariant);
+                    }
+                    if (!other->compiledKernels.empty()) {
+                        other->compiledKernel = other->compiledKernels.front().kernel.get();
+                        other->compiledKernelDimension = other->compiledKernels.front().dims;
+                    } else {
+                        other->_isKernelCompiled = false;
                     }
+                    // Auto-unlock of compiledKernelMutex, RAII
                 }
             }
 
@@ -535,13 +1611,24 @@ namespace GSPar {
                 // Clone
                 other->gpuIndex = this->gpuIndex;
                 other->batched = this->batched;
+                other->dimensionAgnostic = this->dimensionAgnostic;
+                other->autotuning = this->autotuning;
                 other->batchSize = this->batchSize;
                 other->kernelName = this->kernelName;
                 other->userKernel = this->userKernel;
                 other->extraKernelCode = this->extraKernelCode;
                 other->paramsOrder = this->paramsOrder;
                 other->params = this->params;
+                other->constantParams = this->constantParams;
+                other->updateModes = this->updateModes;
+                other->outputRanges = this->outputRanges;
+                other->outOfCore = this->outOfCore;
+                other->tileSize = this->tileSize;
+                other->tiledParameters = this->tiledParameters;
+                other->tileBytes = this->tileBytes;
+                other->compilerOptions = this->compilerOptions;
                 other->stdVarNames = this->stdVarNames;
+                other->maxCompiledKernels = this->maxCompiledKernels;
                 other->useSharedMemory = this->useSharedMemory;
                 other->sharedMemoryParameter = this->sharedMemoryParameter;
             }
@@ -549,14 +1636,14 @@ namespace GSPar {
             template<class TDriverInstance>
             BaseParallelPattern& setCompiledKernel(decltype(TDriverInstance::getKernelType())* kernel, Driver::Dimensions dims) {
                 std::lock_guard<std::mutex> lock(this->compiledKernelMutex); // Auto-unlock, RAII
-                this->compiledKernel = std::shared_ptr<Driver::BaseKernelBase>(kernel);
-                this->compiledKernelDimension = dims;
-                this->_isKernelCompiled = true;
-                this->isKernelStale = false;
+                this->addCompiledKernelVariant(makeReadyCompiledKernel(std::shared_ptr<Driver::BaseKernelBase>(kernel)), dims);
                 return *this;
                 // Auto-unlock of compiledKernelMutex, RAII
             }
 
+            /**
+             * Gets the most recently used compiled kernel
+             */
             template<class TDriverInstance>
             decltype(TDriverInstance::getKernelType())* getCompiledKernel() const {
                 return static_cast<decltype(TDriverInstance::getKernelType())*>(this->compiledKernel.get());
@@ -594,6 +1681,34 @@ namespace GSPar {
                 this->isKernelStale = true; // The kernel code changed, we need to recompile it
                 return *this;
             }
+            std::string getExtraKernelCode() {
+                return this->extraKernelCode;
+            }
+
+            /**
+             * Adds a compiler option, mapped to the flags of each runtime compiler
+             */
+            virtual BaseParallelPattern& addCompilerOption(Driver::CompilerOption option) {
+                Driver::CompilerOptions previous = this->compilerOptions;
+                if (this->compilerOptions.add(option) != previous) {
+                    this->isKernelStale = true; // The kernel must be rebuilt with the new option
+                }
+                return *this;
+            }
+            /**
+             * Adds a -DNAME[=VALUE] macro definition (mapped to the syntax of each runtime compiler)
+             * or an option that is passed unchanged to the runtime compiler
+             */
+            virtual BaseParallelPattern& addCompilerOption(std::string option) {
+                Driver::CompilerOptions previous = this->compilerOptions;
+                if (this->compilerOptions.add(option) != previous) {
+                    this->isKernelStale = true; // The kernel must be rebuilt with the new option
+                }
+                return *this;
+            }
+            const Driver::CompilerOptions& getCompilerOptions() {
+                return this->compilerOptions;
+            }
 
             virtual std::pair<std::string, std::string> generateDefaultControlIf(Driver::Dimensions dims, std::array<std::string, 3> stdVarNames) {
                 std::string r = "if (";
@@ -620,21 +1735,55 @@ namespace GSPar {
 
                 std::pair<std::string, std::string> ifDimensions = this->generateDefaultControlIf(dims, codeGenerator->getStdVarNames(this->stdVarNames));
 
-                return (!this->extraKernelCode.empty() ? this->extraKernelCode + "\n" : "")
+                std::string constantsDefinition, constantsUndefinition;
+                for (auto& constant : this->constantParams) {
+                    constantsDefinition += "#define " + constant.first + " " + constant.second + "\n";
+                    // Undefined after the kernel, so it doesn't leak to other kernels of a PatternComposition
+                    constantsUndefinition += "#undef " + constant.first + "\n";
+                }
+
+                return constantsDefinition
+                    + (!this->extraKernelCode.empty() ? this->extraKernelCode + "\n" : "")
                     + codeGenerator->getKernelPrefix() + " " + kernelName + "("
                     + codeGenerator->generateParams(this, dims) + ") {\n"
                     + codeGenerator->generateInitKernel(this, dims) + "\n"
                     + codeGenerator->generateStdVariables(this, dims)
                     + codeGenerator->generateBatchedParametersInitialization(this, dims) + "\n"
+                    + this->generateTiledParametersInitialization(dims, codeGenerator->getStdVarNames(this->stdVarNames))
                     + ifDimensions.first
-                    + this->getKernelCore(dims, codeGenerator->getStdVarNames(this->stdVarNames))
+                    + this->getKernelCore(dims, codeGenerator->getStdVarNames(this->stdVarNames), codeGenerator)
                     + "\n" + ifDimensions.second + "\n" // if (dims)
-                    + "}\n"; // kernel
+                    + "}\n" // kernel
+                    + constantsUndefinition;
+            }
+
+            /**
+             * Moves the pointers of the tiled parameters back by the first index of the tile, so the kernel indexes them as the whole data
+             */
+            std::string generateTiledParametersInitialization(Driver::Dimensions dims, std::array<std::string, 3> stdVarNames) {
+                if (!this->outOfCore) {
+                    return "";
+                }
+                std::string r;
+                std::string tileMin = "gspar_min_" + stdVarNames[dims.getCount() - 1];
+                for (auto& tiledParameter : this->tileBytes) {
+                    BaseParameter* param = this->getParameter(tiledParameter.first);
+                    if (!param || param->direction == GSPAR_PARAM_NONE) {
+                        continue;
+                    }
+                    std::string constant = param->direction == GSPAR_PARAM_IN && param->isConstant() ? "const " : "";
+                    r += param->name + " = (GSPAR_DEVICE_GLOBAL_MEMORY " + constant + param->type.getFullName() + ")((GSPAR_DEVICE_GLOBAL_MEMORY const char*)"
+                        + param->name + " - " + tileMin + " * " + std::to_string(tiledParameter.second) + ");\n";
+                }
+                return r;
             }
 
             virtual std::string getKernelName() {
                 if (this->kernelName.empty()) {
-                    this->kernelName = "gspar_kernel_" + getRandomString(7);
+                    // The name is derived from the kernel code, so the generated source (and its cache key) is the same across executions
+                    std::vector<std::string> nameParts = { typeid(*this).name(), this->extraKernelCode, this->userKernel };
+                    nameParts.insert(nameParts.end(), this->paramsOrder.begin(), this->paramsOrder.end());
+                    this->kernelName = "gspar_kernel_" + Driver::KernelBinaryCache::computeKey(nameParts).substr(0, 12);
                 }
                 return this->kernelName;
             }
@@ -653,7 +1802,10 @@ namespace GSPar {
                 return *this;
             }
 
-            virtual std::string getKernelCore(Driver::Dimensions dims, std::array<std::string, 3> stdVarNames) {
+            /**
+             * @param codeGenerator Generator of the driver the kernel is compiled for
+             */
+            virtual std::string getKernelCore(Driver::Dimensions dims, std::array<std::string, 3> stdVarNames, Driver::BaseKernelGenerator* codeGenerator) {
                 return std::string(this->getUserKernel());
             }
             std::string getUserKernel() {
@@ -676,6 +1828,34 @@ namespace GSPar {
                 }
                 return it->second.get();
             }
+            /**
+             * Gets a parameter sharing its ownership, so it can be used by other patterns (e.g., FusedMap)
+             */
+            std::shared_ptr<BaseParameter> getSharedParameter(std::string name) {
+                auto it = this->params.find(name);
+                if (it == this->params.end()) {
+                    return nullptr;
+                }
+                return it->second;
+            }
+            /**
+             * Gives the pattern its own copy of the pointer parameters it shares with clones, so it copies the same host memory
+             * to and from its own GPU memory. Placeholders, batched parameters and MemoryObjects from the user are kept shared.
+             */
+            BaseParallelPattern& unshareParameters() {
+                this->waitPendingRun(); // The run uses the GPU memory of the shared parameters
+                for (auto& param : this->params) {
+                    BaseParameter* parameter = param.second.get();
+                    if (param.second.use_count() == 1 || parameter->paramValueType != GSPAR_PARAM_POINTER || !parameter->isComplete() || parameter->isBatched()) {
+                        continue;
+                    }
+                    auto pointerParameter = static_cast<PointerParameter*>(parameter);
+                    if (!pointerParameter->getUserMemoryObject()) {
+                        param.second = std::make_shared<PointerParameter>(param.first, parameter->type, parameter->size, pointerParameter->getPointer(), parameter->direction);
+                    }
+                }
+                return *this;
+            }
             virtual std::vector<BaseParameter*> getParameterList() {
                 std::vector<BaseParameter*> paramList;
                 for (auto &paramName : this->paramsOrder) {
@@ -791,6 +1971,52 @@ namespace GSPar {
                 return *this;
             }
 
+            /**
+             * Constant parameters: the value is written in the kernel source instead of being passed as a kernel argument,
+             * so the compiler can unroll and simplify code that uses it.
+             * Changing the value recompiles the kernel (other patterns are not affected).
+             */
+            template <typename T>
+            BaseParallelPattern& setConstantParameter(std::string name, T value) {
+                static_assert(std::is_arithmetic<T>::value, "Constant parameters must be of arithmetic types");
+                std::stringstream literal;
+                literal << "((" << getTemplatedType<T>().name << ")(";
+                // The cast keeps the parameter type inside the kernel, the suffix keeps the value in the range of the literal
+                if (std::is_integral<T>::value && std::is_unsigned<T>::value) {
+                    literal << (unsigned long long)value << "ULL";
+                } else if (std::is_integral<T>::value) {
+                    if ((long long)value == std::numeric_limits<long long>::min()) {
+                        // The literal is only the digits, which don't fit in a long long without the minus
+                        literal << "-" << std::numeric_limits<long long>::max() << "LL - 1";
+                    } else {
+                        literal << (long long)value << "LL";
+                    }
+                } else {
+                    if (!std::isfinite((long double)value)) {
+                        throw GSParException("Constant parameter \"" + name + "\" must be a finite number, as kernels have no portable literal for NaN and infinity");
+                    }
+                    literal << std::setprecision(std::numeric_limits<T>::max_digits10) << +value;
+                }
+                literal << "))";
+                auto constant = this->constantParams.find(name);
+                if (constant == this->constantParams.end() || constant->second != literal.str()) {
+                    this->constantParams[name] = literal.str();
+                    this->isKernelStale = true; // The kernel code changed, we need to recompile it
+                }
+                // It is no longer a kernel parameter
+                auto paramOrder = std::find(this->paramsOrder.begin(), this->paramsOrder.end(), name);
+                if (paramOrder != this->paramsOrder.end()) {
+                    this->waitPendingRun(); // Its GPU memory goes back to the device's pool
+                    this->paramsOrder.erase(paramOrder);
+                    this->params.erase(name);
+                    this->isKernelStale = true;
+                }
+                return *this;
+            }
+            const std::map<std::string, std::string>& getConstantParameters() {
+                return this->constantParams;
+            }
+
             /**
              * Batched (pointer and value) parameters
              */
@@ -824,9 +2050,26 @@ namespace GSPar {
 
             virtual bool isKernelCompiledFor(Driver::Dimensions dims) {
                 // We only compile if the kernel wasn't compiled yet and the configuration didn't change
-                return this->_isKernelCompiled && !this->isKernelStale &&
-                    // TODO #10 Do we really need the exact same dimension? The sizes are passed in parameters.
-                    this->compiledKernelDimension == dims;
+                std::lock_guard<std::mutex> lock(this->compiledKernelMutex); // Auto-unlock, RAII
+                auto variant = this->findCompiledKernelVariant(dims);
+                return variant != this->compiledKernels.end() && isCompiledKernelReady(variant->kernel);
+                // Auto-unlock of compiledKernelMutex, RAII
+            }
+
+            /**
+             * Sets how many compiled kernel variants this pattern keeps. The least recently used ones are released first.
+             */
+            virtual BaseParallelPattern& setMaxCompiledKernels(unsigned int maxCompiledKernels) {
+                std::lock_guard<std::mutex> lock(this->compiledKernelMutex); // Auto-unlock, RAII
+                this->maxCompiledKernels = maxCompiledKernels ? maxCompiledKernels : 1;
+                while (this->compiledKernels.size() > this->maxCompiledKernels) {
+                    this->compiledKernels.pop_back();
+                }
+                return *this;
+                // Auto-unlock of compiledKernelMutex, RAII
+            }
+            unsigned int getMaxCompiledKernels() {
+                return this->maxCompiledKernels;
             }
 
             /**
@@ -837,46 +2080,39 @@ namespace GSPar {
              */
             template<class TDriverInstance>
             BaseParallelPattern& compile(Driver::Dimensions dims) {
-                // We only compile if the kernel wasn't compiled yet and the configuration didn't change
-                if (this->isKernelCompiledFor(dims)) {
-                    return *this;
-                }
-                std::lock_guard<std::mutex> lock(this->compiledKernelMutex); // Auto-unlock, RAII
-                #ifdef GSPAR_DEBUG
-                    std::stringstream ss;
-                    ss << "[" << std::this_thread::get_id() << " GSPar "<<this<<"] Compiling Kernel for ParallelPattern with " << dims.toString() << std::endl;
-                    std::cout << ss.str();
-                    ss.str("");
-                #endif
-
-                auto gpu = this->getGpu<TDriverInstance>();
-                if (gpu == nullptr) {
-                    throw GSParException("No GPU found for Pattern compilation");
-                }
-
-                std::string kernelName = this->getKernelName();
-
-                this->callbackBeforeGeneratingKernelSource();
+                this->compileVariant<TDriverInstance>(dims);
+                return *this;
+            }
 
-                std::string kernelSource = this->generateKernelSource<TDriverInstance>(dims);
+            /**
+             * Compiles the pattern for the dims Dimensions in the background, using the CompilationThreadPool.
+             * The kernel source is generated by the calling thread, so the background thread only compiles it and stores the kernel.
+             * A later run for the same Dimensions only waits if the kernel is still being compiled.
+             * The pattern must not be destroyed before the returned future is ready.
+             * 
+             * @param <TDriverInstance> Type of the specialized BaseInstance class
+             * @param dims The Dimensions for which the pattern should be compiled
+             * @return A future that is ready when the compilation finishes, and rethrows its exception on get()
+             */
+            template<class TDriverInstance>
+            std::shared_future<void> compileAsync(Driver::Dimensions dims) {
+                PreparedCompilation prepared = this->prepareCompilation<TDriverInstance>(dims);
+                return CompilationThreadPool::getInstance()->submit([this, prepared]() mutable {
+                    this->compilePrepared(prepared);
+                });
+            }
 
-                #ifdef GSPAR_DEBUG
-                    ss << "[" << std::this_thread::get_id() << " GSPar "<<this<<"] Compiling kernel source for " << kernelName << ":" << std::endl;
-                    ss << kernelSource << std::endl;
-                    std::cout << ss.str();
-                    ss.str("");
-                #endif
-                // this->compiledKernel = std::unique_ptr<void, void(*)(void*)>{
-                //     (void*)(gpu->prepareKernel(kernelSource.c_str(), kernelName.c_str())),
-                //     [](void *ptr) { delete static_cast<decltype(TDriverInstance::getKernelType())*>(ptr); }
-                // };
-                auto kernel = gpu->prepareKernel(kernelSource.c_str(), kernelName.c_str());
-                this->compiledKernel = std::shared_ptr<Driver::BaseKernelBase>(kernel);
-                this->compiledKernelDimension = dims;
-                this->_isKernelCompiled = true;
-                this->isKernelStale = false;
-                return *this;
-                // Auto-unlock of compiledKernelMutex, RAII
+            /**
+             * Gets the kernel compiled for the dims Dimensions, compiling it if there is no such variant yet.
+             * If another thread is already compiling the same variant, waits for it instead of compiling it again.
+             * 
+             * @param <TDriverInstance> Type of the specialized BaseInstance class
+             * @param dims The Dimensions for which the pattern should be compiled
+             */
+            template<class TDriverInstance>
+            std::shared_ptr<Driver::BaseKernelBase> compileVariant(Driver::Dimensions dims) {
+                PreparedCompilation prepared = this->prepareCompilation<TDriverInstance>(dims);
+                return this->compilePrepared(prepared);
             }
 
             // TODO most of the following functions should have protected visibility
@@ -919,11 +2155,20 @@ namespace GSPar {
                     if (!param || !param->isComplete()) {
                         throw GSParException("Pattern parameter \"" + param->name + "\" is just a placeholder. The parameter list must be complete to run the parallel pattern.");
                     }
+                    if (this->isTiledParameter(paramName)) {
+                        continue; // The tiles have their own GPU memory
+                    }
                     if (param->paramValueType == Pattern::ParameterValueType::GSPAR_PARAM_POINTER) { // It is a PointerParameter
                         auto paramPointer = static_cast<Pattern::PointerParameter*>(param);
                         if (paramPointer->getMemoryObject() == nullptr) { // It returns a MemoryObject from user, if available
                             paramPointer->malloc(device, this->batchSize); //TODO check if the batchSize changed since the last parameter allocation
-                            #ifndef GSPAR_PATTERN_DISABLE_PINNED_MEMORY
+                        }
+                        // A memory object rebound to another host pointer (see rebindMemoryObject) must be pinned again.
+                        // Memory objects bound elsewhere by the pattern itself (e.g., the Reduce partial totals) are not pinned.
+                        if (!paramPointer->getUserMemoryObject() && paramPointer->getMemoryObject()->getHostPointer() == paramPointer->getPointer()) {
+                            // With staging buffers, the copies already overlap through pinned memory of the device,
+                            // so the user memory is not registered again for every item of a stream
+                            #if !defined(GSPAR_PATTERN_DISABLE_PINNED_MEMORY) && !GSPAR_HOST_STAGING_BUFFERS
                                 // In some cases, copyInAsync fails with CUDA_ERROR_INVALID_VALUE: invalid argument. According to the docs:
                                 //   Memory regions requested must be either entirely registered with CUDA, or in the case of host pageable transfers, not registered at all.
                                 //   Memory regions spanning over allocations that are both registered and not registered with CUDA are not supported and will return CUDA_ERROR_INVALID_VALUE.
@@ -935,7 +2180,9 @@ namespace GSPar {
                                         chunkedMemObj->pinHostMemory();
                                     } else {
                                         auto singleMemObj = dynamic_cast<decltype(TDriverInstance::getMemoryObjectType())*>(paramPointer->getMemoryObject());
-                                        singleMemObj->pinHostMemory();
+                                        if (!singleMemObj->isPinnedHostMemory()) {
+                                            singleMemObj->pinHostMemory();
+                                        }
                                     }
                                 }
                             #endif
@@ -965,7 +2212,7 @@ namespace GSPar {
 
                 for (auto &paramName : this->paramsOrder) {
                     auto param = this->getParameter(paramName);
-                    if (param && param->isIn()) {
+                    if (param && param->isIn() && !this->residentInputs.count(paramName) && !this->isTiledParameter(paramName)) {
                         if (param->paramValueType == Pattern::ParameterValueType::GSPAR_PARAM_POINTER) {
                             auto paramPointer = static_cast<Pattern::PointerParameter*>(param);
                             #ifdef GSPAR_DEBUG
@@ -982,12 +2229,44 @@ namespace GSPar {
                                     for (unsigned int c = 0; c < this->batchSize; c++) {
                                         chunkedMemObj->copyInAsync(c, executionFlow);
                                     }
+                                    this->bytesCopiedToGpu += this->batchSize * param->size;
                                 } else {
                                     chunkedMemObj->copyInAsync(executionFlow); // Copy all the chunks
+                                    this->bytesCopiedToGpu += chunkedMemObj->getChunkCount() * param->size;
                                 }
                             } else {
+                                // Only the GPU memory of IN parameters is never written by kernels. Memory from the user may be written elsewhere
+                                ParameterUpdateMode updateMode = GSPAR_UPDATE_ALWAYS;
+                                if (param->direction == GSPAR_PARAM_IN && !paramPointer->getUserMemoryObject()) {
+                                    updateMode = this->getParameterUpdateMode(paramName);
+                                }
                                 auto singleMemObj = dynamic_cast<decltype(TDriverInstance::getMemoryObjectType())*>(paramPointer->getMemoryObject());
-                                singleMemObj->copyInAsync(executionFlow);
+                                if (paramPointer->isGpuCopyDirtyOnlyInRanges(updateMode)) {
+                                    size_t copied = 0;
+                                    for (auto& range : paramPointer->getDirtyRanges()) {
+                                        singleMemObj->copyInAsync(range.first, range.second - range.first, executionFlow);
+                                        copied += range.second - range.first;
+                                    }
+                                    #ifdef GSPAR_DEBUG
+                                        ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Copied only " << copied << " dirty bytes of " << param->name << std::endl;
+                                        std::cout << ss.str();
+                                        ss.str("");
+                                    #endif
+                                    paramPointer->setGpuCopyCurrent(updateMode);
+                                    this->bytesCopiedToGpu += copied;
+                                    this->bytesSkippedToGpu += param->size - copied;
+                                } else if (paramPointer->isGpuCopyCurrent(updateMode)) {
+                                    #ifdef GSPAR_DEBUG
+                                        ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Skipped copying " << param->name << ", the GPU already has it" << std::endl;
+                                        std::cout << ss.str();
+                                        ss.str("");
+                                    #endif
+                                    this->bytesSkippedToGpu += param->size;
+                                } else {
+                                    singleMemObj->copyInAsync(executionFlow);
+                                    paramPointer->setGpuCopyCurrent(updateMode);
+                                    this->bytesCopiedToGpu += param->size;
+                                }
                             }
                         } else if (param->paramValueType == Pattern::ParameterValueType::GSPAR_PARAM_VALUE) {
                             if (param->isBatched()) {
@@ -1000,11 +2279,16 @@ namespace GSPar {
                 }
             }
 
+            /**
+             * Enqueues the copies of the OUT parameters back to the host in the execution flow of the pattern.
+             * Synchronizing the execution flow waits for all of them.
+             */
             template<class TDriverInstance>
             void copyParametersFromGpuToHostAsync() {
                 // #ifdef GSPAR_DEBUG
                 //     std::stringstream ss;
                 // #endif
+                auto executionFlow = this->getExecutionFlow<TDriverInstance>();
                 for (auto& paramName : this->paramsOrder) {
                     // #ifdef GSPAR_DEBUG
                     //     ss << "[GSPar Pattern "<<this<<"] Copying parameter " << paramName << " from GPU to host" << std::endl;
@@ -1012,27 +2296,30 @@ namespace GSPar {
                     //     ss.str("");
                     // #endif
                     auto param = this->getParameter(paramName);
-                    if (param && param->isOut() && param->paramValueType == Pattern::ParameterValueType::GSPAR_PARAM_POINTER) {
+                    if (param && param->isOut() && param->paramValueType == Pattern::ParameterValueType::GSPAR_PARAM_POINTER && !this->residentOutputs.count(paramName)
+                            && !this->isTiledParameter(paramName)) {
                         auto paramPointer = static_cast<Pattern::PointerParameter*>(param);
-                        // TODO copy async
-                        // memObj->copyOutAsync();
+                        auto outputRange = this->outputRanges.find(paramName);
                         // std::cout << "Asking to copy " << param->name << " back from GPU" << std::endl;
                         if (param->isBatched()) {
+                            // A range of the chunks is read at once and scattered to their host memory
                             auto chunkedMemObj = dynamic_cast<decltype(TDriverInstance::getChunkedMemoryObjectType())*>(paramPointer->getMemoryObject());
-                            if (this->batchSize != chunkedMemObj->getChunkCount()) {
+                            if (outputRange != this->outputRanges.end()) {
+                                chunkedMemObj->copyOutAsync(outputRange->second.first, outputRange->second.second, executionFlow);
+                            } else if (this->batchSize != chunkedMemObj->getChunkCount()) {
                                 // The pattern batch size changed from when the parameter was created.
                                 // If it is lower than the parameter batch size, we copy only the related chunks
                                 // TODO what if it is higher?
-                                for (unsigned int c = 0; c < this->batchSize; c++) {
-                                    chunkedMemObj->copyOut(c);
-                                }
+                                chunkedMemObj->copyOutAsync(0, this->batchSize * chunkedMemObj->getChunkSize(), executionFlow);
                             } else {
-                                chunkedMemObj->copyOut(); // Copy all the chunks
+                                chunkedMemObj->copyOutAsync(executionFlow); // Copy all the chunks
                             }
                         } else {
                             auto singleMemObj = dynamic_cast<decltype(TDriverInstance::getMemoryObjectType())*>(paramPointer->getMemoryObject());
-                            if (singleMemObj) {
-                                singleMemObj->copyOut();
+                            if (singleMemObj && outputRange != this->outputRanges.end()) {
+                                singleMemObj->copyOutAsync(outputRange->second.first, outputRange->second.second, executionFlow);
+                            } else if (singleMemObj) {
+                                singleMemObj->copyOutAsync(executionFlow);
                             }
                         }
                     }
@@ -1065,8 +2352,7 @@ namespace GSPar {
                         //     ss.str("");
                         // #endif
                         kernel->setParameter(sizeof(unsigned long), &(dims[d].max));
-                        if (dims[d].min && !this->isBatched()) { // Same check as codeGenerator
-                            // TODO Support min in batches
+                        if (this->isUsingMinParameter(dims, d)) { // Same check as codeGenerator
                             // #ifdef GSPAR_DEBUG
                             //     ss << "[" << std::this_thread::get_id() << " GSPar Pattern "<<this<<"] Setting min parameter for dimension " << d << ": " << dims[d].min << " (in kernel " << kernel << ")" << std::endl;
                             //     std::cout << ss.str();
@@ -1145,6 +2431,31 @@ namespace GSPar {
                 this->run<TDriverInstance>(dims, false);
             }
 
+            /**
+             * Starts running the pattern and returns without waiting for the GPU, so one thread can keep several patterns and GPUs busy.
+             * The results are in the host once the handle completes. Running the pattern again waits for the previous run to complete,
+             * and rethrows its failure if no wait on its handle did.
+             */
+            template<class TDriverInstance>
+            RunHandle runAsync() {
+                return this->startRun<TDriverInstance>(Driver::Dimensions(), true);
+            }
+
+            template<class TDriverInstance>
+            RunHandle runAsync(unsigned long dims[3][2]) {
+                return this->startRun<TDriverInstance>(Driver::Dimensions(dims), false);
+            }
+
+            template<class TDriverInstance>
+            RunHandle runAsync(unsigned long max[3]) {
+                return this->startRun<TDriverInstance>(Driver::Dimensions(max), false);
+            }
+
+            template<class TDriverInstance>
+            RunHandle runAsync(Driver::Dimensions dims) {
+                return this->startRun<TDriverInstance>(dims, false);
+            }
+
             // Overridable callbacks
             // TODO these callbacks should have protected visibility
             virtual void callbackBeforeGeneratingKernelSource() { }
@@ -1,5 +1,4 @@
 
-#include <regex>
 #include <iostream>
 #include <cstring>
 #include <vector>
@@ -10,6 +9,10 @@
 #include <typeinfo>
 
 #include "GSPar_CUDA.hpp"
+#include "GSPar_KernelCache.hpp"
+#if GSPAR_HOST_STAGING_HUGE_PAGES
+#include <sys/mman.h>
+#endif
 
 using namespace GSPar::Driver::CUDA;
 
@@ -119,6 +122,17 @@ CUstream ExecutionFlow::start() {
 void ExecutionFlow::synchronize() {
     throwExceptionIfFailed( cuStreamSynchronize(this->getBaseFlowObject()) );
 }
+bool ExecutionFlow::isFinished() {
+    if (!this->flowObject) {
+        return true;
+    }
+    CUresult result = cuStreamQuery(this->flowObject);
+    if (result == CUDA_ERROR_NOT_READY) {
+        return false;
+    }
+    throwExceptionIfFailed(result);
+    return true;
+}
 CUstream ExecutionFlow::checkAndStartFlow(Device* device, ExecutionFlow* executionFlow) {
     return BaseExecutionFlow::checkAndStartFlow(device, executionFlow);
 }
@@ -182,6 +196,20 @@ unsigned int Instance::getGpuCount() {
 }
 
 
+///// Program /////
+
+Program::Program(nvrtcProgram cudaProgram, CUmodule cudaModule, CUcontext context) :
+    cudaProgram(cudaProgram), cudaModule(cudaModule), context(context) { }
+Program::~Program() {
+    // We don't throw exceptions on destructors
+    // The last kernel may be destroyed by any thread, so the context is set as current first
+    cuCtxSetCurrent(this->context);
+    cuModuleUnload(this->cudaModule);
+    if (this->cudaProgram) { // Programs loaded from the kernel binary cache have no NVRTC program
+        nvrtcDestroyProgram(&this->cudaProgram);
+    }
+}
+
 ///// Device /////
 
 Device::Device() : BaseDevice() { }
@@ -200,6 +228,11 @@ Device::~Device() {
         this->defaultExecutionFlow = NULL;
     }
 
+    this->programCache.clear(); // Modules not used by any kernel are unloaded before the context is released
+
+    this->memoryPool.trim(); // Before the context is released
+    this->stagingPool.trim();
+
     if (this->libContext && this->libDevice) {
         Exception* ex = Exception::checkError( cuCtxSynchronize() );
         if (ex) {
@@ -314,22 +347,41 @@ ChunkedMemoryObject* Device::mallocChunked(unsigned int chunks, long chunkSize,
 ChunkedMemoryObject* Device::mallocChunked(unsigned int chunks, long chunkSize, const void** hostPointers) {
     return new ChunkedMemoryObject(this, chunks, chunkSize, hostPointers);
 }
-Kernel* Device::prepareKernel(const std::string kernel_source, const std::string kernel_name) {
+std::vector<std::string> Device::getCompilerFlags(const CompilerOptions& compilerOptions) {
+    std::vector<std::string> flags;
+    for (auto option : compilerOptions.options) {
+        switch (option) {
+            case GSPAR_COMPILER_FAST_MATH:
+                flags.push_back("--use_fast_math");
+                break;
+            case GSPAR_COMPILER_MAD_ENABLE:
+                flags.push_back("--fmad=true");
+                break;
+            case GSPAR_COMPILER_DISABLE_OPTIMIZATIONS:
+                flags.push_back("--device-debug");
+                break;
+        }
+    }
+    for (auto& definition : compilerOptions.definitions) {
+        flags.push_back("--define-macro=" + definition);
+    }
+    flags.insert(flags.end(), compilerOptions.nativeOptions.begin(), compilerOptions.nativeOptions.end());
+    return flags;
+}
+Kernel* Device::prepareKernel(const std::string kernel_source, const std::string kernel_name, const CompilerOptions& compilerOptions) {
     this->getContext(); // There must be a context to call almost everything
-    return new Kernel(this, kernel_source, kernel_name);
+    return new Kernel(this, kernel_source, kernel_name, compilerOptions);
 }
-std::vector<Kernel*> Device::prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames) {
+std::vector<Kernel*> Device::prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames, const CompilerOptions& compilerOptions) {
     this->getContext(); // There must be a context to call almost everything
     
     std::string programName = "program_" + kernelNames.front();
     
-    auto programAndModule = this->compileCudaProgramAndLoadModule(kernelSource, programName);
-    nvrtcProgram cudaProgram = std::get<0>(programAndModule);
-    CUmodule cudaModule = std::get<1>(programAndModule);
+    auto program = this->getProgram(kernelSource, programName, compilerOptions);
 
     std::vector<Kernel*> kernels;
     for (auto name : kernelNames) {
-        kernels.push_back(new Kernel(this, cudaProgram, cudaModule, name));
+        kernels.push_back(new Kernel(this, program, name));
     }
     return kernels;
 }
@@ -353,7 +405,19 @@ const int Device::queryInfoNumeric(CUdevice_attribute paramName, bool cacheable)
     }
     return pi;
 }
-std::tuple<nvrtcProgram, CUmodule> Device::compileCudaProgramAndLoadModule(std::string source, const std::string programName) {
+std::shared_ptr<Program> Device::getProgram(std::string source, const std::string programName, const CompilerOptions& compilerOptions) {
+    std::string normalizedSource = ProgramCache<std::shared_ptr<Program>>::normalizeSource(source);
+    // The same source built with other flags is another program
+    std::vector<std::string> compilerFlags = this->getCompilerFlags(compilerOptions);
+    std::string key = normalizedSource;
+    for (auto& flag : compilerFlags) {
+        key += "\n// " + flag;
+    }
+    return this->programCache.getOrCompile(key, [this, &normalizedSource, &programName, &compilerFlags]() {
+        return this->compileCudaProgramAndLoadModule(normalizedSource, programName, compilerFlags);
+    });
+}
+std::shared_ptr<Program> Device::compileCudaProgramAndLoadModule(std::string source, const std::string programName, const std::vector<std::string> compilerFlags) {
 #ifdef GSPAR_DEBUG
     std::stringstream ss; // Using stringstream eases multi-threaded debugging
     ss << "[GSPar Device " << this << "] Kernel received to compile: [" << programName << "] = \n" << source << std::endl;
@@ -371,15 +435,16 @@ std::tuple<nvrtcProgram, CUmodule> Device::compileCudaProgramAndLoadModule(std::
     // --------------------------------------------------------------------
     // Appending additional routines to the kernel source
     // --------------------------------------------------------------------
+    KernelGenerator* kernelGenerator = Instance::getInstance()->getKernelGenerator();
+    // When the GSPar runtime is linked, the kernel only needs the declarations of its functions
+    bool linkRuntime = GSPAR_LINK_DEVICE_RUNTIME;
     std::string completeKernelSource = "";
-    if (computeCapabilityMajor < 6) {
-        // atomicAdd() for double-precision floating-point numbers is not available by
-        // default on devices with compute capability lower than 6.0
-        // https://docs.nvidia.com/cuda/cuda-c-programming-guide/index.html#atomicadd
-        completeKernelSource.append(KernelGenerator::ATOMIC_ADD_POLYFILL);
+    if (linkRuntime) {
+        completeKernelSource.append(kernelGenerator->generateStdFunctionDeclarations(computeCapabilityMajor < 6));
+    } else {
+        completeKernelSource.append(this->getRuntimeSource());
     }
-    completeKernelSource.append(Instance::getInstance()->getKernelGenerator()->generateStdFunctions());
-    completeKernelSource.append(Instance::getInstance()->getKernelGenerator()->replaceMacroKeywords(source));
+    completeKernelSource.append(kernelGenerator->replaceMacroKeywords(source));
 
 #ifdef GSPAR_DEBUG
     ss << "[GSPar Device " << this << "] Complete kernel for compilation: [" << programName << "] = \n" << completeKernelSource << std::endl;
@@ -387,14 +452,12 @@ std::tuple<nvrtcProgram, CUmodule> Device::compileCudaProgramAndLoadModule(std::
     ss.str("");
 #endif
 
-    nvrtcProgram cudaProgram;
+    nvrtcProgram cudaProgram = NULL;
     CUmodule cudaModule;
 
-    throwCompilationExceptionIfFailed( nvrtcCreateProgram(&cudaProgram, completeKernelSource.c_str(), programName.c_str(), 0, NULL, NULL), cudaProgram );
-
     // https://docs.nvidia.com/cuda/nvrtc/index.html
-    int numOptions = 7;
-    const char *compilationOptions[numOptions];
+    int numOptions = 7 + compilerFlags.size() + (linkRuntime ? 1 : 0);
+    std::vector<const char*> compilationOptions(numOptions);
     compilationOptions[0] = "--device-as-default-execution-space";
     compilationOptions[1] = computeCapabilityArg.c_str();
     std::string gsparMacroKernel = "--define-macro=GSPAR_DEVICE_KERNEL=" + KernelGenerator::KERNEL_PREFIX;
@@ -407,23 +470,13 @@ std::tuple<nvrtcProgram, CUmodule> Device::compileCudaProgramAndLoadModule(std::
     compilationOptions[5] = gsparMacroConstant.c_str();
     std::string gsparMacroDevFunction = "--define-macro=GSPAR_DEVICE_FUNCTION=" + KernelGenerator::DEVICE_FUNCTION_PREFIX;
     compilationOptions[6] = gsparMacroDevFunction.c_str();
-
-#ifdef GSPAR_DEBUG
-    ss << "[GSPar Device " << this << "] Compiling kernel with " << numOptions << " options: ";
-    for (int iDebug = 0; iDebug < numOptions; iDebug++) {
-        ss << compilationOptions[iDebug] << " ";
+    for (size_t i = 0; i < compilerFlags.size(); i++) {
+        compilationOptions[7 + i] = compilerFlags[i].c_str();
+    }
+    if (linkRuntime) {
+        // Calls to the GSPar runtime are resolved by cuLink
+        compilationOptions[numOptions - 1] = "--relocatable-device-code=true";
     }
-    ss << std::endl;
-    std::cout << ss.str();
-    ss.str("");
-#endif
-
-    throwCompilationExceptionIfFailed( nvrtcCompileProgram(cudaProgram, numOptions, compilationOptions), cudaProgram );
-
-    size_t ptxSize;
-    throwCompilationExceptionIfFailed( nvrtcGetPTXSize(cudaProgram, &ptxSize), cudaProgram );
-    char* ptxSource = new char[ptxSize];
-    throwCompilationExceptionIfFailed( nvrtcGetPTX(cudaProgram, ptxSource), cudaProgram );
 
     unsigned int error_buffer_size = 1024;
     std::vector<CUjit_option> options;
@@ -440,27 +493,107 @@ std::tuple<nvrtcProgram, CUmodule> Device::compileCudaProgramAndLoadModule(std::
     options.push_back(CU_JIT_TARGET_FROM_CUCONTEXT);
     values.push_back(0); //No option value required for CU_JIT_TARGET_FROM_CUCONTEXT
 
-    Exception::throwIfFailed( cuModuleLoadDataEx(&cudaModule, ptxSource, options.size(), options.data(), values.data()), error_log);
+    // Tries to reuse the PTX (or linked CUBIN) generated by a previous execution
+    int driverVersion, nvrtcMajor, nvrtcMinor;
+    throwExceptionIfFailed( cuDriverGetVersion(&driverVersion) );
+    CompilationException::throwIfFailed( nvrtcVersion(&nvrtcMajor, &nvrtcMinor), defaultExceptionDetails() );
+    std::vector<std::string> cacheKeyParts = { "cuda", completeKernelSource, linkRuntime ? this->getRuntimeSource() : "", this->getName(),
+        std::to_string(driverVersion), std::to_string(nvrtcMajor) + "." + std::to_string(nvrtcMinor) };
+    for (int i = 0; i < numOptions; i++) {
+        cacheKeyParts.push_back(compilationOptions[i]);
+    }
+    KernelBinaryCache* cache = KernelBinaryCache::getInstance();
+    std::string cacheKey = KernelBinaryCache::computeKey(cacheKeyParts);
+    std::vector<char> moduleImage;
+    if (!cache->load(cacheKey, moduleImage)) {
+        moduleImage = this->compileCudaProgram(completeKernelSource, programName, numOptions, compilationOptions.data(), &cudaProgram);
+        if (linkRuntime) {
+            std::vector<char> runtimePtx = this->getRuntimePTX(std::vector<const char*>(compilationOptions.begin(), compilationOptions.end()));
+            CUlinkState linkState;
+            Exception::throwIfFailed( cuLinkCreate(options.size(), options.data(), values.data(), &linkState), error_log);
+            void* cubin;
+            size_t cubinSize;
+            CUresult linkStatus = cuLinkAddData(linkState, CU_JIT_INPUT_PTX, runtimePtx.data(), runtimePtx.size(), "gspar_runtime", 0, NULL, NULL);
+            if (linkStatus == CUDA_SUCCESS) {
+                linkStatus = cuLinkAddData(linkState, CU_JIT_INPUT_PTX, moduleImage.data(), moduleImage.size(), programName.c_str(), 0, NULL, NULL);
+            }
+            if (linkStatus == CUDA_SUCCESS) {
+                linkStatus = cuLinkComplete(linkState, &cubin, &cubinSize);
+            }
+            if (linkStatus == CUDA_SUCCESS) {
+                // The CUBIN is owned by the link state, so it is copied before destroying it
+                moduleImage.assign((char*)cubin, (char*)cubin + cubinSize);
+            }
+            cuLinkDestroy(linkState);
+            Exception::throwIfFailed(linkStatus, error_log);
+        }
+        cache->store(cacheKey, moduleImage.data(), moduleImage.size());
+    }
+
+    Exception::throwIfFailed( cuModuleLoadDataEx(&cudaModule, moduleImage.data(), options.size(), options.data(), values.data()), error_log);
     
-    return std::make_tuple(cudaProgram, cudaModule);
+    return std::make_shared<Program>(cudaProgram, cudaModule, this->getContext());
+}
+std::string Device::getRuntimeSource() {
+    std::string runtimeSource = "";
+    if (this->queryInfoNumeric(CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR) < 6) {
+        // atomicAdd() for double-precision floating-point numbers is not available by
+        // default on devices with compute capability lower than 6.0
+        // https://docs.nvidia.com/cuda/cuda-c-programming-guide/index.html#atomicadd
+        runtimeSource.append(KernelGenerator::ATOMIC_ADD_POLYFILL);
+    }
+    runtimeSource.append(Instance::getInstance()->getKernelGenerator()->generateStdFunctions());
+    return runtimeSource;
+}
+std::vector<char> Device::getRuntimePTX(const std::vector<const char*> compilationOptions) {
+    // The runtime is compiled with the same options of the kernels that will link it
+    std::string key = "";
+    for (auto option : compilationOptions) {
+        key.append(std::string(option) + "\n");
+    }
+    return this->runtimeProgramCache.getOrCompile(key, [this, &compilationOptions]() {
+        nvrtcProgram runtimeProgram = NULL;
+        std::vector<char> runtimePtx = this->compileCudaProgram(this->getRuntimeSource(), "gspar_runtime",
+            compilationOptions.size(), const_cast<const char**>(compilationOptions.data()), &runtimeProgram);
+        nvrtcDestroyProgram(&runtimeProgram);
+        return runtimePtx;
+    });
+}
+std::vector<char> Device::compileCudaProgram(std::string completeSource, const std::string programName, int numOptions, const char** compilationOptions, nvrtcProgram* cudaProgram) {
+    throwCompilationExceptionIfFailed( nvrtcCreateProgram(cudaProgram, completeSource.c_str(), programName.c_str(), 0, NULL, NULL), *cudaProgram );
+
+#ifdef GSPAR_DEBUG
+    std::stringstream ss; // Using stringstream eases multi-threaded debugging
+    ss << "[GSPar Device " << this << "] Compiling kernel with " << numOptions << " options: ";
+    for (int iDebug = 0; iDebug < numOptions; iDebug++) {
+        ss << compilationOptions[iDebug] << " ";
+    }
+    ss << std::endl;
+    std::cout << ss.str();
+    ss.str("");
+#endif
+
+    throwCompilationExceptionIfFailed( nvrtcCompileProgram(*cudaProgram, numOptions, compilationOptions), *cudaProgram );
+
+    size_t ptxSize;
+    throwCompilationExceptionIfFailed( nvrtcGetPTXSize(*cudaProgram, &ptxSize), *cudaProgram );
+    std::vector<char> ptxSource(ptxSize);
+    throwCompilationExceptionIfFailed( nvrtcGetPTX(*cudaProgram, ptxSource.data()), *cudaProgram );
+    return ptxSource;
 }
 
 
 ///// Kernel /////
 
 void Kernel::loadCudaFunction(const std::string kernelName) {
-    throwExceptionIfFailed( cuModuleGetFunction(&this->cudaFunction, this->cudaModule, kernelName.c_str()) );
+    throwExceptionIfFailed( cuModuleGetFunction(&this->cudaFunction, this->program->getCudaModule(), kernelName.c_str()) );
 }
 
 Kernel::Kernel() : BaseKernel() { }
-Kernel::Kernel(Device* device, const std::string kernelSource, const std::string kernelName) : BaseKernel(device, kernelSource, kernelName) {
+Kernel::Kernel(Device* device, const std::string kernelSource, const std::string kernelName, const CompilerOptions& compilerOptions) : BaseKernel(device, kernelSource, kernelName) {
     std::string programName = "program_" + kernelName;
 
-    auto programAndModule = this->device->compileCudaProgramAndLoadModule(kernelSource, programName);
-    this->cudaProgram = std::get<0>(programAndModule);
-    this->cudaModule = std::get<1>(programAndModule);
-
-    this->isPrecompiled = false; //Kernel owns cudaProgram
+    this->program = this->device->getProgram(kernelSource, programName, compilerOptions); // May be shared with other kernels
 
     this->loadCudaFunction(kernelName);
 
@@ -476,11 +609,8 @@ Kernel::Kernel(Device* device, const std::string kernelSource, const std::string
         ss.str("");
     #endif  
 }
-Kernel::Kernel(Device* device, nvrtcProgram cudaProgram, CUmodule cudaModule, const std::string kernelName) : BaseKernel(device) {
-    this->cudaProgram = cudaProgram;
-    this->isPrecompiled = true; //Kernel shares cudaProgram
-
-    this->cudaModule = cudaModule;
+Kernel::Kernel(Device* device, std::shared_ptr<Program> program, const std::string kernelName) : BaseKernel(device) {
+    this->program = program; //Kernel shares the program
 
     this->loadCudaFunction(kernelName);
 }
@@ -494,20 +624,13 @@ Kernel::~Kernel() {
     if (this->isRunningAsync()) {
         this->waitAsync();
     }
-    if (!this->isPrecompiled && this->cudaProgram) {
-        nvrtcDestroyProgram(&this->cudaProgram); // We don't throw exceptions on destructors
-    }
 }
 void Kernel::cloneInto(BaseKernelBase* baseOther) {
     BaseKernel::cloneInto(baseOther);
     Kernel* other = static_cast<Kernel*>(baseOther);
-    other->cudaProgram = this->cudaProgram;
-    other->cudaModule = this->cudaModule;
+    other->program = this->program; // Now the program is shared, and its module outlives every clone
     other->cudaFunction = this->cudaFunction;
     other->kernelParams = this->kernelParams;
-    // TODO Who will destroy the NVRTC program?
-    this->isPrecompiled = true; // Now the program is shared
-    other->isPrecompiled = true;
     other->attributeCache = this->attributeCache;
 }
 int Kernel::setParameter(MemoryObject* memoryObject) {
@@ -669,12 +792,112 @@ const int Kernel::queryInfoNumeric(CUfunction_attribute paramName, bool cacheabl
 
 
 
+///// StagingArea /////
+
+static StagingBuffer allocStagingBuffer(size_t size) {
+#if GSPAR_HOST_STAGING_HUGE_PAGES
+    const size_t hugePageSize = 2UL * 1024 * 1024;
+    if (size >= hugePageSize) {
+        size_t mappedSize = ((size + hugePageSize - 1) / hugePageSize) * hugePageSize;
+        void* pointer = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (pointer != MAP_FAILED) {
+            if (cuMemHostRegister(pointer, mappedSize, CU_MEMHOSTREGISTER_PORTABLE) == CUDA_SUCCESS) {
+                return StagingBuffer{pointer, mappedSize};
+            }
+            munmap(pointer, mappedSize);
+        }
+        // There are no free huge pages, so we use regular pinned memory
+    }
+#endif
+    void* pointer;
+    throwExceptionIfFailed( cuMemHostAlloc(&pointer, size, CU_MEMHOSTALLOC_PORTABLE) );
+    return StagingBuffer{pointer, 0};
+}
+
+void Device::releaseStagingBuffer(StagingBuffer buffer) {
+    // We don't throw exceptions on destructors
+#if GSPAR_HOST_STAGING_HUGE_PAGES
+    if (buffer.mappedSize) {
+        cuMemHostUnregister(buffer.pointer);
+        munmap(buffer.pointer, buffer.mappedSize);
+        return;
+    }
+#endif
+    cuMemFreeHost(buffer.pointer);
+}
+
+struct StagedCopy {
+    std::vector<std::tuple<void*, const void*, size_t>> parts; // Host memory, staging memory and size
+};
+static void CUDA_CB copyStagedToHost(void* userData) {
+    // Runs in a thread of the driver, which must not call the CUDA API
+    StagedCopy* stagedCopy = static_cast<StagedCopy*>(userData);
+    for (auto& part : stagedCopy->parts) {
+        memcpy(std::get<0>(part), std::get<1>(part), std::get<2>(part));
+    }
+    delete stagedCopy;
+}
+
+StagingArea::StagingArea(Device* device, unsigned int regions, size_t regionSize) :
+        device(device), size(regions * regionSize), regionSize(regionSize), events(regions, NULL) {
+    this->buffer = device->getStagingPool().allocate(this->size, 0, allocStagingBuffer);
+}
+StagingArea::~StagingArea() {
+    // We don't throw exceptions on destructors
+    for (CUevent event : this->events) {
+        if (event) {
+            cuEventSynchronize(event); // The buffer is reused as soon as it is back in the pool
+            cuEventDestroy(event);
+        }
+    }
+    this->device->getStagingPool().release(this->buffer, this->size, 0);
+}
+unsigned char* StagingArea::getRegion(unsigned int region) {
+    if (this->events[region]) {
+        throwExceptionIfFailed( cuEventSynchronize(this->events[region]) );
+    }
+    return static_cast<unsigned char*>(this->buffer.pointer) + region * this->regionSize;
+}
+void StagingArea::recordTransfer(unsigned int region, CUstream cudaStream) {
+    if (!this->events[region]) {
+        throwExceptionIfFailed( cuEventCreate(&this->events[region], CU_EVENT_DISABLE_TIMING) );
+    }
+    throwExceptionIfFailed( cuEventRecord(this->events[region], cudaStream) );
+}
+void StagingArea::copyRegionToHost(unsigned int region, size_t offset, void* hostPtr, size_t size, CUstream cudaStream) {
+    this->copyRegionsToHost({ std::make_tuple(region, offset, hostPtr, size) }, cudaStream);
+}
+void StagingArea::copyRegionsToHost(const std::vector<std::tuple<unsigned int, size_t, void*, size_t>>& parts, CUstream cudaStream) {
+    StagedCopy* stagedCopy = new StagedCopy();
+    for (auto& part : parts) {
+        const void* stagingPtr = static_cast<unsigned char*>(this->buffer.pointer) + std::get<0>(part) * this->regionSize + std::get<1>(part);
+        stagedCopy->parts.push_back(std::make_tuple(std::get<2>(part), stagingPtr, std::get<3>(part)));
+    }
+    CUresult result = cuLaunchHostFunc(cudaStream, copyStagedToHost, stagedCopy);
+    if (result != CUDA_SUCCESS) {
+        delete stagedCopy;
+        throwExceptionIfFailed(result);
+    }
+    for (auto& part : parts) {
+        this->recordTransfer(std::get<0>(part), cudaStream); // The region is free only after the copy to the host memory
+    }
+}
+
+
+
 ///// MemoryObject /////
+static CUdeviceptr allocDeviceMemoryBlock(size_t size) {
+    CUdeviceptr memory;
+    throwExceptionIfFailed( cuMemAlloc(&memory, size) );
+    return memory;
+}
+
 void MemoryObject::allocDeviceMemory() {
     this->device->getContext(); // There must be a context to call cuMemAlloc
 
     this->devicePtr = new CUdeviceptr; // It is initialized as NULL, we have to allocate space for it
-    throwExceptionIfFailed( cuMemAlloc(this->devicePtr, size) );
+    *this->devicePtr = this->device->getMemoryPool().allocate(this->size, 0, allocDeviceMemoryBlock);
+    this->allocatedSize = this->size;
 }
 
 MemoryObject::MemoryObject(Device* device, size_t size, void* hostPtr, bool readOnly, bool writeOnly) : BaseMemoryObject(device, size, hostPtr, readOnly, writeOnly) {
@@ -685,37 +908,93 @@ MemoryObject::MemoryObject(Device* device, size_t size, const void* hostPtr) : B
 }
 MemoryObject::~MemoryObject() {
     if (this->devicePtr) {
-        cuMemFree(*(this->devicePtr)); // We don't throw exceptions on destructors
+        this->device->getMemoryPool().release(*(this->devicePtr), this->allocatedSize, 0); // We don't throw exceptions on destructors
+        delete this->devicePtr;
         this->devicePtr = NULL;
     }
     if (this->isPinnedHostMemory()) {
         cuMemHostUnregister(this->hostPtr); // We don't throw exceptions on destructors
     }
 }
+StagingArea* MemoryObject::getStagingArea() {
+#if GSPAR_HOST_STAGING_BUFFERS
+    if (this->isPinnedHostMemory()) {
+        return NULL; // The DMA already accesses the host memory directly
+    }
+    if (!this->stagingArea) {
+        this->stagingArea.reset(new StagingArea(this->device, 1, this->allocatedSize));
+    }
+    return this->stagingArea.get();
+#else
+    return NULL;
+#endif
+}
+void MemoryObject::bindTo(void* hostPtr) {
+    if (this->isPinnedHostMemory() && hostPtr != this->hostPtr) {
+        cuMemHostUnregister(this->hostPtr); // The new host memory may be pinned again
+        this->setPinnedHostMemory(false);
+    }
+    BaseMemoryObject::bindTo(hostPtr);
+}
 void MemoryObject::pinHostMemory() {
     if (!this->isPinnedHostMemory()) { // TODO implement thread-safety
         CUresult result = cuMemHostRegister(this->hostPtr, this->size, 0);
         if (result != CUDA_ERROR_HOST_MEMORY_ALREADY_REGISTERED) {
             throwExceptionIfFailed(result);
         }
+        this->stagingArea.reset(); // Not needed anymore
     }
     BaseMemoryObject::pinHostMemory();
 }
 
 void MemoryObject::copyIn() {
-    throwExceptionIfFailed( cuMemcpyHtoD(*(this->devicePtr), this->hostPtr, this->size) );
+    this->copyIn(0, this->size);
 }
 void MemoryObject::copyOut() {
-    throwExceptionIfFailed( cuMemcpyDtoH(this->hostPtr, *(this->devicePtr), this->size) );
+    this->copyOut(0, this->size);
 }
 void MemoryObject::copyInAsync(ExecutionFlow* executionFlow) {
+    this->copyInAsync(0, this->size, executionFlow);
+}
+void MemoryObject::copyOutAsync(ExecutionFlow* executionFlow) {
+    this->copyOutAsync(0, this->size, executionFlow);
+}
+void MemoryObject::copyIn(size_t offset, size_t length) {
+    this->checkRange(offset, length, this->size);
+    throwExceptionIfFailed( cuMemcpyHtoD(*(this->devicePtr) + offset, static_cast<unsigned char*>(this->hostPtr) + offset, length) );
+}
+void MemoryObject::copyOut(size_t offset, size_t length) {
+    this->checkRange(offset, length, this->size);
+    throwExceptionIfFailed( cuMemcpyDtoH(static_cast<unsigned char*>(this->hostPtr) + offset, *(this->devicePtr) + offset, length) );
+}
+void MemoryObject::copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) {
+    this->checkRange(offset, length, this->size);
     CUstream cudaStream = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
-    throwExceptionIfFailed( cuMemcpyHtoDAsync(*(this->devicePtr), this->hostPtr, this->size, cudaStream) );
+    unsigned char* hostPtr = static_cast<unsigned char*>(this->hostPtr) + offset;
+    StagingArea* stagingArea = this->getStagingArea();
+    if (stagingArea) {
+        // Pageable memory would be copied synchronously by the driver, so we stage it in pinned memory
+        unsigned char* stagingPtr = stagingArea->getRegion(0) + offset;
+        memcpy(stagingPtr, hostPtr, length);
+        throwExceptionIfFailed( cuMemcpyHtoDAsync(*(this->devicePtr) + offset, stagingPtr, length, cudaStream) );
+        stagingArea->recordTransfer(0, cudaStream);
+    } else {
+        throwExceptionIfFailed( cuMemcpyHtoDAsync(*(this->devicePtr) + offset, hostPtr, length, cudaStream) );
+    }
     this->setBaseAsyncObject(cudaStream);
 }
-void MemoryObject::copyOutAsync(ExecutionFlow* executionFlow) {
+void MemoryObject::copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) {
+    this->checkRange(offset, length, this->size);
     CUstream cudaStream = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
-    throwExceptionIfFailed( cuMemcpyDtoHAsync(this->hostPtr, *(this->devicePtr), this->size, cudaStream) );
+    unsigned char* hostPtr = static_cast<unsigned char*>(this->hostPtr) + offset;
+    StagingArea* stagingArea = this->getStagingArea();
+    if (stagingArea) {
+        unsigned char* stagingPtr = stagingArea->getRegion(0) + offset;
+        throwExceptionIfFailed( cuMemcpyDtoHAsync(stagingPtr, *(this->devicePtr) + offset, length, cudaStream) );
+        stagingArea->copyRegionToHost(0, offset, hostPtr, length, cudaStream);
+    } else {
+        throwExceptionIfFailed( cuMemcpyDtoHAsync(hostPtr, *(this->devicePtr) + offset, length, cudaStream) );
+    }
     this->setBaseAsyncObject(cudaStream);
 }
 
@@ -727,7 +1006,8 @@ void ChunkedMemoryObject::allocDeviceMemory() {
     this->device->getContext(); // There must be a context to call cuMemAlloc
 
     this->devicePtr = new CUdeviceptr; // It is initialized as NULL, we have to allocate space for it
-    throwExceptionIfFailed( cuMemAlloc(this->devicePtr, this->getChunkSize() * this->chunks) ); // We allocate space for all the chunks
+    this->allocatedSize = this->getChunkSize() * this->chunks; // We allocate space for all the chunks
+    *this->devicePtr = this->device->getMemoryPool().allocate(this->allocatedSize, 0, allocDeviceMemoryBlock);
 }
 
 ChunkedMemoryObject::ChunkedMemoryObject(Device* device, unsigned int chunks, size_t chunkSize, void** hostPointers, bool readOnly, bool writeOnly) :
@@ -738,7 +1018,49 @@ ChunkedMemoryObject::ChunkedMemoryObject(Device* device, unsigned int chunks, si
         BaseChunkedMemoryObject(device, chunks, chunkSize, hostPointers) {
     this->allocDeviceMemory();
 }
-ChunkedMemoryObject::~ChunkedMemoryObject() { }
+ChunkedMemoryObject::~ChunkedMemoryObject() {
+    if (this->devicePtr) {
+        this->device->getMemoryPool().release(*(this->devicePtr), this->allocatedSize, 0); // We don't throw exceptions on destructors
+        delete this->devicePtr;
+        this->devicePtr = NULL;
+    }
+}
+StagingArea* ChunkedMemoryObject::getStagingArea() {
+#if GSPAR_HOST_STAGING_BUFFERS
+    // The chunks are never pinned (see pinHostMemory)
+    if (!this->stagingArea) {
+        this->stagingArea.reset(new StagingArea(this->device, this->chunks, this->getChunkSize()));
+    }
+    return this->stagingArea.get();
+#else
+    return NULL;
+#endif
+}
+void ChunkedMemoryObject::copyChunkInAsync(unsigned int chunk, size_t offset, size_t length, CUstream cudaStream) {
+    CUdeviceptr chunkPtr = (CUdeviceptr)((unsigned char*)(*this->devicePtr)+(chunk*this->getChunkSize())+offset);
+    unsigned char* hostPtr = static_cast<unsigned char*>(this->hostPointers[chunk]) + offset;
+    StagingArea* stagingArea = this->getStagingArea();
+    if (stagingArea) {
+        unsigned char* stagingPtr = stagingArea->getRegion(chunk) + offset;
+        memcpy(stagingPtr, hostPtr, length);
+        throwExceptionIfFailed( cuMemcpyHtoDAsync(chunkPtr, stagingPtr, length, cudaStream) );
+        stagingArea->recordTransfer(chunk, cudaStream);
+    } else {
+        throwExceptionIfFailed( cuMemcpyHtoDAsync(chunkPtr, hostPtr, length, cudaStream) );
+    }
+}
+void ChunkedMemoryObject::copyChunkOutAsync(unsigned int chunk, size_t offset, size_t length, CUstream cudaStream) {
+    CUdeviceptr chunkPtr = (CUdeviceptr)((unsigned char*)(*this->devicePtr)+(chunk*this->getChunkSize())+offset);
+    unsigned char* hostPtr = static_cast<unsigned char*>(this->hostPointers[chunk]) + offset;
+    StagingArea* stagingArea = this->getStagingArea();
+    if (stagingArea) {
+        unsigned char* stagingPtr = stagingArea->getRegion(chunk) + offset;
+        throwExceptionIfFailed( cuMemcpyDtoHAsync(stagingPtr, chunkPtr, length, cudaStream) );
+        stagingArea->copyRegionToHost(chunk, offset, hostPtr, length, cudaStream);
+    } else {
+        throwExceptionIfFailed( cuMemcpyDtoHAsync(hostPtr, chunkPtr, length, cudaStream) );
+    }
+}
 void ChunkedMemoryObject::pinHostMemory() {
     // TODO implement pinned memory in chunked memory objects
     // We need to keep this empty method here while it is not implemented so the parent method does not get called
@@ -757,17 +1079,12 @@ void ChunkedMemoryObject::copyInAsync(ExecutionFlow* executionFlow) {
     CUstream cudaStream = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
     for (unsigned int chunk = 0; chunk < this->chunks; chunk++) {
         // We don't call copyInAsync(chunk) to avoid calling checkAndStartFlow for each chunk
-        throwExceptionIfFailed( cuMemcpyHtoDAsync((CUdeviceptr)((unsigned char*)(*this->devicePtr)+(chunk*this->getChunkSize())), this->hostPointers[chunk], this->getChunkSize(), cudaStream) );
+        this->copyChunkInAsync(chunk, 0, this->getChunkSize(), cudaStream);
     }
     this->setBaseAsyncObject(cudaStream);
 }
 void ChunkedMemoryObject::copyOutAsync(ExecutionFlow* executionFlow) {
-    CUstream cudaStream = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
-    for (unsigned int chunk = 0; chunk < this->chunks; chunk++) {
-        // We don't call copyOutAsync(chunk) to avoid calling checkAndStartFlow for each chunk
-        throwExceptionIfFailed( cuMemcpyDtoHAsync(this->hostPointers[chunk], (CUdeviceptr)((unsigned char*)(*this->devicePtr)+(chunk*this->getChunkSize())), this->getChunkSize(), cudaStream) );
-    }
-    this->setBaseAsyncObject(cudaStream);
+    this->copyOutAsync(0, this->chunks * this->getChunkSize(), executionFlow);
 }
 void ChunkedMemoryObject::copyIn(unsigned int chunk) {
     throwExceptionIfFailed( cuMemcpyHtoD((CUdeviceptr)((unsigned char*)(*this->devicePtr)+(chunk*this->getChunkSize())), this->hostPointers[chunk], this->getChunkSize()) );
@@ -777,12 +1094,57 @@ void ChunkedMemoryObject::copyOut(unsigned int chunk) {
 }
 void ChunkedMemoryObject::copyInAsync(unsigned int chunk, ExecutionFlow* executionFlow) {
     CUstream cudaStream = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
-    throwExceptionIfFailed( cuMemcpyHtoDAsync((CUdeviceptr)((unsigned char*)(*this->devicePtr)+(chunk*this->getChunkSize())), this->hostPointers[chunk], this->getChunkSize(), cudaStream) );
+    this->copyChunkInAsync(chunk, 0, this->getChunkSize(), cudaStream);
     this->setBaseAsyncObject(cudaStream);
 }
 void ChunkedMemoryObject::copyOutAsync(unsigned int chunk, ExecutionFlow* executionFlow) {
     CUstream cudaStream = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
-    throwExceptionIfFailed( cuMemcpyDtoHAsync(this->hostPointers[chunk], (CUdeviceptr)((unsigned char*)(*this->devicePtr)+(chunk*this->getChunkSize())), this->getChunkSize(), cudaStream) );
+    this->copyChunkOutAsync(chunk, 0, this->getChunkSize(), cudaStream);
+    this->setBaseAsyncObject(cudaStream);
+}
+void ChunkedMemoryObject::copyIn(size_t offset, size_t length) {
+    this->forEachChunkInRange(offset, length, [this](unsigned int chunk, size_t chunkOffset, size_t partLength) {
+        CUdeviceptr chunkPtr = (CUdeviceptr)((unsigned char*)(*this->devicePtr)+(chunk*this->getChunkSize())+chunkOffset);
+        throwExceptionIfFailed( cuMemcpyHtoD(chunkPtr, static_cast<unsigned char*>(this->hostPointers[chunk]) + chunkOffset, partLength) );
+    });
+}
+void ChunkedMemoryObject::copyOut(size_t offset, size_t length) {
+    this->forEachChunkInRange(offset, length, [this](unsigned int chunk, size_t chunkOffset, size_t partLength) {
+        CUdeviceptr chunkPtr = (CUdeviceptr)((unsigned char*)(*this->devicePtr)+(chunk*this->getChunkSize())+chunkOffset);
+        throwExceptionIfFailed( cuMemcpyDtoH(static_cast<unsigned char*>(this->hostPointers[chunk]) + chunkOffset, chunkPtr, partLength) );
+    });
+}
+void ChunkedMemoryObject::copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) {
+    CUstream cudaStream = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
+    this->forEachChunkInRange(offset, length, [this, cudaStream](unsigned int chunk, size_t chunkOffset, size_t partLength) {
+        this->copyChunkInAsync(chunk, chunkOffset, partLength, cudaStream);
+    });
+    this->setBaseAsyncObject(cudaStream);
+}
+void ChunkedMemoryObject::copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) {
+    CUstream cudaStream = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
+    StagingArea* stagingArea = this->getStagingArea();
+    if (stagingArea) {
+        // The regions of the staging area are laid out as the chunks in the device memory,
+        // so the whole range is read at once and then scattered to the host memory of each chunk
+        std::vector<std::tuple<unsigned int, size_t, void*, size_t>> parts;
+        unsigned char* stagingPtr = NULL;
+        this->forEachChunkInRange(offset, length, [this, stagingArea, &parts, &stagingPtr](unsigned int chunk, size_t chunkOffset, size_t partLength) {
+            unsigned char* regionPtr = stagingArea->getRegion(chunk) + chunkOffset; // Waits for the previous transfer of the region
+            if (!stagingPtr) {
+                stagingPtr = regionPtr;
+            }
+            parts.push_back(std::make_tuple(chunk, chunkOffset, static_cast<unsigned char*>(this->hostPointers[chunk]) + chunkOffset, partLength));
+        });
+        if (length) {
+            throwExceptionIfFailed( cuMemcpyDtoHAsync(stagingPtr, (CUdeviceptr)((unsigned char*)(*this->devicePtr)+offset), length, cudaStream) );
+            stagingArea->copyRegionsToHost(parts, cudaStream);
+        }
+    } else {
+        this->forEachChunkInRange(offset, length, [this, cudaStream](unsigned int chunk, size_t chunkOffset, size_t partLength) {
+            this->copyChunkOutAsync(chunk, chunkOffset, partLength, cudaStream);
+        });
+    }
     this->setBaseAsyncObject(cudaStream);
 }
 
@@ -846,10 +1208,21 @@ std::string KernelGenerator::generateStdFunctions() {
     "__device__ double gspar_atomic_add_double(double* valq, double delta) { return atomicAdd(valq, delta); } \n"
     ;
 }
-std::string KernelGenerator::replaceMacroKeywords(std::string kernelSource) {
-    kernelSource = std::regex_replace(kernelSource, std::regex("GSPAR_DEVICE_MACRO_BEGIN"), "#define");
-    kernelSource = std::regex_replace(kernelSource, std::regex("GSPAR_DEVICE_MACRO_END"), "\n");
-    return kernelSource;
+std::string KernelGenerator::generateStdFunctionDeclarations(bool atomicAddPolyfill) {
+    std::string declarations = "";
+    if (atomicAddPolyfill) {
+        declarations += "__device__ double atomicAdd(double* address, double val); \n";
+    }
+    return declarations +
+    "__device__ size_t gspar_get_global_id(unsigned int dimension); \n"
+    "__device__ size_t gspar_get_thread_id(unsigned int dimension); \n"
+    "__device__ size_t gspar_get_block_id(unsigned int dimension); \n"
+    "__device__ size_t gspar_get_block_size(unsigned int dimension); \n"
+    "__device__ size_t gspar_get_grid_size(unsigned int dimension); \n"
+    "extern \"C\" __device__ void gspar_synchronize_local_threads(); \n"
+    "__device__ int gspar_atomic_add_int(int* valq, int delta); \n"
+    "__device__ double gspar_atomic_add_double(double* valq, double delta); \n"
+    ;
 }
 std::string KernelGenerator::generateInitKernel(Pattern::BaseParallelPattern* pattern, Dimensions dims) {
     std::string r = "";
@@ -865,8 +1238,7 @@ std::string KernelGenerator::generateParams(Pattern::BaseParallelPattern* patter
         if (dims.is(d)) {
             std::string varName = this->getStdVarNameForDimension(pattern->getStdVarNames(), d);
             r += "const unsigned long gspar_max_" + varName + ",";
-            if (dims[d].min && !pattern->isBatched()) { // Same check as generateStdVariables
-                // TODO Support min in batches
+            if (pattern->isUsingMinParameter(dims, d)) { // Same check as generateStdVariables
                 r += "const unsigned long gspar_min_" + varName + ",";
             }
         }
@@ -901,8 +1273,7 @@ std::string KernelGenerator::generateStdVariables(Pattern::BaseParallelPattern*
                 r += "size_t " + varName;
             }
             r += " = gspar_get_global_id(" + std::to_string(d) + ")";
-            if (dims[d].min && !pattern->isBatched()) { // Same check as generateParams
-                // TODO Support min in batches
+            if (pattern->isUsingMinParameter(dims, d)) { // Same check as generateParams
                 r += " + gspar_min_" + varName;
             }
             r += "; \n";
@@ -6,6 +6,8 @@
 #include <vector>
 #include <map>
 #include <mutex>
+#include <tuple>
+#include <memory>
 #include <cuda.h>
 #include <nvrtc.h>
 
@@ -15,6 +17,7 @@ namespace GSPar {
     namespace Driver {
         namespace CUDA {
             class Exception;
+            class Program;
             class ExecutionFlow;
             class AsyncExecutionSupport;
             class Instance;
@@ -22,6 +25,7 @@ namespace GSPar {
             class Kernel;
             class MemoryObject;
             class ChunkedMemoryObject;
+            class StagingArea;
             class StreamElement;
             class KernelGenerator;
         }
@@ -75,6 +79,7 @@ namespace GSPar {
                 virtual ~ExecutionFlow();
                 CUstream start() override;
                 void synchronize() override;
+                bool isFinished() override;
 
                 static CUstream checkAndStartFlow(Device* device, ExecutionFlow* executionFlow = NULL);
             };
@@ -107,6 +112,35 @@ namespace GSPar {
                 static Instance* getInstance();
             };
 
+            ///// StagingBuffer /////
+
+            /**
+             * Pinned host memory through which the asynchronous copies of unpinned host memory are made
+             */
+            struct StagingBuffer {
+                void* pointer;
+                size_t mappedSize; // Size of the huge pages mapped with mmap, or 0 if allocated with cuMemHostAlloc
+            };
+
+            ///// Program /////
+
+            /**
+             * A module loaded in a context, with the NVRTC program it was compiled from.
+             * It is shared by all the kernels prepared from the same source, and unloaded when the last of them and the device's cache drop it.
+             */
+            class Program {
+            private:
+                nvrtcProgram cudaProgram;
+                CUmodule cudaModule;
+                CUcontext context;
+
+            public:
+                Program(nvrtcProgram cudaProgram, CUmodule cudaModule, CUcontext context);
+                virtual ~Program();
+                nvrtcProgram getCudaProgram() { return this->cudaProgram; }
+                CUmodule getCudaModule() { return this->cudaModule; }
+            };
+
             ///// Device /////
 
             class Device :
@@ -114,8 +148,16 @@ namespace GSPar {
             private:
                 mutable std::mutex attributeCacheMutex;
                 std::map<CUdevice_attribute, int> attributeCache;
+                ProgramCache<std::shared_ptr<Program>> programCache;
+                ProgramCache<std::vector<char>> runtimeProgramCache{ 0 }; // One PTX per set of compiler flags
+                // Blocks may be freed by any thread, so the context is set as current first
+                DeviceMemoryPool<CUdeviceptr> memoryPool{ [this](CUdeviceptr memory) { cuCtxSetCurrent(this->libContext); cuMemFree(memory); } };
+                DeviceMemoryPool<StagingBuffer> stagingPool{ [this](StagingBuffer buffer) { cuCtxSetCurrent(this->libContext); releaseStagingBuffer(buffer); },
+                    GSPAR_HOST_STAGING_POOL_MAX_BYTES };
                 int deviceId;
 
+                static void releaseStagingBuffer(StagingBuffer buffer);
+
             public:
                 using BaseDevice<ExecutionFlow, Kernel, MemoryObject, ChunkedMemoryObject, CUcontext, CUdevice*, CUstream>::malloc;
                 
@@ -139,12 +181,29 @@ namespace GSPar {
                 MemoryObject* malloc(long size, const void* hostPtr = nullptr) override;
                 ChunkedMemoryObject* mallocChunked(unsigned int chunks, long chunkSize, void** hostPtr = nullptr, bool readOnly = false, bool writeOnly = false) override;
                 ChunkedMemoryObject* mallocChunked(unsigned int chunks, long chunkSize, const void** hostPtr = nullptr) override;
-                Kernel* prepareKernel(const std::string kernelSource, const std::string kernelName) override;
-                std::vector<Kernel*> prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames) override;
+                std::vector<std::string> getCompilerFlags(const CompilerOptions& compilerOptions) override;
+                Kernel* prepareKernel(const std::string kernelSource, const std::string kernelName, const CompilerOptions& compilerOptions = CompilerOptions()) override;
+                std::vector<Kernel*> prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames, const CompilerOptions& compilerOptions = CompilerOptions()) override;
 
                 // const char* queryInfoText(cl_device_info paramName);
                 const int queryInfoNumeric(CUdevice_attribute paramName, bool cacheable = true);
-                std::tuple<nvrtcProgram, CUmodule> compileCudaProgramAndLoadModule(std::string source, const std::string programName);
+                std::shared_ptr<Program> compileCudaProgramAndLoadModule(std::string source, const std::string programName, const std::vector<std::string> compilerFlags = {});
+                /**
+                 * Gets the program and module of a source from the device's program cache, compiling it only once
+                 */
+                std::shared_ptr<Program> getProgram(std::string source, const std::string programName, const CompilerOptions& compilerOptions = CompilerOptions());
+                ProgramCache<std::shared_ptr<Program>>& getProgramCache() { return this->programCache; }
+                DeviceMemoryPool<CUdeviceptr>& getMemoryPool() { return this->memoryPool; }
+                DeviceMemoryPool<StagingBuffer>& getStagingPool() { return this->stagingPool; }
+                /**
+                 * Gets the source of the GSPar runtime for this device, including the polyfills it needs
+                 */
+                std::string getRuntimeSource();
+                /**
+                 * Gets the PTX of the GSPar runtime compiled with the given options, compiling it only once
+                 */
+                std::vector<char> getRuntimePTX(const std::vector<const char*> compilationOptions);
+                std::vector<char> compileCudaProgram(std::string completeSource, const std::string programName, int numOptions, const char** compilationOptions, nvrtcProgram* cudaProgram);
             };
 
             ///// Kernel /////
@@ -153,18 +212,16 @@ namespace GSPar {
                 public BaseKernel<ExecutionFlow, Device, MemoryObject, ChunkedMemoryObject, CUstream>,
                 public AsyncExecutionSupport {
             private:
-                nvrtcProgram cudaProgram = NULL;
-                CUmodule cudaModule = NULL;
+                std::shared_ptr<Program> program; // Keeps the module of cudaFunction loaded
                 CUfunction cudaFunction = NULL;
                 std::vector<void*> kernelParams;
-                bool isPrecompiled;
                 std::map<CUfunction_attribute, int> attributeCache;
 
                 void loadCudaFunction(const std::string kernelName);
 
             public:
                 Kernel();
-                Kernel(Device* device, const std::string kernelSource, const std::string kernelName);
+                Kernel(Device* device, const std::string kernelSource, const std::string kernelName, const CompilerOptions& compilerOptions = CompilerOptions());
                 virtual ~Kernel();
                 virtual void cloneInto(BaseKernelBase* baseOther) override;
                 int setParameter(MemoryObject* memoryObject) override;
@@ -175,26 +232,76 @@ namespace GSPar {
                 Dimensions getNumBlocksAndThreadsFor(Dimensions dims) override;
                 void runAsync(Dimensions max, ExecutionFlow* executionFlow = NULL) override;
 
-                Kernel(Device* device, nvrtcProgram cudaProgram, CUmodule cudaModule, const std::string kernelName);
+                Kernel(Device* device, std::shared_ptr<Program> program, const std::string kernelName);
                 const int queryInfoNumeric(CUfunction_attribute paramName, bool cacheable = true);
             };
 
+            ///// StagingArea /////
+
+            /**
+             * Staging buffer of a memory object, taken from the device's staging pool, split in one region per chunk.
+             * The host only waits for the previous transfer of the region it is going to reuse.
+             */
+            class StagingArea {
+            private:
+                Device* device;
+                StagingBuffer buffer;
+                size_t size;
+                size_t regionSize;
+                std::vector<CUevent> events; // Recorded after the last transfer of each region, NULL if there was none
+
+            public:
+                StagingArea(Device* device, unsigned int regions, size_t regionSize);
+                virtual ~StagingArea();
+                /**
+                 * Gets the host memory of a region, waiting for its previous transfer to finish
+                 */
+                unsigned char* getRegion(unsigned int region);
+                /**
+                 * Records, in the stream, the end of the transfer just enqueued for a region
+                 */
+                void recordTransfer(unsigned int region, CUstream cudaStream);
+                /**
+                 * Enqueues, in the stream, the copy of size bytes from offset of a region to the host memory after the transfer from the device
+                 */
+                void copyRegionToHost(unsigned int region, size_t offset, void* hostPtr, size_t size, CUstream cudaStream);
+                /**
+                 * Enqueues, in the stream, a single copy to the host memory of several parts of the regions: region, offset, host memory and size
+                 */
+                void copyRegionsToHost(const std::vector<std::tuple<unsigned int, size_t, void*, size_t>>& parts, CUstream cudaStream);
+            };
+
             ///// MemoryObject /////
 
             class MemoryObject :
                 public BaseMemoryObject<Exception, ExecutionFlow, Device, CUdeviceptr*, CUstream>,
                 public AsyncExecutionSupport {
             private:
+                std::unique_ptr<StagingArea> stagingArea;
+
                 void allocDeviceMemory();
+                /**
+                 * Gets the staging area of the memory object if its asynchronous copies must be staged, or NULL otherwise
+                 */
+                StagingArea* getStagingArea();
             public:
                 MemoryObject(Device* device, size_t size, void* hostPtr, bool readOnly, bool writeOnly);
                 MemoryObject(Device* device, size_t size, const void* hostPtr);
                 virtual ~MemoryObject();
+                using BaseMemoryObject<Exception, ExecutionFlow, Device, CUdeviceptr*, CUstream>::bindTo;
+                /**
+                 * Unpins the previous host memory, if it was pinned
+                 */
+                virtual void bindTo(void* hostPtr) override;
                 virtual void pinHostMemory() override;
                 virtual void copyIn() override;
                 virtual void copyOut() override;
                 virtual void copyInAsync(ExecutionFlow* executionFlow = NULL) override;
                 virtual void copyOutAsync(ExecutionFlow* executionFlow = NULL) override;
+                virtual void copyIn(size_t offset, size_t length) override;
+                virtual void copyOut(size_t offset, size_t length) override;
+                virtual void copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
+                virtual void copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
             };
 
             ///// ChunkedMemoryObject /////
@@ -203,7 +310,15 @@ namespace GSPar {
                 public BaseChunkedMemoryObject<Exception, ExecutionFlow, Device, CUdeviceptr*, CUstream>,
                 public AsyncExecutionSupport {
             private:
+                std::unique_ptr<StagingArea> stagingArea;
+
                 void allocDeviceMemory();
+                /**
+                 * Gets the staging area of the memory object, with a region for each chunk, or NULL if the copies are not staged
+                 */
+                StagingArea* getStagingArea();
+                void copyChunkInAsync(unsigned int chunk, size_t offset, size_t length, CUstream cudaStream);
+                void copyChunkOutAsync(unsigned int chunk, size_t offset, size_t length, CUstream cudaStream);
 
             public:
                 ChunkedMemoryObject(Device* device, unsigned int chunks, size_t chunkSize, void** hostPointers, bool readOnly, bool writeOnly);
@@ -220,6 +335,11 @@ namespace GSPar {
                 virtual void copyOut(unsigned int chunk);
                 virtual void copyInAsync(unsigned int chunk, ExecutionFlow* executionFlow = NULL);
                 virtual void copyOutAsync(unsigned int chunk, ExecutionFlow* executionFlow = NULL);
+                // Copy a range of bytes, counted across the chunks
+                virtual void copyIn(size_t offset, size_t length) override;
+                virtual void copyOut(size_t offset, size_t length) override;
+                virtual void copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
+                virtual void copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
             };
 
             ///// StreamElement /////
@@ -249,7 +369,10 @@ namespace GSPar {
                 static const std::string ATOMIC_ADD_POLYFILL;
                 const std::string getKernelPrefix() override;
                 std::string generateStdFunctions() override;
-                std::string replaceMacroKeywords(std::string kernelSource) override;
+                /**
+                 * Declarations of the functions of generateStdFunctions, for kernels linked with the GSPar runtime
+                 */
+                std::string generateStdFunctionDeclarations(bool atomicAddPolyfill = false);
                 std::string generateInitKernel(Pattern::BaseParallelPattern* pattern, Dimensions dims) override;
                 std::string generateParams(Pattern::BaseParallelPattern* pattern, Dimensions dims) override;
                 std::string generateStdVariables(Pattern::BaseParallelPattern* pattern, Dimensions dims) override;
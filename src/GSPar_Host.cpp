@@ -0,0 +1,1585 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <regex>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <tuple>
+#include <dlfcn.h>
+#include <unistd.h>
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#include <ucontext.h>
+#endif
+
+#include "GSPar_Host.hpp"
+#include "GSPar_KernelCache.hpp"
+
+using namespace GSPar::Driver::Host;
+
+
+///// Exception /////
+
+std::string Exception::getErrorString(int code) {
+    return std::string(strerror(code));
+}
+Exception::Exception(std::string msg, std::string details) : BaseException(msg, details) { }
+Exception::Exception(int code, std::string details) : BaseException(code, details) {
+    // Can't call this virtual function in the base constructor
+    this->msg = this->getErrorString(code);
+}
+Exception* Exception::checkError(int code, std::string details) {
+    return BaseException::checkError<Exception>(code, 0, details);
+}
+void Exception::throwIfFailed(int code, std::string details) {
+    BaseException::throwIfFailed<Exception>(code, 0, details);
+}
+
+
+///// ThreadPool /////
+
+namespace {
+    // Pool and index of the worker running in the current thread, so tasks submitted
+    // by a worker go to its own deque and a waiting worker can keep running tasks
+    thread_local ThreadPool* currentWorkerPool = nullptr;
+    thread_local int currentWorkerIndex = -1;
+}
+
+ThreadPool::ThreadPool(unsigned int numThreads) : nextQueue(0) {
+    if (numThreads == 0) {
+        numThreads = 1;
+    }
+    for (unsigned int i = 0; i < numThreads; i++) {
+        this->queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+    }
+    for (unsigned int i = 0; i < numThreads; i++) {
+        this->workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->sleepMutex); // Auto-unlock, RAII
+        this->stopping = true;
+        // Auto-unlock of sleepMutex, RAII
+    }
+    this->sleepCondition.notify_all();
+    for (auto &worker : this->workers) {
+        worker.join();
+    }
+}
+unsigned int ThreadPool::getThreadCount() {
+    return this->workers.size();
+}
+void ThreadPool::submit(std::function<void()> task) {
+    unsigned int queueIndex;
+    if (currentWorkerPool == this) {
+        queueIndex = currentWorkerIndex;
+    } else {
+        queueIndex = this->nextQueue++ % this->queues.size();
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->queues[queueIndex]->mutex); // Auto-unlock, RAII
+        this->queues[queueIndex]->tasks.push_back(std::move(task));
+        // Auto-unlock of the worker queue mutex, RAII
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->sleepMutex); // Auto-unlock, RAII
+        this->pendingTasks++;
+        // Auto-unlock of sleepMutex, RAII
+    }
+    this->sleepCondition.notify_one();
+}
+bool ThreadPool::runPendingTask(int workerIndex) {
+    std::function<void()> task;
+    int numQueues = this->queues.size();
+    if (workerIndex >= 0) { // Workers pop the most recent task from their own deque
+        std::lock_guard<std::mutex> lock(this->queues[workerIndex]->mutex); // Auto-unlock, RAII
+        auto &tasks = this->queues[workerIndex]->tasks;
+        if (!tasks.empty()) {
+            task = std::move(tasks.back());
+            tasks.pop_back();
+        }
+        // Auto-unlock of the worker queue mutex, RAII
+    }
+    // And steal the oldest task of the other workers' deques
+    for (int i = 1; !task && i <= numQueues; i++) {
+        int victim = (workerIndex + i) % numQueues;
+        if (victim == workerIndex) continue;
+        std::lock_guard<std::mutex> lock(this->queues[victim]->mutex); // Auto-unlock, RAII
+        auto &tasks = this->queues[victim]->tasks;
+        if (!tasks.empty()) {
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        // Auto-unlock of the worker queue mutex, RAII
+    }
+    if (!task) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->sleepMutex); // Auto-unlock, RAII
+        this->pendingTasks--;
+        // Auto-unlock of sleepMutex, RAII
+    }
+    task();
+    return true;
+}
+void ThreadPool::workerLoop(unsigned int workerIndex) {
+    currentWorkerPool = this;
+    currentWorkerIndex = workerIndex;
+    while (true) {
+        if (this->runPendingTask(workerIndex)) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(this->sleepMutex);
+        this->sleepCondition.wait(lock, [this] { return this->pendingTasks > 0 || this->stopping; });
+        if (this->stopping && this->pendingTasks <= 0) {
+            return;
+        }
+    }
+}
+void ThreadPool::parallelFor(size_t count, size_t grainSize, std::function<void(size_t, size_t)> body) {
+    if (count == 0) {
+        return;
+    }
+    if (grainSize == 0) {
+        grainSize = 1;
+    }
+
+    struct ParallelForState {
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t remainingTasks;
+        std::exception_ptr failure;
+    };
+    auto state = std::make_shared<ParallelForState>();
+    auto sharedBody = std::make_shared<std::function<void(size_t, size_t)>>(std::move(body));
+    state->remainingTasks = (count + grainSize - 1) / grainSize;
+
+    for (size_t from = 0; from < count; from += grainSize) {
+        size_t to = std::min(count, from + grainSize);
+        this->submit([state, sharedBody, from, to]() {
+            std::exception_ptr failure;
+            try {
+                (*sharedBody)(from, to);
+            } catch (...) {
+                failure = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(state->mutex); // Auto-unlock, RAII
+            if (failure && !state->failure) {
+                state->failure = failure;
+            }
+            if (--state->remainingTasks == 0) {
+                state->finished.notify_all();
+            }
+            // Auto-unlock of state mutex, RAII
+        });
+    }
+
+    // The calling thread helps running the tasks instead of just blocking
+    int workerIndex = (currentWorkerPool == this) ? currentWorkerIndex : -1;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex); // Auto-unlock, RAII
+            if (state->remainingTasks == 0) break;
+            // Auto-unlock of state mutex, RAII
+        }
+        if (!this->runPendingTask(workerIndex)) {
+            // Every remaining task is already running in some worker
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->finished.wait(lock, [&state] { return state->remainingTasks == 0; });
+            break;
+        }
+    }
+    if (state->failure) {
+        std::rethrow_exception(state->failure);
+    }
+}
+
+
+///// CommandQueue /////
+
+CommandQueue::CommandQueue() {
+    this->thread = std::thread(&CommandQueue::run, this);
+}
+CommandQueue::~CommandQueue() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex); // Auto-unlock, RAII
+        this->stopping = true;
+        // Auto-unlock of mutex, RAII
+    }
+    this->commandAvailable.notify_all();
+    // The commands still enqueued are run before the thread finishes
+    this->thread.join();
+}
+void CommandQueue::run() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        this->commandAvailable.wait(lock, [this] { return !this->commands.empty() || this->stopping; });
+        if (this->commands.empty()) {
+            return; // Stopping
+        }
+        std::function<void()> command = std::move(this->commands.front());
+        this->commands.pop_front();
+        this->busy = true;
+        lock.unlock();
+
+        std::exception_ptr failure;
+        try {
+            command();
+        } catch (...) {
+            failure = std::current_exception();
+        }
+
+        lock.lock();
+        if (failure && !this->failure) {
+            this->failure = failure;
+        }
+        this->busy = false;
+        if (this->commands.empty()) {
+            this->queueDrained.notify_all();
+        }
+    }
+}
+void CommandQueue::enqueue(std::function<void()> command) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex); // Auto-unlock, RAII
+        this->commands.push_back(std::move(command));
+        // Auto-unlock of mutex, RAII
+    }
+    this->commandAvailable.notify_one();
+}
+void CommandQueue::synchronize() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->queueDrained.wait(lock, [this] { return this->commands.empty() && !this->busy; });
+    if (this->failure) {
+        std::exception_ptr failure = this->failure;
+        this->failure = nullptr;
+        std::rethrow_exception(failure);
+    }
+}
+bool CommandQueue::isDrained() {
+    std::lock_guard<std::mutex> lock(this->mutex); // Auto-unlock, RAII
+    return this->commands.empty() && !this->busy;
+}
+
+
+///// Program /////
+
+Program::Program(void* libraryHandle, bool usingLocalSynchronization) {
+    this->libraryHandle = libraryHandle;
+    this->usingLocalSynchronization = usingLocalSynchronization;
+}
+Program::~Program() {
+    if (this->libraryHandle) {
+        dlclose(this->libraryHandle); // We don't throw exceptions on destructors
+        this->libraryHandle = nullptr;
+    }
+}
+void* Program::loadSymbol(const std::string symbolName) {
+    dlerror(); // Clears any previous error
+    void* symbol = dlsym(this->libraryHandle, symbolName.c_str());
+    if (!symbol) {
+        const char* error = dlerror();
+        throw Exception("Symbol " + symbolName + " not found in the compiled kernel library", error ? std::string(error) : defaultExceptionDetails());
+    }
+    return symbol;
+}
+KernelEntry Program::getBlockEntry(const std::string kernelName) {
+    return reinterpret_cast<KernelEntry>(this->loadSymbol("gspar_block_" + kernelName));
+}
+KernelEntry Program::getItemEntry(const std::string kernelName) {
+    return reinterpret_cast<KernelEntry>(this->loadSymbol("gspar_item_" + kernelName));
+}
+unsigned int Program::getParameterCount(const std::string kernelName) {
+    return *static_cast<const unsigned int*>(this->loadSymbol("gspar_param_count_" + kernelName));
+}
+
+
+///// ExecutionFlow /////
+
+ExecutionFlow::ExecutionFlow() : BaseExecutionFlow() { }
+ExecutionFlow::ExecutionFlow(Device* device) : BaseExecutionFlow(device) { }
+ExecutionFlow::~ExecutionFlow() {
+    if (this->flowObject) {
+        #ifdef GSPAR_DEBUG
+            std::stringstream ss; // Using stringstream eases multi-threaded debugging
+            ss << "[GSPar Execution Flow " << this << "] clearing command queue" << std::endl;
+            std::cout << ss.str();
+            ss.str("");
+        #endif
+        // The pending commands are run before the queue is destroyed
+        delete this->flowObject;
+        this->flowObject = NULL;
+    }
+}
+CommandQueue* ExecutionFlow::start() {
+    if (!this->device) {
+        // Can't start flow on a NULL device
+        throw Exception("A device is required to start an execution flow", defaultExceptionDetails());
+    }
+    if (!this->flowObject) {
+        this->device->getContext(); // Starts the thread pool
+        this->setBaseFlowObject(new CommandQueue());
+    }
+    return this->getBaseFlowObject();
+}
+void ExecutionFlow::synchronize() {
+    if (this->flowObject) {
+        this->flowObject->synchronize();
+    }
+}
+bool ExecutionFlow::isFinished() {
+    // Failures of the commands are rethrown by synchronize
+    return !this->flowObject || this->flowObject->isDrained();
+}
+CommandQueue* ExecutionFlow::checkAndStartFlow(Device* device, ExecutionFlow* executionFlow) {
+    return BaseExecutionFlow::checkAndStartFlow(device, executionFlow);
+}
+
+
+///// AsyncExecutionSupport /////
+
+AsyncExecutionSupport::AsyncExecutionSupport(CommandQueue* asyncObj) : BaseAsyncExecutionSupport(asyncObj) { }
+void AsyncExecutionSupport::waitAsync() {
+    if (this->asyncObject) {
+        this->asyncObject->synchronize();
+        this->runningAsync = false;
+    }
+};
+// static
+void AsyncExecutionSupport::waitAllAsync(std::initializer_list<AsyncExecutionSupport*> asyncs) {
+    for (auto async : asyncs) {
+        async->waitAsync();
+    }
+}
+
+
+///// Instance /////
+
+Instance *Instance::instance = nullptr;
+
+void Instance::loadGpuList() {
+    this->init();
+    this->clearGpuList();
+
+    this->devices.push_back(new Device(std::thread::hardware_concurrency()));
+}
+
+Instance::Instance() : BaseInstance(Runtime::GSPAR_RT_HOST) { }
+Instance::~Instance() {
+    Instance::instance = nullptr;
+}
+Instance* Instance::getInstance() {
+    // TODO implement thread-safety
+    if (!instance) {
+        instance = new Instance();
+    }
+    return instance;
+}
+
+void Instance::init() {
+    this->instanceInitiated = true;
+}
+
+unsigned int Instance::getGpuCount() {
+    this->init();
+    return 1;
+}
+
+
+///// Device /////
+
+Device::Device() : BaseDevice() {
+    this->threadCount = std::thread::hardware_concurrency();
+}
+Device::Device(unsigned int threadCount) {
+    // hardware_concurrency() returns 0 when it can't detect the number of threads
+    this->threadCount = threadCount ? threadCount : 1;
+}
+Device::~Device() {
+    // We don't throw exceptions on destructors
+#ifdef GSPAR_DEBUG
+    std::cout << "[GSPar Device " << this << "] Destructing";
+#endif
+    if (this->defaultExecutionFlow) {
+        delete this->defaultExecutionFlow;
+        this->defaultExecutionFlow = NULL;
+    }
+    if (this->libContext) {
+        delete this->libContext; // Joins the workers
+        this->libContext = NULL;
+    }
+#ifdef GSPAR_DEBUG
+    std::cout << "[GSPar Device " << this << "] Destructed successfully";
+#endif
+}
+std::string Device::readCpuInfo(const std::string field) {
+    std::ifstream cpuInfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuInfo, line)) {
+        if (line.compare(0, field.length(), field) == 0) {
+            size_t separator = line.find(':');
+            if (separator != std::string::npos) {
+                size_t begin = line.find_first_not_of(" \t", separator + 1);
+                return begin == std::string::npos ? "" : line.substr(begin);
+            }
+        }
+    }
+    return "";
+}
+ExecutionFlow* Device::getDefaultExecutionFlow() {
+    std::lock_guard<std::mutex> lock(this->defaultExecutionFlowMutex); // Auto-unlock, RAII
+    if (!this->defaultExecutionFlow) {
+        this->defaultExecutionFlow = new ExecutionFlow(this);
+    }
+    return this->defaultExecutionFlow;
+    // Auto-unlock of defaultExecutionFlowMutex, RAII
+}
+ThreadPool* Device::getContext() {
+    if (!this->libContext) {
+        std::lock_guard<std::mutex> lock(this->libContextMutex); // Auto-unlock, RAII
+        if (!this->libContext) { // Check if someone changed it while we were waiting for the lock
+            this->setContext(new ThreadPool(this->threadCount));
+        }
+        // Auto-unlock of libContextMutex, RAII
+    }
+    return this->libContext;
+}
+CommandQueue* Device::startDefaultExecutionFlow() {
+    return this->getDefaultExecutionFlow()->start();
+}
+const std::string Device::getName() {
+    std::string name = this->readCpuInfo("model name");
+    if (name.empty()) {
+        name = "Host CPU";
+    }
+    return name;
+}
+unsigned int Device::getComputeUnitsCount() {
+    return this->threadCount;
+}
+unsigned int Device::getWarpSize() {
+    // Each work-item runs alone in a host thread
+    return 1;
+}
+unsigned int Device::getMaxThreadsPerBlock() {
+    return GSPAR_HOST_MAX_THREADS_PER_BLOCK;
+}
+unsigned long Device::getGlobalMemorySizeBytes() {
+    return (unsigned long)sysconf(_SC_PHYS_PAGES) * (unsigned long)sysconf(_SC_PAGE_SIZE);
+}
+unsigned long Device::getLocalMemorySizeBytes() {
+    // Block-shared memory is allocated per block in the host thread running it, so the
+    // L2 cache size is the amount that keeps it as fast as shared memory is supposed to be
+    long cacheSize = 0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    cacheSize = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    return cacheSize > 0 ? cacheSize : 256 * 1024;
+}
+unsigned long Device::getSharedMemoryPerComputeUnitSizeBytes() {
+    return this->getLocalMemorySizeBytes();
+}
+unsigned int Device::getClockRateMHz() {
+    return (unsigned int)atof(this->readCpuInfo("cpu MHz").c_str());
+}
+bool Device::isIntegratedMainMemory() {
+    return true;
+}
+MemoryObject* Device::malloc(long size, void* hostPtr, bool readOnly, bool writeOnly) {
+    return new MemoryObject(this, size, hostPtr, readOnly, writeOnly);
+}
+MemoryObject* Device::malloc(long size, const void* hostPtr) {
+    return new MemoryObject(this, size, hostPtr);
+}
+ChunkedMemoryObject* Device::mallocChunked(unsigned int chunks, long chunkSize, void** hostPointers, bool readOnly, bool writeOnly) {
+    return new ChunkedMemoryObject(this, chunks, chunkSize, hostPointers, readOnly, writeOnly);
+}
+ChunkedMemoryObject* Device::mallocChunked(unsigned int chunks, long chunkSize, const void** hostPointers) {
+    return new ChunkedMemoryObject(this, chunks, chunkSize, hostPointers);
+}
+std::vector<std::string> Device::getCompilerFlags(const CompilerOptions& compilerOptions) {
+    std::vector<std::string> flags;
+    for (auto option : compilerOptions.options) {
+        switch (option) {
+            case GSPAR_COMPILER_FAST_MATH:
+                flags.push_back("-ffast-math");
+                break;
+            case GSPAR_COMPILER_MAD_ENABLE:
+                flags.push_back("-ffp-contract=fast");
+                break;
+            case GSPAR_COMPILER_DISABLE_OPTIMIZATIONS:
+                flags.push_back("-O0"); // Overrides the level in GSPAR_HOST_COMPILER_FLAGS
+                break;
+        }
+    }
+    for (auto& definition : compilerOptions.definitions) {
+        flags.push_back("-D" + definition);
+    }
+    flags.insert(flags.end(), compilerOptions.nativeOptions.begin(), compilerOptions.nativeOptions.end());
+    return flags;
+}
+Kernel* Device::prepareKernel(const std::string kernelSource, const std::string kernelName, const CompilerOptions& compilerOptions) {
+    return new Kernel(this, kernelSource, kernelName, compilerOptions);
+}
+std::vector<Kernel*> Device::prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames, const CompilerOptions& compilerOptions) {
+    auto program = this->getProgram(kernelSource, kernelNames, compilerOptions);
+
+    std::vector<Kernel*> kernels;
+    for (auto name : kernelNames) {
+        kernels.push_back(new Kernel(this, program, name));
+    }
+    return kernels;
+}
+std::shared_ptr<Program> Device::getProgram(std::string source, const std::vector<std::string> kernelNames, const CompilerOptions& compilerOptions) {
+    std::string normalizedSource = ProgramCache<std::shared_ptr<Program>>::normalizeSource(source);
+    // Entry points are generated only for the requested kernels and the same source built with other flags is another program,
+    // so both are part of the key
+    std::vector<std::string> compilerFlags = this->getCompilerFlags(compilerOptions);
+    std::string key = normalizedSource;
+    for (auto& name : kernelNames) {
+        key += "\n// " + name;
+    }
+    for (auto& flag : compilerFlags) {
+        key += "\n// " + flag;
+    }
+    return this->programCache.getOrCompile(key, [this, &normalizedSource, &kernelNames, &compilerFlags]() {
+        return this->compileHostProgram(normalizedSource, kernelNames, compilerFlags);
+    });
+}
+namespace {
+
+    /**
+     * Removes the precompiled GSPar runtime headers when the process exits.
+     * Devices are usually never destructed, as the driver instance lives until the end of the process.
+     */
+    struct RuntimeHeaderFiles {
+        std::mutex pathsMutex;
+        std::vector<std::string> paths;
+
+        void add(const std::string headerPath) {
+            std::lock_guard<std::mutex> lock(this->pathsMutex); // Auto-unlock, RAII
+            this->paths.push_back(headerPath);
+        }
+        ~RuntimeHeaderFiles() {
+            for (auto& headerPath : this->paths) {
+                unlink((headerPath + ".gch").c_str());
+                unlink(headerPath.c_str());
+                rmdir(headerPath.substr(0, headerPath.rfind('/')).c_str());
+            }
+        }
+    };
+    RuntimeHeaderFiles runtimeHeaderFiles;
+
+}
+
+std::string Device::getRuntimeHeader(const std::string extraFlags) {
+    return this->runtimeHeaderCache.getOrCompile(extraFlags, [this, &extraFlags]() {
+        char workDirTemplate[] = GSPAR_HOST_TMP_DIR "/gspar_runtime_XXXXXX";
+        if (!mkdtemp(workDirTemplate)) {
+            throw Exception(errno, "Failed to create a temporary directory in " GSPAR_HOST_TMP_DIR " - " + defaultExceptionDetails());
+        }
+        std::string headerPath = std::string(workDirTemplate) + "/gspar_runtime.h";
+        runtimeHeaderFiles.add(headerPath);
+        std::ofstream headerFile(headerPath);
+        KernelGenerator* kernelGenerator = Instance::getInstance()->getKernelGenerator();
+        headerFile << kernelGenerator->generateMacroDefinitions() << kernelGenerator->generateStdFunctions();
+        headerFile.close();
+        if (headerFile.fail()) {
+            throw Exception("Failed to write GSPar runtime to " + headerPath, defaultExceptionDetails());
+        }
+
+        // The precompiled header is only used with the same flags it was built with, so they are the kernels' ones.
+        // If it can't be built, the compiler simply parses the header itself
+        std::string command = std::string(GSPAR_HOST_COMPILER) + " " + GSPAR_HOST_COMPILER_FLAGS + extraFlags +
+            " -x c++-header -o \"" + headerPath + ".gch\" \"" + headerPath + "\" > /dev/null 2>&1";
+
+#ifdef GSPAR_DEBUG
+        std::stringstream ss; // Using stringstream eases multi-threaded debugging
+        ss << "[GSPar Device " << this << "] Precompiling GSPar runtime with: " << command << std::endl;
+        std::cout << ss.str();
+#endif
+
+        if (std::system(command.c_str()) != 0) {
+            unlink((headerPath + ".gch").c_str());
+        }
+        return headerPath;
+    });
+}
+std::shared_ptr<Program> Device::compileHostProgram(std::string source, const std::vector<std::string> kernelNames, const std::vector<std::string> compilerFlags) {
+#ifdef GSPAR_DEBUG
+    std::stringstream ss; // Using stringstream eases multi-threaded debugging
+    ss << "[GSPar Device " << this << "] Kernel received to compile: \n" << source << std::endl;
+    std::cout << ss.str();
+    ss.str("");
+#endif
+
+    // --------------------------------------------------------------------
+    // Appending additional routines to the kernel source
+    // --------------------------------------------------------------------
+    // Each flag is single-quoted for the shell, so definitions may have spaces and parentheses
+    std::string extraFlags;
+    for (auto& flag : compilerFlags) {
+        std::string quotedFlag = flag;
+        for (size_t pos = quotedFlag.find('\''); pos != std::string::npos; pos = quotedFlag.find('\'', pos + 4)) {
+            quotedFlag.replace(pos, 1, "'\\''");
+        }
+        extraFlags += " '" + quotedFlag + "'";
+    }
+
+    KernelGenerator* kernelGenerator = Instance::getInstance()->getKernelGenerator();
+    source = kernelGenerator->replaceMacroKeywords(source);
+    std::string runtimeSource = kernelGenerator->generateMacroDefinitions() + kernelGenerator->generateStdFunctions();
+    std::string completeKernelSource = "";
+#if GSPAR_LINK_DEVICE_RUNTIME
+    // The runtime comes from a header precompiled once, included by the command line
+    std::string runtimeHeaderPath = this->getRuntimeHeader(extraFlags);
+#else
+    completeKernelSource.append(runtimeSource);
+#endif
+    completeKernelSource.append(source);
+    for (auto name : kernelNames) {
+        completeKernelSource.append(kernelGenerator->generateEntryPoints(source, name));
+    }
+
+#ifdef GSPAR_DEBUG
+    ss << "[GSPar Device " << this << "] Complete kernel for compilation: \n" << completeKernelSource << std::endl;
+    std::cout << ss.str();
+    ss.str("");
+#endif
+
+    // --------------------------------------------------------------------
+    // Compiling the kernel into a shared library with the system compiler
+    // --------------------------------------------------------------------
+    char workDirTemplate[] = GSPAR_HOST_TMP_DIR "/gspar_XXXXXX";
+    if (!mkdtemp(workDirTemplate)) {
+        throw Exception(errno, "Failed to create a temporary directory in " GSPAR_HOST_TMP_DIR " - " + defaultExceptionDetails());
+    }
+    std::string workDir(workDirTemplate);
+    std::string sourcePath = workDir + "/kernel.cpp";
+    std::string libraryPath = workDir + "/kernel.so";
+    std::string logPath = workDir + "/build.log";
+    auto removeWorkDir = [&]() {
+        unlink(sourcePath.c_str());
+        unlink(libraryPath.c_str());
+        unlink(logPath.c_str());
+        rmdir(workDir.c_str());
+    };
+
+    // Tries to reuse the library compiled by a previous execution
+    KernelBinaryCache* cache = KernelBinaryCache::getInstance();
+    std::string cacheKey = KernelBinaryCache::computeKey({ "host", runtimeSource, completeKernelSource, GSPAR_HOST_COMPILER, GSPAR_HOST_COMPILER_FLAGS, extraFlags, this->getName() });
+    std::vector<char> binary;
+    if (cache->load(cacheKey, binary)) {
+        std::ofstream libraryFile(libraryPath, std::ios::binary);
+        libraryFile.write(binary.data(), binary.size());
+        libraryFile.close();
+        if (libraryFile.fail()) {
+            removeWorkDir();
+            throw Exception("Failed to write cached kernel library to " + libraryPath, defaultExceptionDetails());
+        }
+    } else {
+        std::ofstream sourceFile(sourcePath);
+        sourceFile << completeKernelSource;
+        sourceFile.close();
+        if (sourceFile.fail()) {
+            removeWorkDir();
+            throw Exception("Failed to write kernel source to " + sourcePath, defaultExceptionDetails());
+        }
+
+        std::string command = std::string(GSPAR_HOST_COMPILER) + " " + GSPAR_HOST_COMPILER_FLAGS + extraFlags +
+#if GSPAR_LINK_DEVICE_RUNTIME
+            " -include \"" + runtimeHeaderPath + "\"" +
+#endif
+            " -o \"" + libraryPath + "\" \"" + sourcePath + "\" > \"" + logPath + "\" 2>&1";
+
+#ifdef GSPAR_DEBUG
+        ss << "[GSPar Device " << this << "] Compiling kernel with: " << command << std::endl;
+        std::cout << ss.str();
+        ss.str("");
+#endif
+
+        if (std::system(command.c_str()) != 0) {
+            std::ifstream logFile(logPath);
+            std::stringstream log;
+            log << logFile.rdbuf();
+            removeWorkDir();
+            throw Exception("Failed to compile kernel with " GSPAR_HOST_COMPILER, defaultExceptionDetails() + "\n" + log.str());
+        }
+
+        if (cache->isEnabled()) {
+            std::ifstream libraryFile(libraryPath, std::ios::binary);
+            binary.assign(std::istreambuf_iterator<char>(libraryFile), std::istreambuf_iterator<char>());
+            cache->store(cacheKey, binary.data(), binary.size());
+        }
+    }
+
+    void* libraryHandle = dlopen(libraryPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+    std::string loadError = libraryHandle ? "" : std::string(dlerror());
+    removeWorkDir(); // The library remains mapped after its file is removed
+    if (!libraryHandle) {
+        throw Exception("Failed to load compiled kernel library", defaultExceptionDetails() + "\n" + loadError);
+    }
+
+    bool usingLocalSynchronization = source.find(KernelGenerator::SYNCHRONIZE_FUNCTION) != std::string::npos;
+    return std::make_shared<Program>(libraryHandle, usingLocalSynchronization);
+}
+
+
+///// Kernel /////
+
+namespace {
+
+#if defined(__x86_64__) || defined(__aarch64__)
+    /**
+     * Saves the callee-saved registers of the running fiber in its stack, stores its stack pointer in fromStack
+     * and resumes the fiber suspended in toStack. Unlike swapcontext, it doesn't save the signal mask, which costs a system call.
+     */
+    extern "C" __attribute__((visibility("hidden"))) void gspar_host_fiber_switch(void** fromStack, void* toStack);
+    #if defined(__x86_64__)
+    // The floating-point control words are saved too, below the System V callee-saved registers
+    asm(
+        ".text \n"
+        ".p2align 4 \n"
+        ".globl gspar_host_fiber_switch \n"
+        ".hidden gspar_host_fiber_switch \n"
+        ".type gspar_host_fiber_switch, @function \n"
+        "gspar_host_fiber_switch: \n"
+        "    pushq %rbp \n"
+        "    pushq %rbx \n"
+        "    pushq %r12 \n"
+        "    pushq %r13 \n"
+        "    pushq %r14 \n"
+        "    pushq %r15 \n"
+        "    subq $8, %rsp \n"
+        "    stmxcsr (%rsp) \n"
+        "    fnstcw 4(%rsp) \n"
+        "    movq %rsp, (%rdi) \n"
+        "    movq %rsi, %rsp \n"
+        "    ldmxcsr (%rsp) \n"
+        "    fldcw 4(%rsp) \n"
+        "    addq $8, %rsp \n"
+        "    popq %r15 \n"
+        "    popq %r14 \n"
+        "    popq %r13 \n"
+        "    popq %r12 \n"
+        "    popq %rbx \n"
+        "    popq %rbp \n"
+        "    ret \n"
+        ".size gspar_host_fiber_switch, .-gspar_host_fiber_switch \n"
+    );
+    const size_t FIBER_FRAME_BYTES = 72; // Control words, 6 registers, the address of entry and its return address
+    #else
+    // x19-x29, the link register (x30) and the low halves of v8-v15 (d8-d15) are callee-saved in AAPCS64
+    asm(
+        ".text \n"
+        ".p2align 4 \n"
+        ".globl gspar_host_fiber_switch \n"
+        ".hidden gspar_host_fiber_switch \n"
+        ".type gspar_host_fiber_switch, %function \n"
+        "gspar_host_fiber_switch: \n"
+        "    sub sp, sp, #160 \n"
+        "    stp x19, x20, [sp, #0] \n"
+        "    stp x21, x22, [sp, #16] \n"
+        "    stp x23, x24, [sp, #32] \n"
+        "    stp x25, x26, [sp, #48] \n"
+        "    stp x27, x28, [sp, #64] \n"
+        "    stp x29, x30, [sp, #80] \n"
+        "    stp d8, d9, [sp, #96] \n"
+        "    stp d10, d11, [sp, #112] \n"
+        "    stp d12, d13, [sp, #128] \n"
+        "    stp d14, d15, [sp, #144] \n"
+        "    mov x2, sp \n"
+        "    str x2, [x0] \n"
+        "    mov sp, x1 \n"
+        "    ldp x19, x20, [sp, #0] \n"
+        "    ldp x21, x22, [sp, #16] \n"
+        "    ldp x23, x24, [sp, #32] \n"
+        "    ldp x25, x26, [sp, #48] \n"
+        "    ldp x27, x28, [sp, #64] \n"
+        "    ldp x29, x30, [sp, #80] \n"
+        "    ldp d8, d9, [sp, #96] \n"
+        "    ldp d10, d11, [sp, #112] \n"
+        "    ldp d12, d13, [sp, #128] \n"
+        "    ldp d14, d15, [sp, #144] \n"
+        "    add sp, sp, #160 \n"
+        "    ret \n"
+        ".size gspar_host_fiber_switch, .-gspar_host_fiber_switch \n"
+    );
+    const size_t FIBER_FRAME_BYTES = 160;
+    #endif
+
+    /**
+     * Stack pointer of a suspended fiber
+     */
+    typedef void* FiberContext;
+
+    void switchFiber(FiberContext& from, FiberContext& to) {
+        gspar_host_fiber_switch(&from, to);
+    }
+
+    /**
+     * Prepares a fiber that calls entry, which must never return, when it is first switched to
+     */
+    void startFiber(FiberContext& context, char* stack, size_t stackBytes, void (*entry)()) {
+        uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + stackBytes) & ~static_cast<uintptr_t>(15);
+        #if defined(__x86_64__)
+            // The last slot is the return address of entry, which is never used, so entry starts with the alignment of a call
+            uint64_t* frame = reinterpret_cast<uint64_t*>(top - FIBER_FRAME_BYTES);
+            memset(frame, 0, FIBER_FRAME_BYTES);
+            uint32_t* controlWords = reinterpret_cast<uint32_t*>(frame);
+            controlWords[0] = 0x1F80; // Default MXCSR
+            controlWords[1] = 0x037F; // Default x87 control word
+            frame[7] = reinterpret_cast<uint64_t>(entry); // Popped by ret
+        #else
+            uint64_t* frame = reinterpret_cast<uint64_t*>(top - FIBER_FRAME_BYTES);
+            memset(frame, 0, FIBER_FRAME_BYTES);
+            frame[11] = reinterpret_cast<uint64_t>(entry); // x30, the link register used by ret
+        #endif
+        context = frame;
+    }
+#else
+    typedef ucontext_t FiberContext;
+
+    void switchFiber(FiberContext& from, FiberContext& to) {
+        swapcontext(&from, &to);
+    }
+
+    void startFiber(FiberContext& context, char* stack, size_t stackBytes, void (*entry)()) {
+        getcontext(&context);
+        context.uc_stack.ss_sp = stack;
+        context.uc_stack.ss_size = stackBytes;
+        context.uc_link = nullptr;
+        makecontext(&context, entry, 0);
+    }
+#endif
+
+    /**
+     * Work-items of a block that synchronize local threads run as coroutines (fibers) in the
+     * host thread running the block. Each one runs until it reaches gspar_synchronize_local_threads(),
+     * when it yields back to the scheduler, which only resumes them once all of them got there.
+     * The stacks are kept by each host thread, and x86-64 and AArch64 switch fibers without system calls.
+     */
+    struct FiberBlock {
+        FiberContext scheduler;
+        std::vector<FiberContext> contexts;
+        std::vector<WorkItem> items;
+        std::vector<bool> finished;
+        std::vector<std::unique_ptr<char[]>> stacks;
+        size_t current = 0;
+        KernelEntry entry = nullptr;
+        void** args = nullptr;
+    };
+    thread_local FiberBlock fiberBlock;
+
+    void fiberMain() {
+        FiberBlock& block = fiberBlock;
+        size_t index = block.current;
+        block.entry(block.args, &block.items[index]);
+        block.finished[index] = true;
+        switchFiber(block.contexts[index], block.scheduler); // Never resumed, the next block starts the fiber again
+    }
+
+    void fiberSynchronize(WorkItem* item) {
+        FiberBlock& block = fiberBlock;
+        switchFiber(block.contexts[block.current], block.scheduler);
+    }
+
+    void runBlockWithFibers(KernelEntry entry, void** args, WorkItem& blockItem) {
+        FiberBlock& block = fiberBlock;
+        size_t numItems = blockItem.localSize[0] * blockItem.localSize[1] * blockItem.localSize[2];
+        block.contexts.resize(numItems);
+        block.items.resize(numItems);
+        block.finished.assign(numItems, false);
+        while (block.stacks.size() < numItems) {
+            block.stacks.push_back(std::unique_ptr<char[]>(new char[GSPAR_HOST_FIBER_STACK_BYTES]));
+        }
+        block.entry = entry;
+        block.args = args;
+
+        for (size_t i = 0; i < numItems; i++) {
+            WorkItem& item = block.items[i];
+            item = blockItem;
+            item.localId[0] = i % blockItem.localSize[0];
+            item.localId[1] = (i / blockItem.localSize[0]) % blockItem.localSize[1];
+            item.localId[2] = i / (blockItem.localSize[0] * blockItem.localSize[1]);
+            for (int d = 0; d < SUPPORTED_DIMS; d++) {
+                item.globalId[d] = item.groupId[d] * item.localSize[d] + item.localId[d];
+            }
+            startFiber(block.contexts[i], block.stacks[i].get(), GSPAR_HOST_FIBER_STACK_BYTES, fiberMain);
+        }
+
+        size_t running = numItems;
+        while (running > 0) {
+            // Each round runs every work-item until its next synchronization point
+            for (size_t i = 0; i < numItems; i++) {
+                if (!block.finished[i]) {
+                    block.current = i;
+                    switchFiber(block.scheduler, block.contexts[i]);
+                    if (block.finished[i]) running--;
+                }
+            }
+        }
+    }
+
+    /**
+     * Everything a kernel execution needs, copied when it is enqueued
+     */
+    struct KernelLaunch {
+        std::shared_ptr<Program> program; // Keeps the library loaded
+        KernelEntry entry;
+        bool usingLocalSynchronization;
+        std::vector<KernelParameter> parameters;
+        unsigned int sharedMemoryBytes;
+        size_t numBlocks[SUPPORTED_DIMS];
+        size_t numThreads[SUPPORTED_DIMS];
+
+        void runBlocks(size_t from, size_t to) {
+            std::vector<void*> args;
+            for (auto &parameter : this->parameters) {
+                args.push_back(parameter.pointer ? parameter.pointer : (void*)parameter.value.data());
+            }
+            // Block-shared memory is the last parameter, such as in OpenCL
+            std::unique_ptr<unsigned char[]> sharedMemory;
+            void* sharedMemoryPtr = nullptr;
+            if (this->sharedMemoryBytes > 0) {
+                sharedMemory.reset(new unsigned char[this->sharedMemoryBytes]);
+                sharedMemoryPtr = sharedMemory.get();
+                args.push_back(&sharedMemoryPtr);
+            }
+
+            WorkItem blockItem;
+            memset(&blockItem, 0, sizeof(WorkItem));
+            for (int d = 0; d < SUPPORTED_DIMS; d++) {
+                blockItem.localSize[d] = this->numThreads[d];
+                blockItem.numGroups[d] = this->numBlocks[d];
+            }
+            blockItem.synchronize = this->usingLocalSynchronization ? fiberSynchronize : nullptr;
+
+            for (size_t b = from; b < to; b++) {
+                blockItem.groupId[0] = b % this->numBlocks[0];
+                blockItem.groupId[1] = (b / this->numBlocks[0]) % this->numBlocks[1];
+                blockItem.groupId[2] = b / (this->numBlocks[0] * this->numBlocks[1]);
+                if (this->usingLocalSynchronization) {
+                    runBlockWithFibers(this->entry, args.data(), blockItem);
+                } else {
+                    this->entry(args.data(), &blockItem);
+                }
+            }
+        }
+
+        void run(ThreadPool* pool) {
+            size_t totalBlocks = this->numBlocks[0] * this->numBlocks[1] * this->numBlocks[2];
+            // A few tasks per worker, so the faster ones can steal from the slower
+            size_t grainSize = totalBlocks / (pool->getThreadCount() * 4);
+            pool->parallelFor(totalBlocks, grainSize, [this](size_t from, size_t to) {
+                this->runBlocks(from, to);
+            });
+        }
+    };
+
+}
+
+void Kernel::loadEntries(const std::string kernelName) {
+    this->blockEntry = this->program->getBlockEntry(kernelName);
+    this->itemEntry = this->program->getItemEntry(kernelName);
+    this->declaredParameterCount = this->program->getParameterCount(kernelName);
+}
+
+Kernel::Kernel() : BaseKernel() { }
+Kernel::Kernel(Device* device, const std::string kernelSource, const std::string kernelName, const CompilerOptions& compilerOptions) : BaseKernel(device, kernelSource, kernelName) {
+    this->program = this->device->getProgram(kernelSource, { kernelName }, compilerOptions);
+    this->loadEntries(kernelName);
+}
+Kernel::Kernel(Device* device, std::shared_ptr<Program> program, const std::string kernelName) : BaseKernel(device) {
+    this->kernelName = kernelName;
+    this->program = program;
+    this->loadEntries(kernelName);
+}
+Kernel::~Kernel() {
+#ifdef GSPAR_DEBUG
+    std::stringstream ss; // Using stringstream eases multi-threaded debugging
+    ss << "[GSPar Kernel " << this << "] Destructing..." << std::endl;
+    std::cout << ss.str();
+    ss.str("");
+#endif
+    if (this->isRunningAsync()) {
+        try {
+            this->waitAsync();
+        } catch (GSParException &ex) { // We don't throw exceptions on destructors
+            std::cerr << "Failed when waiting for kernel on Kernel's destructor: ";
+            std::cerr << ex.what() << " - " << ex.getDetails() << std::endl;
+        }
+    }
+}
+void Kernel::cloneInto(BaseKernelBase* baseOther) {
+    BaseKernel::cloneInto(baseOther);
+    Kernel* other = static_cast<Kernel*>(baseOther);
+    other->program = this->program;
+    other->blockEntry = this->blockEntry;
+    other->itemEntry = this->itemEntry;
+    other->declaredParameterCount = this->declaredParameterCount;
+    other->kernelParams = this->kernelParams;
+}
+int Kernel::setParameter(MemoryObject* memoryObject) {
+    this->kernelParams.push_back({ memoryObject->getBaseMemoryObject(), {} });
+    return ++this->parameterCount;
+}
+int Kernel::setParameter(ChunkedMemoryObject* chunkedMemoryObject) {
+    this->kernelParams.push_back({ chunkedMemoryObject->getBaseMemoryObject(), {} });
+    return ++this->parameterCount;
+}
+int Kernel::setParameter(size_t parmSize, void* parm) {
+    // Values are copied, so the kernel can be enqueued and run after the caller's variable is gone
+    unsigned char* bytes = static_cast<unsigned char*>(parm);
+    this->kernelParams.push_back({ nullptr, std::vector<unsigned char>(bytes, bytes + parmSize) });
+    return ++this->parameterCount;
+}
+int Kernel::setParameter(size_t parmSize, const void* parm) {
+    return this->setParameter(parmSize, const_cast<void*>(parm));
+}
+void Kernel::clearParameters() {
+    BaseKernel::clearParameters();
+    this->kernelParams.clear();
+}
+GSPar::Driver::Dimensions Kernel::getNumBlocksAndThreadsFor(Dimensions dims) {
+    unsigned int maxThreadsPerBlock = this->device->getMaxThreadsPerBlock();
+    size_t maxThreadsDimension[SUPPORTED_DIMS] = { maxThreadsPerBlock, maxThreadsPerBlock, maxThreadsPerBlock };
+    return this->getNumBlocksAndThreads(dims, maxThreadsPerBlock, maxThreadsDimension);
+}
+void Kernel::runAsync(Dimensions dims, ExecutionFlow* executionFlow) {
+    CommandQueue* queue = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
+
+    if (!dims.x) {
+        throw Exception("The first dimension is required to run a kernel");
+    }
+
+    unsigned int numParameters = this->kernelParams.size() + (this->sharedMemoryBytes > 0 ? 1 : 0);
+    if (numParameters != this->declaredParameterCount) {
+        throw Exception("Kernel " + this->kernelName + " declares " + std::to_string(this->declaredParameterCount) +
+            " parameters, but " + std::to_string(numParameters) + " were set", defaultExceptionDetails());
+    }
+
+    Dimensions blocksAndThreads = this->getNumBlocksAndThreadsFor(dims);
+
+    auto launch = std::make_shared<KernelLaunch>();
+    launch->program = this->program;
+    launch->usingLocalSynchronization = this->program->isUsingLocalSynchronization();
+    launch->entry = launch->usingLocalSynchronization ? this->itemEntry : this->blockEntry;
+    launch->parameters = this->kernelParams;
+    launch->sharedMemoryBytes = this->sharedMemoryBytes;
+    for (int d = 0; d < SUPPORTED_DIMS; d++) {
+        launch->numBlocks[d] = blocksAndThreads[d].min;
+        launch->numThreads[d] = blocksAndThreads[d].max;
+    }
+
+    #ifdef GSPAR_DEBUG
+        std::stringstream ss; // Using stringstream eases multi-threaded debugging
+        ss << "[GSPar Kernel " << this << "] Shall start " << dims.toString() << " threads: ";
+        ss << "starting (" << launch->numThreads[0] << "," << launch->numThreads[1] << "," << launch->numThreads[2] << ") threads ";
+        ss << "in (" << launch->numBlocks[0] << "," << launch->numBlocks[1] << "," << launch->numBlocks[2] << ") blocks ";
+        ss << "using " << this->sharedMemoryBytes << " bytes of shared memory in execution flow " << executionFlow << std::endl;
+        std::cout << ss.str();
+        ss.str("");
+    #endif
+
+    ThreadPool* pool = this->device->getContext();
+    queue->enqueue([launch, pool]() {
+        launch->run(pool);
+    });
+
+    this->setBaseAsyncObject(queue);
+
+    this->runningAsync = true;
+}
+
+
+///// MemoryObject /////
+
+/**
+ * Allocates device memory aligned to cache lines, so kernels can use vector instructions
+ */
+static void* allocAlignedMemory(size_t size) {
+    void* memory = nullptr;
+    throwExceptionIfFailed( posix_memalign(&memory, 64, size) );
+    return memory;
+}
+
+void MemoryObject::allocDeviceMemory() {
+    this->devicePtr = new void*; // It is initialized as NULL, we have to allocate space for it
+    this->allocatedSize = this->size;
+#if GSPAR_ZERO_COPY
+    // The host memory already is the memory of the device, it just has to be aligned as ours
+    if (this->hostPtr && isHostMemoryAligned(this->hostPtr, 64)) {
+        *this->devicePtr = this->hostPtr;
+        this->zeroCopy = true;
+        return;
+    }
+#endif
+    *this->devicePtr = this->device->getMemoryPool().allocate(this->size, 0, allocAlignedMemory);
+}
+
+MemoryObject::MemoryObject(Device* device, size_t size, void* hostPtr, bool readOnly, bool writeOnly) : BaseMemoryObject(device, size, hostPtr, readOnly, writeOnly) {
+    this->allocDeviceMemory();
+}
+MemoryObject::MemoryObject(Device* device, size_t size, const void* hostPtr) : BaseMemoryObject(device, size, hostPtr) {
+    this->allocDeviceMemory();
+}
+MemoryObject::~MemoryObject() {
+    if (this->devicePtr) {
+        if (!this->zeroCopy) {
+            this->device->getMemoryPool().release(*this->devicePtr, this->allocatedSize, 0);
+        }
+        delete this->devicePtr;
+        this->devicePtr = NULL;
+    }
+}
+void MemoryObject::bindTo(void* hostPtr) {
+    if (this->zeroCopy && hostPtr != this->hostPtr) {
+        // The previous host memory goes back to its owner, so the data moves to memory of our own
+        void* deviceMemory = this->device->getMemoryPool().allocate(this->allocatedSize, 0, allocAlignedMemory);
+        memcpy(deviceMemory, *this->devicePtr, this->allocatedSize);
+        *this->devicePtr = deviceMemory;
+        this->zeroCopy = false;
+    }
+    BaseMemoryObject::bindTo(hostPtr);
+}
+void MemoryObject::copyIn() {
+    this->copyIn(0, this->size);
+}
+void MemoryObject::copyOut() {
+    this->copyOut(0, this->size);
+}
+void MemoryObject::copyInAsync(ExecutionFlow* executionFlow) {
+    this->copyInAsync(0, this->size, executionFlow);
+}
+void MemoryObject::copyOutAsync(ExecutionFlow* executionFlow) {
+    this->copyOutAsync(0, this->size, executionFlow);
+}
+void MemoryObject::copyIn(size_t offset, size_t length) {
+    this->checkRange(offset, length, this->size);
+    if (*this->devicePtr != this->hostPtr) {
+        memcpy((unsigned char*)(*this->devicePtr) + offset, (unsigned char*)this->hostPtr + offset, length);
+    }
+}
+void MemoryObject::copyOut(size_t offset, size_t length) {
+    this->checkRange(offset, length, this->size);
+    if (*this->devicePtr != this->hostPtr) {
+        memcpy((unsigned char*)this->hostPtr + offset, (unsigned char*)(*this->devicePtr) + offset, length);
+    }
+}
+void MemoryObject::copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) {
+    this->checkRange(offset, length, this->size);
+    CommandQueue* queue = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
+    void* devicePtr = (unsigned char*)(*this->devicePtr) + offset;
+    void* hostPtr = (unsigned char*)this->hostPtr + offset;
+    if (devicePtr != hostPtr) {
+        queue->enqueue([devicePtr, hostPtr, length]() {
+            memcpy(devicePtr, hostPtr, length);
+        });
+    }
+    this->setBaseAsyncObject(queue);
+}
+void MemoryObject::copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) {
+    this->checkRange(offset, length, this->size);
+    CommandQueue* queue = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
+    void* devicePtr = (unsigned char*)(*this->devicePtr) + offset;
+    void* hostPtr = (unsigned char*)this->hostPtr + offset;
+    if (devicePtr != hostPtr) {
+        queue->enqueue([devicePtr, hostPtr, length]() {
+            memcpy(hostPtr, devicePtr, length);
+        });
+    }
+    this->setBaseAsyncObject(queue);
+}
+
+
+///// ChunkedMemoryObject /////
+
+void ChunkedMemoryObject::allocDeviceMemory() {
+    this->devicePtr = new void*; // It is initialized as NULL, we have to allocate space for it
+    *this->devicePtr = nullptr;
+    this->allocatedSize = this->getChunkSize() * this->chunks; // We allocate space for all the chunks
+    *this->devicePtr = this->device->getMemoryPool().allocate(this->allocatedSize, 0, allocAlignedMemory);
+}
+
+ChunkedMemoryObject::ChunkedMemoryObject(Device* device, unsigned int chunks, size_t chunkSize, void** hostPointers, bool readOnly, bool writeOnly) :
+        BaseChunkedMemoryObject(device, chunks, chunkSize, hostPointers, readOnly, writeOnly) {
+    this->allocDeviceMemory();
+}
+ChunkedMemoryObject::ChunkedMemoryObject(Device* device, unsigned int chunks, size_t chunkSize, const void** hostPointers) :
+        BaseChunkedMemoryObject(device, chunks, chunkSize, hostPointers) {
+    this->allocDeviceMemory();
+}
+ChunkedMemoryObject::~ChunkedMemoryObject() {
+    if (this->devicePtr) {
+        this->device->getMemoryPool().release(*this->devicePtr, this->allocatedSize, 0);
+        delete this->devicePtr;
+        this->devicePtr = NULL;
+    }
+}
+void ChunkedMemoryObject::copyIn() {
+    for (unsigned int chunk = 0; chunk < this->chunks; chunk++) {
+        this->copyIn(chunk);
+    }
+}
+void ChunkedMemoryObject::copyOut() {
+    for (unsigned int chunk = 0; chunk < this->chunks; chunk++) {
+        this->copyOut(chunk);
+    }
+}
+void ChunkedMemoryObject::copyInAsync(ExecutionFlow* executionFlow) {
+    for (unsigned int chunk = 0; chunk < this->chunks; chunk++) {
+        this->copyInAsync(chunk, executionFlow);
+    }
+}
+void ChunkedMemoryObject::copyOutAsync(ExecutionFlow* executionFlow) {
+    this->copyOutAsync(0, this->chunks * this->getChunkSize(), executionFlow);
+}
+void ChunkedMemoryObject::copyIn(unsigned int chunk) {
+    memcpy((unsigned char*)(*this->devicePtr) + (chunk * this->getChunkSize()), this->hostPointers[chunk], this->getChunkSize());
+}
+void ChunkedMemoryObject::copyOut(unsigned int chunk) {
+    memcpy(this->hostPointers[chunk], (unsigned char*)(*this->devicePtr) + (chunk * this->getChunkSize()), this->getChunkSize());
+}
+void ChunkedMemoryObject::copyInAsync(unsigned int chunk, ExecutionFlow* executionFlow) {
+    CommandQueue* queue = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
+    void* devicePtr = (unsigned char*)(*this->devicePtr) + (chunk * this->getChunkSize());
+    void* hostPtr = this->hostPointers[chunk];
+    size_t size = this->getChunkSize();
+    queue->enqueue([devicePtr, hostPtr, size]() {
+        memcpy(devicePtr, hostPtr, size);
+    });
+    this->setBaseAsyncObject(queue);
+}
+void ChunkedMemoryObject::copyOutAsync(unsigned int chunk, ExecutionFlow* executionFlow) {
+    CommandQueue* queue = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
+    void* devicePtr = (unsigned char*)(*this->devicePtr) + (chunk * this->getChunkSize());
+    void* hostPtr = this->hostPointers[chunk];
+    size_t size = this->getChunkSize();
+    queue->enqueue([devicePtr, hostPtr, size]() {
+        memcpy(hostPtr, devicePtr, size);
+    });
+    this->setBaseAsyncObject(queue);
+}
+void ChunkedMemoryObject::copyIn(size_t offset, size_t length) {
+    this->forEachChunkInRange(offset, length, [this](unsigned int chunk, size_t chunkOffset, size_t partLength) {
+        memcpy((unsigned char*)(*this->devicePtr) + (chunk * this->getChunkSize()) + chunkOffset, (unsigned char*)this->hostPointers[chunk] + chunkOffset, partLength);
+    });
+}
+void ChunkedMemoryObject::copyOut(size_t offset, size_t length) {
+    this->forEachChunkInRange(offset, length, [this](unsigned int chunk, size_t chunkOffset, size_t partLength) {
+        memcpy((unsigned char*)this->hostPointers[chunk] + chunkOffset, (unsigned char*)(*this->devicePtr) + (chunk * this->getChunkSize()) + chunkOffset, partLength);
+    });
+}
+void ChunkedMemoryObject::copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) {
+    CommandQueue* queue = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
+    this->forEachChunkInRange(offset, length, [this, queue](unsigned int chunk, size_t chunkOffset, size_t partLength) {
+        void* devicePtr = (unsigned char*)(*this->devicePtr) + (chunk * this->getChunkSize()) + chunkOffset;
+        void* hostPtr = (unsigned char*)this->hostPointers[chunk] + chunkOffset;
+        queue->enqueue([devicePtr, hostPtr, partLength]() {
+            memcpy(devicePtr, hostPtr, partLength);
+        });
+    });
+    this->setBaseAsyncObject(queue);
+}
+void ChunkedMemoryObject::copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) {
+    CommandQueue* queue = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
+    // A single command scatters the range to the host memory of each chunk
+    std::vector<std::tuple<void*, const void*, size_t>> parts;
+    this->forEachChunkInRange(offset, length, [this, &parts](unsigned int chunk, size_t chunkOffset, size_t partLength) {
+        void* devicePtr = (unsigned char*)(*this->devicePtr) + (chunk * this->getChunkSize()) + chunkOffset;
+        void* hostPtr = (unsigned char*)this->hostPointers[chunk] + chunkOffset;
+        parts.push_back(std::make_tuple(hostPtr, devicePtr, partLength));
+    });
+    queue->enqueue([parts]() {
+        for (auto& part : parts) {
+            memcpy(std::get<0>(part), std::get<1>(part), std::get<2>(part));
+        }
+    });
+    this->setBaseAsyncObject(queue);
+}
+
+
+///// StreamElement /////
+
+StreamElement::StreamElement(Device* device) : BaseStreamElement(device) {
+    // Can't call this virtual function in the base constructor
+    this->start();
+}
+
+StreamElement::~StreamElement() { }
+
+
+///// KernelGenerator /////
+
+const std::string KernelGenerator::KERNEL_PREFIX = "static inline";
+const std::string KernelGenerator::GLOBAL_MEMORY_PREFIX = "";
+const std::string KernelGenerator::SHARED_MEMORY_PREFIX = "";
+const std::string KernelGenerator::CONSTANT_PREFIX = "const";
+const std::string KernelGenerator::DEVICE_FUNCTION_PREFIX = "static inline";
+const std::string KernelGenerator::SYNCHRONIZE_FUNCTION = "gspar_synchronize_local_threads";
+
+const std::string KernelGenerator::getKernelPrefix() {
+    return KernelGenerator::KERNEL_PREFIX + " void";
+}
+std::string KernelGenerator::generateMacroDefinitions() {
+    // Defined in the source instead of the command line, so there is no shell quoting involved
+    return "#define GSPAR_DEVICE_KERNEL " + KernelGenerator::KERNEL_PREFIX + "\n"
+        "#define GSPAR_DEVICE_GLOBAL_MEMORY " + KernelGenerator::GLOBAL_MEMORY_PREFIX + "\n"
+        "#define GSPAR_DEVICE_SHARED_MEMORY " + KernelGenerator::SHARED_MEMORY_PREFIX + "\n"
+        "#define GSPAR_DEVICE_CONSTANT " + KernelGenerator::CONSTANT_PREFIX + "\n"
+        "#define GSPAR_DEVICE_FUNCTION " + KernelGenerator::DEVICE_FUNCTION_PREFIX + "\n";
+}
+std::string KernelGenerator::generateStdFunctions() {
+    return ""
+    "#include <stddef.h> \n"
+    "#include <stdint.h> \n"
+    "#include <stdio.h> \n"
+    "#include <string.h> \n"
+    "#include <math.h> \n"
+    // Same layout of GSPar::Driver::Host::WorkItem
+    "struct gspar_host_item { \n"
+    "    size_t global_id[3]; \n"
+    "    size_t local_id[3]; \n"
+    "    size_t group_id[3]; \n"
+    "    size_t local_size[3]; \n"
+    "    size_t num_groups[3]; \n"
+    "    void (*synchronize)(struct gspar_host_item*); \n"
+    "}; \n"
+    "static thread_local struct gspar_host_item* gspar_current_item = 0; \n"
+    "static inline size_t gspar_get_global_id(unsigned int dimension) { return dimension < 3 ? gspar_current_item->global_id[dimension] : 0; } \n"
+    "static inline size_t gspar_get_thread_id(unsigned int dimension) { return dimension < 3 ? gspar_current_item->local_id[dimension] : 0; } \n"
+    "static inline size_t gspar_get_block_id(unsigned int dimension) { return dimension < 3 ? gspar_current_item->group_id[dimension] : 0; } \n"
+    "static inline size_t gspar_get_block_size(unsigned int dimension) { return dimension < 3 ? gspar_current_item->local_size[dimension] : 0; } \n"
+    "static inline size_t gspar_get_grid_size(unsigned int dimension) { return dimension < 3 ? gspar_current_item->num_groups[dimension] : 0; } \n"
+    // Other work-items of the block run while this one is suspended, so we restore its item afterwards
+    "static inline void gspar_synchronize_local_threads() { \n"
+    "    struct gspar_host_item* item = gspar_current_item; \n"
+    "    item->synchronize(item); \n"
+    "    gspar_current_item = item; \n"
+    "} \n"
+    // CUDA kernels rely on the min/max device functions
+    "template<typename T> static inline T min(T a, T b) { return b < a ? b : a; } \n"
+    "template<typename T> static inline T max(T a, T b) { return a < b ? b : a; } \n"
+    // Atomic functions
+    "static inline int gspar_atomic_add_int(int* valq, int delta) { return __atomic_fetch_add(valq, delta, __ATOMIC_SEQ_CST); } \n"
+    "static inline double gspar_atomic_add_double(double* valq, double delta) { \n"
+    "    double old, desired; \n"
+    "    __atomic_load(valq, &old, __ATOMIC_RELAXED); \n"
+    "    do { \n"
+    "        desired = old + delta; \n"
+    "    } while (!__atomic_compare_exchange(valq, &old, &desired, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)); \n"
+    "    return old; \n"
+    "} \n"
+    ;
+}
+std::string KernelGenerator::removeComments(const std::string& source) {
+    std::string r;
+    for (size_t i = 0; i < source.length(); i++) {
+        if (source.compare(i, 2, "//") == 0) {
+            i = source.find('\n', i);
+            if (i == std::string::npos) break;
+            r += '\n';
+        } else if (source.compare(i, 2, "/*") == 0) {
+            i = source.find("*/", i + 2);
+            if (i == std::string::npos) break;
+            i++;
+            r += ' ';
+        } else {
+            r += source[i];
+        }
+    }
+    return r;
+}
+std::vector<std::string> KernelGenerator::getKernelParameterTypes(const std::string kernelSource, const std::string kernelName) {
+    std::string source = this->removeComments(kernelSource);
+
+    // The kernel definition is the occurrence of the name followed by the parameter list and the body
+    std::regex kernelNameRegex("\\b" + kernelName + "\\s*\\(");
+    std::string paramList;
+    bool found = false;
+    for (auto it = std::sregex_iterator(source.begin(), source.end(), kernelNameRegex); it != std::sregex_iterator() && !found; ++it) {
+        size_t begin = it->position() + it->length();
+        int depth = 1;
+        size_t end = begin;
+        for (; end < source.length() && depth > 0; end++) {
+            if (source[end] == '(') depth++;
+            else if (source[end] == ')') depth--;
+        }
+        size_t body = source.find_first_not_of(" \t\r\n", end);
+        if (depth == 0 && body != std::string::npos && source[body] == '{') {
+            paramList = source.substr(begin, end - begin - 1);
+            found = true;
+        }
+    }
+    if (!found) {
+        throw Exception("Kernel " + kernelName + " not found in kernel source", defaultExceptionDetails());
+    }
+
+    // Split the parameters in the top-level commas
+    std::vector<std::string> params;
+    std::string current;
+    int depth = 0;
+    for (char c : paramList) {
+        if (c == '(' || c == '<' || c == '[') depth++;
+        else if (c == ')' || c == '>' || c == ']') depth--;
+        if (c == ',' && depth == 0) {
+            params.push_back(current);
+            current.clear();
+        } else {
+            current += c;
+        }
+    }
+    params.push_back(current);
+
+    std::vector<std::string> types;
+    for (auto param : params) {
+        param = std::regex_replace(param, std::regex("\\s+"), " "); // Parameters may span multiple lines
+        if (param.find_first_not_of(" \t\r\n") == std::string::npos) continue; // Kernel without parameters
+        if (std::regex_match(param, std::regex("^\\s*void\\s*$"))) continue;
+        // Removes the parameter name, keeping the type
+        std::smatch match;
+        std::regex nameRegex("^(.*[^A-Za-z0-9_])([A-Za-z_][A-Za-z0-9_]*)\\s*(\\[\\s*\\])?\\s*$");
+        if (!std::regex_match(param, match, nameRegex)) {
+            throw Exception("Could not parse parameter '" + param + "' of kernel " + kernelName, defaultExceptionDetails());
+        }
+        std::string type = match[1].str();
+        if (match[3].matched) {
+            type += "*"; // Arrays are passed as pointers
+        }
+        types.push_back(type);
+    }
+    return types;
+}
+std::string KernelGenerator::generateEntryPoints(const std::string kernelSource, const std::string kernelName) {
+    std::vector<std::string> types = this->getKernelParameterTypes(kernelSource, kernelName);
+
+    std::string call = kernelName + "(";
+    for (size_t i = 0; i < types.size(); i++) {
+        if (i > 0) call += ", ";
+        call += "*(" + types[i] + "*)gspar_args[" + std::to_string(i) + "]";
+    }
+    call += ");";
+
+    return "\n"
+    "extern \"C\" const unsigned int gspar_param_count_" + kernelName + " = " + std::to_string(types.size()) + "; \n"
+    "extern \"C\" void gspar_item_" + kernelName + "(void** gspar_args, struct gspar_host_item* gspar_item) { \n"
+    "    gspar_current_item = gspar_item; \n"
+    "    " + call + " \n"
+    "} \n"
+    // Work-items without synchronization run sequentially, so the compiler can inline and vectorize the kernel
+    "extern \"C\" void gspar_block_" + kernelName + "(void** gspar_args, struct gspar_host_item* gspar_item) { \n"
+    "    gspar_current_item = gspar_item; \n"
+    "    for (size_t gspar_z = 0; gspar_z < gspar_item->local_size[2]; gspar_z++) { \n"
+    "        gspar_item->local_id[2] = gspar_z; \n"
+    "        gspar_item->global_id[2] = gspar_item->group_id[2] * gspar_item->local_size[2] + gspar_z; \n"
+    "        for (size_t gspar_y = 0; gspar_y < gspar_item->local_size[1]; gspar_y++) { \n"
+    "            gspar_item->local_id[1] = gspar_y; \n"
+    "            gspar_item->global_id[1] = gspar_item->group_id[1] * gspar_item->local_size[1] + gspar_y; \n"
+    "            for (size_t gspar_x = 0; gspar_x < gspar_item->local_size[0]; gspar_x++) { \n"
+    "                gspar_item->local_id[0] = gspar_x; \n"
+    "                gspar_item->global_id[0] = gspar_item->group_id[0] * gspar_item->local_size[0] + gspar_x; \n"
+    "                " + call + " \n"
+    "            } \n"
+    "        } \n"
+    "    } \n"
+    "} \n";
+}
+std::string KernelGenerator::generateInitKernel(Pattern::BaseParallelPattern* pattern, Dimensions max) {
+    return "";
+}
+std::string KernelGenerator::generateParams(Pattern::BaseParallelPattern* pattern, Dimensions dims) {
+    std::string r = "";
+    for(int d = 0; d < dims.getCount(); d++) {
+        if (dims.is(d)) {
+            std::string varName = this->getStdVarNameForDimension(pattern->getStdVarNames(), d);
+            r += "const unsigned long gspar_max_" + varName + ",";
+            if (pattern->isUsingMinParameter(dims, d)) { // Same check as generateStdVariables
+                r += "const unsigned long gspar_min_" + varName + ",";
+            }
+        }
+    }
+    if (pattern->isBatched()) {
+        // This names are used in other methods
+        r += "unsigned int gspar_batch_size,";
+    }
+    for(auto &param : pattern->getParameterList()) {
+        if (param->direction != Pattern::ParameterDirection::GSPAR_PARAM_NONE) {
+            if (param->direction == Pattern::ParameterDirection::GSPAR_PARAM_IN && param->isConstant()) {
+                r += "const ";
+            }
+            r += param->toKernelParameter() + ",";
+        }
+    }
+    // Block-shared memory is passed as the last parameter, such as in OpenCL
+    if (pattern->isUsingSharedMemory()) {
+        auto shmem = pattern->getSharedMemoryParameter();
+        r += shmem->toString();
+    } else {
+        if (!r.empty()) r.pop_back(); // removes last comma
+    }
+    return r;
+}
+std::string KernelGenerator::generateStdVariables(Pattern::BaseParallelPattern* pattern, Dimensions dims) {
+    std::array<std::string, 3> patternNames = pattern->getStdVarNames();
+
+    std::string r;
+    for(int d = 0; d < dims.getCount(); d++) {
+        if (dims.is(d)) {
+            std::string varName = this->getStdVarNameForDimension(patternNames, d);
+            if (pattern->isBatched()) {
+                r += "size_t gspar_global_" + varName;
+            } else {
+                r += "size_t " + varName;
+            }
+            r += " = gspar_get_global_id(" + std::to_string(d) + ")";
+            if (pattern->isUsingMinParameter(dims, d)) { // Same check as generateParams
+                r += " + gspar_min_" + varName;
+            }
+            r += "; \n";
+            // TODO Support multi-dimensional batches
+            if (pattern->isBatched()) {
+                // Intended implicit floor(gspar_global/dims)
+                r += "size_t gspar_batch_" + varName + " = ((size_t)(gspar_global_" + varName + " / gspar_max_" + varName + ")); \n";
+                r += "size_t gspar_offset_" + varName + " = gspar_batch_" + varName + " * gspar_max_" + varName + "; \n";
+                // This variable names are used in other methods, keep track
+                r += "size_t " + varName + " = gspar_global_" + varName + " - gspar_offset_" + varName + "; \n";
+            }
+        }
+    }
+    return r;
+}
+std::string KernelGenerator::generateBatchedParametersInitialization(Pattern::BaseParallelPattern* pattern, Dimensions dims) {
+    std::array<std::string, 3> patternNames = pattern->getStdVarNames();
+    // TODO Support multi-dimensional batches
+    std::string stdVarFirstDimension = this->getStdVarNameForDimension(patternNames, 0);
+
+    std::string r = "";
+    for(auto &param : pattern->getParameterList()) {
+        if (param->isBatched()) {
+            if (param->direction == Pattern::ParameterDirection::GSPAR_PARAM_IN && param->isConstant()) {
+                r += "const ";
+            }
+            r += param->type.getFullName() + " " + param->name + " = ";
+            if (param->paramValueType == Pattern::ParameterValueType::GSPAR_PARAM_POINTER) {
+                r += "&" + param->getKernelParameterName() + "[gspar_offset_" + stdVarFirstDimension + "]";
+            } else if (param->paramValueType == Pattern::ParameterValueType::GSPAR_PARAM_VALUE) {
+                r += param->getKernelParameterName() + "[gspar_batch_" + stdVarFirstDimension + "]";
+            }
+            r += ";\n";
+        }
+    }
+    return r;
+}
+
+bool KernelGenerator::isBlockRunSequentially() {
+    // Fibers also run the work-items of a block in order, until each one synchronizes
+    return true;
+}
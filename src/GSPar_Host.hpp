@@ -0,0 +1,454 @@
+
+#ifndef __GSPAR_HOST_INCLUDED__
+#define __GSPAR_HOST_INCLUDED__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <exception>
+#include <cstdlib>
+
+// Compiler used to JIT the kernels into shared libraries
+#ifndef GSPAR_HOST_COMPILER
+#define GSPAR_HOST_COMPILER "c++"
+#endif
+#ifndef GSPAR_HOST_COMPILER_FLAGS
+#define GSPAR_HOST_COMPILER_FLAGS "-std=c++11 -O3 -march=native -fPIC -shared -w"
+#endif
+// Directory where the kernel sources and libraries are written while being compiled
+#ifndef GSPAR_HOST_TMP_DIR
+#define GSPAR_HOST_TMP_DIR "/tmp"
+#endif
+// Number of work-items in a block (work-group). A block always runs in a single host thread
+#ifndef GSPAR_HOST_MAX_THREADS_PER_BLOCK
+#define GSPAR_HOST_MAX_THREADS_PER_BLOCK 256
+#endif
+// Stack size of each work-item of kernels that synchronize local threads
+#ifndef GSPAR_HOST_FIBER_STACK_BYTES
+#define GSPAR_HOST_FIBER_STACK_BYTES (64 * 1024)
+#endif
+
+///// Forward declarations /////
+
+namespace GSPar {
+    namespace Driver {
+        namespace Host {
+            class Exception;
+            class ThreadPool;
+            class CommandQueue;
+            class Program;
+            class ExecutionFlow;
+            class AsyncExecutionSupport;
+            class Instance;
+            class Device;
+            class Kernel;
+            class MemoryObject;
+            class ChunkedMemoryObject;
+            class StreamElement;
+            class KernelGenerator;
+        }
+    }
+}
+
+#include "GSPar_BaseGPUDriver.hpp"
+
+namespace GSPar {
+    namespace Driver {
+        namespace Host {
+
+            ///// Exception /////
+
+            /**
+             * Error codes of the host driver are errno values
+             */
+            class Exception :
+                public BaseException<int> {
+            protected:
+                std::string getErrorString(int code) override;
+
+            public:
+                explicit Exception(std::string msg, std::string details = "");
+                explicit Exception(int code, std::string details = "");
+
+                static Exception* checkError(int code, std::string details = "");
+                static void throwIfFailed(int code, std::string details = "");
+            };
+
+            ///// WorkItem /////
+
+            /**
+             * Execution context of a single work-item (a GPU thread), shared with the JIT-compiled kernels.
+             * Its layout must match the gspar_host_item struct emitted by KernelGenerator::generateStdFunctions().
+             */
+            struct WorkItem {
+                size_t globalId[SUPPORTED_DIMS];
+                size_t localId[SUPPORTED_DIMS];
+                size_t groupId[SUPPORTED_DIMS];
+                size_t localSize[SUPPORTED_DIMS];
+                size_t numGroups[SUPPORTED_DIMS];
+                void (*synchronize)(WorkItem* item);
+            };
+
+            /**
+             * Entry points exported by the JIT-compiled library for each kernel
+             */
+            typedef void (*KernelEntry)(void** args, WorkItem* item);
+
+            /**
+             * A kernel argument: the address of the device pointer of a memory object or a copy of a value
+             */
+            struct KernelParameter {
+                void* pointer;
+                std::vector<unsigned char> value;
+            };
+
+            ///// ThreadPool /////
+
+            /**
+             * Work-stealing pool of host threads, which plays the role of the compute units of a GPU.
+             * Each worker pops tasks from the back of its own deque and, when it runs out of work,
+             * steals tasks from the front of the other workers' deques.
+             */
+            class ThreadPool {
+            private:
+                struct WorkerQueue {
+                    std::mutex mutex;
+                    std::deque<std::function<void()>> tasks;
+                };
+                std::vector<std::unique_ptr<WorkerQueue>> queues;
+                std::vector<std::thread> workers;
+                std::atomic<unsigned int> nextQueue;
+                std::mutex sleepMutex;
+                std::condition_variable sleepCondition;
+                long pendingTasks = 0; // Guarded by sleepMutex
+                bool stopping = false; // Guarded by sleepMutex
+
+                bool runPendingTask(int workerIndex);
+                void workerLoop(unsigned int workerIndex);
+
+            public:
+                explicit ThreadPool(unsigned int numThreads);
+                virtual ~ThreadPool();
+                unsigned int getThreadCount();
+                void submit(std::function<void()> task);
+                /**
+                 * Splits [0, count) in ranges of grainSize elements, run them in the pool and wait for all of them.
+                 * The calling thread helps running the tasks while it waits.
+                 */
+                void parallelFor(size_t count, size_t grainSize, std::function<void(size_t, size_t)> body);
+            };
+
+            ///// CommandQueue /////
+
+            /**
+             * In-order queue of commands run by a dedicated host thread.
+             * It is the host counterpart of a CUstream or a cl_command_queue.
+             */
+            class CommandQueue {
+            private:
+                std::thread thread;
+                std::mutex mutex;
+                std::condition_variable commandAvailable;
+                std::condition_variable queueDrained;
+                std::deque<std::function<void()>> commands;
+                bool busy = false;
+                bool stopping = false;
+                std::exception_ptr failure;
+
+                void run();
+
+            public:
+                CommandQueue();
+                virtual ~CommandQueue();
+                void enqueue(std::function<void()> command);
+                /**
+                 * Wait for all the enqueued commands to complete.
+                 * Rethrows the first exception thrown by a command since the last synchronization.
+                 */
+                void synchronize();
+                /**
+                 * Whether all the enqueued commands completed, without waiting for them
+                 */
+                bool isDrained();
+            };
+
+            ///// Program /////
+
+            /**
+             * A kernel source compiled into a shared library and loaded with dlopen.
+             * It is shared by all the kernels prepared from the same source.
+             */
+            class Program {
+            private:
+                void* libraryHandle = nullptr;
+                bool usingLocalSynchronization = false;
+
+                void* loadSymbol(const std::string symbolName);
+
+            public:
+                Program(void* libraryHandle, bool usingLocalSynchronization);
+                virtual ~Program();
+                /**
+                 * Entry point that runs all the work-items of a block sequentially
+                 */
+                KernelEntry getBlockEntry(const std::string kernelName);
+                /**
+                 * Entry point that runs a single work-item
+                 */
+                KernelEntry getItemEntry(const std::string kernelName);
+                unsigned int getParameterCount(const std::string kernelName);
+                bool isUsingLocalSynchronization() { return this->usingLocalSynchronization; }
+            };
+
+            ///// ExecutionFlow /////
+
+            class ExecutionFlow :
+                virtual public BaseExecutionFlow<ExecutionFlow, Device, CommandQueue*> {
+            public:
+                ExecutionFlow();
+                explicit ExecutionFlow(Device* device);
+                virtual ~ExecutionFlow();
+                CommandQueue* start() override;
+                void synchronize() override;
+                bool isFinished() override;
+
+                static CommandQueue* checkAndStartFlow(Device* device, ExecutionFlow* executionFlow = NULL);
+            };
+
+            ///// AsyncExecutionSupport /////
+
+            class AsyncExecutionSupport :
+                virtual public BaseAsyncExecutionSupport<CommandQueue*> {
+            public:
+                AsyncExecutionSupport(CommandQueue* asyncObj = NULL);
+                void waitAsync() override;
+
+                static void waitAllAsync(std::initializer_list<AsyncExecutionSupport*> asyncs);
+            };
+
+            ///// Instance /////
+
+            class Instance :
+                public BaseInstance<ExecutionFlow, Device, Kernel, MemoryObject, ChunkedMemoryObject, KernelGenerator> {
+            protected:
+                static Instance *instance;
+                void loadGpuList() override;
+
+            public:
+                Instance();
+                virtual ~Instance();
+                void init() override;
+                /**
+                 * The host is always seen as a single device
+                 */
+                unsigned int getGpuCount() override;
+
+                static Instance* getInstance();
+            };
+
+            ///// Device /////
+
+            /**
+             * The host CPU seen as a device. The context is the thread pool where the kernels run.
+             * There is no lib-specific device object.
+             */
+            class Device :
+                public BaseDevice<ExecutionFlow, Kernel, MemoryObject, ChunkedMemoryObject, ThreadPool*, void*, CommandQueue*> {
+            private:
+                unsigned int threadCount;
+                ProgramCache<std::shared_ptr<Program>> programCache;
+                ProgramCache<std::string> runtimeHeaderCache;
+                DeviceMemoryPool<void*> memoryPool{ [](void* memory) { free(memory); } };
+                std::string readCpuInfo(const std::string field);
+
+            public:
+                using BaseDevice<ExecutionFlow, Kernel, MemoryObject, ChunkedMemoryObject, ThreadPool*, void*, CommandQueue*>::malloc;
+
+                Device();
+                explicit Device(unsigned int threadCount);
+                virtual ~Device();
+                ExecutionFlow* getDefaultExecutionFlow() override;
+                ThreadPool* getContext() override;
+                CommandQueue* startDefaultExecutionFlow() override;
+                const std::string getName() override;
+                unsigned int getComputeUnitsCount() override;
+                unsigned int getWarpSize() override;
+                unsigned int getMaxThreadsPerBlock() override;
+                unsigned long getGlobalMemorySizeBytes() override;
+                unsigned long getLocalMemorySizeBytes() override;
+                unsigned long getSharedMemoryPerComputeUnitSizeBytes() override;
+                unsigned int getClockRateMHz() override;
+                bool isIntegratedMainMemory() override;
+                MemoryObject* malloc(long size, void* hostPtr = nullptr, bool readOnly = false, bool writeOnly = false) override;
+                MemoryObject* malloc(long size, const void* hostPtr = nullptr) override;
+                ChunkedMemoryObject* mallocChunked(unsigned int chunks, long chunkSize, void** hostPtr = nullptr, bool readOnly = false, bool writeOnly = false) override;
+                ChunkedMemoryObject* mallocChunked(unsigned int chunks, long chunkSize, const void** hostPtr = nullptr) override;
+                std::vector<std::string> getCompilerFlags(const CompilerOptions& compilerOptions) override;
+                Kernel* prepareKernel(const std::string kernelSource, const std::string kernelName, const CompilerOptions& compilerOptions = CompilerOptions()) override;
+                std::vector<Kernel*> prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames, const CompilerOptions& compilerOptions = CompilerOptions()) override;
+
+                /**
+                 * Gets the path of the GSPar runtime header, precompiled once per device for the given (shell-quoted) flags.
+                 * It is removed when the process exits.
+                 */
+                std::string getRuntimeHeader(const std::string extraFlags);
+                std::shared_ptr<Program> compileHostProgram(std::string source, const std::vector<std::string> kernelNames, const std::vector<std::string> compilerFlags = {});
+                /**
+                 * Gets the program of a source from the device's program cache, compiling it only once
+                 */
+                std::shared_ptr<Program> getProgram(std::string source, const std::vector<std::string> kernelNames, const CompilerOptions& compilerOptions = CompilerOptions());
+                ProgramCache<std::shared_ptr<Program>>& getProgramCache() { return this->programCache; }
+                DeviceMemoryPool<void*>& getMemoryPool() { return this->memoryPool; }
+            };
+
+            ///// Kernel /////
+
+            class Kernel :
+                public BaseKernel<ExecutionFlow, Device, MemoryObject, ChunkedMemoryObject, CommandQueue*>,
+                public AsyncExecutionSupport {
+            private:
+                std::shared_ptr<Program> program;
+                KernelEntry blockEntry = nullptr;
+                KernelEntry itemEntry = nullptr;
+                unsigned int declaredParameterCount = 0;
+                std::vector<KernelParameter> kernelParams;
+
+                void loadEntries(const std::string kernelName);
+
+            public:
+                Kernel();
+                Kernel(Device* device, const std::string kernelSource, const std::string kernelName, const CompilerOptions& compilerOptions = CompilerOptions());
+                virtual ~Kernel();
+                virtual void cloneInto(BaseKernelBase* baseOther) override;
+                int setParameter(MemoryObject* memoryObject) override;
+                int setParameter(ChunkedMemoryObject* chunkedMemoryObject) override;
+                int setParameter(size_t parmSize, void* parm) override;
+                int setParameter(size_t parmSize, const void* parm) override;
+                void clearParameters() override;
+                Dimensions getNumBlocksAndThreadsFor(Dimensions dims) override;
+                void runAsync(Dimensions max, ExecutionFlow* executionFlow = NULL) override;
+
+                Kernel(Device* device, std::shared_ptr<Program> program, const std::string kernelName);
+            };
+
+            ///// MemoryObject /////
+
+            /**
+             * The device memory is a separate host allocation, so kernels keep the same
+             * copy-in/copy-out semantics they have in GPU drivers.
+             */
+            class MemoryObject :
+                public BaseMemoryObject<Exception, ExecutionFlow, Device, void**, CommandQueue*>,
+                public AsyncExecutionSupport {
+            private:
+                void allocDeviceMemory();
+            public:
+                MemoryObject(Device* device, size_t size, void* hostPtr, bool readOnly, bool writeOnly);
+                MemoryObject(Device* device, size_t size, const void* hostPtr);
+                virtual ~MemoryObject();
+                using BaseMemoryObject<Exception, ExecutionFlow, Device, void**, CommandQueue*>::bindTo;
+                /**
+                 * Stops using the previous host memory as device memory, if it was
+                 */
+                virtual void bindTo(void* hostPtr) override;
+                virtual void copyIn() override;
+                virtual void copyOut() override;
+                virtual void copyInAsync(ExecutionFlow* executionFlow = NULL) override;
+                virtual void copyOutAsync(ExecutionFlow* executionFlow = NULL) override;
+                virtual void copyIn(size_t offset, size_t length) override;
+                virtual void copyOut(size_t offset, size_t length) override;
+                virtual void copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
+                virtual void copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
+            };
+
+            ///// ChunkedMemoryObject /////
+
+            class ChunkedMemoryObject :
+                public BaseChunkedMemoryObject<Exception, ExecutionFlow, Device, void**, CommandQueue*>,
+                public AsyncExecutionSupport {
+            private:
+                void allocDeviceMemory();
+
+            public:
+                ChunkedMemoryObject(Device* device, unsigned int chunks, size_t chunkSize, void** hostPointers, bool readOnly, bool writeOnly);
+                ChunkedMemoryObject(Device* device, unsigned int chunks, size_t chunkSize, const void** hostPointers);
+                virtual ~ChunkedMemoryObject();
+                // Copy all chunks
+                virtual void copyIn() override;
+                virtual void copyOut() override;
+                virtual void copyInAsync(ExecutionFlow* executionFlow = NULL) override;
+                virtual void copyOutAsync(ExecutionFlow* executionFlow = NULL) override;
+                // Copy specific chunks of memory. We can't use function overloading due to the override.
+                virtual void copyIn(unsigned int chunk);
+                virtual void copyOut(unsigned int chunk);
+                virtual void copyInAsync(unsigned int chunk, ExecutionFlow* executionFlow = NULL);
+                virtual void copyOutAsync(unsigned int chunk, ExecutionFlow* executionFlow = NULL);
+                // Copy a range of bytes, counted across the chunks
+                virtual void copyIn(size_t offset, size_t length) override;
+                virtual void copyOut(size_t offset, size_t length) override;
+                virtual void copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
+                virtual void copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
+            };
+
+            ///// StreamElement /////
+
+            class StreamElement :
+                public BaseStreamElement<ExecutionFlow, Device, CommandQueue*, CommandQueue*>,
+                public AsyncExecutionSupport,
+                public ExecutionFlow {
+            private:
+                Kernel* kernel;
+
+            public:
+                explicit StreamElement(Device* device);
+                ~StreamElement();
+            };
+
+            ///// KernelGenerator /////
+
+            class KernelGenerator :
+                public BaseKernelGenerator {
+            private:
+                std::string removeComments(const std::string& source);
+
+            public:
+                static const std::string KERNEL_PREFIX;
+                static const std::string GLOBAL_MEMORY_PREFIX;
+                static const std::string SHARED_MEMORY_PREFIX;
+                static const std::string CONSTANT_PREFIX;
+                static const std::string DEVICE_FUNCTION_PREFIX;
+                static const std::string SYNCHRONIZE_FUNCTION;
+                const std::string getKernelPrefix() override;
+                std::string generateStdFunctions() override;
+                std::string generateInitKernel(Pattern::BaseParallelPattern* pattern, Dimensions dims) override;
+                std::string generateParams(Pattern::BaseParallelPattern* pattern, Dimensions dims) override;
+                std::string generateStdVariables(Pattern::BaseParallelPattern* pattern, Dimensions dims) override;
+                std::string generateBatchedParametersInitialization(Pattern::BaseParallelPattern* pattern, Dimensions dims) override;
+                /**
+                 * A block runs its work-items in a loop of a single host thread, unless they synchronize
+                 */
+                bool isBlockRunSequentially() override;
+
+                std::string generateMacroDefinitions();
+                /**
+                 * Parse the signature of a kernel and return the type of each of its parameters
+                 */
+                std::vector<std::string> getKernelParameterTypes(const std::string kernelSource, const std::string kernelName);
+                /**
+                 * Generate the C entry points (gspar_block_, gspar_item_ and gspar_param_count_) loaded with dlsym
+                 */
+                std::string generateEntryPoints(const std::string kernelSource, const std::string kernelName);
+            };
+
+        }
+    }
+}
+
+#endif
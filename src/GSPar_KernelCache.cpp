@@ -0,0 +1,218 @@
+
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <tuple>
+#include <algorithm>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#ifdef GSPAR_DEBUG
+#include <iostream>
+#endif
+
+#include "GSPar_Base.hpp"
+#include "GSPar_KernelCache.hpp"
+
+using namespace GSPar::Driver;
+
+///// KernelBinaryCache /////
+
+KernelBinaryCache::KernelBinaryCache() : maxSize(GSPAR_KERNEL_CACHE_MAX_BYTES), hits(0), misses(0), stores(0) {
+    const char* disable = std::getenv("GSPAR_KERNEL_CACHE_DISABLE");
+    const char* directory = std::getenv("GSPAR_KERNEL_CACHE_DIR");
+    const char* xdgCache = std::getenv("XDG_CACHE_HOME");
+    const char* home = std::getenv("HOME");
+    if (directory && *directory) {
+        this->directory = directory;
+    } else if (xdgCache && *xdgCache) {
+        this->directory = std::string(xdgCache) + "/gsparlib";
+    } else if (home && *home) {
+        this->directory = std::string(home) + "/.cache/gsparlib";
+    }
+    this->enabled = !disable && !this->directory.empty();
+}
+
+KernelBinaryCache* KernelBinaryCache::getInstance() {
+    static KernelBinaryCache instance; // Thread-safe initialization since C++11
+    return &instance;
+}
+
+std::string KernelBinaryCache::computeKey(const std::vector<std::string>& parts) {
+    // FNV-1a 128-bit, in two 64-bit words. The prime is 2^88 + 0x13B, so hash * prime = hash * 0x13B + (hash << 88)
+    unsigned long long hashLow = 0x62B821756295C58DULL;
+    unsigned long long hashHigh = 0x6C62272E07BB0142ULL;
+    auto hashBytes = [&](const char* bytes, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            hashLow ^= (unsigned char)bytes[i];
+            // hashLow * 0x13B in 32-bit halves, to get the carry to the high word
+            unsigned long long productLow = (hashLow & 0xFFFFFFFFULL) * 0x13B;
+            unsigned long long productHigh = (hashLow >> 32) * 0x13B + (productLow >> 32);
+            unsigned long long shifted = hashLow << 24; // hash << 88 only changes the high word
+            hashLow = (productHigh << 32) | (productLow & 0xFFFFFFFFULL);
+            hashHigh = hashHigh * 0x13B + (productHigh >> 32) + shifted;
+        }
+    };
+    for (auto& part : parts) {
+        // The size of each part is hashed too, so moving bytes between parts changes the key
+        std::string size = std::to_string(part.size()) + ":";
+        hashBytes(size.data(), size.size());
+        hashBytes(part.data(), part.size());
+    }
+    std::stringstream key;
+    key << std::hex << std::setfill('0') << std::setw(16) << hashHigh << std::setw(16) << hashLow;
+    return key.str();
+}
+
+bool KernelBinaryCache::isEnabled() {
+    std::lock_guard<std::mutex> lock(this->directoryMutex); // Auto-unlock, RAII
+    return this->enabled;
+}
+void KernelBinaryCache::setEnabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(this->directoryMutex); // Auto-unlock, RAII
+    this->enabled = enabled && !this->directory.empty();
+}
+std::string KernelBinaryCache::getDirectory() {
+    std::lock_guard<std::mutex> lock(this->directoryMutex); // Auto-unlock, RAII
+    return this->directory;
+}
+void KernelBinaryCache::setDirectory(const std::string directory) {
+    std::lock_guard<std::mutex> lock(this->directoryMutex); // Auto-unlock, RAII
+    this->directory = directory;
+    if (directory.empty()) {
+        this->enabled = false;
+    }
+}
+
+unsigned long KernelBinaryCache::getMaxSize() {
+    std::lock_guard<std::mutex> lock(this->directoryMutex); // Auto-unlock, RAII
+    return this->maxSize;
+}
+void KernelBinaryCache::setMaxSize(unsigned long maxSize) {
+    std::lock_guard<std::mutex> lock(this->directoryMutex); // Auto-unlock, RAII
+    this->maxSize = maxSize;
+}
+
+std::string KernelBinaryCache::getEntryPath(const std::string& key) {
+    return this->getDirectory() + "/" + key + ".bin";
+}
+
+bool KernelBinaryCache::createDirectory(const std::string& path) {
+    // Creates every missing component, like mkdir -p
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+        std::string component = path.substr(0, pos);
+        if (mkdir(component.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        if (pos == std::string::npos) {
+            return true;
+        }
+    }
+}
+
+bool KernelBinaryCache::load(const std::string& key, std::vector<char>& binary) {
+    if (!this->isEnabled()) {
+        return false;
+    }
+    std::ifstream entry(this->getEntryPath(key), std::ios::binary | std::ios::ate);
+    if (!entry.is_open()) {
+        this->misses++;
+        return false;
+    }
+    std::streamsize size = entry.tellg();
+    entry.seekg(0, std::ios::beg);
+    binary.resize(size);
+    if (size <= 0 || !entry.read(binary.data(), size)) {
+        binary.clear();
+        this->misses++;
+        return false;
+    }
+    utime(this->getEntryPath(key).c_str(), nullptr); // The modification time tells the least recently used entries
+#ifdef GSPAR_DEBUG
+    std::stringstream ss; // Using stringstream eases multi-threaded debugging
+    ss << "[GSPar KernelBinaryCache] Hit for " << key << " (" << size << " bytes)" << std::endl;
+    std::cout << ss.str();
+#endif
+    this->hits++;
+    return true;
+}
+
+bool KernelBinaryCache::store(const std::string& key, const char* binary, size_t size) {
+    if (!this->isEnabled() || !binary || !size) {
+        return false;
+    }
+    std::string directory = this->getDirectory();
+    if (!this->createDirectory(directory)) {
+        return false;
+    }
+    // Writes to a temporary file and renames it, so concurrent processes never read a partial entry
+    std::string entryPath = this->getEntryPath(key);
+    std::string temporaryPath = entryPath + "." + std::to_string(getpid()) + "." + GSPar::getRandomString(6) + ".tmp";
+    std::ofstream entry(temporaryPath, std::ios::binary | std::ios::trunc);
+    entry.write(binary, size);
+    entry.close();
+    if (entry.fail() || std::rename(temporaryPath.c_str(), entryPath.c_str()) != 0) {
+        std::remove(temporaryPath.c_str());
+        return false;
+    }
+#ifdef GSPAR_DEBUG
+    std::stringstream ss; // Using stringstream eases multi-threaded debugging
+    ss << "[GSPar KernelBinaryCache] Stored " << key << " (" << size << " bytes) in " << directory << std::endl;
+    std::cout << ss.str();
+#endif
+    this->stores++;
+    this->evict(directory);
+    return true;
+}
+
+void KernelBinaryCache::evict(const std::string& directory) {
+    unsigned long maxSize = this->getMaxSize();
+    if (!maxSize) {
+        return;
+    }
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) {
+        return;
+    }
+    // Modification time, size and path of each entry
+    std::vector<std::tuple<time_t, unsigned long, std::string>> entries;
+    unsigned long totalSize = 0;
+    while (struct dirent* file = readdir(dir)) {
+        std::string name = file->d_name;
+        struct stat status;
+        if (name.size() <= 4 || name.compare(name.size() - 4, 4, ".bin") != 0) {
+            continue; // Temporary files and the tuning database
+        }
+        std::string path = directory + "/" + name;
+        if (stat(path.c_str(), &status) == 0) {
+            entries.emplace_back(status.st_mtime, status.st_size, path);
+            totalSize += status.st_size;
+        }
+    }
+    closedir(dir);
+    std::sort(entries.begin(), entries.end());
+    for (auto& entry : entries) {
+        if (totalSize <= maxSize) {
+            break;
+        }
+        if (std::remove(std::get<2>(entry).c_str()) == 0) {
+            totalSize -= std::get<1>(entry);
+#ifdef GSPAR_DEBUG
+            std::stringstream ss; // Using stringstream eases multi-threaded debugging
+            ss << "[GSPar KernelBinaryCache] Evicted " << std::get<2>(entry) << " (" << std::get<1>(entry) << " bytes)" << std::endl;
+            std::cout << ss.str();
+#endif
+        }
+    }
+}
+
+void KernelBinaryCache::resetCounters() {
+    this->hits = 0;
+    this->misses = 0;
+    this->stores = 0;
+}
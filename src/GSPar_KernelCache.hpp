@@ -0,0 +1,96 @@
+
+#ifndef __GSPAR_KERNELCACHE_INCLUDED__
+#define __GSPAR_KERNELCACHE_INCLUDED__
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+/**
+ * Bytes the entries of the kernel cache may use on disk when not set, 0 for no limit.
+ * The least recently used entries are removed when a new one exceeds it.
+ */
+#ifndef GSPAR_KERNEL_CACHE_MAX_BYTES
+#define GSPAR_KERNEL_CACHE_MAX_BYTES (256UL * 1024 * 1024)
+#endif
+
+namespace GSPar {
+    namespace Driver {
+
+        ///// KernelBinaryCache /////
+
+        /**
+         * Content-addressed on-disk cache of compiled kernels (OpenCL program binaries, CUDA PTX and Host libraries).
+         * Each entry is stored in a file named by the hash of everything that influences the compilation:
+         * the complete kernel source, the build options, the device name and the driver version.
+         *
+         * The cache directory is taken from the GSPAR_KERNEL_CACHE_DIR environment variable and defaults
+         * to $XDG_CACHE_HOME/gsparlib (or $HOME/.cache/gsparlib).
+         * Setting the GSPAR_KERNEL_CACHE_DISABLE environment variable disables the cache.
+         * The entries are limited to GSPAR_KERNEL_CACHE_MAX_BYTES (see setMaxSize), evicting the least recently used.
+         */
+        class KernelBinaryCache {
+        private:
+            std::mutex directoryMutex;
+            std::string directory;
+            bool enabled;
+            unsigned long maxSize;
+            std::atomic<unsigned long> hits;
+            std::atomic<unsigned long> misses;
+            std::atomic<unsigned long> stores;
+
+            std::string getEntryPath(const std::string& key);
+            /**
+             * Removes the least recently used entries until they fit in maxSize
+             */
+            void evict(const std::string& directory);
+
+        public:
+            KernelBinaryCache();
+
+            static KernelBinaryCache* getInstance();
+            /**
+             * Computes the cache key of a compilation, the 128-bit FNV-1a hash of the parts
+             * @param parts Everything that influences the compiled binary
+             */
+            static std::string computeKey(const std::vector<std::string>& parts);
+            /**
+             * Creates a directory and every missing parent, like mkdir -p
+             */
+            static bool createDirectory(const std::string& path);
+
+            bool isEnabled();
+            void setEnabled(bool enabled);
+            std::string getDirectory();
+            void setDirectory(const std::string directory);
+            unsigned long getMaxSize();
+            /**
+             * @param maxSize Bytes the entries may use on disk, 0 for no limit
+             */
+            void setMaxSize(unsigned long maxSize);
+
+            /**
+             * Loads a compiled binary from the cache
+             * @param key Key computed with computeKey
+             * @param binary Filled with the contents of the cached binary on a hit
+             * @return true on a cache hit
+             */
+            bool load(const std::string& key, std::vector<char>& binary);
+            /**
+             * Stores a compiled binary in the cache. Failures are not fatal, they only disable this entry.
+             * @param key Key computed with computeKey
+             * @return true if the binary was stored
+             */
+            bool store(const std::string& key, const char* binary, size_t size);
+
+            unsigned long getHits() { return this->hits; }
+            unsigned long getMisses() { return this->misses; }
+            unsigned long getStores() { return this->stores; }
+            void resetCounters();
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,98 @@
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#ifdef GSPAR_DEBUG
+#include <iostream>
+#endif
+
+#include "GSPar_KernelCache.hpp"
+#include "GSPar_KernelTuning.hpp"
+
+using namespace GSPar::Driver;
+
+///// KernelTuningDatabase /////
+
+KernelTuningDatabase::KernelTuningDatabase() {
+    const char* file = std::getenv("GSPAR_TUNING_FILE");
+    if (file && *file) {
+        this->file = file;
+    } else if (KernelBinaryCache::getInstance()->isEnabled()) {
+        this->file = KernelBinaryCache::getInstance()->getDirectory() + "/workgroup_tuning.txt";
+    }
+}
+
+KernelTuningDatabase* KernelTuningDatabase::getInstance() {
+    static KernelTuningDatabase instance; // Thread-safe initialization since C++11
+    return &instance;
+}
+
+std::string KernelTuningDatabase::getFile() {
+    std::lock_guard<std::mutex> lock(this->entriesMutex); // Auto-unlock, RAII
+    return this->file;
+}
+void KernelTuningDatabase::setFile(const std::string file) {
+    std::lock_guard<std::mutex> lock(this->entriesMutex); // Auto-unlock, RAII
+    this->file = file;
+    this->loaded = false; // The entries of the new file are loaded on the next search
+}
+
+void KernelTuningDatabase::loadFile() {
+    // entriesMutex must be locked
+    this->loaded = true;
+    if (this->file.empty()) {
+        return;
+    }
+    std::ifstream database(this->file);
+    std::string line;
+    while (std::getline(database, line)) {
+        // Each line is "key x y z". Later lines replace earlier ones with the same key
+        std::istringstream fields(line);
+        std::string key;
+        std::array<unsigned long, 3> numThreadsPerBlock;
+        if (fields >> key >> numThreadsPerBlock[0] >> numThreadsPerBlock[1] >> numThreadsPerBlock[2]) {
+            this->entries[key] = numThreadsPerBlock;
+        }
+    }
+}
+
+bool KernelTuningDatabase::find(const std::string& key, std::array<unsigned long, 3>& numThreadsPerBlock) {
+    std::lock_guard<std::mutex> lock(this->entriesMutex); // Auto-unlock, RAII
+    if (!this->loaded) {
+        this->loadFile();
+    }
+    auto entry = this->entries.find(key);
+    if (entry == this->entries.end()) {
+        return false;
+    }
+    numThreadsPerBlock = entry->second;
+    return true;
+}
+
+void KernelTuningDatabase::store(const std::string& key, const std::array<unsigned long, 3>& numThreadsPerBlock) {
+    std::lock_guard<std::mutex> lock(this->entriesMutex); // Auto-unlock, RAII
+    this->entries[key] = numThreadsPerBlock;
+    if (this->file.empty()) {
+        return;
+    }
+    // Appending a single short line keeps the file consistent when several processes tune at the same time
+    std::string directory = this->file.substr(0, this->file.find_last_of('/'));
+    std::ostringstream line;
+    line << key << " " << numThreadsPerBlock[0] << " " << numThreadsPerBlock[1] << " " << numThreadsPerBlock[2] << "\n";
+    std::ofstream database(this->file, std::ios::app);
+    if (!database.is_open() && KernelBinaryCache::createDirectory(directory)) {
+        database.open(this->file, std::ios::app);
+    }
+    database << line.str();
+#ifdef GSPAR_DEBUG
+    std::stringstream ss; // Using stringstream eases multi-threaded debugging
+    ss << "[GSPar KernelTuningDatabase] Stored " << line.str() << std::flush;
+    std::cout << ss.str();
+#endif
+}
+
+void KernelTuningDatabase::clear() {
+    std::lock_guard<std::mutex> lock(this->entriesMutex); // Auto-unlock, RAII
+    this->entries.clear();
+    this->loaded = true; // Doesn't reload the file
+}
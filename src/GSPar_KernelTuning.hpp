@@ -0,0 +1,63 @@
+
+#ifndef __GSPAR_KERNELTUNING_INCLUDED__
+#define __GSPAR_KERNELTUNING_INCLUDED__
+
+#include <string>
+#include <array>
+#include <map>
+#include <mutex>
+
+namespace GSPar {
+    namespace Driver {
+
+        ///// KernelTuningDatabase /////
+
+        /**
+         * Persistent database of the fastest number of threads per block found by the autotuner,
+         * keyed by the kernel, the device and the dimensions it was tuned for.
+         *
+         * The database is a text file shared by every process, taken from the GSPAR_TUNING_FILE environment variable.
+         * It defaults to workgroup_tuning.txt in the kernel binary cache directory, and is kept only in memory
+         * when GSPAR_KERNEL_CACHE_DISABLE is set.
+         */
+        class KernelTuningDatabase {
+        private:
+            std::mutex entriesMutex;
+            std::string file;
+            bool loaded = false;
+            std::map<std::string, std::array<unsigned long, 3>> entries;
+
+            void loadFile();
+
+        public:
+            KernelTuningDatabase();
+
+            static KernelTuningDatabase* getInstance();
+
+            std::string getFile();
+            /**
+             * Changes the database file. An empty name keeps the tuning results only in memory.
+             */
+            void setFile(const std::string file);
+
+            /**
+             * Finds the number of threads per block tuned for a key
+             * @param key Key computed with KernelBinaryCache::computeKey
+             * @param numThreadsPerBlock Filled with the threads per block of each dimension on a hit
+             * @return true if the key was already tuned
+             */
+            bool find(const std::string& key, std::array<unsigned long, 3>& numThreadsPerBlock);
+            /**
+             * Stores a tuning result, also appending it to the database file
+             */
+            void store(const std::string& key, const std::array<unsigned long, 3>& numThreadsPerBlock);
+            /**
+             * Forgets every tuning result kept in memory (the file is not changed)
+             */
+            void clear();
+        };
+
+    }
+}
+
+#endif
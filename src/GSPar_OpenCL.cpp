@@ -1,14 +1,19 @@
 
-#include <regex>
 #include <iostream>
 #include <cstring>
+#include <cstdio>
 #include <vector>
+#include <tuple>
 #ifdef GSPAR_DEBUG
 #include <sstream>
 #include <thread>
 #endif
 
 #include "GSPar_OpenCL.hpp"
+#include "GSPar_KernelCache.hpp"
+#if GSPAR_HOST_STAGING_HUGE_PAGES
+#include <sys/mman.h>
+#endif
 
 using namespace GSPar::Driver::OpenCL;
 
@@ -109,7 +114,7 @@ void Exception::throwIfFailed(cl_int code, std::string details) {
 }
 
 Exception::Exception(cl_int code, cl_program program, cl_device_id device) : Exception(code) {
-    if (code == CL_BUILD_PROGRAM_FAILURE) {
+    if (program && (code == CL_BUILD_PROGRAM_FAILURE || code == CL_COMPILE_PROGRAM_FAILURE || code == CL_LINK_PROGRAM_FAILURE)) {
         size_t log_size;
         clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
         char *log = new char[log_size];
@@ -182,6 +187,23 @@ void ExecutionFlow::synchronize() {
     // throwExceptionIfFailed( clReleaseEvent(evt) );
     throwExceptionIfFailed( clFinish(this->flowObject) );
 }
+bool ExecutionFlow::isFinished() {
+    if (!this->flowObject) {
+        return true;
+    }
+    // The queue is in order, so the marker completes after all the commands enqueued before it
+    cl_event marker;
+    throwExceptionIfFailed( clEnqueueMarkerWithWaitList(this->flowObject, 0, NULL, &marker) );
+    throwExceptionIfFailed( clFlush(this->flowObject) );
+    cl_int status;
+    cl_int result = clGetEventInfo(marker, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+    clReleaseEvent(marker);
+    throwExceptionIfFailed(result);
+    if (status < 0) {
+        throwExceptionIfFailed(status); // Negative statuses are the error of a command
+    }
+    return status == CL_COMPLETE;
+}
 cl_command_queue ExecutionFlow::checkAndStartFlow(Device* device, ExecutionFlow* executionFlow) {
     return BaseExecutionFlow::checkAndStartFlow(device, executionFlow);
 }
@@ -384,11 +406,20 @@ Device::Device(cl_device_id device) {
 }
 Device::~Device() {
     // We don't throw exceptions on destructors
+    this->stagingPool.trim(); // Before the default queue, which unmaps the buffers, is released
     if (this->defaultExecutionFlow) {
         delete this->defaultExecutionFlow;
         this->defaultExecutionFlow = NULL;
     }
 
+    this->programCache.clear(); // Kernels retain their own programs
+    for (auto runtimeProgram : this->runtimeProgramCache.getPrograms()) {
+        if (runtimeProgram) {
+            clReleaseProgram(runtimeProgram);
+        }
+    }
+    this->memoryPool.trim(); // Before the context is released
+
     if (this->libContext) {
         #ifdef GSPAR_DEBUG
             std::stringstream ss; // Using stringstream eases multi-threaded debugging
@@ -405,6 +436,70 @@ Device::~Device() {
         this->libContext = NULL;
     }
 }
+void Device::releaseMemoryBlock(cl_mem memory) {
+    Exception* ex = Exception::checkError( clReleaseMemObject(memory) ); // We don't throw exceptions on destructors
+    if (ex != nullptr) {
+        std::cerr << "Failed when releasing OpenCL memory object: ";
+        std::cerr << ex->what() << " - " << ex->getDetails() << std::endl;
+        delete ex;
+    }
+}
+StagingBuffer Device::allocStagingBuffer(size_t size) {
+    StagingBuffer buffer{NULL, NULL, NULL, 0};
+    cl_mem_flags ocl_flags = CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR;
+#if GSPAR_HOST_STAGING_HUGE_PAGES
+    const size_t hugePageSize = 2UL * 1024 * 1024;
+    if (size >= hugePageSize) {
+        size_t hugePagesSize = ((size + hugePageSize - 1) / hugePageSize) * hugePageSize;
+        void* hugePages = mmap(NULL, hugePagesSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (hugePages != MAP_FAILED) {
+            buffer.hugePages = hugePages;
+            buffer.hugePagesSize = hugePagesSize;
+            ocl_flags = CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR;
+        }
+        // If there are no free huge pages, the buffer allocates regular pinned memory
+    }
+#endif
+    cl_int status;
+    buffer.buffer = clCreateBuffer(this->getContext(), ocl_flags, size, buffer.hugePages, &status);
+    if (status == CL_SUCCESS) {
+        // The buffer stays mapped, so its host memory is used directly by the transfers
+        buffer.pointer = clEnqueueMapBuffer(this->startDefaultExecutionFlow(), buffer.buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+            0, size, 0, NULL, NULL, &status);
+        if (status != CL_SUCCESS) {
+            clReleaseMemObject(buffer.buffer);
+        }
+    }
+    if (status != CL_SUCCESS) {
+#if GSPAR_HOST_STAGING_HUGE_PAGES
+        if (buffer.hugePages) {
+            munmap(buffer.hugePages, buffer.hugePagesSize);
+        }
+#endif
+        throwExceptionIfFailed(status);
+    }
+    return buffer;
+}
+void Device::releaseStagingBuffer(StagingBuffer buffer) {
+    // We don't throw exceptions on destructors
+    cl_event unmapped = NULL;
+    Exception* ex = Exception::checkError( clEnqueueUnmapMemObject(this->startDefaultExecutionFlow(), buffer.buffer, buffer.pointer, 0, NULL, &unmapped) );
+    if (ex == nullptr) {
+        ex = Exception::checkError( clWaitForEvents(1, &unmapped) ); // The host memory may be freed right after
+        clReleaseEvent(unmapped);
+    }
+    if (ex != nullptr) {
+        std::cerr << "Failed when unmapping OpenCL staging buffer: ";
+        std::cerr << ex->what() << " - " << ex->getDetails() << std::endl;
+        delete ex;
+    }
+    releaseMemoryBlock(buffer.buffer);
+#if GSPAR_HOST_STAGING_HUGE_PAGES
+    if (buffer.hugePages) {
+        munmap(buffer.hugePages, buffer.hugePagesSize);
+    }
+#endif
+}
 ExecutionFlow* Device::getDefaultExecutionFlow() {
     if (!this->defaultExecutionFlow) {
         this->defaultExecutionFlow = new ExecutionFlow(this);
@@ -470,15 +565,36 @@ ChunkedMemoryObject* Device::mallocChunked(unsigned int chunks, long chunkSize,
 ChunkedMemoryObject* Device::mallocChunked(unsigned int chunks, long chunkSize, const void** hostPointers) {
     return new ChunkedMemoryObject(this, chunks, chunkSize, hostPointers);
 }
-Kernel* Device::prepareKernel(const std::string kernel_source, const std::string kernel_name) {
-    return new Kernel(this, kernel_source, kernel_name);
+std::vector<std::string> Device::getCompilerFlags(const CompilerOptions& compilerOptions) {
+    std::vector<std::string> flags;
+    for (auto option : compilerOptions.options) {
+        switch (option) {
+            case GSPAR_COMPILER_FAST_MATH:
+                flags.push_back("-cl-fast-relaxed-math");
+                break;
+            case GSPAR_COMPILER_MAD_ENABLE:
+                flags.push_back("-cl-mad-enable");
+                break;
+            case GSPAR_COMPILER_DISABLE_OPTIMIZATIONS:
+                flags.push_back("-cl-opt-disable");
+                break;
+        }
+    }
+    for (auto& definition : compilerOptions.definitions) {
+        flags.push_back("-D " + definition);
+    }
+    flags.insert(flags.end(), compilerOptions.nativeOptions.begin(), compilerOptions.nativeOptions.end());
+    return flags;
+}
+Kernel* Device::prepareKernel(const std::string kernel_source, const std::string kernel_name, const CompilerOptions& compilerOptions) {
+    return new Kernel(this, kernel_source, kernel_name, compilerOptions);
 }
-std::vector<Kernel*> Device::prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames) {
-    cl_program oclProgram = this->compileOCLProgram(kernelSource);
+std::vector<Kernel*> Device::prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames, const CompilerOptions& compilerOptions) {
+    auto oclProgram = this->getProgram(kernelSource, compilerOptions);
 
     std::vector<Kernel*> kernels;
     for (auto name : kernelNames) {
-        kernels.push_back(new Kernel(this, oclProgram, name));
+        kernels.push_back(new Kernel(this, oclProgram.get(), name));
     }
     return kernels;
 }
@@ -503,7 +619,56 @@ const T* Device::queryInfoDevice(cl_device_info paramName, bool cacheable) {
     }
     return value;
 }
-cl_program Device::compileOCLProgram(std::string source) {
+std::shared_ptr<_cl_program> Device::getProgram(std::string source, const CompilerOptions& compilerOptions) {
+    std::string normalizedSource = ProgramCache<std::shared_ptr<_cl_program>>::normalizeSource(source);
+    // The same source built with other flags is another program
+    std::vector<std::string> compilerFlags = this->getCompilerFlags(compilerOptions);
+    std::string key = normalizedSource;
+    for (auto& flag : compilerFlags) {
+        key += "\n// " + flag;
+    }
+    return this->programCache.getOrCompile(key, [this, &normalizedSource, &compilerFlags]() {
+        return std::shared_ptr<_cl_program>(this->compileOCLProgram(normalizedSource, compilerFlags), clReleaseProgram);
+    });
+}
+cl_program Device::getRuntimeProgram(const std::vector<std::string> compilerFlags) {
+#if GSPAR_LINK_DEVICE_RUNTIME
+    // Separate compilation and linking were introduced in OpenCL 1.2
+    std::string version = this->queryInfoDevice<char>(CL_DEVICE_VERSION); // "OpenCL <major>.<minor> <vendor-specific>"
+    int major = 0, minor = 0;
+    if (sscanf(version.c_str(), "OpenCL %d.%d", &major, &minor) != 2 || major < 1 || (major == 1 && minor < 2)) {
+        return NULL;
+    }
+
+    // The runtime is compiled with the same flags of the kernels that will link it
+    std::string options = "";
+    for (auto& flag : compilerFlags) {
+        options.append(flag + " ");
+    }
+    return this->runtimeProgramCache.getOrCompile(options, [this, &options]() {
+        std::string runtimeSource = "#pragma OPENCL EXTENSION all: enable\n";
+        runtimeSource.append(Instance::getInstance()->getKernelGenerator()->generateStdFunctions());
+        const char* src = runtimeSource.c_str();
+        cl_device_id devId = this->getBaseDeviceObject();
+        cl_int status;
+
+#ifdef GSPAR_DEBUG
+        std::stringstream ss; // Using stringstream eases multi-threaded debugging
+        ss << "[GSPar Device " << this << "] Compiling GSPar runtime with arguments: " << options << std::endl;
+        std::cout << ss.str();
+#endif
+
+        cl_program runtimeProgram = clCreateProgramWithSource(this->getContext(), 1, &src, NULL, &status);
+        Exception::throwIfFailed(status, runtimeProgram, devId);
+        status = clCompileProgram(runtimeProgram, 1, &devId, options.c_str(), 0, NULL, NULL, NULL, NULL);
+        Exception::throwIfFailed(status, runtimeProgram, devId);
+        return runtimeProgram;
+    });
+#else
+    return NULL;
+#endif
+}
+cl_program Device::compileOCLProgram(std::string source, const std::vector<std::string> compilerFlags) {
 #ifdef GSPAR_DEBUG
     std::stringstream ss; // Using stringstream eases multi-threaded debugging
     ss << "[GSPar Device " << this << "] Kernel received to compile: \n" << source << std::endl;
@@ -511,11 +676,18 @@ cl_program Device::compileOCLProgram(std::string source) {
     ss.str("");
 #endif
 
+    KernelGenerator* kernelGenerator = Instance::getInstance()->getKernelGenerator();
+    // When the GSPar runtime is linked, the kernel only needs the declarations of its functions
+    cl_program runtimeProgram = this->getRuntimeProgram(compilerFlags);
     std::string openclExtensions = "#pragma OPENCL EXTENSION all: enable\n";
     std::string completeKernelSource = "";
     completeKernelSource.append(openclExtensions);
-    completeKernelSource.append(Instance::getInstance()->getKernelGenerator()->generateStdFunctions());
-    completeKernelSource.append(Instance::getInstance()->getKernelGenerator()->replaceMacroKeywords(source));
+    if (runtimeProgram) {
+        completeKernelSource.append(kernelGenerator->generateStdFunctionDeclarations());
+    } else {
+        completeKernelSource.append(kernelGenerator->generateStdFunctions());
+    }
+    completeKernelSource.append(kernelGenerator->replaceMacroKeywords(source));
 
 #ifdef GSPAR_DEBUG
     ss << "[GSPar Device " << this << "] Complete kernel for compilation: \n" << completeKernelSource << std::endl;
@@ -523,7 +695,7 @@ cl_program Device::compileOCLProgram(std::string source) {
     ss.str("");
 #endif
 
-    cl_program oclProgram;
+    cl_program oclProgram = NULL;
     cl_device_id devId = this->getBaseDeviceObject();
 
     // Place for inserting any additional macros
@@ -533,6 +705,9 @@ cl_program Device::compileOCLProgram(std::string source) {
     macrosGspar.append(" -D GSPAR_DEVICE_SHARED_MEMORY=" + KernelGenerator::SHARED_MEMORY_PREFIX);
     macrosGspar.append(" -D GSPAR_DEVICE_CONSTANT=" + KernelGenerator::CONSTANT_PREFIX);
     macrosGspar.append(" -D GSPAR_DEVICE_FUNCTION=" + KernelGenerator::DEVICE_FUNCTION_PREFIX);
+    for (auto& flag : compilerFlags) {
+        macrosGspar.append(" " + flag);
+    }
     const char *compilationOptions = macrosGspar.c_str();
 
 #ifdef GSPAR_DEBUG
@@ -543,12 +718,59 @@ cl_program Device::compileOCLProgram(std::string source) {
 #endif
 
     cl_int status;
+
+    // Tries to reuse a binary built by a previous execution
+    KernelBinaryCache* cache = KernelBinaryCache::getInstance();
+    std::string cacheKey = KernelBinaryCache::computeKey({ "opencl", completeKernelSource, runtimeProgram ? kernelGenerator->generateStdFunctions() : "", macrosGspar, this->getName(), this->queryInfoDevice<char>(CL_DRIVER_VERSION) });
+    std::vector<char> binary;
+    if (cache->load(cacheKey, binary)) {
+        size_t binarySize = binary.size();
+        const unsigned char* binaryPtr = (const unsigned char*)binary.data();
+        cl_int binaryStatus;
+        oclProgram = clCreateProgramWithBinary(this->getContext(), 1, &devId, &binarySize, &binaryPtr, &binaryStatus, &status);
+        if (status == CL_SUCCESS && binaryStatus == CL_SUCCESS) {
+            status = clBuildProgram(oclProgram, 1, &devId, compilationOptions, NULL, NULL);
+            if (status == CL_SUCCESS) {
+                return oclProgram;
+            }
+        }
+        // An unusable binary (e.g., from an updated runtime) is simply rebuilt from source and replaced
+        if (oclProgram) {
+            clReleaseProgram(oclProgram);
+        }
+    }
+
     const char* src = completeKernelSource.c_str();
-    oclProgram = clCreateProgramWithSource(this->getContext(), 1, &src, NULL, &status);
-    Exception::throwIfFailed(status, oclProgram, devId);
+    if (runtimeProgram) {
+        // Compiles only the user code and links it with the runtime already compiled for this device
+        cl_program userObject = clCreateProgramWithSource(this->getContext(), 1, &src, NULL, &status);
+        Exception::throwIfFailed(status, userObject, devId);
+
+        status = clCompileProgram(userObject, 1, &devId, compilationOptions, 0, NULL, NULL, NULL, NULL);
+        Exception::throwIfFailed(status, userObject, devId);
+
+        cl_program linkInputs[] = { runtimeProgram, userObject };
+        oclProgram = clLinkProgram(this->getContext(), 1, &devId, "", 2, linkInputs, NULL, NULL, &status);
+        clReleaseProgram(userObject);
+        Exception::throwIfFailed(status, oclProgram, devId);
+    } else {
+        oclProgram = clCreateProgramWithSource(this->getContext(), 1, &src, NULL, &status);
+        Exception::throwIfFailed(status, oclProgram, devId);
 
-    status = clBuildProgram(oclProgram, 1, &devId, compilationOptions, NULL, NULL);
-    Exception::throwIfFailed(status, oclProgram, devId);
+        status = clBuildProgram(oclProgram, 1, &devId, compilationOptions, NULL, NULL);
+        Exception::throwIfFailed(status, oclProgram, devId);
+    }
+
+    if (cache->isEnabled()) {
+        size_t binarySize = 0;
+        if (clGetProgramInfo(oclProgram, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL) == CL_SUCCESS && binarySize > 0) {
+            binary.resize(binarySize);
+            unsigned char* binaryPtr = (unsigned char*)binary.data();
+            if (clGetProgramInfo(oclProgram, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binaryPtr, NULL) == CL_SUCCESS) {
+                cache->store(cacheKey, binary.data(), binarySize);
+            }
+        }
+    }
 
     return oclProgram;
 }
@@ -563,16 +785,19 @@ void Kernel::loadOclKernel(const std::string kernelName) {
 }
 
 Kernel::Kernel() : BaseKernel() { }
-Kernel::Kernel(Device* device, const std::string kernelSource, const std::string kernelName) : BaseKernel(device, kernelSource, kernelName) {
-    this->oclProgram = device->compileOCLProgram(kernelSource);
-
-    this->isPrecompiled = false; //Kernel owns oclProgram
+Kernel::Kernel(Device* device, const std::string kernelSource, const std::string kernelName, const CompilerOptions& compilerOptions) : BaseKernel(device, kernelSource, kernelName) {
+    auto oclProgram = device->getProgram(kernelSource, compilerOptions);
+    // The program may be shared with other kernels and evicted from the device's cache, so the kernel keeps its own reference
+    this->oclProgram = oclProgram.get();
+    throwExceptionIfFailed( clRetainProgram(this->oclProgram) );
+    this->isPrecompiled = false;
 
     this->loadOclKernel(kernelName);
 }
 Kernel::Kernel(Device* device, cl_program oclProgram, const std::string kernelName) : BaseKernel(device) {
     this->oclProgram = oclProgram;
-    this->isPrecompiled = true; //Kernel shares oclProgram
+    throwExceptionIfFailed( clRetainProgram(this->oclProgram) ); // Kernel shares oclProgram
+    this->isPrecompiled = false;
 
     this->loadOclKernel(kernelName);
 }
@@ -613,13 +838,10 @@ void Kernel::cloneInto(BaseKernelBase* baseOther) {
     BaseKernel::cloneInto(baseOther);
     Kernel* other = static_cast<Kernel*>(baseOther);
     other->oclProgram = this->oclProgram;
-    // cl_kernel objects are not thread-safe (OpenCL 1.2 Specification p. 360)
+    throwExceptionIfFailed( clRetainProgram(other->oclProgram) ); // Each clone keeps its own reference to the shared program
+    other->isPrecompiled = false;
+    // cl_kernel objects are not thread-safe (OpenCL 1.2 Specification p. 360), so each clone gets its own handle of the same program
     other->loadOclKernel(this->kernelName);
-    // We do not mark this kernel as precompiled, so it destroys the cl_program on destructor.
-    // However, once it is destroyed, the cloned pattern cannot be further cloned because we need the program to call clCreateKernel (called during the clone process)
-    // TODO I haven't tested, but this probably causes issues
-    // this->isPrecompiled = true;
-    other->isPrecompiled = true;
 }
 int Kernel::setParameter(MemoryObject* memoryObject) {
     cl_mem oclObject = memoryObject->getBaseMemoryObject();
@@ -737,9 +959,112 @@ T* Kernel::queryInfo(cl_kernel_work_group_info param, bool cacheable) {
 }
 
 
+///// StagingArea /////
+
+struct StagedCopy {
+    std::vector<std::tuple<void*, const void*, size_t>> parts; // Host memory, staging memory and size
+    cl_event copiedEvent;
+};
+static void CL_CALLBACK copyStagedToHost(cl_event readEvent, cl_int status, void* userData) {
+    // Runs in a thread of the driver, which must not call blocking OpenCL functions
+    StagedCopy* stagedCopy = static_cast<StagedCopy*>(userData);
+    if (status == CL_COMPLETE) {
+        for (auto& part : stagedCopy->parts) {
+            memcpy(std::get<0>(part), std::get<1>(part), std::get<2>(part));
+        }
+    }
+    clSetUserEventStatus(stagedCopy->copiedEvent, status); // A failed read also fails the commands waiting for the copy
+    clReleaseEvent(stagedCopy->copiedEvent);
+    delete stagedCopy;
+}
+
+StagingArea::StagingArea(Device* device, unsigned int regions, size_t regionSize) :
+        device(device), size(regions * regionSize), regionSize(regionSize), events(regions, NULL) {
+    this->buffer = device->getStagingPool().allocate(this->size, 0, [device](size_t size) { return device->allocStagingBuffer(size); });
+}
+StagingArea::~StagingArea() {
+    // We don't throw exceptions on destructors
+    for (cl_event event : this->events) {
+        if (event) {
+            clWaitForEvents(1, &event); // The buffer is reused as soon as it is back in the pool
+            clReleaseEvent(event);
+        }
+    }
+    this->device->getStagingPool().release(this->buffer, this->size, 0);
+}
+unsigned char* StagingArea::getRegion(unsigned int region) {
+    if (this->events[region]) {
+        throwExceptionIfFailed( clWaitForEvents(1, &this->events[region]) );
+    }
+    return static_cast<unsigned char*>(this->buffer.pointer) + region * this->regionSize;
+}
+void StagingArea::setTransferEvent(unsigned int region, cl_event event) {
+    throwExceptionIfFailed( clRetainEvent(event) );
+    if (this->events[region]) {
+        clReleaseEvent(this->events[region]);
+    }
+    this->events[region] = event;
+}
+void StagingArea::copyRegionToHost(unsigned int region, size_t offset, void* hostPtr, size_t size, cl_event readEvent, cl_command_queue oclQueue) {
+    this->copyRegionsToHost({ std::make_tuple(region, offset, hostPtr, size) }, readEvent, oclQueue);
+}
+void StagingArea::copyRegionsToHost(const std::vector<std::tuple<unsigned int, size_t, void*, size_t>>& parts, cl_event readEvent, cl_command_queue oclQueue) {
+    cl_int status;
+    cl_event copiedEvent = clCreateUserEvent(this->device->getContext(), &status);
+    throwExceptionIfFailed(status);
+    throwExceptionIfFailed( clRetainEvent(copiedEvent) ); // Released by the callback
+    StagedCopy* stagedCopy = new StagedCopy();
+    stagedCopy->copiedEvent = copiedEvent;
+    for (auto& part : parts) {
+        const void* stagingPtr = static_cast<unsigned char*>(this->buffer.pointer) + std::get<0>(part) * this->regionSize + std::get<1>(part);
+        stagedCopy->parts.push_back(std::make_tuple(std::get<2>(part), stagingPtr, std::get<3>(part)));
+    }
+    status = clSetEventCallback(readEvent, CL_COMPLETE, copyStagedToHost, stagedCopy);
+    if (status != CL_SUCCESS) {
+        clReleaseEvent(copiedEvent);
+        clReleaseEvent(copiedEvent);
+        delete stagedCopy;
+        throwExceptionIfFailed(status);
+    }
+    bool firstRegion = true;
+    for (auto& part : parts) {
+        unsigned int region = std::get<0>(part);
+        if (this->events[region] == copiedEvent) {
+            continue;
+        }
+        if (!firstRegion) {
+            clRetainEvent(copiedEvent); // Each region releases its own reference
+        }
+        firstRegion = false;
+        if (this->events[region]) {
+            clReleaseEvent(this->events[region]);
+        }
+        this->events[region] = copiedEvent; // The region is free only after the copy to the host memory
+    }
+    throwExceptionIfFailed( clEnqueueMarkerWithWaitList(oclQueue, 1, &copiedEvent, NULL) );
+}
+
+
+
 ///// MemoryObject /////
 
-void MemoryObject::copy(bool in, bool async, ExecutionFlow* executionFlow) {
+StagingArea* MemoryObject::getStagingArea() {
+#if GSPAR_HOST_STAGING_BUFFERS
+    // OpenCL has no way to pin host memory, so we always stage it
+    if (this->zeroCopy) {
+        return NULL;
+    }
+    if (!this->stagingArea) {
+        this->stagingArea.reset(new StagingArea(this->device, 1, this->allocatedSize));
+    }
+    return this->stagingArea.get();
+#else
+    return NULL;
+#endif
+}
+
+void MemoryObject::copy(bool in, bool async, size_t offset, size_t length, ExecutionFlow* executionFlow) {
+    this->checkRange(offset, length, this->size);
     cl_event *evt = new cl_event;
     cl_bool blocking = async ? CL_FALSE : CL_TRUE;
     int numEvtsToWait = 0;
@@ -756,17 +1081,46 @@ void MemoryObject::copy(bool in, bool async, ExecutionFlow* executionFlow) {
     }
 
     cl_command_queue oclQueue = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
+    StagingArea* stagingArea = async ? this->getStagingArea() : NULL;
 
-    if (in) {
+    if (this->zeroCopy) {
+        // Mapping synchronizes the host memory with the device without copies. Mapping to write doesn't read the device memory
+        cl_int status;
+        cl_event mapped;
+        void* mappedPtr = clEnqueueMapBuffer(oclQueue, this->devicePtr, CL_FALSE, in ? CL_MAP_WRITE_INVALIDATE_REGION : CL_MAP_READ,
+            offset, length, numEvtsToWait, evtToWait, &mapped, &status);
+        throwExceptionIfFailed(status);
+        status = clEnqueueUnmapMemObject(oclQueue, this->devicePtr, mappedPtr, 1, &mapped, evt);
+        clReleaseEvent(mapped);
+        throwExceptionIfFailed(status);
+        if (blocking) {
+            throwExceptionIfFailed( clWaitForEvents(1, evt) );
+        }
+    } else if (in) {
+        const void* source = static_cast<unsigned char*>(this->hostPtr) + offset;
+        if (stagingArea) {
+            // The host memory is copied before returning, so it can be changed while the transfer runs
+            unsigned char* stagingPtr = stagingArea->getRegion(0) + offset;
+            memcpy(stagingPtr, source, length);
+            source = stagingPtr;
+        }
         throwExceptionIfFailed( clEnqueueWriteBuffer(
             oclQueue, this->devicePtr,
-            blocking, 0, this->size, this->hostPtr,
+            blocking, offset, length, source,
             numEvtsToWait, evtToWait, evt) );
+        if (stagingArea) {
+            stagingArea->setTransferEvent(0, *evt);
+        }
     } else { //copy out
+        void* hostPtr = static_cast<unsigned char*>(this->hostPtr) + offset;
+        void* destination = stagingArea ? stagingArea->getRegion(0) + offset : hostPtr;
         throwExceptionIfFailed( clEnqueueReadBuffer(
             oclQueue, this->devicePtr,
-            blocking, 0, this->size, this->hostPtr,
+            blocking, offset, length, destination,
             numEvtsToWait, evtToWait, evt) );
+        if (stagingArea) {
+            stagingArea->copyRegionToHost(0, offset, hostPtr, length, *evt, oclQueue);
+        }
     }
     if (this->getBaseAsyncObject()) { // Releases old async event handler
         this->releaseBaseAsyncObject();
@@ -787,8 +1141,6 @@ void MemoryObject::copy(bool in, bool async, ExecutionFlow* executionFlow) {
 }
 
 void MemoryObject::allocDeviceMemory() {
-    cl_int status;
-
     // Security check is already done in base class
     cl_mem_flags ocl_flags = CL_MEM_READ_WRITE;
     if (this->isReadOnly()) {
@@ -797,8 +1149,25 @@ void MemoryObject::allocDeviceMemory() {
         ocl_flags = CL_MEM_WRITE_ONLY;
     }
 
-    this->devicePtr = clCreateBuffer(device->getContext(), ocl_flags, size, NULL, &status);
-    throwExceptionIfFailed(status);
+    cl_context context = device->getContext();
+    this->allocatedSize = this->size;
+#if GSPAR_ZERO_COPY
+    // Devices that share the host memory (e.g., CPUs and integrated GPUs) use aligned host memory directly
+    if (this->hostPtr && isHostMemoryAligned(this->hostPtr) && this->device->isIntegratedMainMemory()) {
+        cl_int status;
+        this->devicePtr = clCreateBuffer(context, ocl_flags | CL_MEM_USE_HOST_PTR, this->size, this->hostPtr, &status);
+        throwExceptionIfFailed(status);
+        this->zeroCopy = true;
+        return;
+    }
+#endif
+    // Buffers with the same flags are reused from the device's pool
+    this->devicePtr = this->device->getMemoryPool().allocate(this->size, this->flags, [context, ocl_flags](size_t size) {
+        cl_int status;
+        cl_mem memory = clCreateBuffer(context, ocl_flags, size, NULL, &status);
+        throwExceptionIfFailed(status);
+        return memory;
+    });
 }
 MemoryObject::MemoryObject(Device* device, size_t size, void* hostPtr, bool readOnly, bool writeOnly) : BaseMemoryObject(device, size, hostPtr, readOnly, writeOnly) {
     this->allocDeviceMemory();
@@ -814,25 +1183,66 @@ MemoryObject::~MemoryObject() {
             std::cout << ss.str();
             ss.str("");
         #endif
-        Exception* ex = Exception::checkError( clReleaseMemObject(this->devicePtr) ); // We don't throw exceptions on destructors
-        if (ex != nullptr) {
-            std::cerr << "Failed when releasing OpenCL memory object: ";
-            std::cerr << ex->what() << " - " << ex->getDetails() << std::endl;
-            delete ex;
+        if (this->zeroCopy) {
+            Device::releaseMemoryBlock(this->devicePtr); // We don't throw exceptions on destructors
+        } else {
+            this->device->getMemoryPool().release(this->devicePtr, this->allocatedSize, this->flags); // We don't throw exceptions on destructors
         }
         this->devicePtr = NULL;
     }
 }
-void MemoryObject::copyIn() { copy(true, false); }
-void MemoryObject::copyOut() { copy(false, false); }
-void MemoryObject::copyInAsync(ExecutionFlow* executionFlow) { copy(true, true, executionFlow); }
-void MemoryObject::copyOutAsync(ExecutionFlow* executionFlow) { copy(false, true, executionFlow); }
+void MemoryObject::bindTo(void* hostPtr) {
+    if (this->zeroCopy && hostPtr != this->hostPtr) {
+        // The buffer would keep writing in the previous host memory, so the data moves to a buffer of our own
+        cl_context context = this->device->getContext();
+        cl_mem_flags ocl_flags = this->isReadOnly() ? CL_MEM_READ_ONLY : (this->isWriteOnly() ? CL_MEM_WRITE_ONLY : CL_MEM_READ_WRITE);
+        cl_mem deviceMemory = this->device->getMemoryPool().allocate(this->allocatedSize, this->flags, [context, ocl_flags](size_t size) {
+            cl_int status;
+            cl_mem memory = clCreateBuffer(context, ocl_flags, size, NULL, &status);
+            throwExceptionIfFailed(status);
+            return memory;
+        });
+        cl_command_queue oclQueue = this->device->startDefaultExecutionFlow();
+        cl_event copied;
+        throwExceptionIfFailed( clEnqueueCopyBuffer(oclQueue, this->devicePtr, deviceMemory, 0, 0, this->allocatedSize, 0, NULL, &copied) );
+        throwExceptionIfFailed( clWaitForEvents(1, &copied) );
+        clReleaseEvent(copied);
+        Device::releaseMemoryBlock(this->devicePtr);
+        this->devicePtr = deviceMemory;
+        this->zeroCopy = false;
+    }
+    BaseMemoryObject::bindTo(hostPtr);
+}
+void MemoryObject::copyIn() { copy(true, false, 0, this->size); }
+void MemoryObject::copyOut() { copy(false, false, 0, this->size); }
+void MemoryObject::copyInAsync(ExecutionFlow* executionFlow) { copy(true, true, 0, this->size, executionFlow); }
+void MemoryObject::copyOutAsync(ExecutionFlow* executionFlow) { copy(false, true, 0, this->size, executionFlow); }
+void MemoryObject::copyIn(size_t offset, size_t length) { copy(true, false, offset, length); }
+void MemoryObject::copyOut(size_t offset, size_t length) { copy(false, false, offset, length); }
+void MemoryObject::copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) { copy(true, true, offset, length, executionFlow); }
+void MemoryObject::copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) { copy(false, true, offset, length, executionFlow); }
 
 
 ///// ChunkedMemoryObject /////
 
-void ChunkedMemoryObject::copy(bool in, bool async, unsigned int chunkFrom, unsigned int chunkTo, ExecutionFlow* executionFlow) {
-    unsigned int numChunksToCopy = chunkTo - chunkFrom;
+StagingArea* ChunkedMemoryObject::getStagingArea() {
+#if GSPAR_HOST_STAGING_BUFFERS
+    if (!this->stagingArea) {
+        this->stagingArea.reset(new StagingArea(this->device, this->chunks, this->getChunkSize()));
+    }
+    return this->stagingArea.get();
+#else
+    return NULL;
+#endif
+}
+
+void ChunkedMemoryObject::copy(bool in, bool async, size_t offset, size_t length, ExecutionFlow* executionFlow) {
+    // The part of the range in each chunk: chunk, offset in the chunk and length
+    std::vector<std::tuple<unsigned int, size_t, size_t>> parts;
+    this->forEachChunkInRange(offset, length, [&parts](unsigned int chunk, size_t chunkOffset, size_t partLength) {
+        parts.push_back(std::make_tuple(chunk, chunkOffset, partLength));
+    });
+    unsigned int numChunksToCopy = parts.size();
     cl_event *newEvents = new cl_event[numChunksToCopy];
 
     cl_bool blocking = async ? CL_FALSE : CL_TRUE;
@@ -844,18 +1254,58 @@ void ChunkedMemoryObject::copy(bool in, bool async, unsigned int chunkFrom, unsi
     }
 
     cl_command_queue oclQueue = ExecutionFlow::checkAndStartFlow(this->device, executionFlow);
+    StagingArea* stagingArea = async ? this->getStagingArea() : NULL;
+
+    if (!in && stagingArea && numChunksToCopy) {
+        // The regions of the staging area are laid out as the chunks in the device memory,
+        // so the whole range is read at once and then scattered to the host memory of each chunk
+        std::vector<std::tuple<unsigned int, size_t, void*, size_t>> stagedParts;
+        unsigned char* stagingPtr = NULL;
+        for (auto& part : parts) {
+            unsigned int chunk = std::get<0>(part);
+            unsigned char* regionPtr = stagingArea->getRegion(chunk) + std::get<1>(part); // Waits for the previous transfer of the region
+            if (!stagingPtr) {
+                stagingPtr = regionPtr;
+            }
+            stagedParts.push_back(std::make_tuple(chunk, std::get<1>(part), static_cast<unsigned char*>(this->hostPointers[chunk]) + std::get<1>(part), std::get<2>(part)));
+        }
+        numChunksToCopy = 1; // A single event
+        throwExceptionIfFailed( clEnqueueReadBuffer(
+            oclQueue, this->devicePtr,
+            blocking, offset, length, stagingPtr,
+            currentNumEvents, currentEvents, &newEvents[0]) );
+        stagingArea->copyRegionsToHost(stagedParts, newEvents[0], oclQueue);
+        parts.clear();
+    }
 
-    for (unsigned int chunk = chunkFrom, evtIdx = 0; chunk < chunkTo; chunk++, evtIdx++) {
+    for (unsigned int evtIdx = 0; evtIdx < parts.size(); evtIdx++) {
+        unsigned int chunk = std::get<0>(parts[evtIdx]);
+        size_t chunkOffset = std::get<1>(parts[evtIdx]);
+        size_t partLength = std::get<2>(parts[evtIdx]);
+        unsigned char* hostPtr = static_cast<unsigned char*>(this->hostPointers[chunk]) + chunkOffset;
         if (in) {
+            const void* source = hostPtr;
+            if (stagingArea) {
+                unsigned char* stagingPtr = stagingArea->getRegion(chunk) + chunkOffset;
+                memcpy(stagingPtr, hostPtr, partLength);
+                source = stagingPtr;
+            }
             throwExceptionIfFailed( clEnqueueWriteBuffer(
                 oclQueue, this->devicePtr,
-                blocking, chunk * this->getChunkSize(), this->getChunkSize(), this->hostPointers[chunk],
+                blocking, chunk * this->getChunkSize() + chunkOffset, partLength, source,
                 currentNumEvents, currentEvents, &newEvents[evtIdx]) );
+            if (stagingArea) {
+                stagingArea->setTransferEvent(chunk, newEvents[evtIdx]);
+            }
         } else { //copy out
+            void* destination = stagingArea ? stagingArea->getRegion(chunk) + chunkOffset : hostPtr;
             throwExceptionIfFailed( clEnqueueReadBuffer(
                 oclQueue, this->devicePtr,
-                blocking, chunk * this->getChunkSize(), this->getChunkSize(), this->hostPointers[chunk],
+                blocking, chunk * this->getChunkSize() + chunkOffset, partLength, destination,
                 currentNumEvents, currentEvents, &newEvents[evtIdx]) );
+            if (stagingArea) {
+                stagingArea->copyRegionToHost(chunk, chunkOffset, hostPtr, partLength, newEvents[evtIdx], oclQueue);
+            }
         }
     }
     if (this->getBaseAsyncObject()) { // Releases old async event handler
@@ -876,8 +1326,6 @@ void ChunkedMemoryObject::copy(bool in, bool async, unsigned int chunkFrom, unsi
 }
 
 void ChunkedMemoryObject::allocDeviceMemory() {
-    cl_int status;
-
     // Security check is already done in base class
     cl_mem_flags ocl_flags = CL_MEM_READ_WRITE;
     if (this->isReadOnly()) {
@@ -887,8 +1335,14 @@ void ChunkedMemoryObject::allocDeviceMemory() {
     }
 
     // We allocate space for all the memory chunks
-    this->devicePtr = clCreateBuffer(device->getContext(), ocl_flags, this->getChunkSize() * this->chunks, NULL, &status);
-    throwExceptionIfFailed(status);
+    cl_context context = device->getContext();
+    this->allocatedSize = this->getChunkSize() * this->chunks;
+    this->devicePtr = this->device->getMemoryPool().allocate(this->allocatedSize, this->flags, [context, ocl_flags](size_t size) {
+        cl_int status;
+        cl_mem memory = clCreateBuffer(context, ocl_flags, size, NULL, &status);
+        throwExceptionIfFailed(status);
+        return memory;
+    });
 }
 ChunkedMemoryObject::ChunkedMemoryObject(Device* device, unsigned int chunks, size_t chunkSize, void** hostPointers, bool readOnly, bool writeOnly) :
         BaseChunkedMemoryObject(device, chunks, chunkSize, hostPointers, readOnly, writeOnly) {
@@ -899,16 +1353,23 @@ ChunkedMemoryObject::ChunkedMemoryObject(Device* device, unsigned int chunks, si
     this->allocDeviceMemory();
 }
 ChunkedMemoryObject::~ChunkedMemoryObject() {
-    //devicePtr is released in ~MemoryObject
+    if (this->devicePtr) {
+        this->device->getMemoryPool().release(this->devicePtr, this->allocatedSize, this->flags); // We don't throw exceptions on destructors
+        this->devicePtr = NULL;
+    }
 }
-void ChunkedMemoryObject::copyIn() { copy(true, false, 0, this->chunks); }
-void ChunkedMemoryObject::copyOut() { copy(false, false, 0, this->chunks); }
-void ChunkedMemoryObject::copyInAsync(ExecutionFlow* executionFlow) { copy(true, true, 0, this->chunks, executionFlow); }
-void ChunkedMemoryObject::copyOutAsync(ExecutionFlow* executionFlow) { copy(false, true, 0, this->chunks, executionFlow); }
-void ChunkedMemoryObject::copyIn(unsigned int chunk) { copy(true, false, chunk, chunk+1); }
-void ChunkedMemoryObject::copyOut(unsigned int chunk) { copy(false, false, chunk, chunk+1); }
-void ChunkedMemoryObject::copyInAsync(unsigned int chunk, ExecutionFlow* executionFlow) { copy(true, true, chunk, chunk+1, executionFlow); }
-void ChunkedMemoryObject::copyOutAsync(unsigned int chunk, ExecutionFlow* executionFlow) { copy(false, true, chunk, chunk+1, executionFlow); }
+void ChunkedMemoryObject::copyIn() { copy(true, false, 0, this->chunks * this->getChunkSize()); }
+void ChunkedMemoryObject::copyOut() { copy(false, false, 0, this->chunks * this->getChunkSize()); }
+void ChunkedMemoryObject::copyInAsync(ExecutionFlow* executionFlow) { copy(true, true, 0, this->chunks * this->getChunkSize(), executionFlow); }
+void ChunkedMemoryObject::copyOutAsync(ExecutionFlow* executionFlow) { copy(false, true, 0, this->chunks * this->getChunkSize(), executionFlow); }
+void ChunkedMemoryObject::copyIn(unsigned int chunk) { copy(true, false, chunk * this->getChunkSize(), this->getChunkSize()); }
+void ChunkedMemoryObject::copyOut(unsigned int chunk) { copy(false, false, chunk * this->getChunkSize(), this->getChunkSize()); }
+void ChunkedMemoryObject::copyInAsync(unsigned int chunk, ExecutionFlow* executionFlow) { copy(true, true, chunk * this->getChunkSize(), this->getChunkSize(), executionFlow); }
+void ChunkedMemoryObject::copyOutAsync(unsigned int chunk, ExecutionFlow* executionFlow) { copy(false, true, chunk * this->getChunkSize(), this->getChunkSize(), executionFlow); }
+void ChunkedMemoryObject::copyIn(size_t offset, size_t length) { copy(true, false, offset, length); }
+void ChunkedMemoryObject::copyOut(size_t offset, size_t length) { copy(false, false, offset, length); }
+void ChunkedMemoryObject::copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) { copy(true, true, offset, length, executionFlow); }
+void ChunkedMemoryObject::copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow) { copy(false, true, offset, length, executionFlow); }
 
 
 ///// StreamElement /////
@@ -952,10 +1413,17 @@ std::string KernelGenerator::generateStdFunctions() {
     "} \n"
     ;
 }
-std::string KernelGenerator::replaceMacroKeywords(std::string kernelSource) {
-    kernelSource = std::regex_replace(kernelSource, std::regex("GSPAR_DEVICE_MACRO_BEGIN"), "#define");
-    kernelSource = std::regex_replace(kernelSource, std::regex("GSPAR_DEVICE_MACRO_END"), "\n");
-    return kernelSource;
+std::string KernelGenerator::generateStdFunctionDeclarations() {
+    return ""
+    "size_t gspar_get_global_id(unsigned int dimension); \n"
+    "size_t gspar_get_thread_id(unsigned int dimension); \n"
+    "size_t gspar_get_block_id(unsigned int dimension); \n"
+    "size_t gspar_get_block_size(unsigned int dimension); \n"
+    "size_t gspar_get_grid_size(unsigned int dimension); \n"
+    "void gspar_synchronize_local_threads(); \n"
+    "int gspar_atomic_add_int(__global int *valq, int delta); \n"
+    "double gspar_atomic_add_double(__global double *valq, double delta); \n"
+    ;
 }
 std::string KernelGenerator::generateInitKernel(Pattern::BaseParallelPattern* pattern, Dimensions max) {
     return "";
@@ -966,8 +1434,7 @@ std::string KernelGenerator::generateParams(Pattern::BaseParallelPattern* patter
         if (dims.is(d)) {
             std::string varName = this->getStdVarNameForDimension(pattern->getStdVarNames(), d);
             r += "const unsigned long gspar_max_" + varName + ",";
-            if (dims[d].min && !pattern->isBatched()) {
-                // TODO Support min in batches
+            if (pattern->isUsingMinParameter(dims, d)) {
                 r += "const unsigned long gspar_min_" + varName + ",";
             }
         }
@@ -1010,16 +1477,15 @@ std::string KernelGenerator::generateStdVariables(Pattern::BaseParallelPattern*
                 r += "size_t " + varName;
             }
             r += " = gspar_get_global_id(" + std::to_string(d) + ")";
-            if (dims[d].min && !pattern->isBatched()) {
-                // TODO Support min in batches
+            if (pattern->isUsingMinParameter(dims, d)) {
                 r += " + gspar_min_" + varName;
             }
             r += "; \n";
             // TODO Support multi-dimensional batches
             if (pattern->isBatched()) {
                 // Intended implicit floor(gspar_global/dims)
-                r += "size_t gspar_batch_" + varName + " = ((size_t)(gspar_global_" + varName + " / " + std::to_string(dims[d].max) + ")); \n";
-                r += "size_t gspar_offset_" + varName + " = gspar_batch_" + varName + " * " + std::to_string(dims[d].max) + "; \n";
+                r += "size_t gspar_batch_" + varName + " = ((size_t)(gspar_global_" + varName + " / gspar_max_" + varName + ")); \n";
+                r += "size_t gspar_offset_" + varName + " = gspar_batch_" + varName + " * gspar_max_" + varName + "; \n";
                 // This variable names are used in other methods, keep track
                 r += "size_t " + varName + " = gspar_global_" + varName + " - gspar_offset_" + varName + "; \n";
             }
@@ -5,6 +5,9 @@
 #include <string>
 #include <map>
 #include <mutex>
+#include <memory>
+#include <vector>
+#include <tuple>
 #include <CL/opencl.h>
 
 ///// Forward declarations /////
@@ -20,6 +23,7 @@ namespace GSPar {
             class Kernel;
             class MemoryObject;
             class ChunkedMemoryObject;
+            class StagingArea;
             class StreamElement;
             class KernelGenerator;
         }
@@ -61,6 +65,7 @@ namespace GSPar {
                 virtual ~ExecutionFlow();
                 cl_command_queue start() override;
                 void synchronize() override;
+                bool isFinished() override;
 
                 static cl_command_queue checkAndStartFlow(Device* device, ExecutionFlow* executionFlow = NULL);
             };
@@ -108,6 +113,19 @@ namespace GSPar {
                 static Instance* getInstance();
             };
 
+            ///// StagingBuffer /////
+
+            /**
+             * Pinned host memory through which the asynchronous copies of host memory are made.
+             * It is the host memory of a buffer allocated with CL_MEM_ALLOC_HOST_PTR, mapped while the buffer exists.
+             */
+            struct StagingBuffer {
+                cl_mem buffer;
+                void* pointer;
+                void* hugePages; // Memory mapped with mmap, used by the buffer with CL_MEM_USE_HOST_PTR, or NULL
+                size_t hugePagesSize;
+            };
+
             ///// Device /////
 
             class Device :
@@ -115,8 +133,17 @@ namespace GSPar {
             private:
                 mutable std::mutex attributeCacheMutex;
                 std::map<cl_device_info, void*> attributeCache;
+                // Evicted programs are released by the deleter once no one is building kernels from them
+                ProgramCache<std::shared_ptr<_cl_program>> programCache;
+                ProgramCache<cl_program> runtimeProgramCache{ 0 }; // One program per set of compiler flags, released with the device
+                DeviceMemoryPool<cl_mem> memoryPool{ releaseMemoryBlock };
+                DeviceMemoryPool<StagingBuffer> stagingPool{ [this](StagingBuffer buffer) { this->releaseStagingBuffer(buffer); },
+                    GSPAR_HOST_STAGING_POOL_MAX_BYTES };
+
+                void releaseStagingBuffer(StagingBuffer buffer);
 
             public:
+                static void releaseMemoryBlock(cl_mem memory);
                 using BaseDevice<ExecutionFlow, Kernel, MemoryObject, ChunkedMemoryObject, cl_context, cl_device_id, cl_command_queue>::malloc;
 
                 Device();
@@ -138,12 +165,29 @@ namespace GSPar {
                 MemoryObject* malloc(long size, const void* hostPtr = nullptr) override;
                 ChunkedMemoryObject* mallocChunked(unsigned int chunks, long chunkSize, void** hostPtr = nullptr, bool readOnly = false, bool writeOnly = false) override;
                 ChunkedMemoryObject* mallocChunked(unsigned int chunks, long chunkSize, const void** hostPtr = nullptr) override;
-                Kernel* prepareKernel(const std::string kernelSource, const std::string kernelName) override;
-                std::vector<Kernel*> prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames) override;
+                std::vector<std::string> getCompilerFlags(const CompilerOptions& compilerOptions) override;
+                Kernel* prepareKernel(const std::string kernelSource, const std::string kernelName, const CompilerOptions& compilerOptions = CompilerOptions()) override;
+                std::vector<Kernel*> prepareKernels(const std::string kernelSource, const std::vector<std::string> kernelNames, const CompilerOptions& compilerOptions = CompilerOptions()) override;
 
                 template<class T>
                 const T* queryInfoDevice(cl_device_info paramName, bool cacheable = true);
-                cl_program compileOCLProgram(std::string source);
+                /**
+                 * Gets the GSPar runtime compiled (not linked) for this device with the given flags, compiling it only once.
+                 * Returns NULL if the device doesn't support separate compilation (OpenCL < 1.2) or GSPAR_LINK_DEVICE_RUNTIME is 0.
+                 */
+                cl_program getRuntimeProgram(const std::vector<std::string> compilerFlags = {});
+                cl_program compileOCLProgram(std::string source, const std::vector<std::string> compilerFlags = {});
+                /**
+                 * Gets the program of a source from the device's program cache, compiling it only once
+                 */
+                std::shared_ptr<_cl_program> getProgram(std::string source, const CompilerOptions& compilerOptions = CompilerOptions());
+                ProgramCache<std::shared_ptr<_cl_program>>& getProgramCache() { return this->programCache; }
+                DeviceMemoryPool<cl_mem>& getMemoryPool() { return this->memoryPool; }
+                DeviceMemoryPool<StagingBuffer>& getStagingPool() { return this->stagingPool; }
+                /**
+                 * Allocates and maps a new staging buffer. Use getStagingPool to reuse the released ones.
+                 */
+                StagingBuffer allocStagingBuffer(size_t size);
             };
 
             ///// Kernel /////
@@ -161,7 +205,7 @@ namespace GSPar {
 
             public:
                 Kernel();
-                Kernel(Device* device, const std::string kernelSource, const std::string kernelName);
+                Kernel(Device* device, const std::string kernelSource, const std::string kernelName, const CompilerOptions& compilerOptions = CompilerOptions());
                 virtual ~Kernel();
                 virtual void cloneInto(BaseKernelBase* baseOther) override;
                 int setParameter(MemoryObject* memoryObject) override;
@@ -176,23 +220,74 @@ namespace GSPar {
                 Kernel(Device* device, cl_program oclProgram, const std::string kernelName);
             };
 
+            ///// StagingArea /////
+
+            /**
+             * Staging buffer of a memory object, taken from the device's staging pool, split in one region per chunk.
+             * The host only waits for the previous transfer of the region it is going to reuse.
+             */
+            class StagingArea {
+            private:
+                Device* device;
+                StagingBuffer buffer;
+                size_t size;
+                size_t regionSize;
+                std::vector<cl_event> events; // Completed after the last transfer of each region, NULL if there was none
+
+            public:
+                StagingArea(Device* device, unsigned int regions, size_t regionSize);
+                virtual ~StagingArea();
+                /**
+                 * Gets the host memory of a region, waiting for its previous transfer to finish
+                 */
+                unsigned char* getRegion(unsigned int region);
+                /**
+                 * Sets the event of the transfer just enqueued for a region
+                 */
+                void setTransferEvent(unsigned int region, cl_event event);
+                /**
+                 * Copies a region to the host memory as soon as the read from the device finishes.
+                 * The later commands of the queue wait for the copy, so synchronizing the execution flow includes it.
+                 */
+                void copyRegionToHost(unsigned int region, size_t offset, void* hostPtr, size_t size, cl_event readEvent, cl_command_queue oclQueue);
+                /**
+                 * Copies several parts of the regions (region, offset, host memory and size) to the host memory as soon as a single read finishes
+                 */
+                void copyRegionsToHost(const std::vector<std::tuple<unsigned int, size_t, void*, size_t>>& parts, cl_event readEvent, cl_command_queue oclQueue);
+            };
+
             ///// MemoryObject /////
 
             class MemoryObject :
                 public BaseMemoryObject<Exception, ExecutionFlow, Device, cl_mem, cl_event*>,
                 public AsyncExecutionSupport {
             private:
-                void copy(bool in, bool async, ExecutionFlow* executionFlow = NULL);
+                std::unique_ptr<StagingArea> stagingArea;
+
+                /**
+                 * Gets the staging area of the memory object, or NULL if the copies are not staged
+                 */
+                StagingArea* getStagingArea();
+                void copy(bool in, bool async, size_t offset, size_t length, ExecutionFlow* executionFlow = NULL);
                 void allocDeviceMemory();
 
             public:
                 MemoryObject(Device* device, size_t size, void* hostPtr, bool readOnly, bool writeOnly);
                 MemoryObject(Device* device, size_t size, const void* hostPtr);
                 virtual ~MemoryObject();
+                using BaseMemoryObject<Exception, ExecutionFlow, Device, cl_mem, cl_event*>::bindTo;
+                /**
+                 * Stops using the previous host memory as device memory, if it was
+                 */
+                virtual void bindTo(void* hostPtr) override;
                 void copyIn() override;
                 void copyOut() override;
                 void copyInAsync(ExecutionFlow* executionFlow = NULL) override;
                 void copyOutAsync(ExecutionFlow* executionFlow = NULL) override;
+                void copyIn(size_t offset, size_t length) override;
+                void copyOut(size_t offset, size_t length) override;
+                void copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
+                void copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
             };
 
             ///// ChunkedMemoryObject /////
@@ -201,7 +296,16 @@ namespace GSPar {
                 public BaseChunkedMemoryObject<Exception, ExecutionFlow, Device, cl_mem, cl_event*>,
                 public AsyncExecutionSupport {
             private:
-                void copy(bool in, bool async, unsigned int chunkFrom, unsigned int chunkTo, ExecutionFlow* executionFlow = NULL);
+                std::unique_ptr<StagingArea> stagingArea;
+
+                /**
+                 * Gets the staging area of the memory object, with a region for each chunk, or NULL if the copies are not staged
+                 */
+                StagingArea* getStagingArea();
+                /**
+                 * Copies a range of bytes, counted across the chunks, with a transfer for the part in each chunk
+                 */
+                void copy(bool in, bool async, size_t offset, size_t length, ExecutionFlow* executionFlow = NULL);
                 void allocDeviceMemory();
 
             public:
@@ -218,6 +322,11 @@ namespace GSPar {
                 virtual void copyOut(unsigned int chunk);
                 virtual void copyInAsync(unsigned int chunk, ExecutionFlow* executionFlow = NULL);
                 virtual void copyOutAsync(unsigned int chunk, ExecutionFlow* executionFlow = NULL);
+                // Copy a range of bytes, counted across the chunks
+                virtual void copyIn(size_t offset, size_t length) override;
+                virtual void copyOut(size_t offset, size_t length) override;
+                virtual void copyInAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
+                virtual void copyOutAsync(size_t offset, size_t length, ExecutionFlow* executionFlow = NULL) override;
             };
 
             ///// StreamElement /////
@@ -247,7 +356,10 @@ namespace GSPar {
                 static const std::string DEVICE_FUNCTION_PREFIX;
                 const std::string getKernelPrefix() override;
                 std::string generateStdFunctions() override;
-                std::string replaceMacroKeywords(std::string kernelSource) override;
+                /**
+                 * Declarations of the functions of generateStdFunctions, for kernels linked with the GSPar runtime
+                 */
+                std::string generateStdFunctionDeclarations();
                 std::string generateInitKernel(Pattern::BaseParallelPattern* pattern, Dimensions dims) override;
                 std::string generateParams(Pattern::BaseParallelPattern* pattern, Dimensions dims) override;
                 std::string generateStdVariables(Pattern::BaseParallelPattern* pattern, Dimensions dims) override;
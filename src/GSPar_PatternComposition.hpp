@@ -4,8 +4,12 @@
 
 #include <vector>
 #include <map>
+#include <set>
 #include <initializer_list>
 #include <utility>
+#include <mutex>
+#include <future>
+#include <memory>
 
 ///// Forward declarations /////
 
@@ -37,12 +41,90 @@ namespace GSPar {
             std::vector<BaseParallelPattern*> patterns;
             std::map<BaseParallelPattern*, PatternType> patternsTypes;
             Driver::Dimensions compiledPatternsDimension;
+            // Options for every kernel of the composition, merged with the options of each pattern
+            Driver::CompilerOptions compilerOptions;
+            Driver::CompilerOptions compiledCompilerOptions;
+            // Held while the patterns are compiled, so a run waits for a compilation in progress
+            std::mutex compilationMutex;
+            // Started by compileAsync, which compiles without holding compilationMutex
+            std::shared_future<void> pendingCompilation;
+            // Should consecutive Maps run as a single kernel?
+            bool mapFusion = false;
+            std::vector<std::unique_ptr<FusedMap>> fusedMaps;
+            std::vector<std::unique_ptr<FusedMapReduce>> fusedMapReduces;
+            // The patterns actually compiled and run: the ones added, with the consecutive Maps replaced by FusedMaps
+            // (or by a FusedMapReduce, together with the Reduce of the vector they write)
+            std::vector<std::pair<BaseParallelPattern*, PatternType>> runnablePatterns;
+            // Should the data shared by the patterns stay in the GPU between them?
+            bool deviceResidentDataflow = true;
+            // GPU memory shared by the patterns for each parameter name, and the index of its GPU
+            std::map<std::string, std::pair<unsigned int, std::unique_ptr<Driver::BaseMemoryObjectBase>>> residentMemoryObjects;
 
             template<typename Base, typename T>
             inline bool instanceof(const T*) {
                 return std::is_base_of<Base, T>::value;
             }
 
+            /**
+             * Checks whether any pattern from the index on has a parameter with the name
+             */
+            bool isParameterUsedFrom(const std::string name, size_t index) {
+                for (; index < this->patterns.size(); index++) {
+                    if (this->patterns[index]->getParameter(name)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            /**
+             * Updates the runnablePatterns, fusing the consecutive Maps that can be fused. compilationMutex must be locked.
+             */
+            template<class TDriverInstance>
+            void fuseMaps() {
+                this->runnablePatterns.clear();
+                size_t usedFusedMaps = 0;
+                size_t usedFusedMapReduces = 0;
+                for (size_t i = 0; i < this->patterns.size(); ) {
+                    std::vector<BaseParallelPattern*> group = { this->patterns[i] };
+                    if (this->mapFusion && this->patternsTypes[this->patterns[i]] == GSPAR_PATTERN_MAP && FusedMap::canFuse({}, this->patterns[i])) {
+                        while (i + group.size() < this->patterns.size()) {
+                            BaseParallelPattern* next = this->patterns[i + group.size()];
+                            if (this->patternsTypes[next] != GSPAR_PATTERN_MAP || !FusedMap::canFuse(group, next)) {
+                                break;
+                            }
+                            group.push_back(next);
+                        }
+                    }
+                    BaseParallelPattern* next = (i + group.size() < this->patterns.size()) ? this->patterns[i + group.size()] : nullptr;
+                    if (this->mapFusion && this->patternsTypes[this->patterns[i]] == GSPAR_PATTERN_MAP && next && this->patternsTypes[next] == GSPAR_PATTERN_REDUCE
+                            && FusedMap::canFuse({}, this->patterns[i]) && !this->isParameterUsedFrom(static_cast<Reduce*>(next)->getVectorName(), i + group.size() + 1)
+                            && FusedMapReduce::canFuse(group, static_cast<Reduce*>(next), TDriverInstance::getInstance()->getKernelGenerator()->getStdVarNames(next->getStdVarNames())[0])) {
+                        // The Reduce computes each element with the code of the Maps, so the reduced vector is never written
+                        if (usedFusedMapReduces == this->fusedMapReduces.size()) {
+                            this->fusedMapReduces.emplace_back(new FusedMapReduce());
+                        }
+                        FusedMapReduce* fusedMapReduce = this->fusedMapReduces[usedFusedMapReduces++].get();
+                        fusedMapReduce->fuse(group, static_cast<Reduce*>(next));
+                        this->runnablePatterns.push_back(std::make_pair(fusedMapReduce, GSPAR_PATTERN_REDUCE));
+                        i += group.size() + 1;
+                        continue;
+                    }
+                    if (group.size() > 1) {
+                        // FusedMaps are reused between runs, so their kernels are only recompiled if the fused code changes
+                        if (usedFusedMaps == this->fusedMaps.size()) {
+                            this->fusedMaps.emplace_back(new FusedMap());
+                        }
+                        FusedMap* fusedMap = this->fusedMaps[usedFusedMaps++].get();
+                        fusedMap->fuse(group);
+                        this->runnablePatterns.push_back(std::make_pair(fusedMap, GSPAR_PATTERN_MAP));
+                    } else {
+                        this->runnablePatterns.push_back(std::make_pair(this->patterns[i], this->patternsTypes[this->patterns[i]]));
+                    }
+                    i += group.size();
+                }
+            }
+
             template<class TDriverInstance>
             std::string generateKernelSource(Driver::Dimensions max, unsigned int gpuIndex = 0) {
 
@@ -51,12 +133,21 @@ namespace GSPar {
                     kernelSource += "\n";
                 }
                 bool addedKernel = false;
-                for(auto pattern : patterns) {
+                std::set<std::string> kernelNames;
+                for(auto& runnablePattern : this->runnablePatterns) {
+                    auto pattern = runnablePattern.first;
                     if (pattern->getGpuIndex() != gpuIndex) {
                         continue;
                     }
                     addedKernel = true;
 
+                    // Patterns with the same code get the same kernel name, but they must be unique in a program
+                    std::string kernelName = pattern->getKernelName();
+                    if (!kernelNames.insert(kernelName).second) {
+                        pattern->setKernelName(kernelName + "_" + std::to_string(kernelNames.size()));
+                        kernelNames.insert(pattern->getKernelName());
+                    }
+
                     pattern->callbackBeforeGeneratingKernelSource();
                     kernelSource += pattern->generateKernelSource<TDriverInstance>(max);
                     kernelSource += "\n";
@@ -86,10 +177,142 @@ namespace GSPar {
                 }
             }
 
+            /**
+             * Checks whether the parameters with the same name in the patterns are the same data, which can be kept in the GPU between them
+             */
+            bool isResidentCandidate(const std::vector<std::pair<BaseParallelPattern*, BaseParameter*>>& users, std::map<BaseParallelPattern*, PatternType>& types) {
+                if (users.size() < 2) {
+                    return false;
+                }
+                auto firstPattern = users.front().first;
+                auto first = users.front().second;
+                for (auto& user : users) {
+                    auto pattern = user.first;
+                    auto parameter = user.second;
+                    if (parameter->paramValueType != GSPAR_PARAM_POINTER || parameter->isBatched() || !parameter->isComplete()
+                            || parameter->direction == GSPAR_PARAM_NONE || parameter->direction == GSPAR_PARAM_PRESENT) {
+                        return false;
+                    }
+                    // Autotuning runs the kernel several times, so it needs its inputs copied from the host in every run
+                    if (pattern->isAutotuning() || pattern->getGpuIndex() != firstPattern->getGpuIndex()) {
+                        return false;
+                    }
+                    // Tiles copy their slices from and to the host
+                    if (pattern->isTiledParameter(parameter->name)) {
+                        return false;
+                    }
+                    // The Reduce copies its total out by itself
+                    if (types[pattern] == GSPAR_PATTERN_REDUCE && static_cast<Reduce*>(pattern)->getOutputParameterName() == parameter->name) {
+                        return false;
+                    }
+                    auto pointerParameter = static_cast<PointerParameter*>(parameter);
+                    auto firstPointerParameter = static_cast<PointerParameter*>(first);
+                    if (pointerParameter->getPointer() != firstPointerParameter->getPointer() || parameter->size != first->size
+                            || parameter->type.getFullName() != first->type.getFullName()
+                            || pointerParameter->getUserMemoryObject() != firstPointerParameter->getUserMemoryObject()) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            /**
+             * Makes the patterns that use the same data, with the same parameter name, share a single GPU buffer.
+             * The data is copied to the GPU only by the first of them and back to the host only by the last one that writes it (OUT or INOUT),
+             * so the host gets the same data as when the patterns run on their own.
+             * Returns the parameters that got the shared buffer, which must be unset with unshareResidentParameters after running.
+             */
+            template<class TDriverInstance>
+            std::vector<PointerParameter*> shareResidentParameters(const std::vector<std::pair<BaseParallelPattern*, PatternType>>& runnablePatterns) {
+                std::vector<PointerParameter*> sharedParameters;
+                if (!this->deviceResidentDataflow) {
+                    return sharedParameters;
+                }
+                // The patterns that use each parameter name, in the order they run
+                std::map<std::string, std::vector<std::pair<BaseParallelPattern*, BaseParameter*>>> users;
+                std::map<BaseParallelPattern*, PatternType> types;
+                for (auto& runnablePattern : runnablePatterns) {
+                    types[runnablePattern.first] = runnablePattern.second;
+                    for (auto parameter : runnablePattern.first->getParameterList()) {
+                        users[parameter->name].push_back(std::make_pair(runnablePattern.first, parameter));
+                    }
+                }
+
+                std::map<BaseParallelPattern*, std::pair<std::set<std::string>, std::set<std::string>>> residentParameters;
+                for (auto& user : users) {
+                    if (!this->isResidentCandidate(user.second, types)) {
+                        continue;
+                    }
+                    auto firstPattern = user.second.front().first;
+                    auto first = static_cast<PointerParameter*>(user.second.front().second);
+                    // The patterns after the last writer only read the data, which is already in the host
+                    size_t lastWriter = user.second.size();
+                    for (size_t i = 0; i < user.second.size(); i++) {
+                        if (user.second[i].second->isOut()) {
+                            lastWriter = i;
+                        }
+                    }
+                    Driver::BaseMemoryObjectBase* memoryObject = first->getUserMemoryObject();
+                    if (!memoryObject) {
+                        // The buffer is kept between runs while the data and the GPU are the same
+                        auto& resident = this->residentMemoryObjects[user.first];
+                        if (!resident.second || resident.first != firstPattern->getGpuIndex()
+                                || resident.second->getHostPointer() != first->getPointer() || resident.second->getSize() != first->size) {
+                            auto gpu = firstPattern->getGpu<TDriverInstance>();
+                            auto singleMemObj = gpu->malloc(first->size, first->getPointer(), false, false);
+                            resident.first = firstPattern->getGpuIndex();
+                            resident.second = std::unique_ptr<Driver::BaseMemoryObjectBase>(singleMemObj);
+                            #if !defined(GSPAR_PATTERN_DISABLE_PINNED_MEMORY) && !GSPAR_HOST_STAGING_BUFFERS
+                                if (lastWriter < user.second.size()) {
+                                    singleMemObj->pinHostMemory(); // Same as the patterns do for their own output parameters
+                                }
+                            #endif
+                        }
+                        memoryObject = resident.second.get();
+                    }
+                    for (size_t i = 0; i < user.second.size(); i++) {
+                        auto pattern = user.second[i].first;
+                        auto parameter = static_cast<PointerParameter*>(user.second[i].second);
+                        if (!parameter->getUserMemoryObject()) {
+                            parameter->setUserMemoryObject(memoryObject);
+                            sharedParameters.push_back(parameter);
+                        }
+                        if (i > 0) {
+                            residentParameters[pattern].first.insert(user.first);
+                        }
+                        if (i < lastWriter) {
+                            residentParameters[pattern].second.insert(user.first);
+                        }
+                    }
+                }
+                for (auto& runnablePattern : runnablePatterns) {
+                    auto& resident = residentParameters[runnablePattern.first];
+                    runnablePattern.first->setResidentParameters(resident.first, resident.second);
+                }
+                return sharedParameters;
+            }
+
+            /**
+             * Restores the parameters changed by shareResidentParameters, so the patterns can also run on their own
+             */
+            void unshareResidentParameters(const std::vector<std::pair<BaseParallelPattern*, PatternType>>& runnablePatterns, std::vector<PointerParameter*>& sharedParameters) {
+                for (auto parameter : sharedParameters) {
+                    parameter->setUserMemoryObject(nullptr);
+                }
+                for (auto& runnablePattern : runnablePatterns) {
+                    runnablePattern.first->setResidentParameters({}, {});
+                }
+            }
+
             template<class TDriverInstance>
             void run(Driver::Dimensions pDims, bool useCompiledDim) {
                 this->assertAnyPatternAdded();
-                Driver::Dimensions dims = useCompiledDim ? this->compiledPatternsDimension : pDims;
+                Driver::Dimensions dims = pDims;
+                if (useCompiledDim) {
+                    std::unique_lock<std::mutex> lock(this->compilationMutex);
+                    this->waitPendingCompilation(lock); // It sets the compiled dimensions
+                    dims = this->compiledPatternsDimension;
+                }
                 if (!dims.getCount()) {
                     throw GSParException("No dimensions set to run the pattern composition");
                 }
@@ -98,18 +321,31 @@ namespace GSPar {
 
                 this->compilePatterns<TDriverInstance>(dims);
 
-                for (const auto& pattern : this->patterns) {
-                    // We pass dims again in Run case we have other thread asking the pattern to compile to another dims (which shouldn't happen anyway)
-                    switch (this->patternsTypes[pattern]) {
-                        case GSPAR_PATTERN_MAP:
-                            (static_cast<Map*>(pattern))->run<TDriverInstance>(dims);
-                            break;
-                        case GSPAR_PATTERN_REDUCE:
-                            // Almost https://en.wikipedia.org/wiki/Curiously_recurring_template_pattern
-                            (static_cast<Reduce*>(pattern))->run<TDriverInstance>(dims);
-                            break;
+                std::vector<std::pair<BaseParallelPattern*, PatternType>> runnablePatterns;
+                {
+                    std::lock_guard<std::mutex> lock(this->compilationMutex); // Auto-unlock, RAII
+                    runnablePatterns = this->runnablePatterns;
+                }
+                std::vector<PointerParameter*> sharedParameters = this->shareResidentParameters<TDriverInstance>(runnablePatterns);
+                try {
+                    for (const auto& runnablePattern : runnablePatterns) {
+                        auto pattern = runnablePattern.first;
+                        // We pass dims again in Run case we have other thread asking the pattern to compile to another dims (which shouldn't happen anyway)
+                        switch (runnablePattern.second) {
+                            case GSPAR_PATTERN_MAP:
+                                (static_cast<Map*>(pattern))->run<TDriverInstance>(dims);
+                                break;
+                            case GSPAR_PATTERN_REDUCE:
+                                // Almost https://en.wikipedia.org/wiki/Curiously_recurring_template_pattern
+                                (static_cast<Reduce*>(pattern))->run<TDriverInstance>(dims);
+                                break;
+                        }
                     }
+                } catch (...) {
+                    this->unshareResidentParameters(runnablePatterns, sharedParameters);
+                    throw;
                 }
+                this->unshareResidentParameters(runnablePatterns, sharedParameters);
             }
 
         public:
@@ -146,6 +382,10 @@ namespace GSPar {
                 other->built = this->built;
                 other->extraKernelCode = this->extraKernelCode;
                 other->stdVarNames = this->stdVarNames;
+                other->compilerOptions = this->compilerOptions;
+                other->compiledCompilerOptions = this->compiledCompilerOptions;
+                other->mapFusion = this->mapFusion;
+                other->deviceResidentDataflow = this->deviceResidentDataflow;
                 if (this->compiledPatternsDimension.getCount()) {
                     Driver::Dimensions compiledPatternsDimension = this->compiledPatternsDimension;
                     other->compiledPatternsDimension = compiledPatternsDimension;
@@ -158,6 +398,47 @@ namespace GSPar {
                 return *this;
             }
 
+            /**
+             * Adds a compiler option to every kernel of the composition
+             */
+            virtual PatternComposition& addCompilerOption(Driver::CompilerOption option) {
+                this->compilerOptions.add(option);
+                return *this;
+            }
+            /**
+             * Adds a -DNAME[=VALUE] macro definition or a native compiler option to every kernel of the composition
+             */
+            virtual PatternComposition& addCompilerOption(std::string option) {
+                this->compilerOptions.add(option);
+                return *this;
+            }
+
+            /**
+             * Runs consecutive Maps (in the same GPU and with the same settings) as a single kernel, see FusedMap.
+             * Each Map must only read the elements written by the previous ones in the same index.
+             * If the Maps are followed by a Reduce of a vector they write, they run in its kernel and the vector is not copied back, see FusedMapReduce.
+             */
+            virtual PatternComposition& setMapFusion(bool mapFusion) {
+                this->mapFusion = mapFusion;
+                return *this;
+            }
+            virtual bool isMapFusion() {
+                return this->mapFusion;
+            }
+
+            /**
+             * Keeps the data used by more than one pattern (parameters with the same name and host pointer) in the GPU between them.
+             * It is copied to the GPU only by the first pattern that uses it and back to the host only by the last one, according to their directions.
+             * Enabled by default.
+             */
+            virtual PatternComposition& setDeviceResidentDataflow(bool deviceResidentDataflow) {
+                this->deviceResidentDataflow = deviceResidentDataflow;
+                return *this;
+            }
+            virtual bool isDeviceResidentDataflow() {
+                return this->deviceResidentDataflow;
+            }
+
             virtual BaseParallelPattern* getPattern(size_t index) {
                 return patterns[index];
             }
@@ -171,23 +452,47 @@ namespace GSPar {
             }
 
             virtual bool isAllPatternsCompiledFor(Driver::Dimensions dims) {
-                if (this->compiledPatternsDimension != dims) { // We are compiled with a different dims
+                // Each pattern keeps its own compiled variants, so we may have been compiled with other dims in between
+                if (this->runnablePatterns.empty()) {
                     return false;
                 }
-                for (auto pattern : this->patterns) {
-                    if (!pattern->isKernelCompiledFor(dims)) {
+                for (auto& runnablePattern : this->runnablePatterns) {
+                    if (!runnablePattern.first->isKernelCompiledFor(dims)) {
                         return false;
                     }
                 }
                 return true;
             }
 
+            /**
+             * Kernel sources of a composition generated by prepareCompilation, with everything their compilation needs,
+             * so compiling them doesn't read the patterns
+             */
             template<class TDriverInstance>
-            PatternComposition& compilePatterns(Driver::Dimensions dims) {
-                this->assertAnyPatternAdded();
-                if (this->isAllPatternsCompiledFor(dims)) {
+            struct PreparedCompilation {
+                bool compiled = false; // Whether the patterns were already compiled for these dims and options
+                Driver::Dimensions dims;
+                Driver::CompilerOptions compilerOptions;
+                // For each GPU, compiles its program, or is empty if it has no patterns
+                std::vector<std::function<std::vector<decltype(TDriverInstance::getKernelType())*>()>> prepareKernels;
+                // For each GPU, the patterns that get its kernels, in the same order
+                std::vector<std::vector<BaseParallelPattern*>> gpuPatterns;
+            };
+
+            /**
+             * Generates the kernel sources of the patterns for the dims Dimensions. compilationMutex must be locked.
+             */
+            template<class TDriverInstance>
+            PreparedCompilation<TDriverInstance> prepareCompilation(Driver::Dimensions dims) {
+                PreparedCompilation<TDriverInstance> prepared;
+                prepared.dims = dims;
+                prepared.compilerOptions = this->compilerOptions;
+                // The patterns may have changed since the last run, so the Maps are fused again (it only recompiles if their code changed)
+                this->fuseMaps<TDriverInstance>();
+                if (this->isAllPatternsCompiledFor(dims) && this->compiledCompilerOptions == this->compilerOptions) {
                     // The kernels are already compiled
-                    return *this;
+                    prepared.compiled = true;
+                    return prepared;
                 }
                 
                 // Init GPU driver
@@ -201,20 +506,28 @@ namespace GSPar {
 
                 auto gpus = driver->getGpuList();
 
-                unsigned int gpuIndex = 0;
-                for (const auto& gpu : gpus) {
+                // The kernel sources are generated sequentially (it changes the patterns), but each GPU compiles its program concurrently
+                prepared.prepareKernels.resize(gpus.size());
+                prepared.gpuPatterns.resize(gpus.size());
+                for (unsigned int gpuIndex = 0; gpuIndex < gpus.size(); gpuIndex++) {
+                    auto gpu = gpus[gpuIndex];
                     // Prepare kernels
                     std::string kernelSource = this->generateKernelSource<TDriverInstance>(dims, gpuIndex);
                     if (kernelSource.empty()) {
                         continue; // If there's no patterns in this GPU, we can move on
                     }
 
+                    // All the kernels of a GPU are built in a single program, so it gets the options of every one of them
                     std::vector<std::string> kernelNames;
-                    for (auto pattern : this->patterns) {
+                    Driver::CompilerOptions gpuCompilerOptions = this->compilerOptions;
+                    for (auto& runnablePattern : this->runnablePatterns) {
+                        auto pattern = runnablePattern.first;
                         if (pattern->getGpuIndex() != gpuIndex) {
                             continue;
                         }
                         kernelNames.push_back(pattern->getKernelName());
+                        gpuCompilerOptions.add(pattern->getCompilerOptions());
+                        prepared.gpuPatterns[gpuIndex].push_back(pattern);
                     }
 
                     #ifdef GSPAR_DEBUG
@@ -226,24 +539,131 @@ namespace GSPar {
                     #endif
 
                     if (!kernelNames.empty()) { // If there's no patterns in this GPU, we can move on
-                        auto kernels = gpu->prepareKernels(kernelSource.c_str(), kernelNames);
-                        int patternIndex = 0;
-                        for (auto pattern : this->patterns) {
-                            if (pattern->getGpuIndex() != gpuIndex) {
-                                continue;
-                            }
-                            pattern->setCompiledKernel<TDriverInstance>(kernels.at(patternIndex), dims);
-                            patternIndex++;
+                        prepared.prepareKernels[gpuIndex] = [gpu, kernelSource, kernelNames, gpuCompilerOptions]() {
+                            return gpu->prepareKernels(kernelSource.c_str(), kernelNames, gpuCompilerOptions);
+                        };
+                    }
+                }
+                return prepared;
+            }
+
+            /**
+             * Compiles the kernel sources generated by prepareCompilation, one thread per GPU
+             * @return The kernels of each GPU
+             */
+            template<class TDriverInstance>
+            static std::vector<std::vector<decltype(TDriverInstance::getKernelType())*>> compilePrepared(PreparedCompilation<TDriverInstance>& prepared) {
+                std::vector<std::future<std::vector<decltype(TDriverInstance::getKernelType())*>>> compilations(prepared.prepareKernels.size());
+                for (size_t gpuIndex = 0; gpuIndex < compilations.size(); gpuIndex++) {
+                    if (prepared.prepareKernels[gpuIndex]) {
+                        compilations[gpuIndex] = std::async(std::launch::async, prepared.prepareKernels[gpuIndex]);
+                    }
+                }
+
+                // Waits for every GPU before rethrowing, so no compilation outlives this call
+                std::vector<std::vector<decltype(TDriverInstance::getKernelType())*>> kernels(compilations.size());
+                std::exception_ptr compilationError;
+                for (size_t gpuIndex = 0; gpuIndex < compilations.size(); gpuIndex++) {
+                    if (!compilations[gpuIndex].valid()) {
+                        continue;
+                    }
+                    try {
+                        kernels[gpuIndex] = compilations[gpuIndex].get();
+                    } catch (...) {
+                        if (!compilationError) {
+                            compilationError = std::current_exception();
+                        }
+                    }
+                }
+                if (compilationError) {
+                    for (auto& gpuKernels : kernels) {
+                        for (auto kernel : gpuKernels) {
+                            delete kernel;
                         }
                     }
-                    gpuIndex++;
+                    std::rethrow_exception(compilationError);
                 }
+                return kernels;
+            }
 
-                this->compiledPatternsDimension = dims;
+            /**
+             * Stores the kernels compiled by compilePrepared in their patterns. compilationMutex must be locked.
+             */
+            template<class TDriverInstance>
+            void setCompiledKernels(PreparedCompilation<TDriverInstance>& prepared, std::vector<std::vector<decltype(TDriverInstance::getKernelType())*>>& kernels) {
+                for (size_t gpuIndex = 0; gpuIndex < kernels.size(); gpuIndex++) {
+                    for (size_t patternIndex = 0; patternIndex < kernels[gpuIndex].size(); patternIndex++) {
+                        prepared.gpuPatterns[gpuIndex].at(patternIndex)->template setCompiledKernel<TDriverInstance>(kernels[gpuIndex][patternIndex], prepared.dims);
+                    }
+                }
+
+                this->compiledPatternsDimension = prepared.dims;
+                this->compiledCompilerOptions = prepared.compilerOptions;
+            }
+
+            /**
+             * Waits for a compilation started by compileAsync, so the patterns are not compiled twice.
+             * Its failure is rethrown by the future returned by compileAsync, and the next compilation tries again
+             */
+            void waitPendingCompilation(std::unique_lock<std::mutex>& lock) {
+                while (this->pendingCompilation.valid()) {
+                    std::shared_future<void> pendingCompilation = this->pendingCompilation;
+                    lock.unlock(); // The compilation locks the mutex to store its kernels
+                    pendingCompilation.wait();
+                    lock.lock();
+                    if (this->pendingCompilation.valid() && this->pendingCompilation.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                        this->pendingCompilation = std::shared_future<void>();
+                    }
+                }
+            }
+
+            template<class TDriverInstance>
+            PatternComposition& compilePatterns(Driver::Dimensions dims) {
+                this->assertAnyPatternAdded();
+                std::unique_lock<std::mutex> lock(this->compilationMutex);
+                this->waitPendingCompilation(lock);
+                auto prepared = this->prepareCompilation<TDriverInstance>(dims);
+                if (prepared.compiled) {
+                    return *this;
+                }
+                // The mutex is held while compiling, so a run waits for it
+                auto kernels = compilePrepared(prepared);
+                this->setCompiledKernels(prepared, kernels);
 
                 return *this;
             }
 
+            /**
+             * Compiles the patterns for the dims Dimensions in the background, using the CompilationThreadPool.
+             * The kernel sources are generated by the calling thread, so the background thread only compiles them and stores the kernels.
+             * A later run waits only if the compilation is still in progress.
+             * The composition must not be destroyed before the returned future is ready.
+             * 
+             * @param <TDriverInstance> Type of the specialized BaseInstance class
+             * @param dims The Dimensions for which the patterns should be compiled
+             * @return A future that is ready when the compilation finishes, and rethrows its exception on get()
+             */
+            template<class TDriverInstance>
+            std::shared_future<void> compileAsync(Driver::Dimensions dims) {
+                this->assertAnyPatternAdded();
+                std::unique_lock<std::mutex> lock(this->compilationMutex);
+                this->waitPendingCompilation(lock);
+                auto prepared = std::make_shared<PreparedCompilation<TDriverInstance>>(this->prepareCompilation<TDriverInstance>(dims));
+                if (prepared->compiled) {
+                    std::promise<void> compiled;
+                    compiled.set_value();
+                    return compiled.get_future().share();
+                }
+                // The task can't store the kernels before this thread unlocks the mutex, so pendingCompilation is already set by then
+                this->pendingCompilation = CompilationThreadPool::getInstance()->submit([this, prepared]() {
+                    auto kernels = compilePrepared(*prepared);
+                    std::lock_guard<std::mutex> lock(this->compilationMutex); // Auto-unlock, RAII
+                    this->setCompiledKernels(*prepared, kernels);
+                    // Auto-unlock of compilationMutex, RAII
+                });
+                return this->pendingCompilation;
+            }
+
             template<class TDriverInstance>
             void run() {
                 this->run<TDriverInstance>(Driver::Dimensions(), true);
@@ -1,7 +1,12 @@
-
 #ifndef __GSPAR_PATTERNMAP_INCLUDED__
 #define __GSPAR_PATTERNMAP_INCLUDED__
 
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <cstring>
+
 #include "GSPar_BaseParallelPattern.hpp"
 
 namespace GSPar {
@@ -21,6 +26,249 @@ namespace GSPar {
                 this->cloneInto<TDriverInstance>(other);
                 return other;
             }
+
+            /**
+             * Runs the Map in tiles of its last dimension, for data larger than the GPU memory.
+             * Only the slices of the tiled parameters (see setTiledParameter) used by each tile are in the GPU,
+             * and the slices of a tile are copied while the previous one runs.
+             * @param tileSize Indexes of the last dimension in each tile, or 0 to use GSPAR_OUT_OF_CORE_DEVICE_MEMORY_PERCENT of the GPU memory
+             */
+            Map& setOutOfCore(bool outOfCore, unsigned long tileSize = 0) {
+                if (this->outOfCore != outOfCore) {
+                    this->isKernelStale = true; // The kernel moves the pointers of the tiled parameters
+                }
+                this->outOfCore = outOfCore;
+                this->tileSize = tileSize;
+                return *this;
+            }
+            /**
+             * Copies only the slice of the parameter used by each tile of an out-of-core run.
+             * Index i of the last dimension uses the bytes from i * bytesPerIndex, as a[x] in one dimension or m[y * width + x] in two.
+             * @param bytesPerIndex Bytes used by each index of the last dimension, or 0 to divide the parameter size by the extent of the dimension
+             */
+            Map& setTiledParameter(std::string name, size_t bytesPerIndex = 0) {
+                this->tiledParameters[name] = bytesPerIndex;
+                return *this;
+            }
+            Map& unsetTiledParameter(std::string name) {
+                this->tiledParameters.erase(name);
+                return *this;
+            }
+        };
+
+        /**
+         * Map whose kernel runs the code of consecutive Maps of a PatternComposition, one after the other, in each work-item.
+         * Parameters with the same name are the same data in every fused Map, so they are copied to the GPU and back only once,
+         * and what a Map writes in an element is read by the next ones without another kernel launch.
+         * Thus, each Map must only read the elements written by the previous ones in the same index.
+         */
+        class FusedMap : public Map {
+        protected:
+            // The parameters of the fused Maps from which each parameter of the kernel was merged
+            std::map<std::string, std::vector<std::shared_ptr<BaseParameter>>> mergedParameters;
+
+        public:
+            FusedMap() : Map() { };
+
+            /**
+             * Checks whether two parameters with the same name, of different patterns, are the same data
+             */
+            static bool isSameData(BaseParameter* parameter, BaseParameter* other) {
+                if (parameter->paramValueType != other->paramValueType || parameter->type.getFullName() != other->type.getFullName()
+                        || parameter->size != other->size) {
+                    return false;
+                }
+                if (parameter->paramValueType == GSPAR_PARAM_VALUE) {
+                    void* value = static_cast<ValueParameter*>(parameter)->getPointer();
+                    void* otherValue = static_cast<ValueParameter*>(other)->getPointer();
+                    return value == otherValue || std::memcmp(value, otherValue, parameter->size) == 0;
+                }
+                auto pointerParameter = static_cast<PointerParameter*>(parameter);
+                auto otherPointerParameter = static_cast<PointerParameter*>(other);
+                bool directionsMerge = parameter->direction != GSPAR_PARAM_PRESENT && parameter->direction != GSPAR_PARAM_NONE
+                    && other->direction != GSPAR_PARAM_PRESENT && other->direction != GSPAR_PARAM_NONE;
+                if (!directionsMerge && parameter->direction != other->direction) {
+                    return false;
+                }
+                return pointerParameter->getPointer() == otherPointerParameter->getPointer()
+                    && pointerParameter->getUserMemoryObject() == otherPointerParameter->getUserMemoryObject();
+            }
+
+            /**
+             * Merges the parameters of the same data into a single parameter of the fused kernel
+             */
+            static std::shared_ptr<BaseParameter> mergeParameters(const std::vector<std::shared_ptr<BaseParameter>>& parameters) {
+                auto first = parameters.front();
+                // The first Map gets the value from the host, every Map may change it
+                bool in = first->isIn();
+                bool out = false;
+                for (auto& parameter : parameters) {
+                    out = out || parameter->isOut();
+                }
+                ParameterDirection direction = in ? (out ? GSPAR_PARAM_INOUT : GSPAR_PARAM_IN) : GSPAR_PARAM_OUT;
+                if (first->direction == direction || first->direction == GSPAR_PARAM_PRESENT || first->direction == GSPAR_PARAM_NONE) {
+                    return first; // Shares its GPU memory, as the fused Maps are not run on their own
+                }
+                // Only pointer parameters can be written, so we only need to create those
+                auto pointerParameter = static_cast<PointerParameter*>(first.get());
+                if (pointerParameter->getUserMemoryObject()) {
+                    return std::make_shared<PointerParameter>(first->name, first->type, pointerParameter->getUserMemoryObject(), direction);
+                }
+                return std::make_shared<PointerParameter>(first->name, first->type, first->size, pointerParameter->getPointer(), direction);
+            }
+
+            /**
+             * Gets the parameters of the patterns, grouped by name, in the order they are first used
+             */
+            static std::vector<std::pair<std::string, std::vector<std::shared_ptr<BaseParameter>>>> collectParameters(const std::vector<BaseParallelPattern*>& patterns) {
+                std::vector<std::pair<std::string, std::vector<std::shared_ptr<BaseParameter>>>> parameters;
+                std::map<std::string, size_t> indexes;
+                for (auto pattern : patterns) {
+                    for (auto parameter : pattern->getParameterList()) {
+                        auto index = indexes.find(parameter->name);
+                        if (index == indexes.end()) {
+                            index = indexes.insert(std::make_pair(parameter->name, parameters.size())).first;
+                            parameters.push_back(std::make_pair(parameter->name, std::vector<std::shared_ptr<BaseParameter>>()));
+                        }
+                        parameters[index->second].second.push_back(pattern->getSharedParameter(parameter->name));
+                    }
+                }
+                return parameters;
+            }
+
+            /**
+             * Concatenates the extra kernel code of the patterns, without repeating the same code
+             */
+            static std::string fuseExtraKernelCode(const std::vector<BaseParallelPattern*>& patterns) {
+                std::set<std::string> extraKernelCodes;
+                std::string extraKernelCode;
+                for (auto pattern : patterns) {
+                    // The same helper functions may be used by many of the Maps
+                    if (extraKernelCodes.insert(pattern->getExtraKernelCode()).second && !pattern->getExtraKernelCode().empty()) {
+                        extraKernelCode += pattern->getExtraKernelCode() + "\n";
+                    }
+                }
+                return extraKernelCode;
+            }
+
+            /**
+             * Gets the update modes of the parameters, from the first pattern that uses each one (which copies it to the GPU)
+             */
+            static std::map<std::string, ParameterUpdateMode> fuseUpdateModes(const std::vector<BaseParallelPattern*>& patterns) {
+                std::map<std::string, ParameterUpdateMode> updateModes;
+                std::set<std::string> used;
+                for (auto pattern : patterns) {
+                    for (auto parameter : pattern->getParameterList()) {
+                        if (used.insert(parameter->name).second) {
+                            updateModes[parameter->name] = pattern->getParameterUpdateMode(parameter->name);
+                        }
+                    }
+                }
+                return updateModes;
+            }
+
+            /**
+             * Gets the output ranges of the parameters, from the last pattern that sets each one
+             */
+            static std::map<std::string, std::pair<size_t, size_t>> fuseOutputRanges(const std::vector<BaseParallelPattern*>& patterns) {
+                std::map<std::string, std::pair<size_t, size_t>> outputRanges;
+                for (auto pattern : patterns) {
+                    for (auto& outputRange : pattern->getOutputRanges()) {
+                        outputRanges[outputRange.first] = outputRange.second;
+                    }
+                }
+                return outputRanges;
+            }
+
+            /**
+             * Concatenates the code of the Maps, each one in its own scope and with its own constants
+             */
+            static std::string fuseKernelCode(const std::vector<BaseParallelPattern*>& patterns) {
+                std::string kernelCode;
+                for (auto pattern : patterns) {
+                    // Constants are undefined before the next Map, which may use the same names
+                    kernelCode += "{\n";
+                    for (auto& constant : pattern->getConstantParameters()) {
+                        kernelCode += "#define " + constant.first + " " + constant.second + "\n";
+                    }
+                    kernelCode += pattern->getUserKernel() + "\n";
+                    for (auto& constant : pattern->getConstantParameters()) {
+                        kernelCode += "#undef " + constant.first + "\n";
+                    }
+                    kernelCode += "}\n";
+                }
+                return kernelCode;
+            }
+
+            /**
+             * Checks whether the pattern can be fused after the patterns already fused
+             */
+            static bool canFuse(const std::vector<BaseParallelPattern*>& fused, BaseParallelPattern* pattern) {
+                if (pattern->isBatched() || pattern->isUsingSharedMemory() || pattern->isOutOfCore()) {
+                    return false;
+                }
+                for (auto parameter : pattern->getParameterList()) {
+                    if (!parameter->isComplete()) {
+                        return false; // Placeholders are set just before running
+                    }
+                }
+                if (fused.empty()) {
+                    return true;
+                }
+                BaseParallelPattern* first = fused.front();
+                if (pattern->getGpuIndex() != first->getGpuIndex() || pattern->getStdVarNames() != first->getStdVarNames()
+                        || pattern->isDimensionAgnostic() != first->isDimensionAgnostic() || !(pattern->getCompilerOptions() == first->getCompilerOptions())) {
+                    return false;
+                }
+                // Parameters with the same name must be the same data
+                for (auto parameter : pattern->getParameterList()) {
+                    for (auto fusedPattern : fused) {
+                        BaseParameter* fusedParameter = fusedPattern->getParameter(parameter->name);
+                        if (fusedParameter && !isSameData(parameter, fusedParameter)) {
+                            return false;
+                        }
+                    }
+                }
+                return true;
+            }
+
+            /**
+             * Updates the kernel code and the parameters from the Maps being fused.
+             * The kernel is only recompiled if their code or parameters list changed.
+             */
+            void fuse(const std::vector<BaseParallelPattern*>& patterns) {
+                BaseParallelPattern* first = patterns.front();
+                std::string extraKernelCode = fuseExtraKernelCode(patterns);
+                std::string userKernel = fuseKernelCode(patterns);
+                if (userKernel != this->userKernel || extraKernelCode != this->extraKernelCode || this->stdVarNames != first->getStdVarNames()
+                        || !(this->compilerOptions == first->getCompilerOptions())) {
+                    this->userKernel = userKernel;
+                    this->extraKernelCode = extraKernelCode;
+                    this->stdVarNames = first->getStdVarNames();
+                    this->compilerOptions = first->getCompilerOptions();
+                    this->kernelName.clear();
+                    this->params.clear();
+                    this->paramsOrder.clear();
+                    this->mergedParameters.clear();
+                    this->isKernelStale = true;
+                }
+                this->setGpuIndex(first->getGpuIndex());
+                this->setDimensionAgnostic(first->isDimensionAgnostic());
+                this->autotuning = false;
+                for (auto pattern : patterns) {
+                    this->autotuning = this->autotuning || pattern->isAutotuning();
+                }
+                this->updateModes = fuseUpdateModes(patterns);
+                this->outputRanges = fuseOutputRanges(patterns);
+
+                for (auto& parameter : collectParameters(patterns)) {
+                    // A parameter is merged again only if some Map replaced it, so its GPU memory is kept between runs
+                    if (this->mergedParameters[parameter.first] != parameter.second) {
+                        this->mergedParameters[parameter.first] = parameter.second;
+                        this->setParameter(mergeParameters(parameter.second));
+                    }
+                }
+            }
         };
 
     }
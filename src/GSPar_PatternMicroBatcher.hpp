@@ -0,0 +1,180 @@
+#ifndef __GSPAR_PATTERNMICROBATCHER_INCLUDED__
+#define __GSPAR_PATTERNMICROBATCHER_INCLUDED__
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <future>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#ifdef GSPAR_DEBUG
+#include <sstream>
+#include <iostream>
+#endif
+
+/**
+ * Microseconds a MicroBatcher waits for a batch to fill when not given, counted from its first item
+ */
+#ifndef GSPAR_MICRO_BATCHER_MAX_DELAY_US
+#define GSPAR_MICRO_BATCHER_MAX_DELAY_US 1000
+#endif
+
+#include "GSPar_BaseParallelPattern.hpp"
+#include "GSPar_PatternMap.hpp"
+
+namespace GSPar {
+    namespace Pattern {
+
+        /**
+         * Gathers single items, submitted by any number of threads, into the batches of a batched pattern (see setBatchSize).
+         * A batch runs when it is full or when its first item waited for the maximum delay, so a slow stream doesn't wait for a full batch.
+         * Each item gets a future with the item itself, after its results were copied back by the pattern.
+         *
+         * A partial batch runs with a smaller batch size if the pattern is dimension-agnostic, which doesn't recompile the kernel.
+         * Otherwise, copies of its last item fill the rest of the batch.
+         *
+         * @param <TDriverInstance> Driver used to run the pattern
+         * @param <TItem> Type of the items, which must be copyable
+         * @param <TPattern> Type of the pattern
+         */
+        template<class TDriverInstance, class TItem, class TPattern = Map>
+        class MicroBatcher {
+        private:
+            struct PendingItem {
+                TItem item;
+                std::promise<TItem> promise;
+                std::chrono::steady_clock::time_point submitted;
+            };
+
+            std::unique_ptr<TPattern> pattern;
+            Driver::Dimensions dims;
+            std::function<void(TPattern&, std::vector<TItem*>&)> setBatch;
+            std::chrono::microseconds maxDelay;
+            unsigned int batchSize;
+
+            std::deque<PendingItem> pending;
+            std::mutex pendingMutex;
+            std::condition_variable pendingCondition;
+            bool stopping = false;
+            std::thread dispatcher;
+
+            /**
+             * Runs the pending items in batches until the batcher is destroyed
+             */
+            void dispatch() {
+                std::unique_lock<std::mutex> lock(this->pendingMutex);
+                while (true) {
+                    this->pendingCondition.wait(lock, [this]() { return !this->pending.empty() || this->stopping; });
+                    if (this->pending.empty()) {
+                        break; // Stopping, with every item already run
+                    }
+                    auto deadline = this->pending.front().submitted + this->maxDelay;
+                    // The remaining items don't wait when stopping
+                    this->pendingCondition.wait_until(lock, deadline, [this]() { return this->pending.size() >= this->batchSize || this->stopping; });
+
+                    std::vector<PendingItem> batch;
+                    while (!this->pending.empty() && batch.size() < this->batchSize) {
+                        batch.push_back(std::move(this->pending.front()));
+                        this->pending.pop_front();
+                    }
+                    lock.unlock(); // New items are submitted while the batch runs
+                    this->runBatch(batch);
+                    lock.lock();
+                }
+            }
+
+            void runBatch(std::vector<PendingItem>& batch) {
+                #ifdef GSPAR_DEBUG
+                    std::stringstream ss;
+                    ss << "[" << std::this_thread::get_id() << " GSPar MicroBatcher " << this << "] Running a batch of " << batch.size();
+                    ss << " items in a batch size of " << this->batchSize << std::endl;
+                    std::cout << ss.str();
+                #endif
+                std::vector<TItem*> items;
+                for (auto& pendingItem : batch) {
+                    items.push_back(&pendingItem.item);
+                }
+                std::vector<TItem> padding;
+                try {
+                    if (this->pattern->isDimensionAgnostic()) {
+                        this->pattern->setBatchSize(items.size()); // The batch size is a kernel parameter
+                    } else {
+                        padding.assign(this->batchSize - items.size(), batch.back().item);
+                        for (auto& item : padding) {
+                            items.push_back(&item);
+                        }
+                    }
+                    this->setBatch(*this->pattern, items);
+                    this->pattern->template run<TDriverInstance>(this->dims);
+                } catch (...) {
+                    std::exception_ptr failure = std::current_exception();
+                    for (auto& pendingItem : batch) {
+                        pendingItem.promise.set_exception(failure);
+                    }
+                    return;
+                }
+                for (auto& pendingItem : batch) {
+                    pendingItem.promise.set_value(std::move(pendingItem.item));
+                }
+            }
+
+        public:
+            /**
+             * @param pattern Batched pattern, which is cloned with its own execution flow and GPU memory
+             * @param setBatch Sets the batched parameters of the items in the pattern, as setBatchedParameter would be called for a batch.
+             *                 It is called by a single thread, so the arrays it gives to the pattern may be reused by the next batch.
+             * @param maxDelay Longest time the first item of a batch waits for the batch to fill
+             */
+            MicroBatcher(const TPattern& pattern, Driver::Dimensions dims, std::function<void(TPattern&, std::vector<TItem*>&)> setBatch,
+                    std::chrono::microseconds maxDelay = std::chrono::microseconds(GSPAR_MICRO_BATCHER_MAX_DELAY_US)) :
+                    pattern(pattern.template clone<TDriverInstance>()), dims(dims), setBatch(setBatch), maxDelay(maxDelay) {
+                if (!this->pattern->isBatched() || !this->pattern->getBatchSize()) {
+                    throw GSParException("A micro-batcher needs a batched pattern");
+                }
+                this->pattern->unshareParameters();
+                this->batchSize = this->pattern->getBatchSize();
+                this->dispatcher = std::thread(&MicroBatcher::dispatch, this);
+            }
+            MicroBatcher(const TPattern& pattern, unsigned long max[3], std::function<void(TPattern&, std::vector<TItem*>&)> setBatch,
+                    std::chrono::microseconds maxDelay = std::chrono::microseconds(GSPAR_MICRO_BATCHER_MAX_DELAY_US)) :
+                    MicroBatcher(pattern, Driver::Dimensions(max), setBatch, maxDelay) { }
+            /**
+             * Runs the pending items, without waiting for the delay, before destroying the batcher
+             */
+            virtual ~MicroBatcher() {
+                {
+                    std::lock_guard<std::mutex> lock(this->pendingMutex); // Auto-unlock, RAII
+                    this->stopping = true;
+                    // Auto-unlock of pendingMutex, RAII
+                }
+                this->pendingCondition.notify_one();
+                this->dispatcher.join();
+            }
+
+            unsigned int getBatchSize() { return this->batchSize; }
+
+            /**
+             * Adds an item to the next batch. Can be called by any thread.
+             * @return Gets the item with its results, or rethrows the failure of its batch
+             */
+            std::future<TItem> submit(TItem item) {
+                std::future<TItem> future;
+                {
+                    std::lock_guard<std::mutex> lock(this->pendingMutex); // Auto-unlock, RAII
+                    this->pending.push_back({ std::move(item), std::promise<TItem>(), std::chrono::steady_clock::now() });
+                    future = this->pending.back().promise.get_future();
+                    // Auto-unlock of pendingMutex, RAII
+                }
+                this->pendingCondition.notify_one();
+                return future;
+            }
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef __GSPAR_PATTERNPIPELINE_INCLUDED__
+#define __GSPAR_PATTERNPIPELINE_INCLUDED__
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
+
+/**
+ * Items each queue of a Pipeline holds when not given. A stage waits while the queue to the next stage is full
+ */
+#ifndef GSPAR_PIPELINE_QUEUE_CAPACITY
+#define GSPAR_PIPELINE_QUEUE_CAPACITY 4
+#endif
+/**
+ * Times a stage yields while its queue is full or empty before sleeping until the other side changes it
+ */
+#ifndef GSPAR_PIPELINE_SPIN_COUNT
+#define GSPAR_PIPELINE_SPIN_COUNT 64
+#endif
+
+#include "GSPar_BaseParallelPattern.hpp"
+
+namespace GSPar {
+    namespace Pattern {
+
+        /**
+         * Bounded lock-free queue with a single producer thread and a single consumer thread.
+         * The blocking push and pop spin for a while and then sleep, so a stage waiting behind a slower one doesn't take a core.
+         */
+        template<class T>
+        class BoundedQueue {
+        private:
+            std::vector<T> slots;
+            std::atomic<size_t> head{0}; // Pushes, written only by the producer
+            std::atomic<size_t> tail{0}; // Pops, written only by the consumer
+            std::atomic<bool> closed{false};
+            // Only used by a side that is sleeping and the other side waking it up
+            std::mutex waitMutex;
+            std::condition_variable waitCondition;
+            std::atomic<unsigned int> waiters{0};
+
+            bool isFull() {
+                return this->head.load(std::memory_order_acquire) - this->tail.load(std::memory_order_acquire) == this->slots.size();
+            }
+            bool isEmpty() {
+                return this->head.load(std::memory_order_acquire) == this->tail.load(std::memory_order_acquire);
+            }
+            void notifyWaiters() {
+                std::atomic_thread_fence(std::memory_order_seq_cst); // A waiter either sees the change or is seen here
+                if (this->waiters.load(std::memory_order_relaxed)) {
+                    std::lock_guard<std::mutex> lock(this->waitMutex); // Auto-unlock, RAII
+                    this->waitCondition.notify_all();
+                    // Auto-unlock of waitMutex, RAII
+                }
+            }
+            template<class TPredicate>
+            void sleepUntil(TPredicate ready) {
+                std::unique_lock<std::mutex> lock(this->waitMutex);
+                this->waiters++;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                // The timeout checks whether the pipeline was aborted, which doesn't wake the queues
+                this->waitCondition.wait_for(lock, std::chrono::milliseconds(1), ready);
+                this->waiters--;
+            }
+
+        public:
+            explicit BoundedQueue(size_t capacity) : slots(capacity ? capacity : 1) { }
+
+            /**
+             * Pushes the item, unless the queue is full
+             */
+            bool tryPush(T& item) {
+                size_t head = this->head.load(std::memory_order_relaxed);
+                if (head - this->tail.load(std::memory_order_acquire) == this->slots.size()) {
+                    return false;
+                }
+                this->slots[head % this->slots.size()] = std::move(item);
+                this->head.store(head + 1, std::memory_order_release);
+                this->notifyWaiters();
+                return true;
+            }
+            /**
+             * Pops an item, unless the queue is empty
+             */
+            bool tryPop(T& item) {
+                size_t tail = this->tail.load(std::memory_order_relaxed);
+                if (this->head.load(std::memory_order_acquire) == tail) {
+                    return false;
+                }
+                item = std::move(this->slots[tail % this->slots.size()]);
+                this->tail.store(tail + 1, std::memory_order_release);
+                this->notifyWaiters();
+                return true;
+            }
+            /**
+             * Tells that the producer will not push anything else
+             */
+            void close() {
+                this->closed.store(true, std::memory_order_release);
+                this->notifyWaiters();
+            }
+            bool isClosed() {
+                return this->closed.load(std::memory_order_acquire);
+            }
+
+            /**
+             * Waits while the queue is full. Returns false if aborted
+             */
+            bool push(T& item, const std::atomic<bool>& aborted) {
+                for (unsigned int attempt = 0; !this->tryPush(item); attempt++) {
+                    if (aborted) {
+                        return false;
+                    }
+                    if (attempt < GSPAR_PIPELINE_SPIN_COUNT) {
+                        std::this_thread::yield();
+                    } else {
+                        this->sleepUntil([this]() { return !this->isFull(); });
+                    }
+                }
+                return true;
+            }
+            /**
+             * Waits while the queue is empty. Returns false at the end of the stream or if aborted
+             */
+            bool pop(T& item, const std::atomic<bool>& aborted) {
+                for (unsigned int attempt = 0; !this->tryPop(item); attempt++) {
+                    if (aborted) {
+                        return false;
+                    }
+                    if (this->isClosed()) {
+                        return this->tryPop(item); // Pushed before closing
+                    }
+                    if (attempt < GSPAR_PIPELINE_SPIN_COUNT) {
+                        std::this_thread::yield();
+                    } else {
+                        this->sleepUntil([this]() { return !this->isEmpty() || this->isClosed(); });
+                    }
+                }
+                return true;
+            }
+        };
+
+        /**
+         * Runs a stream of items through a host source, host or GPU stages and a host sink.
+         * Each one has its own thread, connected to the next one by a BoundedQueue, so all of them work at once on different items.
+         * A GPU stage runs a clone of a pattern, with its own execution flow and GPU memory.
+         *
+         * @param <TDriverInstance> Driver used to run the patterns
+         * @param <TItem> Type of the items of the stream, created with its default constructor
+         */
+        template<class TDriverInstance, class TItem>
+        class Pipeline {
+        private:
+            typedef BoundedQueue<std::unique_ptr<TItem>> Queue;
+
+            std::function<bool(TItem&)> sourceFunction;
+            std::vector<std::function<void(TItem&)>> stages;
+            std::function<void(TItem&)> sinkFunction;
+            size_t queueCapacity;
+
+            std::atomic<bool> aborted{false};
+            std::mutex failureMutex;
+            std::exception_ptr failure;
+
+            /**
+             * Stores the first failure and stops all the threads
+             */
+            void fail() {
+                std::lock_guard<std::mutex> lock(this->failureMutex); // Auto-unlock, RAII
+                if (!this->failure) {
+                    this->failure = std::current_exception();
+                }
+                this->aborted = true;
+                // Auto-unlock of failureMutex, RAII
+            }
+
+        public:
+            explicit Pipeline(size_t queueCapacity = GSPAR_PIPELINE_QUEUE_CAPACITY) : queueCapacity(queueCapacity) { }
+
+            /**
+             * Sets the function that fills each new item. It returns false, without an item, at the end of the stream
+             */
+            Pipeline& source(std::function<bool(TItem&)> sourceFunction) {
+                this->sourceFunction = sourceFunction;
+                return *this;
+            }
+            /**
+             * Adds a stage that runs on the host
+             */
+            Pipeline& stage(std::function<void(TItem&)> stageFunction) {
+                this->stages.push_back(stageFunction);
+                return *this;
+            }
+            /**
+             * Adds a stage that runs a clone of the pattern for each item
+             * @param setItem Called as setItem(TPattern&, TItem&) to set the parameters of the item in the pattern,
+             *                which copies its results back to the item
+             */
+            template<class TPattern, class TSetItem>
+            Pipeline& stage(const TPattern& pattern, Driver::Dimensions dims, TSetItem setItem) {
+                std::shared_ptr<TPattern> clone(pattern.template clone<TDriverInstance>());
+                clone->unshareParameters();
+                std::function<void(TPattern&, TItem&)> setItemFunction = setItem;
+                this->stages.push_back([clone, dims, setItemFunction](TItem& item) {
+                    setItemFunction(*clone, item);
+                    clone->template run<TDriverInstance>(dims);
+                });
+                return *this;
+            }
+            template<class TPattern, class TSetItem>
+            Pipeline& stage(const TPattern& pattern, unsigned long max[3], TSetItem setItem) {
+                return this->stage(pattern, Driver::Dimensions(max), setItem);
+            }
+            /**
+             * Sets the function that consumes each item, in the order they were created
+             */
+            Pipeline& sink(std::function<void(TItem&)> sinkFunction) {
+                this->sinkFunction = sinkFunction;
+                return *this;
+            }
+
+            /**
+             * Runs the stream until the source ends and every item reaches the sink.
+             * Rethrows the first exception thrown in any stage, which stops the others.
+             */
+            void run() {
+                if (!this->sourceFunction) {
+                    throw GSParException("The pipeline has no source");
+                }
+                this->aborted = false;
+                this->failure = nullptr;
+
+                std::vector<std::unique_ptr<Queue>> queues;
+                for (size_t q = 0; q <= this->stages.size(); q++) {
+                    queues.emplace_back(new Queue(this->queueCapacity));
+                }
+
+                std::vector<std::thread> threads;
+                threads.emplace_back([this, &queues]() {
+                    try {
+                        while (!this->aborted) {
+                            std::unique_ptr<TItem> item(new TItem());
+                            if (!this->sourceFunction(*item) || !queues.front()->push(item, this->aborted)) {
+                                break;
+                            }
+                        }
+                    } catch (...) {
+                        this->fail();
+                    }
+                    queues.front()->close();
+                });
+                for (size_t s = 0; s < this->stages.size(); s++) {
+                    threads.emplace_back([this, &queues, s]() {
+                        try {
+                            std::unique_ptr<TItem> item;
+                            while (queues[s]->pop(item, this->aborted)) {
+                                this->stages[s](*item);
+                                if (!queues[s + 1]->push(item, this->aborted)) {
+                                    break;
+                                }
+                            }
+                        } catch (...) {
+                            this->fail();
+                        }
+                        queues[s + 1]->close();
+                    });
+                }
+                threads.emplace_back([this, &queues]() {
+                    try {
+                        std::unique_ptr<TItem> item;
+                        while (queues.back()->pop(item, this->aborted)) {
+                            if (this->sinkFunction) {
+                                this->sinkFunction(*item);
+                            }
+                        }
+                    } catch (...) {
+                        this->fail();
+                    }
+                });
+
+                for (auto& thread : threads) {
+                    thread.join();
+                }
+                if (this->failure) {
+                    std::rethrow_exception(this->failure);
+                }
+            }
+        };
+
+    }
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <cctype>
 
 #include "GSPar_PatternReduce.hpp"
 
@@ -41,7 +42,8 @@ PointerParameter* Reduce::getSharedMemoryParameter() {
         std::lock_guard<std::mutex> lock(this->sharedMemoryParameterMutex); // Auto-unlock, RAII
         if (this->sharedMemoryParameter == nullptr) { // Check if there was a race condition for this resource
             auto outParam = this->getOutputParameter();
-            std::string paramName = "gspar_shared_" + getRandomString(5);
+            // Deterministic, so identical patterns generate identical sources and share compiled programs
+            std::string paramName = "gspar_shared_" + outParam->name;
             this->sharedMemoryParameter = new PointerParameter(paramName, outParam->type, 0, nullptr);
         }
         // Auto-unlock of sharedMemoryParameterMutex, RAII
@@ -49,7 +51,7 @@ PointerParameter* Reduce::getSharedMemoryParameter() {
     return this->sharedMemoryParameter;
 };
 
-std::string Reduce::getKernelCore(Driver::Dimensions dims, std::array<std::string, 3> stdVarNames) {
+std::string Reduce::getKernelCore(Driver::Dimensions dims, std::array<std::string, 3> stdVarNames, Driver::BaseKernelGenerator* codeGenerator) {
     if (dims.y || dims.z) {
         // TODO support multiple dimensions
         throw GSParException("Reduce pattern currently does not support multi-dimensional kernels");
@@ -68,13 +70,37 @@ std::string Reduce::getKernelCore(Driver::Dimensions dims, std::array<std::strin
     
     // TODO support batches and min-max in Reduce
 
+    // If the param is input, we reduce it together in the end
+    std::string reduceOutParam = outParam->isIn() ?
+    "       if (gspar_get_grid_size(0) == 1) { \n"
+    "           " + this->partialTotalsParamName+"["+bid+"] = " + this->partialTotalsParamName+"["+bid+"]" + op + "*" + outParam->name + "; \n"
+    "       } \n"
+        : "";
+
+    if (codeGenerator->isBlockRunSequentially()) {
+        // Each thread adds its element to the total of the block, which the last one stores, so there are no barriers to wait for
+        return
+        "   size_t " + tid + " = gspar_get_thread_id(0); \n"
+        "   size_t " + bid + " = gspar_get_block_id(0); \n"
+        "   size_t " + bsize + " = gspar_get_block_size(0); \n"
+        + this->generateInputLoad(shmem + "[" + tid + "]", gid) +
+        "   if (" + tid + " > 0) { \n"
+        "       "+shmem+"[0] = "+shmem+"[0]" + op + shmem+"["+tid+"]; \n"
+        "   } \n"
+        "   if ("+tid+" == "+bsize+"-1 || "+gid+" == "+max+"-1) { \n"
+        "       " + this->partialTotalsParamName + "["+bid+"] = "+shmem+"[0]; \n"
+        + reduceOutParam +
+        "   } \n"
+        ;
+    }
+
     // https://devblogs.nvidia.com/using-shared-memory-cuda-cc/
     // https://developer.download.nvidia.com/assets/cuda/files/reduction.pdf
     std::string kernelSource =
     "   size_t " + tid + " = gspar_get_thread_id(0); \n"
     "   size_t " + bid + " = gspar_get_block_id(0); \n"
     "   size_t " + bsize + " = gspar_get_block_size(0); \n"
-    "   " + shmem + "["+tid+"] = " + this->vectorName + "["+gid+"]; \n"
+    + this->generateInputLoad(shmem + "[" + tid + "]", gid) +
     "   gspar_synchronize_local_threads(); \n"
 
     "   for (unsigned int s="+bsize+"/2; s>0; s>>=1) { \n"
@@ -92,21 +118,20 @@ std::string Reduce::getKernelCore(Driver::Dimensions dims, std::array<std::strin
     "           "+shmem+"[0] = "+shmem+"[0]" + op + shmem+"["+max+"-1]; \n"
     "       } \n"
     "       " + this->partialTotalsParamName + "["+bid+"] = "+shmem+"[0]; \n"
-    // If the param is input, we reduce it together in the end
-    + (outParam->isIn() ?
-    "       if (gspar_get_grid_size(0) == 1) { \n"
-    "           " + this->partialTotalsParamName+"["+bid+"] = " + this->partialTotalsParamName+"["+bid+"]" + op + "*" + outParam->name + "; \n"
-    "       } \n"
-        : "") +
+    + reduceOutParam +
     "   } \n"
     ;
 
     return kernelSource;
 };
 
-bool Reduce::isKernelCompiledFor(Driver::Dimensions dims) {
-    // We only compile if the kernel wasn't compiled yet and the configuration didn't change
-    return this->_isKernelCompiled && !this->isKernelStale && this->compiledKernelDimension.getCount() == dims.getCount();
+std::string Reduce::generateInputLoad(std::string sharedMemoryElement, std::string globalIndex) {
+    return "   " + sharedMemoryElement + " = " + this->vectorName + "[" + globalIndex + "]; \n";
+}
+
+bool Reduce::isCompiledKernelVariantFor(CompiledKernelVariant& variant, Driver::Dimensions dims) {
+    // The Reduce kernel does not depend on the size of the dimensions
+    return variant.dims.getCount() == dims.getCount() && variant.batched == this->batched && variant.batchSize == this->batchSize;
 }
 
 void Reduce::callbackBeforeGeneratingKernelSource() {
@@ -153,3 +178,163 @@ void Reduce::callbackBeforeAllocatingMemoryOnGpu(Driver::Dimensions dims, Driver
         this->setPointerParameter(this->partialTotalsParamName, partialsTotalsType, partialTotalsSize, partialTotals, GSPAR_PARAM_OUT);
     }
 }
+
+///// FusedMapReduce /////
+
+FusedMapReduce::FusedMapReduce() : Reduce() {
+    this->useSharedMemory = true;
+}
+
+bool FusedMapReduce::replaceElementAccesses(const std::string code, const std::string vectorName, const std::string index, const std::string replacement, std::string& replaced) {
+    auto isIdentifierChar = [](char c) { return std::isalnum((unsigned char)c) || c == '_'; };
+    auto skipSpaces = [&code](size_t pos) {
+        while (pos < code.size() && std::isspace((unsigned char)code[pos])) pos++;
+        return pos;
+    };
+    replaced.clear();
+    size_t copied = 0;
+    bool firstAccess = true;
+    for (size_t pos = code.find(vectorName); pos != std::string::npos; pos = code.find(vectorName, pos + vectorName.size())) {
+        size_t end = pos + vectorName.size();
+        if ((pos > 0 && isIdentifierChar(code[pos - 1])) || (end < code.size() && isIdentifierChar(code[end]))) {
+            continue; // Only part of another name
+        }
+        // It must be exactly vectorName[index]
+        size_t cursor = skipSpaces(end);
+        if (cursor >= code.size() || code[cursor] != '[') {
+            return false;
+        }
+        cursor = skipSpaces(cursor + 1);
+        if (code.compare(cursor, index.size(), index) != 0 || (cursor + index.size() < code.size() && isIdentifierChar(code[cursor + index.size()]))) {
+            return false;
+        }
+        cursor = skipSpaces(cursor + index.size());
+        if (cursor >= code.size() || code[cursor] != ']') {
+            return false;
+        }
+        cursor++;
+        if (firstAccess) {
+            // The value in memory is never computed, so the first access must be a plain assignment
+            size_t assignment = skipSpaces(cursor);
+            if (assignment + 1 >= code.size() || code[assignment] != '=' || code[assignment + 1] == '=') {
+                return false;
+            }
+            firstAccess = false;
+        }
+        replaced.append(code, copied, pos - copied);
+        replaced += replacement;
+        copied = cursor;
+        pos = cursor - vectorName.size(); // The search continues after the access
+    }
+    replaced.append(code, copied, std::string::npos);
+    return !firstAccess;
+}
+
+bool FusedMapReduce::canFuse(const std::vector<BaseParallelPattern*>& maps, Reduce* reduce, const std::string stdVarName) {
+    BaseParallelPattern* first = maps.front();
+    if (reduce->isBatched() || reduce->getGpuIndex() != first->getGpuIndex() || reduce->getStdVarNames() != first->getStdVarNames()
+            || reduce->isDimensionAgnostic() != first->isDimensionAgnostic() || !(reduce->getCompilerOptions() == first->getCompilerOptions())) {
+        return false;
+    }
+    // The reduced vector must be written by the Maps
+    BaseParameter* vector = reduce->getParameter(reduce->getVectorName());
+    if (!vector || vector->paramValueType != GSPAR_PARAM_POINTER) {
+        return false;
+    }
+    bool written = false;
+    for (auto map : maps) {
+        BaseParameter* mapVector = map->getParameter(vector->name);
+        if (mapVector) {
+            if (!FusedMap::isSameData(mapVector, vector)) {
+                return false;
+            }
+            written = written || mapVector->isOut();
+        }
+    }
+    if (!written) {
+        return false;
+    }
+    // The other parameters with the same name must be the same data
+    for (auto parameter : reduce->getParameterList()) {
+        if (!parameter->isComplete()) {
+            return false;
+        }
+        for (auto map : maps) {
+            BaseParameter* mapParameter = map->getParameter(parameter->name);
+            if (parameter->name != vector->name && mapParameter && !FusedMap::isSameData(parameter, mapParameter)) {
+                return false;
+            }
+        }
+    }
+    std::string replaced;
+    return replaceElementAccesses(FusedMap::fuseKernelCode(maps), vector->name, stdVarName, "gspar_mapped", replaced);
+}
+
+void FusedMapReduce::fuse(const std::vector<BaseParallelPattern*>& maps, Reduce* reduce) {
+    BaseParallelPattern* first = maps.front();
+    std::string extraKernelCode = FusedMap::fuseExtraKernelCode(maps);
+    std::string userKernel = FusedMap::fuseKernelCode(maps);
+    if (userKernel != this->userKernel || extraKernelCode != this->extraKernelCode || this->stdVarNames != reduce->getStdVarNames()
+            || !(this->compilerOptions == reduce->getCompilerOptions()) || this->mappedVectorName != reduce->getVectorName()
+            || this->binaryOperation != reduce->getBinaryOperation() || this->outputParameterName != reduce->getOutputParameterName()) {
+        this->userKernel = userKernel;
+        this->extraKernelCode = extraKernelCode;
+        this->stdVarNames = reduce->getStdVarNames();
+        this->compilerOptions = reduce->getCompilerOptions();
+        this->mappedVectorName = reduce->getVectorName();
+        this->binaryOperation = reduce->getBinaryOperation();
+        this->outputParameterName = reduce->getOutputParameterName();
+        // After the first pass, the partial totals are reduced in place
+        this->vectorName = this->partialTotalsParamName;
+        this->kernelName.clear();
+        this->params.clear();
+        this->paramsOrder.clear();
+        this->mergedParameters.clear();
+        this->sharedMemoryParameter = nullptr; // It depends on the output parameter
+        this->isKernelStale = true;
+    }
+    this->setGpuIndex(first->getGpuIndex());
+    this->setDimensionAgnostic(first->isDimensionAgnostic());
+
+    // The mapped vector is not a parameter, it exists only while each element is reduced
+    std::vector<BaseParallelPattern*> patterns = maps;
+    patterns.push_back(reduce);
+    this->updateModes = FusedMap::fuseUpdateModes(patterns);
+    this->outputRanges = FusedMap::fuseOutputRanges(patterns);
+    for (auto& parameter : FusedMap::collectParameters(patterns)) {
+        if (parameter.first == this->mappedVectorName) {
+            continue;
+        }
+        // A parameter is merged again only if some pattern replaced it, so its GPU memory is kept between runs
+        if (this->mergedParameters[parameter.first] != parameter.second) {
+            this->mergedParameters[parameter.first] = parameter.second;
+            this->setParameter(FusedMap::mergeParameters(parameter.second));
+        }
+    }
+    if (!this->getParameter(this->firstPassParamName)) {
+        this->setValueParameter(this->firstPassParamName, this->getTemplatedType<int>(), sizeof(int), &this->firstPass);
+    }
+}
+
+std::string FusedMapReduce::generateInputLoad(std::string sharedMemoryElement, std::string globalIndex) {
+    // Same type of the elements of the reduced vector
+    std::string mappedType = this->getOutputParameter()->getNonPointerTypeName();
+    std::string mapped = "gspar_mapped_" + this->mappedVectorName;
+    std::string mapsCode;
+    if (!replaceElementAccesses(this->userKernel, this->mappedVectorName, globalIndex, mapped, mapsCode)) {
+        throw GSParException("Could not fuse the Maps that compute '" + this->mappedVectorName + "' in the Reduce pattern");
+    }
+    return ""
+    "   if (" + this->firstPassParamName + ") { \n"
+    "       " + mappedType + " " + mapped + "; \n"
+    + mapsCode +
+    "       " + sharedMemoryElement + " = " + mapped + "; \n"
+    "   } else { \n"
+    + Reduce::generateInputLoad(sharedMemoryElement, globalIndex) +
+    "   } \n";
+}
+
+void FusedMapReduce::callbackBeforeReductionPass(unsigned int pass) {
+    // The Maps compute the elements only in the first pass, the next ones reduce the partial totals
+    this->firstPass = (pass == 0);
+}
@@ -2,7 +2,12 @@
 #ifndef __GSPAR_PATTERNREDUCE_INCLUDED__
 #define __GSPAR_PATTERNREDUCE_INCLUDED__
 
+#include <vector>
+#include <map>
+#include <memory>
+
 #include "GSPar_BaseParallelPattern.hpp"
+#include "GSPar_PatternMap.hpp"
 
 namespace GSPar {
     namespace Pattern {
@@ -11,17 +16,20 @@ namespace GSPar {
          * Reduce parallel pattern
          */
         class Reduce : public BaseParallelPattern {
-        private:
-            const std::string partialTotalsParamName = "gspar_partial_reductions";
-            PointerParameter* getOutputParameter();
-
         protected:
+            PointerParameter* getOutputParameter();
+            const std::string partialTotalsParamName = "gspar_partial_reductions";
             std::string vectorName;
             std::string binaryOperation; // https://northstar-www.dartmouth.edu/doc/ibmcxx/en_US/doc/language/ref/ruclxbin.htm
             std::string outputParameterName;
 
             PointerParameter* generateSharedMemoryParameter(Driver::Dimensions dims, Driver::BaseKernelBase *kernel) override;
             PointerParameter* getSharedMemoryParameter() override;
+            bool isCompiledKernelVariantFor(CompiledKernelVariant& variant, Driver::Dimensions dims) override;
+            /**
+             * Generates the code that loads the element of the input vector reduced by each thread into shared memory
+             */
+            virtual std::string generateInputLoad(std::string sharedMemoryElement, std::string globalIndex);
 
         public:
             Reduce() : BaseParallelPattern() { };
@@ -42,18 +50,34 @@ namespace GSPar {
                 return other;
             };
 
-            std::string getKernelCore(Driver::Dimensions dims, std::array<std::string, 3> stdVarNames) override;
+            std::string getKernelCore(Driver::Dimensions dims, std::array<std::string, 3> stdVarNames, Driver::BaseKernelGenerator* codeGenerator) override;
+
+            std::string getVectorName() { return this->vectorName; }
+            std::string getBinaryOperation() { return this->binaryOperation; }
+            std::string getOutputParameterName() { return this->outputParameterName; }
 
-            bool isKernelCompiledFor(Driver::Dimensions dims) override;
 
             // Callback override
             void callbackBeforeGeneratingKernelSource() override;
             void callbackBeforeAllocatingMemoryOnGpu(Driver::Dimensions dims, Driver::BaseKernelBase *kernel) override;
+            /**
+             * Called before setting the parameters of each reduction pass. The first pass is 0
+             */
+            virtual void callbackBeforeReductionPass(unsigned int pass) { }
 
             // Main run function for Reduce Pattern
             // TODO this does not override base class due to templates. Fix this.
             template<class TDriverInstance>
             void run(Driver::Dimensions dimsToUse) {
+                this->runAsync<TDriverInstance>(dimsToUse).wait();
+            }
+
+            /**
+             * Enqueues all the reduction passes and returns without waiting for the GPU.
+             * The handle copies the result to the output parameter when the last pass finishes.
+             */
+            template<class TDriverInstance>
+            RunHandle runAsync(Driver::Dimensions dimsToUse) {
                 if (dimsToUse.y || dimsToUse.z) {
                     // TODO support multiple dimensions
                     throw GSParException("Reduce pattern currently does not support multi-dimensional kernels");
@@ -64,7 +88,10 @@ namespace GSPar {
                 #ifdef GSPAR_DEBUG
                     std::stringstream ss;
                 #endif
-                this->compile<TDriverInstance>(dimsToUse);
+                this->finishPendingRun(); // Its partial totals are still in the GPU
+
+                // Holds the variant alive even if it gets evicted while running
+                std::shared_ptr<Driver::BaseKernelBase> compiledKernel = this->compileVariant<TDriverInstance>(dimsToUse);
 
                 // #ifdef GSPAR_DEBUG
                 //     auto gpu = this->getGpu<TDriverInstance, decltype(TDriverInstance::getDeviceType())>();
@@ -73,7 +100,7 @@ namespace GSPar {
                 //     ss.str("");
                 // #endif
 
-                auto kernel = this->getCompiledKernel<TDriverInstance>();
+                auto kernel = static_cast<decltype(TDriverInstance::getKernelType())*>(compiledKernel.get());
                 kernel->clearParameters();
 
                 this->callbackBeforeAllocatingMemoryOnGpu(dimsToUse, kernel);
@@ -99,7 +126,9 @@ namespace GSPar {
                     throw GSParException("Could not find partial totals parameter with name '" + this->partialTotalsParamName + "' in Reduce pattern");
                 }
 
-                while (true) {
+                for (unsigned int pass = 0; ; pass++) {
+
+                    this->callbackBeforeReductionPass(pass);
 
                     Driver::Dimensions blocksAndThreads = kernel->getNumBlocksAndThreadsFor(dimsToRun);
 
@@ -111,9 +140,7 @@ namespace GSPar {
                     // Sets Pattern parameters in Kernel object
                     for (auto& paramName : this->paramsOrder) {
                         if (paramName == this->vectorName) { // Input parameter
-                            if (inputMemoryObject) {
-                                inputMemoryObject->waitAsync(); // Waits for async copy to finish
-                            }
+                            // We don't need to wait the async copy (or the previous pass) because they are running in the same execution flow
                             kernel->setParameter(inputMemoryObject); // We can simply set the memory object
                         } else {
                             auto param = this->getParameter(paramName);
@@ -134,10 +161,8 @@ namespace GSPar {
 
                     kernel->runAsync(dimsToRun, executionFlow);
 
-                    kernel->waitAsync();
-
                     #ifdef GSPAR_DEBUG
-                        ss << "[GSPar Reduce "<<this<<"] Finished running kernel " << kernel << " in flow " << executionFlow;
+                        ss << "[GSPar Reduce "<<this<<"] Started running kernel " << kernel << " in flow " << executionFlow;
                         ss << ". Reduced to " << blocksAndThreads.x.min << " element(s)" << std::endl;
                         std::cout << ss.str();
                         ss.str("");
@@ -153,21 +178,72 @@ namespace GSPar {
                     kernel->clearParameters();
                 }
 
-                // "Hack" to copy partial totals into output parameter
-                PointerParameter *outParam = this->getOutputParameter();
-                decltype(TDriverInstance::getMemoryObjectType())* outputMemoryObject = dynamic_cast<decltype(TDriverInstance::getMemoryObjectType())*>(partialTotals->getMemoryObject());
-                outputMemoryObject->bindTo(outParam->getPointer(), outParam->size);
-                outputMemoryObject->copyOut();
-                outParam->direction = GSPAR_PARAM_NONE; // We already copied the parameter out, copyParametersFromGpuToHostAsync should ignore it
+                // The handle holds the variant alive until the run completes
+                this->pendingRun = RunHandle([executionFlow]() {
+                    return executionFlow->isFinished();
+                }, [this, compiledKernel, kernel, partialTotals, dimsToUse, executionFlow]() {
+                    kernel->waitAsync();
+
+                    // "Hack" to copy partial totals into output parameter
+                    // Binding a zero-copy buffer to other memory copies its data, so it waits for the passes
+                    PointerParameter *outParam = this->getOutputParameter();
+                    decltype(TDriverInstance::getMemoryObjectType())* outputMemoryObject = dynamic_cast<decltype(TDriverInstance::getMemoryObjectType())*>(partialTotals->getMemoryObject());
+                    outputMemoryObject->bindTo(outParam->getPointer(), outParam->size);
+                    outputMemoryObject->copyOutAsync(executionFlow);
+                    outParam->direction = GSPAR_PARAM_NONE; // We already copied the parameter out, copyParametersFromGpuToHostAsync should ignore it
 
-                this->callbackAfterRunInGpu();
+                    this->callbackAfterRunInGpu();
 
-                this->copyParametersFromGpuToHostAsync<TDriverInstance>();
+                    this->copyParametersFromGpuToHostAsync<TDriverInstance>();
+                    executionFlow->synchronize(); // All the copies to the host
 
-                this->callbackAfterCopyDataFromGpuToHost(dimsToUse, kernel);
+                    this->callbackAfterCopyDataFromGpuToHost(dimsToUse, kernel);
+                });
+                return this->pendingRun;
             }
         };
 
+        /**
+         * Reduce whose first pass computes the reduced vector with the code of the Maps that precede it in a PatternComposition.
+         * Each element is reduced right after being computed, so the vector is never written to memory (nor copied back to the host).
+         * The next passes reduce the partial totals, as any Reduce.
+         */
+        class FusedMapReduce : public Reduce {
+        private:
+            const std::string firstPassParamName = "gspar_first_pass";
+            int firstPass = 1; // Value of the kernel parameter that tells whether the Maps compute the elements
+
+        protected:
+            std::string mappedVectorName; // The vector written by the Maps and reduced
+            // The parameters of the fused patterns from which each parameter of the kernel was merged
+            std::map<std::string, std::vector<std::shared_ptr<BaseParameter>>> mergedParameters;
+
+            std::string generateInputLoad(std::string sharedMemoryElement, std::string globalIndex) override;
+
+        public:
+            FusedMapReduce();
+
+            /**
+             * Replaces the accesses to vectorName[index] in the code.
+             * Fails if the vector is accessed in any other way or if it is read before being written.
+             */
+            static bool replaceElementAccesses(const std::string code, const std::string vectorName, const std::string index, const std::string replacement, std::string& replaced);
+
+            /**
+             * Checks whether the Maps and the Reduce of the vector they write can run as a single kernel
+             * @param stdVarName The name of the index variable of the first dimension
+             */
+            static bool canFuse(const std::vector<BaseParallelPattern*>& maps, Reduce* reduce, const std::string stdVarName);
+
+            /**
+             * Updates the kernel code and the parameters from the patterns being fused.
+             * The kernel is only recompiled if their code or parameters list changed.
+             */
+            void fuse(const std::vector<BaseParallelPattern*>& maps, Reduce* reduce);
+
+            void callbackBeforeReductionPass(unsigned int pass) override;
+        };
+
     }
 }
 
@@ -0,0 +1,88 @@
+#ifndef __GSPAR_PATTERNSTREAMEXECUTOR_INCLUDED__
+#define __GSPAR_PATTERNSTREAMEXECUTOR_INCLUDED__
+
+#include <vector>
+#include <memory>
+#include <functional>
+
+/**
+ * Execution flows of a StreamExecutor when not given: an item is copied to the GPU while the previous one computes
+ * and the one before it is copied back to the host
+ */
+#ifndef GSPAR_STREAM_EXECUTOR_FLOWS
+#define GSPAR_STREAM_EXECUTOR_FLOWS 3
+#endif
+
+#include "GSPar_BaseParallelPattern.hpp"
+#include "GSPar_PatternMap.hpp"
+
+namespace GSPar {
+    namespace Pattern {
+
+        /**
+         * Runs the items of a stream in clones of a pattern, each one with its own execution flow and GPU memory, in turns.
+         * Thus, the copies and the computation of consecutive items overlap, while the pattern is the same as when running one item at a time.
+         * The clones share the compiled kernel and get their own copy of the pointer parameters (see BaseParallelPattern::unshareParameters).
+         *
+         * @param <TDriverInstance> Driver used to run the pattern
+         * @param <TPattern> Type of the pattern, Map or Reduce
+         */
+        template<class TDriverInstance, class TPattern = Map>
+        class StreamExecutor {
+        private:
+            std::vector<std::unique_ptr<TPattern>> patterns;
+            std::vector<RunHandle> runs; // Last item of each flow
+            unsigned int next = 0;
+
+        public:
+            explicit StreamExecutor(const TPattern& pattern, unsigned int flows = GSPAR_STREAM_EXECUTOR_FLOWS) {
+                if (!flows) {
+                    throw GSParException("A stream executor needs at least one execution flow");
+                }
+                for (unsigned int flow = 0; flow < flows; flow++) {
+                    TPattern* clone = pattern.template clone<TDriverInstance>();
+                    clone->unshareParameters();
+                    this->patterns.emplace_back(clone);
+                    this->runs.emplace_back();
+                }
+            }
+            virtual ~StreamExecutor() {
+                // Each clone waits for its last item when destroyed
+            }
+
+            unsigned int getFlowCount() { return this->patterns.size(); }
+
+            /**
+             * Runs an item in the next flow, which first completes its previous item, so the item may reuse its memory.
+             * Rethrows the failure of that previous item.
+             * @param setItem Sets the parameters of the item in the pattern of the flow, as they would be set in the original pattern
+             * @return Completes when the results of the item are in the host
+             */
+            RunHandle run(Driver::Dimensions dims, std::function<void(TPattern&)> setItem) {
+                unsigned int flow = this->next;
+                this->next = (this->next + 1) % this->patterns.size();
+                this->runs[flow].wait();
+                TPattern& pattern = *this->patterns[flow];
+                setItem(pattern);
+                this->runs[flow] = pattern.template runAsync<TDriverInstance>(dims);
+                return this->runs[flow];
+            }
+
+            RunHandle run(unsigned long max[3], std::function<void(TPattern&)> setItem) {
+                return this->run(Driver::Dimensions(max), setItem);
+            }
+
+            /**
+             * Waits for all the items to complete
+             */
+            void synchronize() {
+                for (auto& run : this->runs) {
+                    run.wait();
+                }
+            }
+        };
+
+    }
+}
+
+#endif